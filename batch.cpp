@@ -0,0 +1,92 @@
+// Compile: clear && clang++ -std=c++20 -O2 batch.cpp -o batch
+//
+// Usage: batch [options] <file or directory>...
+//   -o <dir>            output directory (default .)
+//   -s <suffix>         output suffix, e.g. .ppm, .png, .qoi (default .ppm)
+//   -f <filter>         append a filter to the chain, applied in order:
+//                         grayscale, blur, antialias, downscale:<factor>, upscale:<factor>,
+//                         bloom:<threshold>,<sigma>, lens:<count>
+//   -r/-w/-j <n>        reader, writer and worker thread counts
+//   -m <MiB>            in-flight memory cap (default 1024)
+#include "ppmpp.hpp"
+
+#include <sstream>
+
+static ppm::ImageFilter parseFilter(const std::string& spec)
+{
+	std::string name = spec.substr(0, spec.find(':'));
+	std::vector<double> args;
+	if (spec.find(':') != std::string::npos) {
+		std::stringstream ss(spec.substr(spec.find(':') + 1));
+		for (std::string value; std::getline(ss, value, ',');) {
+			args.push_back(std::stod(value));
+		}
+	}
+	auto arg = [&](size_t i, double fallback) { return i < args.size() ? args[i] : fallback; };
+
+	if (name == "grayscale") return [](ppm::Image& img) { img.convertToGrayscale(); };
+	if (name == "blur") return [](ppm::Image& img) { img.applyGaussianBlur(); };
+	if (name == "antialias") return [](ppm::Image& img) { img.applyAntiAliasing(); };
+	if (name == "downscale") {
+		int factor = static_cast<int>(arg(0, 2));
+		if (factor <= 0) throw std::invalid_argument("downscale factor must be positive");
+		return [factor](ppm::Image& img) { img.downscale(img.getWidth() / factor, img.getHeight() / factor); };
+	}
+	if (name == "upscale") {
+		int factor = static_cast<int>(arg(0, 2));
+		if (factor <= 0) throw std::invalid_argument("upscale factor must be positive");
+		return [factor](ppm::Image& img) { img.upscale(factor); };
+	}
+	if (name == "bloom") {
+		double threshold = arg(0, 0.8), sigma = arg(1, 2.0);
+		return [threshold, sigma](ppm::Image& img) { img.applyBloom(threshold, sigma); };
+	}
+	if (name == "lens") {
+		int count = static_cast<int>(arg(0, 5));
+		return [count](ppm::Image& img) { img.applyLens(count); };
+	}
+	throw std::invalid_argument("unknown filter " + name);
+}
+
+int main(int argc, char* argv[])
+{
+	ppm::BatchOptions options;
+	std::vector<ppm::ImageFilter> chain;
+	std::vector<std::string> inputs;
+
+	try {
+		for (int i = 1; i < argc; ++i) {
+			std::string opt = argv[i];
+			auto value = [&]() -> std::string {
+				if (i + 1 >= argc) throw std::invalid_argument("missing value for " + opt);
+				return argv[++i];
+			};
+			if (opt == "-o") options.outputDirectory = value();
+			else if (opt == "-s") options.outputSuffix = value();
+			else if (opt == "-f") chain.push_back(parseFilter(value()));
+			else if (opt == "-r") options.readers = std::stoi(value());
+			else if (opt == "-w") options.writers = std::stoi(value());
+			else if (opt == "-j") options.workers = std::stoi(value());
+			else if (opt == "-m") options.maxInFlightBytes = static_cast<size_t>(std::stoull(value())) << 20;
+			else if (std::filesystem::is_directory(opt)) {
+				for (const auto& file : ppm::listFiles(opt)) inputs.push_back(file);
+			} else {
+				inputs.push_back(opt);
+			}
+		}
+	} catch (const std::exception& e) {
+		std::cerr << "batch: " << e.what() << std::endl;
+		return 2;
+	}
+
+	if (inputs.empty()) {
+		std::cerr << "Usage: batch [-o dir] [-s suffix] [-f filter]... [-r n] [-w n] [-j n] [-m MiB] <file or directory>..." << std::endl;
+		return 2;
+	}
+
+	std::filesystem::create_directories(options.outputDirectory);
+	ppm::BatchReport report = ppm::processBatch(inputs, chain, options);
+	ppm::printBatchReport(std::cout, report);
+
+	return report.failures.empty() ? 0 : 1;
+}
@@ -25,53 +25,3926 @@
 #include <iostream>
 #include <fstream>
 #include <tuple>
+#include <utility>
 #include <vector>
 #include <random>
 #include <cmath>
 #include <algorithm>
 #include <numeric>
+#include <array>
+#include <filesystem>
+#include <string>
+#include <map>
+#include <mutex>
+#include <chrono>
+#include <thread>
+#include <atomic>
+#include <cstdint>
+#include <stdexcept>
+#include <cctype>
+#include <future>
+#include <functional>
+#include <deque>
+#include <condition_variable>
+#include <memory>
+#include <exception>
+#include <queue>
+#include <bit>
+#include <climits>
+#include <limits>
+#include <type_traits>
+
+// Define PPMPP_PROFILE before including ppmpp.hpp to record per-operation counters.
+#ifdef PPMPP_PROFILE
+#define PPMPP_PROFILE_SCOPE(name) ::ppm::profile::ScopedOp ppmppProfileScope_(name)
+#define PPMPP_PROFILE_PIXELS(count) ::ppm::profile::addPixels(static_cast<uint64_t>(count))
+#define PPMPP_PROFILE_SCRATCH(bytes) ::ppm::profile::addScratch(static_cast<uint64_t>(bytes))
+#else
+#define PPMPP_PROFILE_SCOPE(name) ((void)0)
+#define PPMPP_PROFILE_PIXELS(count) ((void)0)
+#define PPMPP_PROFILE_SCRATCH(bytes) ((void)0)
+#endif
 
 namespace ppm
 {
+	// Profiling counters (only filled when PPMPP_PROFILE is defined)
+	namespace profile
+	{
+		struct OpStats {
+			std::string name;
+			uint64_t calls = 0;
+			uint64_t totalNs = 0;
+			uint64_t maxNs = 0;
+			uint64_t pixelsWritten = 0;
+			uint64_t scratchBytes = 0;
+		};
+
+		struct TraceEvent {
+			const char* name;
+			uint64_t startNs;
+			uint64_t durationNs;
+			uint32_t threadId;
+			uint64_t pixelsWritten;
+			uint64_t scratchBytes;
+		};
+
+		constexpr bool enabled =
+#ifdef PPMPP_PROFILE
+			true;
+#else
+			false;
+#endif
+
+		class Registry
+		{
+		public:
+			void record(const char* name, uint64_t startNs, uint64_t durationNs, uint64_t pixels, uint64_t scratch, uint32_t threadId) {
+				std::lock_guard<std::mutex> lock(m_mutex);
+				OpStats& st = m_stats[name];
+				if (st.name.empty()) st.name = name;
+				++st.calls;
+				st.totalNs += durationNs;
+				st.maxNs = std::max(st.maxNs, durationNs);
+				st.pixelsWritten += pixels;
+				st.scratchBytes += scratch;
+				if (m_events.size() < m_traceCapacity) {
+					m_events.push_back({name, startNs, durationNs, threadId, pixels, scratch});
+				} else {
+					++m_droppedEvents;
+				}
+			}
+
+			std::vector<OpStats> snapshot() {
+				std::lock_guard<std::mutex> lock(m_mutex);
+				std::vector<OpStats> result;
+				result.reserve(m_stats.size());
+				for (const auto& [name, st] : m_stats) {
+					result.push_back(st);
+				}
+				return result;
+			}
+
+			std::vector<TraceEvent> events() {
+				std::lock_guard<std::mutex> lock(m_mutex);
+				return m_events;
+			}
+
+			void reset() {
+				std::lock_guard<std::mutex> lock(m_mutex);
+				m_stats.clear();
+				m_events.clear();
+				m_droppedEvents = 0;
+				m_epochNs = steadyNs();
+			}
+
+			void setTraceCapacity(size_t capacity) {
+				std::lock_guard<std::mutex> lock(m_mutex);
+				m_traceCapacity = capacity;
+			}
+
+			uint64_t droppedEvents() {
+				std::lock_guard<std::mutex> lock(m_mutex);
+				return m_droppedEvents;
+			}
+
+			// Scopes still open across a reset() can read a time before the new epoch; those clamp to 0.
+			uint64_t nowNs() {
+				const int64_t elapsed = steadyNs() - m_epochNs.load(std::memory_order_relaxed);
+				return elapsed > 0 ? static_cast<uint64_t>(elapsed) : 0;
+			}
+
+			uint32_t threadId() {
+				thread_local uint32_t id = m_nextThreadId.fetch_add(1);
+				return id;
+			}
+
+		private:
+			static int64_t steadyNs() {
+				return std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now().time_since_epoch()).count();
+			}
+
+			std::mutex m_mutex;
+			std::map<std::string, OpStats> m_stats;
+			std::vector<TraceEvent> m_events;
+			size_t m_traceCapacity = 1 << 16;
+			uint64_t m_droppedEvents = 0;
+			std::atomic<int64_t> m_epochNs{steadyNs()};
+			std::atomic<uint32_t> m_nextThreadId{1};
+		};
+
+		inline Registry& registry() {
+			static Registry instance;
+			return instance;
+		}
+
+		// Times one public operation. Operations called from inside another one (drawFilledCircle -> drawLine)
+		// are folded into the outermost call, so the counters reflect what the caller asked for. Chunks run by
+		// ThreadPool::parallelFor adopt the caller's operation (see AdoptOp), so work done on the workers is
+		// counted there as well; jobs handed to ThreadPool::submit are not tied to any operation.
+		class ScopedOp
+		{
+		public:
+			explicit ScopedOp(const char* name) : m_name(name), m_parent(current()) {
+				if (!m_parent) {
+					m_start = registry().nowNs();
+					current() = this;
+				}
+			}
+
+			~ScopedOp() {
+				if (m_parent) return;
+				const uint64_t end = registry().nowNs();
+				current() = nullptr;
+				registry().record(m_name, m_start, end > m_start ? end - m_start : 0, m_pixels.load(), m_scratch.load(), registry().threadId());
+			}
+
+			ScopedOp(const ScopedOp&) = delete;
+			ScopedOp& operator=(const ScopedOp&) = delete;
+
+			static ScopedOp*& current() {
+				thread_local ScopedOp* op = nullptr;
+				return op;
+			}
+
+			std::atomic<uint64_t> m_pixels{0};
+			std::atomic<uint64_t> m_scratch{0};
+
+		private:
+			const char* m_name;
+			ScopedOp* m_parent;
+			uint64_t m_start = 0;
+		};
+
+		// Makes op the current operation of this thread for the guard's lifetime.
+		class AdoptOp
+		{
+		public:
+			explicit AdoptOp(ScopedOp* op) {
+				if constexpr (enabled) {
+					m_saved = ScopedOp::current();
+					ScopedOp::current() = op;
+				}
+			}
+
+			~AdoptOp() {
+				if constexpr (enabled) ScopedOp::current() = m_saved;
+			}
+
+			AdoptOp(const AdoptOp&) = delete;
+			AdoptOp& operator=(const AdoptOp&) = delete;
+
+		private:
+			ScopedOp* m_saved = nullptr;
+		};
+
+		inline void addPixels(uint64_t count) {
+			if (ScopedOp* op = ScopedOp::current()) op->m_pixels.fetch_add(count, std::memory_order_relaxed);
+		}
+
+		inline void addScratch(uint64_t bytes) {
+			if (ScopedOp* op = ScopedOp::current()) op->m_scratch.fetch_add(bytes, std::memory_order_relaxed);
+		}
+
+		inline std::vector<OpStats> snapshot() { return registry().snapshot(); }
+		inline void reset() { registry().reset(); }
+		inline void setTraceCapacity(size_t capacity) { registry().setTraceCapacity(capacity); }
+
+		// Chrome trace event format ("X" complete events), loadable in chrome://tracing or Perfetto.
+		inline void writeChromeTrace(std::ostream& out) {
+			std::vector<TraceEvent> events = registry().events();
+			out << "{\"displayTimeUnit\":\"ns\",\"traceEvents\":[";
+			for (size_t i = 0; i < events.size(); ++i) {
+				const TraceEvent& e = events[i];
+				out << (i ? ",\n" : "\n")
+				    << "{\"name\":\"" << e.name << "\",\"cat\":\"ppmpp\",\"ph\":\"X\",\"pid\":1,\"tid\":" << e.threadId
+				    << ",\"ts\":" << e.startNs / 1000 << '.' << std::to_string(1000 + e.startNs % 1000).substr(1)
+				    << ",\"dur\":" << e.durationNs / 1000 << '.' << std::to_string(1000 + e.durationNs % 1000).substr(1)
+				    << ",\"args\":{\"pixels\":" << e.pixelsWritten << ",\"scratchBytes\":" << e.scratchBytes << "}}";
+			}
+			out << "\n]}\n";
+		}
+
+		inline bool writeChromeTrace(const std::string& filename) {
+			std::ofstream out(filename, std::ios_base::out | std::ios_base::binary);
+			if (!out.is_open()) return false;
+			writeChromeTrace(out);
+			return static_cast<bool>(out);
+		}
+	} // namespace profile
+
+	// Worker threads shared by the parallel filters and encoders.
+	class ThreadPool
+	{
+	public:
+		explicit ThreadPool(unsigned threads = std::max(1u, std::thread::hardware_concurrency())) {
+			// The thread calling parallelFor takes part in the work, so one worker less is started.
+			for (unsigned i = 1; i < threads; ++i) {
+				m_workers.emplace_back([this] { workerLoop(); });
+			}
+		}
+
+		~ThreadPool() {
+			{
+				std::lock_guard<std::mutex> lock(m_mutex);
+				m_stop = true;
+			}
+			m_cv.notify_all();
+			for (auto& worker : m_workers) worker.join();
+		}
+
+		ThreadPool(const ThreadPool&) = delete;
+		ThreadPool& operator=(const ThreadPool&) = delete;
+
+		unsigned size() const { return static_cast<unsigned>(m_workers.size()) + 1; }
+
+		template <typename F>
+		auto submit(F&& fn) -> std::future<decltype(fn())> {
+			using R = decltype(fn());
+			auto task = std::make_shared<std::packaged_task<R()>>(std::forward<F>(fn));
+			std::future<R> result = task->get_future();
+			if (m_workers.empty()) {
+				(*task)();
+			} else {
+				enqueue([task] { (*task)(); });
+			}
+			return result;
+		}
+
+		// Calls fn(lo, hi) for consecutive chunks of at most grain items in [begin, end) and waits for all of them.
+		// Safe to call from inside a worker: the caller keeps taking chunks itself. Rethrows the first exception.
+		template <typename F>
+		void parallelFor(int begin, int end, int grain, F&& fn) {
+			if (end <= begin) return;
+			grain = std::max(grain, 1);
+			const int chunks = (end - begin + grain - 1) / grain;
+			if (chunks == 1 || m_workers.empty()) {
+				fn(begin, end);
+				return;
+			}
+
+			struct State {
+				std::atomic<int> next{0};
+				std::atomic<int> done{0};
+				std::mutex mutex;
+				std::condition_variable cv;
+				std::exception_ptr error;
+			};
+			auto state = std::make_shared<State>();
+			profile::ScopedOp* owner = profile::enabled ? profile::ScopedOp::current() : nullptr;
+			auto work = [state, &fn, begin, end, grain, chunks, owner]() {
+				profile::AdoptOp adopt(owner);
+				for (;;) {
+					int chunk = state->next.fetch_add(1);
+					if (chunk >= chunks) return;
+					try {
+						fn(begin + chunk * grain, std::min(end, begin + (chunk + 1) * grain));
+					} catch (...) {
+						std::lock_guard<std::mutex> lock(state->mutex);
+						if (!state->error) state->error = std::current_exception();
+					}
+					if (state->done.fetch_add(1) + 1 == chunks) {
+						std::lock_guard<std::mutex> lock(state->mutex);
+						state->cv.notify_all();
+					}
+				}
+			};
+
+			const int helpers = std::min<int>(chunks - 1, static_cast<int>(m_workers.size()));
+			for (int i = 0; i < helpers; ++i) enqueue(work);
+			work();
+
+			std::unique_lock<std::mutex> lock(state->mutex);
+			state->cv.wait(lock, [&] { return state->done.load() == chunks; });
+			if (state->error) std::rethrow_exception(state->error);
+		}
+
+		// Process-wide pool used by the library.
+		static ThreadPool& instance() {
+			static ThreadPool pool;
+			return pool;
+		}
+
+	private:
+		void enqueue(std::function<void()> job) {
+			{
+				std::lock_guard<std::mutex> lock(m_mutex);
+				m_jobs.push_back(std::move(job));
+			}
+			m_cv.notify_one();
+		}
+
+		void workerLoop() {
+			for (;;) {
+				std::function<void()> job;
+				{
+					std::unique_lock<std::mutex> lock(m_mutex);
+					m_cv.wait(lock, [this] { return m_stop || !m_jobs.empty(); });
+					if (m_stop && m_jobs.empty()) return;
+					job = std::move(m_jobs.front());
+					m_jobs.pop_front();
+				}
+				job();
+			}
+		}
+
+		std::vector<std::thread> m_workers;
+		std::deque<std::function<void()>> m_jobs;
+		std::mutex m_mutex;
+		std::condition_variable m_cv;
+		bool m_stop = false;
+	};
+
 	using Pixel = std::tuple<double, double, double>;
 	using Coord = std::tuple<int, int, int, int>;
 	using Point = std::tuple<int, int>;
 
-	// Helper functions
-	constexpr float getFloatColorElement(uint8_t element) { return static_cast<float>(element) / 255.0f; }
-	constexpr float getfRedColorElement(Pixel px) { return std::get<0>(px); }
-	constexpr uint8_t getRedColorElement(Pixel px) { return static_cast<uint8_t>(std::get<0>(px) * 255); }
-	constexpr float getfGreenColorElement(Pixel px) { return std::get<1>(px); }
-	constexpr uint8_t getGreenColorElement(Pixel px) { return static_cast<uint8_t>(std::get<1>(px) * 255); }
-	constexpr float getfBlueColorElement(Pixel px) { return std::get<2>(px); }
-	constexpr uint8_t getBlueColorElement(Pixel px) { return static_cast<uint8_t>(std::get<2>(px) * 255); }
-	constexpr Pixel createfPixelWithColor(float r, float g, float b) { return std::make_tuple(r,g,b); }
-	constexpr Pixel createPixelWithColor(uint8_t r, uint8_t g, uint8_t b) { return std::make_tuple(getFloatColorElement(r), getFloatColorElement(g), getFloatColorElement(b)); }
-	constexpr Pixel createfGrayPixel(float v) { return createfPixelWithColor(v,v,v); }
-	constexpr Pixel createGrayPixel(uint8_t v) { return createPixelWithColor(v,v,v); }
-	constexpr Coord createCoord(int x1, int y1, int x2, int y2) { return std::make_tuple(x1,y1,x2,y2); }
-	constexpr int getCoordX1(Coord co) { return std::get<0>(co); }
-	constexpr int getCoordX2(Coord co) { return std::get<2>(co); }
-	constexpr int getCoordY1(Coord co) { return std::get<1>(co); }
-	constexpr int getCoordY2(Coord co) { return std::get<3>(co); }
-	constexpr Point getFirstPointFromCoord(Coord co) { return std::make_tuple(getCoordX1(co), getCoordY1(co)); }
-	constexpr Point getSecondPointFromCoord(Coord co) { return std::make_tuple(getCoordX2(co), getCoordY2(co)); }
-	constexpr Coord createCoordFromPoints(Point pt1, Point pt2) { return std::make_tuple(std::get<0>(pt1), std::get<1>(pt1), std::get<0>(pt2), std::get<1>(pt2)); }
-	constexpr Point createPoint(int x1, int y1) { return std::make_tuple(x1,y1); }
-	constexpr int getPointX1(Point pt) { return std::get<0>(pt); }
-	constexpr int getPointY1(Point pt) { return std::get<1>(pt); }
-	
-	void setRedColorElement(Pixel& px, float r) {px=std::make_tuple(r,getfGreenColorElement(px),getfBlueColorElement(px));}
-	void setRedColorElement(Pixel& px, uint8_t r) {px=std::make_tuple(getFloatColorElement(r),getfGreenColorElement(px),getfBlueColorElement(px));}
-	void setGreenColorElement(Pixel& px, float g) {px=std::make_tuple(getfRedColorElement(px),g,getfBlueColorElement(px));}
-	void setGreenColorElement(Pixel& px, uint8_t g) {px=std::make_tuple(getfRedColorElement(px),getFloatColorElement(g),getfBlueColorElement(px));}
-	void setBlueColorElement(Pixel& px, float b) {px=std::make_tuple(getfRedColorElement(px),getfGreenColorElement(px),b);}
-	void setBlueColorElement(Pixel& px, uint8_t b) {px=std::make_tuple(getfRedColorElement(px),getfGreenColorElement(px),getFloatColorElement(b));}
+	// Helper functions
+	constexpr float getFloatColorElement(uint8_t element) { return static_cast<float>(element) / 255.0f; }
+	constexpr float getfRedColorElement(Pixel px) { return std::get<0>(px); }
+	constexpr uint8_t getRedColorElement(Pixel px) { return static_cast<uint8_t>(std::get<0>(px) * 255); }
+	constexpr float getfGreenColorElement(Pixel px) { return std::get<1>(px); }
+	constexpr uint8_t getGreenColorElement(Pixel px) { return static_cast<uint8_t>(std::get<1>(px) * 255); }
+	constexpr float getfBlueColorElement(Pixel px) { return std::get<2>(px); }
+	constexpr uint8_t getBlueColorElement(Pixel px) { return static_cast<uint8_t>(std::get<2>(px) * 255); }
+	constexpr Pixel createfPixelWithColor(float r, float g, float b) { return std::make_tuple(r,g,b); }
+	constexpr Pixel createPixelWithColor(uint8_t r, uint8_t g, uint8_t b) { return std::make_tuple(getFloatColorElement(r), getFloatColorElement(g), getFloatColorElement(b)); }
+	constexpr Pixel createfGrayPixel(float v) { return createfPixelWithColor(v,v,v); }
+	constexpr Pixel createGrayPixel(uint8_t v) { return createPixelWithColor(v,v,v); }
+	constexpr Coord createCoord(int x1, int y1, int x2, int y2) { return std::make_tuple(x1,y1,x2,y2); }
+	constexpr int getCoordX1(Coord co) { return std::get<0>(co); }
+	constexpr int getCoordX2(Coord co) { return std::get<2>(co); }
+	constexpr int getCoordY1(Coord co) { return std::get<1>(co); }
+	constexpr int getCoordY2(Coord co) { return std::get<3>(co); }
+	constexpr Point getFirstPointFromCoord(Coord co) { return std::make_tuple(getCoordX1(co), getCoordY1(co)); }
+	constexpr Point getSecondPointFromCoord(Coord co) { return std::make_tuple(getCoordX2(co), getCoordY2(co)); }
+	constexpr Coord createCoordFromPoints(Point pt1, Point pt2) { return std::make_tuple(std::get<0>(pt1), std::get<1>(pt1), std::get<0>(pt2), std::get<1>(pt2)); }
+	constexpr Point createPoint(int x1, int y1) { return std::make_tuple(x1,y1); }
+	constexpr int getPointX1(Point pt) { return std::get<0>(pt); }
+	constexpr int getPointY1(Point pt) { return std::get<1>(pt); }
+	
+	void setRedColorElement(Pixel& px, float r) {px=std::make_tuple(r,getfGreenColorElement(px),getfBlueColorElement(px));}
+	void setRedColorElement(Pixel& px, uint8_t r) {px=std::make_tuple(getFloatColorElement(r),getfGreenColorElement(px),getfBlueColorElement(px));}
+	void setGreenColorElement(Pixel& px, float g) {px=std::make_tuple(getfRedColorElement(px),g,getfBlueColorElement(px));}
+	void setGreenColorElement(Pixel& px, uint8_t g) {px=std::make_tuple(getfRedColorElement(px),getFloatColorElement(g),getfBlueColorElement(px));}
+	void setBlueColorElement(Pixel& px, float b) {px=std::make_tuple(getfRedColorElement(px),getfGreenColorElement(px),b);}
+	void setBlueColorElement(Pixel& px, uint8_t b) {px=std::make_tuple(getfRedColorElement(px),getfGreenColorElement(px),getFloatColorElement(b));}
+
+	// Full-scale value of a channel type: 1 for floating point, the type's maximum for integers.
+	template <typename T>
+	constexpr T channelMax() {
+		if constexpr (std::is_floating_point_v<T>) return T(1);
+		else return std::numeric_limits<T>::max();
+	}
+
+	// Converts one channel between types, rescaling between [0,1] and [0,channelMax] and rounding to nearest.
+	template <typename To, typename From>
+	constexpr To convertChannel(From v) {
+		if constexpr (std::is_floating_point_v<From> && std::is_floating_point_v<To>) {
+			return static_cast<To>(v);
+		} else if constexpr (std::is_floating_point_v<From>) {
+			v = v < From(0) ? From(0) : (v > From(1) ? From(1) : v);
+			return static_cast<To>(v * channelMax<To>() + From(0.5));
+		} else if constexpr (std::is_floating_point_v<To>) {
+			return static_cast<To>(v) / channelMax<From>();
+		} else {
+			return static_cast<To>((static_cast<uint64_t>(v) * channelMax<To>() + channelMax<From>() / 2) / channelMax<From>());
+		}
+	}
+
+	// Trivially copyable color, e.g. Rgb<uint8_t> (3 bytes) or Rgb<float> (12 bytes). Converts implicitly to and from
+	// Pixel, so it can be passed to every Pixel API.
+	template <typename T>
+	struct Rgb {
+		T r{};
+		T g{};
+		T b{};
+
+		constexpr Rgb() = default;
+		constexpr Rgb(T red, T green, T blue) : r(red), g(green), b(blue) {}
+		constexpr Rgb(const Pixel& px)
+			: r(convertChannel<T>(std::get<0>(px))), g(convertChannel<T>(std::get<1>(px))), b(convertChannel<T>(std::get<2>(px))) {}
+		constexpr operator Pixel() const { return Pixel(convertChannel<double>(r), convertChannel<double>(g), convertChannel<double>(b)); }
+
+		constexpr bool operator==(const Rgb&) const = default;
+	};
+
+	template <typename To, typename From>
+	constexpr Rgb<To> rgbCast(const Rgb<From>& c) {
+		return Rgb<To>(convertChannel<To>(c.r), convertChannel<To>(c.g), convertChannel<To>(c.b));
+	}
+
+	using Rgb8 = Rgb<uint8_t>;
+	using Rgbf = Rgb<float>;
+	static_assert(std::is_trivially_copyable_v<Rgb8> && sizeof(Rgb8) == 3);
+
+	struct Vec2i {
+		int x = 0;
+		int y = 0;
+
+		constexpr Vec2i() = default;
+		constexpr Vec2i(int px, int py) : x(px), y(py) {}
+		constexpr Vec2i(const Point& pt) : x(std::get<0>(pt)), y(std::get<1>(pt)) {}
+		constexpr operator Point() const { return Point(x, y); }
+
+		constexpr Vec2i operator+(const Vec2i& o) const { return Vec2i(x + o.x, y + o.y); }
+		constexpr Vec2i operator-(const Vec2i& o) const { return Vec2i(x - o.x, y - o.y); }
+		constexpr bool operator==(const Vec2i&) const = default;
+	};
+
+	// Origin plus size. Converts to and from Coord, whose second corner is inclusive.
+	struct Rect {
+		int x = 0;
+		int y = 0;
+		int w = 0;
+		int h = 0;
+
+		constexpr Rect() = default;
+		constexpr Rect(int px, int py, int width, int height) : x(px), y(py), w(width), h(height) {}
+		constexpr Rect(const Coord& co)
+			: x(std::get<0>(co)), y(std::get<1>(co)), w(std::get<2>(co) - std::get<0>(co) + 1), h(std::get<3>(co) - std::get<1>(co) + 1) {}
+		constexpr operator Coord() const { return Coord(x, y, x + w - 1, y + h - 1); }
+
+		constexpr bool empty() const { return w <= 0 || h <= 0; }
+		constexpr bool contains(const Vec2i& p) const { return p.x >= x && p.x < x + w && p.y >= y && p.y < y + h; }
+		constexpr Rect intersect(const Rect& o) const {
+			const int x0 = std::max(x, o.x), y0 = std::max(y, o.y);
+			const int x1 = std::min(x + w, o.x + o.w), y1 = std::min(y + h, o.y + o.h);
+			return x1 > x0 && y1 > y0 ? Rect(x0, y0, x1 - x0, y1 - y0) : Rect();
+		}
+		constexpr bool operator==(const Rect&) const = default;
+	};
+
+	namespace detail
+	{
+		// Channel access shared by Pixel and Rgb<T>, so that a kernel templated on the pixel type serves Image
+		// (Pixel) and packed Rgb<T> buffers alike.
+		template <typename Px> struct ChannelType { using type = double; };
+		template <typename T> struct ChannelType<Rgb<T>> { using type = T; };
+		template <typename Px> using ChannelOf = typename ChannelType<Px>::type;
+
+		template <size_t I> constexpr double& channel(Pixel& px) { return std::get<I>(px); }
+		template <size_t I> constexpr const double& channel(const Pixel& px) { return std::get<I>(px); }
+		template <size_t I, typename T> constexpr T& channel(Rgb<T>& px) {
+			if constexpr (I == 0) return px.r;
+			else if constexpr (I == 1) return px.g;
+			else return px.b;
+		}
+		template <size_t I, typename T> constexpr const T& channel(const Rgb<T>& px) {
+			if constexpr (I == 0) return px.r;
+			else if constexpr (I == 1) return px.g;
+			else return px.b;
+		}
+
+		// Floating-point type a kernel computes in when it has no integer path: double for Pixel and Rgb<double>,
+		// float otherwise.
+		template <typename Px> using WorkOf = std::conditional_t<std::is_same_v<ChannelOf<Px>, double>, double, float>;
+
+		// Stores a computed value in a channel: integer channels are rounded and clamped to [0, channelMax],
+		// floating-point ones are kept as they are (like Pixel, they may leave [0,1]).
+		template <typename T, typename V>
+		constexpr T storeChannel(V v) {
+			if constexpr (std::is_floating_point_v<T>) {
+				return static_cast<T>(v);
+			} else {
+				return static_cast<T>(std::clamp<V>(v + V(0.5), V(0), static_cast<V>(channelMax<T>())));
+			}
+		}
+	} // namespace detail
+
+	// Affine map (x, y) -> (a x + b y + tx, c x + d y + ty).
+	class Affine2D
+	{
+	public:
+		constexpr Affine2D() = default;
+		constexpr Affine2D(double a, double b, double c, double d, double tx, double ty) : m_a(a), m_b(b), m_c(c), m_d(d), m_tx(tx), m_ty(ty) {}
+
+		static constexpr Affine2D translate(double tx, double ty) { return Affine2D(1, 0, 0, 1, tx, ty); }
+		static constexpr Affine2D scale(double sx, double sy) { return Affine2D(sx, 0, 0, sy, 0, 0); }
+		static constexpr Affine2D shear(double kx, double ky) { return Affine2D(1, kx, ky, 1, 0, 0); }
+
+		// Same sense as drawRotatedRectangle: with y pointing down, positive angles turn clockwise.
+		static Affine2D rotate(double degrees) {
+			const double rad = degrees * M_PI / 180.0;
+			return Affine2D(std::cos(rad), -std::sin(rad), std::sin(rad), std::cos(rad), 0, 0);
+		}
+
+		static Affine2D rotate(double degrees, double cx, double cy) {
+			return translate(cx, cy) * rotate(degrees) * translate(-cx, -cy);
+		}
+
+		// (A * B)(p) = A(B(p)): B is applied first.
+		constexpr Affine2D operator*(const Affine2D& o) const {
+			return Affine2D(m_a * o.m_a + m_b * o.m_c, m_a * o.m_b + m_b * o.m_d, m_c * o.m_a + m_d * o.m_c, m_c * o.m_b + m_d * o.m_d,
+			                m_a * o.m_tx + m_b * o.m_ty + m_tx, m_c * o.m_tx + m_d * o.m_ty + m_ty);
+		}
+
+		constexpr double determinant() const { return m_a * m_d - m_b * m_c; }
+
+		Affine2D inverse() const {
+			const double det = determinant();
+			if (det == 0 || !std::isfinite(det)) throw std::invalid_argument("Affine2D: singular matrix");
+			const double a = m_d / det, b = -m_b / det, c = -m_c / det, d = m_a / det;
+			return Affine2D(a, b, c, d, -(a * m_tx + b * m_ty), -(c * m_tx + d * m_ty));
+		}
+
+		constexpr void apply(double x, double y, double& outX, double& outY) const {
+			outX = m_a * x + m_b * y + m_tx;
+			outY = m_c * x + m_d * y + m_ty;
+		}
+
+	private:
+		double m_a = 1;
+		double m_b = 0;
+		double m_c = 0;
+		double m_d = 1;
+		double m_tx = 0;
+		double m_ty = 0;
+	};
+
+	// Helper functions for colors
+	Pixel blendColors(Pixel &colorbackground, Pixel &colorforeground, float alpha) {float r=0.0f; float g=0.0f; float b=0.0f;r = (std::get<0>(colorforeground) * alpha) + (std::get<0>(colorbackground) * (1.0 - alpha));g = (std::get<1>(colorforeground) * alpha) + (std::get<1>(colorbackground) * (1.0 - alpha));b = (std::get<2>(colorforeground) * alpha) + (std::get<2>(colorbackground) * (1.0 - alpha));return createfPixelWithColor(r,g,b);}
+	void getHSV(double& h, double& s, double& v, const Pixel& px) {double r, g, b;std::tie(r, g, b) = px;double min_val = std::min({r, g, b});double max_val = std::max({r, g, b});double delta = max_val - min_val;v = max_val;if (max_val != 0.0) {s = delta / max_val;} else {s = 0.0;h = -1.0;return;}if (r == max_val) {h = (g - b) / delta;} else if (g == max_val) {h = 2.0 + (b - r) / delta;} else {h = 4.0 + (r - g) / delta;}h *= 60.0;if (h < 0) {h += 360.0;}h /= 360.0;}
+	void setHSV(double h,double s,double v,Pixel& px) {if (s == 0) {px = {v, v, v};return;}h *= 360.0;h = std::fmod(h, 360.0);h /= 60.0;int i = std::floor(h);double f = h - i;double p = v * (1.0 - s);double q = v * (1.0 - s * f);double t = v * (1.0 - s * (1.0 - f));switch (i) {case 0:px = {v, t, p};break;case 1:px = {q, v, p};break;case 2:px = {p, v, t};break;case 3:px = {p, q, v};break;case 4:px = {t, p, v};break;default:px = {v, p, q};break;}}
+
+	// sRGB transfer functions (IEC 61966-2-1) on values in [0,1].
+	inline double srgbToLinear(double v) { return v <= 0.04045 ? v / 12.92 : std::pow((v + 0.055) / 1.055, 2.4); }
+	inline double linearToSrgb(double v) { return v <= 0.0031308 ? v * 12.92 : 1.055 * std::pow(v, 1.0 / 2.4) - 0.055; }
+	inline Pixel toLinear(const Pixel& px) { return Pixel(srgbToLinear(std::get<0>(px)), srgbToLinear(std::get<1>(px)), srgbToLinear(std::get<2>(px))); }
+	inline Pixel toSrgb(const Pixel& px) { return Pixel(linearToSrgb(std::get<0>(px)), linearToSrgb(std::get<1>(px)), linearToSrgb(std::get<2>(px))); }
+
+	namespace detail
+	{
+		// The encoder splits [0,1] into 4096 bins. The closest rounding thresholds (in the linear toe) are
+		// 1/(255*12.92) apart, more than a bin, so each bin holds at most one threshold: the code is the bin's
+		// starting code plus one if the value is past that threshold.
+		struct SrgbTables {
+			static constexpr int bins = 4096;
+			std::array<double, 256> toLinear;          // decode of each 8-bit code
+			std::array<uint8_t, bins + 1> binCode;     // correctly rounded code at i / bins
+			std::array<double, bins + 1> binThreshold; // where the code steps up inside bin i, or 2.0 if it doesn't
+		};
+
+		inline const SrgbTables& srgbTables() {
+			static const SrgbTables tables = [] {
+				SrgbTables t;
+				std::array<double, 255> thresholds;
+				for (int k = 0; k < 256; ++k) {
+					t.toLinear[k] = srgbToLinear(k / 255.0);
+					if (k < 255) thresholds[k] = srgbToLinear((k + 0.5) / 255.0);
+				}
+				for (int i = 0; i <= SrgbTables::bins; ++i) {
+					double lo = static_cast<double>(i) / SrgbTables::bins, hi = static_cast<double>(i + 1) / SrgbTables::bins;
+					auto next = std::upper_bound(thresholds.begin(), thresholds.end(), lo);
+					t.binCode[i] = static_cast<uint8_t>(next - thresholds.begin());
+					t.binThreshold[i] = (next != thresholds.end() && *next < hi) ? *next : 2.0;
+				}
+				return t;
+			}();
+			return tables;
+		}
+
+		inline uint8_t encodeSrgb8(const SrgbTables& t, double linear) {
+			double v = std::clamp(linear, 0.0, 1.0);
+			int i = static_cast<int>(v * SrgbTables::bins);
+			return static_cast<uint8_t>(t.binCode[i] + (v >= t.binThreshold[i]));
+		}
+	} // namespace detail
+
+	// Linear value to the nearest 8-bit sRGB code, from two table lookups.
+	inline uint8_t encodeSrgb8(double linear) {
+		return detail::encodeSrgb8(detail::srgbTables(), linear);
+	}
+
+	// Errors from reading/writing files
+	class Error : public std::runtime_error
+	{
+	public:
+		using std::runtime_error::runtime_error;
+	};
+
+	// Which part of an image a filter runs over; Dirty falls back to All while tracking is off.
+	enum class Region { All, Dirty };
+
+	enum class FileFormat { P2, P3, P5, P6, P7, QOI, PNG };
+
+	// How an Image stores its values. Linear keeps them in linear light, so filters and blending are physically
+	// correct; files are still sRGB-encoded and converted on read/write.
+	enum class ColorSpace { Srgb, Linear };
+
+	namespace detail
+	{
+		struct NetpbmHeader {
+			char format = 0; // '2', '3', '5', '6' or '7'
+			int width = 0;
+			int height = 0;
+			int depth = 0;
+			int maxval = 0;
+			size_t dataOffset = 0;
+		};
+
+		inline std::vector<uint8_t> readFileBytes(const std::string& filename) {
+			std::ifstream in(filename, std::ios_base::in | std::ios_base::binary);
+			if (!in.is_open()) {
+				throw Error("Can't open " + filename);
+			}
+			in.seekg(0, std::ios::end);
+			std::streamoff size = in.tellg();
+			in.seekg(0, std::ios::beg);
+			std::vector<uint8_t> data(size > 0 ? static_cast<size_t>(size) : 0);
+			if (!data.empty() && !in.read(reinterpret_cast<char*>(data.data()), size)) {
+				throw Error("Can't read " + filename);
+			}
+			return data;
+		}
+
+		inline void writeFileBytes(const std::string& filename, const std::vector<uint8_t>& data) {
+			std::ofstream out(filename, std::ios_base::out | std::ios_base::binary);
+			if (!out.is_open()) {
+				throw Error("Could not open " + filename + " for writing.");
+			}
+			out.write(reinterpret_cast<const char*>(data.data()), static_cast<std::streamsize>(data.size()));
+			if (!out) {
+				throw Error("Could not write " + filename);
+			}
+		}
+
+		inline bool isSpace(uint8_t c) {
+			return c == ' ' || c == '\t' || c == '\n' || c == '\r' || c == '\v' || c == '\f';
+		}
+
+		// Skips whitespace and any number of '#' comment lines.
+		inline void skipSpaceAndComments(const std::vector<uint8_t>& data, size_t& pos) {
+			while (pos < data.size()) {
+				if (isSpace(data[pos])) {
+					++pos;
+				} else if (data[pos] == '#') {
+					while (pos < data.size() && data[pos] != '\n') ++pos;
+				} else {
+					break;
+				}
+			}
+		}
+
+		inline unsigned parseUnsigned(const std::vector<uint8_t>& data, size_t& pos) {
+			skipSpaceAndComments(data, pos);
+			if (pos >= data.size() || data[pos] < '0' || data[pos] > '9') {
+				throw Error("Malformed Netpbm data: expected a number");
+			}
+			uint64_t value = 0;
+			while (pos < data.size() && data[pos] >= '0' && data[pos] <= '9') {
+				value = value * 10 + (data[pos++] - '0');
+				if (value > 0xffffffffu) throw Error("Malformed Netpbm data: number out of range");
+			}
+			return static_cast<unsigned>(value);
+		}
+
+		inline std::string parseToken(const std::vector<uint8_t>& data, size_t& pos) {
+			skipSpaceAndComments(data, pos);
+			size_t start = pos;
+			while (pos < data.size() && !isSpace(data[pos])) ++pos;
+			return std::string(data.begin() + start, data.begin() + pos);
+		}
+
+		// With checkRaster false, data may hold just a prefix of the file (see probeImageSize).
+		inline NetpbmHeader parseNetpbmHeader(const std::vector<uint8_t>& data, bool checkRaster = true) {
+			NetpbmHeader header;
+			if (data.size() < 2 || data[0] != 'P') {
+				throw Error("Not a Netpbm file");
+			}
+			header.format = static_cast<char>(data[1]);
+			size_t pos = 2;
+			switch (header.format) {
+				case '2': case '5': header.depth = 1; break;
+				case '3': case '6': header.depth = 3; break;
+				case '7': break;
+				default: throw Error(std::string("Unsupported Netpbm format P") + header.format);
+			}
+			if (header.format == '7') {
+				for (;;) {
+					std::string key = parseToken(data, pos);
+					if (key.empty()) throw Error("Malformed PAM header: missing ENDHDR");
+					if (key == "ENDHDR") break;
+					if (key == "WIDTH") header.width = static_cast<int>(parseUnsigned(data, pos));
+					else if (key == "HEIGHT") header.height = static_cast<int>(parseUnsigned(data, pos));
+					else if (key == "DEPTH") header.depth = static_cast<int>(parseUnsigned(data, pos));
+					else if (key == "MAXVAL") header.maxval = static_cast<int>(parseUnsigned(data, pos));
+					else if (key == "TUPLTYPE") parseToken(data, pos);
+					else throw Error("Malformed PAM header: unknown key " + key);
+				}
+				if (header.depth < 1 || header.depth > 4) throw Error("Unsupported PAM depth");
+			} else {
+				header.width = static_cast<int>(parseUnsigned(data, pos));
+				header.height = static_cast<int>(parseUnsigned(data, pos));
+				header.maxval = static_cast<int>(parseUnsigned(data, pos));
+			}
+			if (header.width <= 0 || header.height <= 0) throw Error("Invalid Netpbm dimensions");
+			if (header.maxval < 1 || header.maxval > 65535) throw Error("Invalid Netpbm maxval");
+			// Exactly one whitespace byte separates the header from binary raster data.
+			if (pos >= data.size() || !isSpace(data[pos])) throw Error("Malformed Netpbm header");
+			header.dataOffset = pos + 1;
+			if (checkRaster) {
+				// Binary samples take 1 or 2 bytes; ASCII ones at least a digit each plus a separator between them. Checked
+				// before anything is allocated for the raster, and by division so huge dimensions can't overflow.
+				const bool ascii = header.format == '2' || header.format == '3';
+				const uint64_t available = data.size() - header.dataOffset;
+				const uint64_t fit = ascii ? (available + 1) / 2 : available / (header.maxval > 255 ? 2 : 1);
+				const uint64_t pixels = static_cast<uint64_t>(header.width) * header.height;
+				if (pixels > fit / header.depth) throw Error("Truncated Netpbm raster");
+			}
+			return header;
+		}
+
+		// Calls fn(pixelIndex, samples) for every pixel; samples holds header.depth raw values.
+		template <typename F>
+		void decodeNetpbmPixels(const std::vector<uint8_t>& data, const NetpbmHeader& header, F fn) {
+			const size_t count = static_cast<size_t>(header.width) * header.height;
+			const int depth = header.depth;
+			unsigned samples[4] = {0, 0, 0, 0};
+			if (header.format == '2' || header.format == '3') {
+				size_t pos = header.dataOffset - 1;
+				for (size_t i = 0; i < count; ++i) {
+					for (int c = 0; c < depth; ++c) {
+						samples[c] = std::min(parseUnsigned(data, pos), static_cast<unsigned>(header.maxval));
+					}
+					fn(i, samples);
+				}
+			} else if (header.maxval <= 255) {
+				const uint8_t* src = data.data() + header.dataOffset;
+				for (size_t i = 0; i < count; ++i, src += depth) {
+					for (int c = 0; c < depth; ++c) samples[c] = src[c];
+					fn(i, samples);
+				}
+			} else {
+				const uint8_t* src = data.data() + header.dataOffset;
+				for (size_t i = 0; i < count; ++i, src += 2 * depth) {
+					for (int c = 0; c < depth; ++c) samples[c] = (static_cast<unsigned>(src[2 * c]) << 8) | src[2 * c + 1];
+					fn(i, samples);
+				}
+			}
+		}
+
+		inline void appendString(std::vector<uint8_t>& out, const std::string& text) {
+			out.insert(out.end(), text.begin(), text.end());
+		}
+
+		inline void appendUnsigned(std::vector<uint8_t>& out, unsigned value) {
+			char digits[10];
+			int n = 0;
+			do { digits[n++] = static_cast<char>('0' + value % 10); value /= 10; } while (value);
+			while (n) out.push_back(static_cast<uint8_t>(digits[--n]));
+		}
+
+		inline std::vector<uint8_t> netpbmHeader(FileFormat format, int width, int height, int depth, int maxval) {
+			std::vector<uint8_t> out;
+			if (format == FileFormat::P7) {
+				static const char* tupleTypes[] = {"GRAYSCALE", "GRAYSCALE_ALPHA", "RGB", "RGB_ALPHA"};
+				appendString(out, "P7\nWIDTH " + std::to_string(width) + "\nHEIGHT " + std::to_string(height) +
+					"\nDEPTH " + std::to_string(depth) + "\nMAXVAL " + std::to_string(maxval) +
+					"\nTUPLTYPE " + tupleTypes[depth - 1] + "\nENDHDR\n");
+			} else {
+				const char* magic = format == FileFormat::P2 ? "P2\n" : format == FileFormat::P3 ? "P3\n" : format == FileFormat::P5 ? "P5\n" : "P6\n";
+				appendString(out, magic + std::to_string(width) + ' ' + std::to_string(height) + '\n' + std::to_string(maxval) + '\n');
+			}
+			return out;
+		}
+
+		// Appends one pixel's samples in the raster encoding of format; lineLength tracks ASCII line wrapping.
+		inline void appendNetpbmSamples(std::vector<uint8_t>& out, FileFormat format, int maxval, const unsigned* samples, int depth, int& lineLength) {
+			if (format == FileFormat::P2 || format == FileFormat::P3) {
+				for (int c = 0; c < depth; ++c) {
+					if (lineLength > 64) { out.push_back('\n'); lineLength = 0; }
+					size_t before = out.size();
+					if (lineLength) out.push_back(' ');
+					appendUnsigned(out, samples[c]);
+					lineLength += static_cast<int>(out.size() - before);
+				}
+			} else if (maxval <= 255) {
+				for (int c = 0; c < depth; ++c) out.push_back(static_cast<uint8_t>(samples[c]));
+			} else {
+				for (int c = 0; c < depth; ++c) {
+					out.push_back(static_cast<uint8_t>(samples[c] >> 8));
+					out.push_back(static_cast<uint8_t>(samples[c] & 0xff));
+				}
+			}
+		}
+
+		inline unsigned quantizeSample(double value, int maxval) {
+			return static_cast<unsigned>(std::clamp(value, 0.0, 1.0) * maxval);
+		}
+
+		inline FileFormat formatFromSuffix(const std::string& suffix, FileFormat fallback) {
+			std::string lower = suffix;
+			std::transform(lower.begin(), lower.end(), lower.begin(), [](unsigned char c) { return static_cast<char>(std::tolower(c)); });
+			if (lower == ".pgm") return FileFormat::P5;
+			if (lower == ".pam") return FileFormat::P7;
+			if (lower == ".ppm" || lower == ".pnm") return FileFormat::P6;
+			if (lower == ".qoi") return FileFormat::QOI;
+			if (lower == ".png") return FileFormat::PNG;
+			return fallback;
+		}
+	} // namespace detail
+
+	// Morphology with a rectangular structuring element. Open is erode then dilate, close the reverse; top-hat is
+	// the image minus its opening (small bright details), black-hat its closing minus the image (small dark ones).
+	enum class MorphologyOp { Erode, Dilate, Open, Close, TopHat, BlackHat };
+
+	// PerChannel takes the min/max of every channel independently; Luminance picks the whole pixel with the
+	// lowest/highest luminance, so no new colors appear.
+	enum class MorphologyMode { PerChannel, Luminance };
+
+	namespace detail
+	{
+		// Running min/max over the window [i - before, i - before + size - 1] at each of n positions of `lanes`
+		// values (element (p, l) at in[p * inStride + l]); positions outside the line count as identity. van Herk / Gil-Werman: the padded line is cut into blocks of `size`, g holds prefix
+		// results and h suffix results within each block, and every window is h at its start combined with g at its
+		// end, three applications of op per value whatever the size.
+		template <typename T, typename Op>
+		void vanHerkLine(const T* in, size_t inStride, T* out, size_t outStride, int n, int lanes, int size, int before, T identity, Op op, std::vector<T>& g, std::vector<T>& h) {
+			const int padded = (n + size - 1 + size - 1) / size * size;
+			g.resize(static_cast<size_t>(padded) * lanes);
+			h.resize(g.size());
+			// Outside the line op(x, identity) is x, so those positions only copy or reset.
+			auto source = [&](int q) { const int p = q - before; return p >= 0 && p < n ? in + static_cast<size_t>(p) * inStride : nullptr; };
+			for (int q = 0; q < padded; ++q) {
+				T* gq = &g[static_cast<size_t>(q) * lanes];
+				const T* src = source(q);
+				if (q % size == 0) {
+					for (int l = 0; l < lanes; ++l) gq[l] = src ? src[l] : identity;
+				} else if (src) {
+					for (int l = 0; l < lanes; ++l) gq[l] = op(gq[l - lanes], src[l]);
+				} else {
+					std::copy_n(gq - lanes, lanes, gq);
+				}
+			}
+			for (int q = padded - 1; q >= 0; --q) {
+				T* hq = &h[static_cast<size_t>(q) * lanes];
+				const T* src = source(q);
+				if (q % size == size - 1) {
+					for (int l = 0; l < lanes; ++l) hq[l] = src ? src[l] : identity;
+				} else if (src) {
+					for (int l = 0; l < lanes; ++l) hq[l] = op(hq[l + lanes], src[l]);
+				} else {
+					std::copy_n(hq + lanes, lanes, hq);
+				}
+			}
+			for (int i = 0; i < n; ++i) {
+				const T* hi = &h[static_cast<size_t>(i) * lanes];
+				const T* gi = &g[static_cast<size_t>(i + size - 1) * lanes];
+				for (int l = 0; l < lanes; ++l) out[static_cast<size_t>(i) * outStride + l] = op(hi[l], gi[l]);
+			}
+		}
+
+		// Erodes (op = min) or dilates (op = max) a row-major image of `channels` interleaved values in place with a
+		// seWidth x seHeight rectangle covering [x - beforeX, ...] x [y - beforeY, ...]. A rectangle is a row
+		// segment followed by a column segment: rows run first, then blocks of 16 columns at once so the column
+		// pass reads whole cache lines. Both passes run in parallel.
+		template <typename T, typename Op>
+		void morphologyRect(T* data, int width, int height, int channels, int seWidth, int seHeight, int beforeX, int beforeY, T identity, Op op) {
+			if (seWidth < 1 || seHeight < 1) throw std::invalid_argument("structuring element must be at least 1x1");
+			ThreadPool& pool = ThreadPool::instance();
+			const size_t rowLength = static_cast<size_t>(width) * channels;
+			std::vector<T> tmp(rowLength * height);
+			pool.parallelFor(0, height, 16, [&](int lo, int hi) {
+				std::vector<T> g, h;
+				for (int y = lo; y < hi; ++y) {
+					vanHerkLine(data + y * rowLength, channels, tmp.data() + y * rowLength, channels, width, channels, seWidth, beforeX, identity, op, g, h);
+				}
+			});
+			const int block = 16;
+			pool.parallelFor(0, (width + block - 1) / block, 4, [&](int lo, int hi) {
+				std::vector<T> g, h;
+				for (int b = lo; b < hi; ++b) {
+					const int x0 = b * block, lanes = (std::min(width, x0 + block) - x0) * channels;
+					vanHerkLine(tmp.data() + static_cast<size_t>(x0) * channels, rowLength, data + static_cast<size_t>(x0) * channels, rowLength, height, lanes, seHeight, beforeY, identity, op, g, h);
+				}
+			});
+		}
+
+		// Applies op to data with min and max as erosion and dilation. The dilation uses the reflected rectangle,
+		// so opening never brightens and closing never darkens.
+		template <typename T, typename Min, typename Max>
+		void morphology(MorphologyOp op, T* data, int width, int height, int channels, int seWidth, int seHeight, T low, T high, Min min, Max max) {
+			const int ax = seWidth / 2, ay = seHeight / 2;
+			auto erode = [&] { morphologyRect(data, width, height, channels, seWidth, seHeight, ax, ay, high, min); };
+			auto dilate = [&] { morphologyRect(data, width, height, channels, seWidth, seHeight, seWidth - 1 - ax, seHeight - 1 - ay, low, max); };
+			switch (op) {
+			case MorphologyOp::Erode: erode(); break;
+			case MorphologyOp::Dilate: dilate(); break;
+			case MorphologyOp::Open: case MorphologyOp::TopHat: erode(); dilate(); break;
+			case MorphologyOp::Close: case MorphologyOp::BlackHat: dilate(); erode(); break;
+			}
+		}
+
+		// Morphology of width x height pixels of type Px from in into result (which must not overlap). Per channel,
+		// the pixels are morphed as interleaved channel values of their own type, so 8-bit pixels take 3 bytes. By
+		// luminance, every pixel becomes a (luminance, index) pair compared by luminance (an integer weighted sum
+		// for 8-bit channels), and the index that survives names the source pixel to copy.
+		template <typename Px>
+		void morphologyPixels(const Px* in, Px* result, int width, int height, MorphologyOp op, int seWidth, int seHeight, MorphologyMode mode) {
+			using T = ChannelOf<Px>;
+			ThreadPool& pool = ThreadPool::instance();
+			auto rows = [&](auto fn) {
+				pool.parallelFor(0, height, 64, [&](int lo, int hi) {
+					for (size_t i = static_cast<size_t>(lo) * width; i < static_cast<size_t>(hi) * width; ++i) fn(i);
+				});
+			};
+			if (mode == MorphologyMode::PerChannel) {
+				std::vector<T> values(static_cast<size_t>(width) * height * 3);
+				PPMPP_PROFILE_SCRATCH(values.size() * sizeof(T));
+				rows([&](size_t i) {
+					values[3 * i] = channel<0>(in[i]);
+					values[3 * i + 1] = channel<1>(in[i]);
+					values[3 * i + 2] = channel<2>(in[i]);
+				});
+				T low = std::numeric_limits<T>::lowest(), high = std::numeric_limits<T>::max();
+				if constexpr (std::is_floating_point_v<T>) {
+					low = -std::numeric_limits<T>::infinity();
+					high = std::numeric_limits<T>::infinity();
+				}
+				morphology(op, values.data(), width, height, 3, seWidth, seHeight, low, high,
+					[](T a, T b) { return std::min(a, b); }, [](T a, T b) { return std::max(a, b); });
+				rows([&](size_t i) { result[i] = Px(values[3 * i], values[3 * i + 1], values[3 * i + 2]); });
+			} else {
+				using Key = std::conditional_t<std::is_same_v<T, uint8_t>, int32_t, WorkOf<Px>>;
+				struct Ranked {
+					Key key;
+					size_t index;
+				};
+				std::vector<Ranked> ranked(static_cast<size_t>(width) * height);
+				PPMPP_PROFILE_SCRATCH(ranked.size() * sizeof(Ranked));
+				rows([&](size_t i) {
+					const Px& px = in[i];
+					if constexpr (std::is_same_v<T, uint8_t>) ranked[i] = {13933 * px.r + 46871 * px.g + 4732 * px.b, i};
+					else ranked[i] = {Key(0.2126) * channel<0>(px) + Key(0.7152) * channel<1>(px) + Key(0.0722) * channel<2>(px), i};
+				});
+				Key low = std::numeric_limits<Key>::lowest(), high = std::numeric_limits<Key>::max();
+				if constexpr (std::is_floating_point_v<Key>) {
+					low = -std::numeric_limits<Key>::infinity();
+					high = std::numeric_limits<Key>::infinity();
+				}
+				morphology(op, ranked.data(), width, height, 1, seWidth, seHeight, Ranked{low, 0}, Ranked{high, 0},
+					[](const Ranked& a, const Ranked& b) { return b.key < a.key ? b : a; },
+					[](const Ranked& a, const Ranked& b) { return b.key > a.key ? b : a; });
+				rows([&](size_t i) { result[i] = in[ranked[i].index]; });
+			}
+
+			if (op == MorphologyOp::TopHat || op == MorphologyOp::BlackHat) {
+				// Luminance picks can differ per channel in either direction, so the difference is clamped.
+				auto difference = [](T a, T b) {
+					if constexpr (std::is_floating_point_v<T>) return std::max(a - b, T(0));
+					else return a > b ? static_cast<T>(a - b) : T(0);
+				};
+				const bool top = op == MorphologyOp::TopHat;
+				rows([&](size_t i) {
+					const Px& a = top ? in[i] : result[i];
+					const Px& b = top ? result[i] : in[i];
+					result[i] = Px(difference(channel<0>(a), channel<0>(b)), difference(channel<1>(a), channel<1>(b)), difference(channel<2>(a), channel<2>(b)));
+				});
+			}
+		}
+
+		// Per-channel median over a (2r+1)^2 window of interleaved 8-bit codes, borders clamped. Constant time per
+		// pixel (Perreault & Hebert): every column keeps a histogram of its 2r+1 rows, the window histogram slides
+		// along the row adding one column and dropping another, and it is split into 16 coarse and 256 fine bins
+		// where a fine segment is only brought up to date when the median falls into it. Row bands run in parallel,
+		// each with its own column histograms.
+		inline void medianFilter8(const uint8_t* in, uint8_t* out, int width, int height, int channels, int radius) {
+			if (radius < 0 || radius > 127) throw std::invalid_argument("median radius must be in [0, 127]");
+			const int rank = (2 * radius + 1) * (2 * radius + 1) / 2;
+			auto clampX = [width](int x) { return std::clamp(x, 0, width - 1); };
+			auto clampY = [height](int y) { return std::clamp(y, 0, height - 1); };
+
+			ThreadPool::instance().parallelFor(0, height, std::max(32, 4 * radius), [&](int lo, int hi) {
+				std::vector<uint16_t> colFine(static_cast<size_t>(width) * 256), colCoarse(static_cast<size_t>(width) * 16);
+				auto addRow = [&](int y, int c, int delta) {
+					const uint8_t* row = in + static_cast<size_t>(clampY(y)) * width * channels + c;
+					for (int x = 0; x < width; ++x) {
+						const uint8_t v = row[static_cast<size_t>(x) * channels];
+						colFine[static_cast<size_t>(x) * 256 + v] += delta;
+						colCoarse[static_cast<size_t>(x) * 16 + (v >> 4)] += delta;
+					}
+				};
+
+				for (int c = 0; c < channels; ++c) {
+					std::fill(colFine.begin(), colFine.end(), 0);
+					std::fill(colCoarse.begin(), colCoarse.end(), 0);
+					for (int y = lo - radius; y <= lo + radius; ++y) addRow(y, c, 1);
+
+					for (int y = lo; y < hi; ++y) {
+						if (y > lo) {
+							addRow(y - radius - 1, c, -1);
+							addRow(y + radius, c, 1);
+						}
+						uint16_t coarse[16] = {};
+						uint16_t fine[16 * 16];
+						int updated[16];
+						std::fill(updated, updated + 16, std::numeric_limits<int>::min() / 2);
+						for (int i = -radius; i <= radius; ++i) {
+							const uint16_t* col = &colCoarse[static_cast<size_t>(clampX(i)) * 16];
+							for (int b = 0; b < 16; ++b) coarse[b] += col[b];
+						}
+
+						uint8_t* dst = out + static_cast<size_t>(y) * width * channels + c;
+						for (int x = 0; x < width; ++x) {
+							if (x > 0) {
+								const uint16_t* add = &colCoarse[static_cast<size_t>(clampX(x + radius)) * 16];
+								const uint16_t* sub = &colCoarse[static_cast<size_t>(clampX(x - radius - 1)) * 16];
+								for (int b = 0; b < 16; ++b) coarse[b] += add[b] - sub[b];
+							}
+							int s = 0, sum = 0;
+							while (sum + coarse[s] <= rank) sum += coarse[s++];
+
+							uint16_t* f = fine + 16 * s;
+							if (x - updated[s] > radius) {
+								std::fill(f, f + 16, 0);
+								for (int i = x - radius; i <= x + radius; ++i) {
+									const uint16_t* col = &colFine[static_cast<size_t>(clampX(i)) * 256 + 16 * s];
+									for (int b = 0; b < 16; ++b) f[b] += col[b];
+								}
+							} else {
+								for (int j = updated[s] + 1; j <= x; ++j) {
+									const uint16_t* add = &colFine[static_cast<size_t>(clampX(j + radius)) * 256 + 16 * s];
+									const uint16_t* sub = &colFine[static_cast<size_t>(clampX(j - radius - 1)) * 256 + 16 * s];
+									for (int b = 0; b < 16; ++b) f[b] += add[b] - sub[b];
+								}
+							}
+							updated[s] = x;
+
+							int b = 0;
+							while (sum + f[b] <= rank) sum += f[b++];
+							dst[static_cast<size_t>(x) * channels] = static_cast<uint8_t>(16 * s + b);
+						}
+					}
+				}
+			});
+		}
+
+		// Per-channel median of interleaved 16-bit keys over a (2r+1)^2 window, borders clamped. Constant time per
+		// pixel like medianFilter8, with four levels of 16 bins (key bits 15-12, 11-8, 7-4 and 3-0): every column
+		// keeps its counts at all four levels, the window's top level slides along the row, and a 16-bin segment
+		// of a lower level is only brought up to date when the median falls into it. Columns with 65536 bins don't
+		// fit a whole row, so each row band is walked in strips at least 2r wide. The counts are stored segment by
+		// segment, each holding its 16 bins for every column of the strip, so that bringing a segment up to date
+		// reads one contiguous run.
+		// With TrackKeys, withinKey receives the median's rank among the window's samples with the same key,
+		// keyCount their number and, where that is 1, sole the sample's pixel index (its column is looked up in
+		// the window's columns, its row from a per-column sum of rows).
+		template <bool TrackKeys = false>
+		void medianFilter16(const uint16_t* in, uint16_t* out, int width, int height, int channels, int radius,
+			uint16_t* withinKey = nullptr, uint16_t* keyCount = nullptr, uint32_t* sole = nullptr) {
+			if (radius < 0 || radius > 127) throw std::invalid_argument("median radius must be in [0, 127]");
+			const int rank = (2 * radius + 1) * (2 * radius + 1) / 2;
+			const size_t rowSamples = static_cast<size_t>(width) * channels;
+			const int strip = std::max(64, 2 * radius);
+			// Where each level's bins start among a column's (or the window's) bins, and where each level's
+			// segments start among the window's update stamps.
+			constexpr int levelStart[4] = {0, 16, 16 + 256, 16 + 256 + 4096};
+			constexpr int segmentStart[4] = {0, 0, 16, 16 + 256};
+			constexpr size_t bins = 16 + 256 + 4096 + 65536;
+			auto clampY = [height](int y) { return std::clamp(y, 0, height - 1); };
+
+			ThreadPool::instance().parallelFor(0, height, std::max(64, 4 * radius), [&](int lo, int hi) {
+				// Column x's bins of the segment starting at bin are at counts[bin * stride + (x - cx0) * 16]; a column
+				// count never exceeds 2r+1 <= 255.
+				const int stride = std::min(width, strip + 2 * radius);
+				std::vector<uint8_t> counts(bins * stride, 0);
+				auto segment = [&](int bin) { return &counts[static_cast<size_t>(bin) * stride]; };
+				std::vector<uint16_t> window(bins);
+				std::vector<int64_t> updated(16 + 256 + 4096, std::numeric_limits<int64_t>::min() / 2);
+				// Stamps grow by more than 2r between row passes, so every segment is stale at the start of a row.
+				int64_t base = 0;
+				// TrackKeys: per key, each column's sample rows summed mod 256, laid out like the last level's counts.
+				// For a key held by one sample in the window, that sample's column is the one holding the key, and
+				// the window spans under 256 rows, so the row mod 256 will do.
+				std::vector<uint8_t> rowSums(TrackKeys ? 65536 * static_cast<size_t>(stride) : 0, 0);
+
+				for (int xs = 0; xs < width; xs += strip) {
+					const int xe = std::min(width, xs + strip);
+					const int cx0 = std::max(0, xs - radius), cx1 = std::min(width, xe + radius);
+					auto local = [&](int x) { return std::clamp(x, 0, width - 1) - cx0; };
+					// The window's counts (columns x-r..x+r, clamped) of the 16 bins starting at bin. Sums are kept in
+					// locals: stores through f could alias the counts, which would stop the loops from vectorizing.
+					auto sumWindow = [&](int bin, int x, uint16_t* f) {
+						const uint8_t* seg = segment(bin);
+						const int a = std::max(x - radius, 0), b = std::min(x + radius, width - 1);
+						const int left = a - (x - radius), right = (x + radius) - b;
+						uint16_t sum[16];
+						for (int k = 0; k < 16; ++k) sum[k] = static_cast<uint16_t>(left * seg[(a - cx0) * 16 + k] + right * seg[(b - cx0) * 16 + k]);
+						for (int i = a - cx0; i <= b - cx0; ++i) {
+							for (int k = 0; k < 16; ++k) sum[k] += seg[i * 16 + k];
+						}
+						std::copy_n(sum, 16, f);
+					};
+					// Moves the window's counts in f of the 16 bins starting at bin from column x-1 to x.
+					auto slide = [&](int bin, int x, uint16_t* f) {
+						const uint8_t* add = segment(bin) + local(x + radius) * 16;
+						const uint8_t* sub = segment(bin) + local(x - radius - 1) * 16;
+						uint16_t sum[16];
+						for (int k = 0; k < 16; ++k) sum[k] = static_cast<uint16_t>(f[k] + add[k] - sub[k]);
+						std::copy_n(sum, 16, f);
+					};
+					for (int c = 0; c < channels; ++c) {
+						auto addRow = [&](int y, int delta) {
+							const uint16_t* row = in + static_cast<size_t>(clampY(y)) * rowSamples + c;
+							for (int x = cx0; x < cx1; ++x) {
+								const unsigned key = row[static_cast<size_t>(x) * channels];
+								const int at = (x - cx0) * 16;
+								segment(0)[at + (key >> 12)] += delta;
+								segment(levelStart[1] + ((key >> 8) & ~15u))[at + ((key >> 8) & 15)] += delta;
+								segment(levelStart[2] + ((key >> 4) & ~15u))[at + ((key >> 4) & 15)] += delta;
+								segment(levelStart[3] + (key & ~15u))[at + (key & 15)] += delta;
+								if constexpr (TrackKeys) rowSums[(key & ~15u) * stride + at + (key & 15)] += static_cast<uint8_t>(delta * clampY(y));
+							}
+						};
+						for (int y = lo - radius; y <= lo + radius; ++y) addRow(y, 1);
+
+						for (int y = lo; y < hi; ++y) {
+							if (y > lo) {
+								addRow(y - radius - 1, -1);
+								addRow(y + radius, 1);
+							}
+							uint16_t* top = window.data();
+							sumWindow(0, xs, top);
+
+							const size_t rowOffset = static_cast<size_t>(y) * rowSamples + c;
+							for (int x = xs; x < xe; ++x) {
+								const int64_t stamp = base + x;
+								if (x > xs) slide(0, x, top);
+								int node = 0, sum = 0;
+								while (sum + top[node] <= rank) sum += top[node++];
+
+								uint16_t* f = top;
+								for (int level = 1; level < 4; ++level) {
+									const int bin = levelStart[level] + 16 * node;
+									f = &window[bin];
+									int64_t& last = updated[segmentStart[level] + node];
+									if (stamp - last > 2 * radius) {
+										sumWindow(bin, x, f);
+									} else {
+										for (int j = static_cast<int>(last - base) + 1; j <= x; ++j) slide(bin, j, f);
+									}
+									last = stamp;
+									int b = 0;
+									while (sum + f[b] <= rank) sum += f[b++];
+									node = 16 * node + b;
+								}
+
+								const size_t i = rowOffset + static_cast<size_t>(x) * channels;
+								out[i] = static_cast<uint16_t>(node);
+								if constexpr (TrackKeys) {
+									withinKey[i] = static_cast<uint16_t>(rank - sum);
+									keyCount[i] = f[node & 15];
+									if (keyCount[i] == 1) {
+										const size_t at = (node & ~15u) * static_cast<size_t>(stride) + (node & 15);
+										const uint8_t* count = segment(levelStart[3]) + at;
+										int sx = std::max(x - radius, 0);
+										while (!count[(sx - cx0) * 16]) ++sx;
+										const int top = std::max(y - radius, 0);
+										const int row = top + static_cast<uint8_t>(rowSums[at + (sx - cx0) * 16] - top);
+										sole[i] = static_cast<uint32_t>(row) * width + sx;
+									}
+								}
+							}
+							base += xe - xs + 2 * radius + 2;
+						}
+						// Removing the last window leaves the counts empty for the next channel or strip.
+						for (int y = hi - 1 - radius; y <= hi - 1 + radius; ++y) addRow(y, -1);
+					}
+				}
+			});
+		}
+
+		// Per-channel median of interleaved doubles; the result is always one of the window's samples. Each
+		// channel's distinct values are collected in hash tables: up to 256 of them, their ranks are the codes
+		// for medianFilter8, up to 65536 the keys for medianFilter16, so either way the cost per pixel does not
+		// depend on the radius. Beyond that the channel is cut into 65536 equal-width keys, and where the median's
+		// key holds several values in the window the value is selected among those samples.
+		// The passes that prepare the keys run on the pool, one band of rows (or of column tiles) per thread.
+		inline void medianFilter(const double* in, double* out, int width, int height, int channels, int radius) {
+			if (radius < 0 || radius > 127) throw std::invalid_argument("median radius must be in [0, 127]");
+			ThreadPool& pool = ThreadPool::instance();
+			const size_t pixels = static_cast<size_t>(width) * height;
+			const size_t rowSamples = static_cast<size_t>(width) * channels;
+			const size_t count = pixels * channels;
+			constexpr size_t maxLevels = 65536;
+			constexpr size_t tableSize = 2 * maxLevels;
+			const int bands = std::min<int>(height, pool.size());
+			auto bandRows = [&](int band) { return std::make_pair(static_cast<int>(static_cast<int64_t>(height) * band / bands), static_cast<int>(static_cast<int64_t>(height) * (band + 1) / bands)); };
+
+			// Every band numbers the values it meets per channel; the bands' values are then merged into one sorted
+			// list per channel and the band-local ids rewritten as ranks in it.
+			struct Levels {
+				std::vector<uint64_t> bits = std::vector<uint64_t>(tableSize);
+				std::vector<int32_t> id = std::vector<int32_t>(tableSize, -1);
+				std::vector<double> values;
+			};
+			std::vector<std::vector<Levels>> bandLevels(bands);
+			std::vector<uint16_t> ids(count);
+			std::atomic<bool> tooMany{false};
+			pool.parallelFor(0, bands, 1, [&](int lo, int hi) {
+				for (int band = lo; band < hi; ++band) {
+					const auto [y0, y1] = bandRows(band);
+					bandLevels[band].resize(channels);
+					for (int c = 0; c < channels && !tooMany; ++c) {
+						Levels& l = bandLevels[band][c];
+						for (size_t i = static_cast<size_t>(y0) * rowSamples + c; i < static_cast<size_t>(y1) * rowSamples; i += channels) {
+							const uint64_t bits = std::bit_cast<uint64_t>(in[i]);
+							size_t slot = (bits * 0x9e3779b97f4a7c15ull) >> 47;
+							while (l.id[slot] >= 0 && l.bits[slot] != bits) slot = (slot + 1) & (tableSize - 1);
+							if (l.id[slot] < 0) {
+								if (l.values.size() == maxLevels) {
+									tooMany = true;
+									return;
+								}
+								l.bits[slot] = bits;
+								l.id[slot] = static_cast<int32_t>(l.values.size());
+								l.values.push_back(in[i]);
+							}
+							ids[i] = static_cast<uint16_t>(l.id[slot]);
+						}
+					}
+				}
+			});
+
+			std::vector<std::vector<double>> sorted(channels);
+			size_t mostLevels = 0;
+			for (int c = 0; c < channels && !tooMany; ++c) {
+				for (const auto& band : bandLevels) sorted[c].insert(sorted[c].end(), band[c].values.begin(), band[c].values.end());
+				std::sort(sorted[c].begin(), sorted[c].end());
+				sorted[c].erase(std::unique(sorted[c].begin(), sorted[c].end()), sorted[c].end());
+				mostLevels = std::max(mostLevels, sorted[c].size());
+			}
+
+			if (!tooMany && mostLevels <= maxLevels) {
+				auto toRank = [&](auto& keys) {
+					pool.parallelFor(0, bands, 1, [&](int lo, int hi) {
+						for (int band = lo; band < hi; ++band) {
+							const auto [y0, y1] = bandRows(band);
+							for (int c = 0; c < channels; ++c) {
+								const std::vector<double>& values = bandLevels[band][c].values;
+								std::vector<uint16_t> rankOf(values.size());
+								for (size_t id = 0; id < values.size(); ++id) {
+									rankOf[id] = static_cast<uint16_t>(std::lower_bound(sorted[c].begin(), sorted[c].end(), values[id]) - sorted[c].begin());
+								}
+								for (size_t i = static_cast<size_t>(y0) * rowSamples + c; i < static_cast<size_t>(y1) * rowSamples; i += channels) {
+									keys[i] = static_cast<std::remove_reference_t<decltype(keys[0])>>(rankOf[ids[i]]);
+								}
+							}
+						}
+					});
+					bandLevels.clear();
+				};
+				auto fromRank = [&](const auto& result) {
+					pool.parallelFor(0, height, 64, [&](int lo, int hi) {
+						for (size_t p = lo * static_cast<size_t>(width); p < hi * static_cast<size_t>(width); ++p) {
+							for (int c = 0; c < channels; ++c) out[p * channels + c] = sorted[c][result[p * channels + c]];
+						}
+					});
+				};
+				if (mostLevels <= 256) {
+					std::vector<uint8_t> codes(count), result(count);
+					PPMPP_PROFILE_SCRATCH(2 * count);
+					toRank(codes);
+					medianFilter8(codes.data(), result.data(), width, height, channels, radius);
+					fromRank(result);
+				} else {
+					std::vector<uint16_t>& keys = ids;
+					std::vector<uint16_t> result(count);
+					PPMPP_PROFILE_SCRATCH(count * sizeof(uint16_t));
+					toRank(keys);
+					medianFilter16(keys.data(), result.data(), width, height, channels, radius);
+					fromRank(result);
+				}
+				return;
+			}
+			bandLevels.clear();
+			sorted.clear();
+
+			std::vector<double> lowest(static_cast<size_t>(bands) * channels, std::numeric_limits<double>::infinity());
+			std::vector<double> highest(lowest.size(), -std::numeric_limits<double>::infinity());
+			pool.parallelFor(0, bands, 1, [&](int lo, int hi) {
+				for (int band = lo; band < hi; ++band) {
+					const auto [y0, y1] = bandRows(band);
+					for (size_t i = static_cast<size_t>(y0) * rowSamples; i < static_cast<size_t>(y1) * rowSamples; i += channels) {
+						for (int c = 0; c < channels; ++c) {
+							lowest[band * channels + c] = std::min(lowest[band * channels + c], in[i + c]);
+							highest[band * channels + c] = std::max(highest[band * channels + c], in[i + c]);
+						}
+					}
+				}
+			});
+			std::vector<double> scale(channels, 0.0);
+			for (int c = 0; c < channels; ++c) {
+				for (int band = 1; band < bands; ++band) {
+					lowest[c] = std::min(lowest[c], lowest[band * channels + c]);
+					highest[c] = std::max(highest[c], highest[band * channels + c]);
+				}
+				if (highest[c] > lowest[c]) scale[c] = 65535.0 / (highest[c] - lowest[c]);
+			}
+
+			// Reuse the id buffer for the keys; a key's value is kept if every sample with it is the same. Each band
+			// records that per (channel, key), and the bands are merged key by key.
+			constexpr uint8_t unused = 0, single = 1, several = 2;
+			const size_t keySlots = static_cast<size_t>(channels) * 65536;
+			std::vector<uint16_t>& keys = ids;
+			std::vector<std::vector<double>> bandValue(bands, std::vector<double>(keySlots));
+			std::vector<std::vector<uint8_t>> bandState(bands, std::vector<uint8_t>(keySlots, unused));
+			pool.parallelFor(0, bands, 1, [&](int lo, int hi) {
+				for (int band = lo; band < hi; ++band) {
+					const auto [y0, y1] = bandRows(band);
+					std::vector<double>& keyValue = bandValue[band];
+					std::vector<uint8_t>& keyState = bandState[band];
+					for (size_t p = static_cast<size_t>(y0) * width; p < static_cast<size_t>(y1) * width; ++p) {
+						for (int c = 0; c < channels; ++c) {
+							const size_t i = p * channels + c;
+							const uint16_t key = static_cast<uint16_t>(std::clamp((in[i] - lowest[c]) * scale[c], 0.0, 65535.0));
+							keys[i] = key;
+							const size_t k = static_cast<size_t>(c) * 65536 + key;
+							if (keyState[k] == unused) {
+								keyState[k] = single;
+								keyValue[k] = in[i];
+							} else if (keyState[k] == single && keyValue[k] != in[i]) {
+								keyState[k] = several;
+							}
+						}
+					}
+				}
+			});
+			std::vector<double>& keyValue = bandValue[0];
+			std::vector<uint8_t>& keyState = bandState[0];
+			pool.parallelFor(0, static_cast<int>(keySlots), 4096, [&](int lo, int hi) {
+				for (int k = lo; k < hi; ++k) {
+					for (int band = 1; band < bands; ++band) {
+						const uint8_t other = bandState[band][k];
+						if (other == unused || keyState[k] == several) continue;
+						if (keyState[k] == unused) {
+							keyState[k] = other;
+							keyValue[k] = bandValue[band][k];
+						} else if (other == several || keyValue[k] != bandValue[band][k]) {
+							keyState[k] = several;
+						}
+					}
+				}
+			});
+			bandValue.resize(1);
+			bandState.resize(1);
+
+			std::vector<uint16_t> medianKeys(count), withinKey(count), keyCount(count);
+			std::vector<uint32_t> sole(count);
+			PPMPP_PROFILE_SCRATCH(count * (4 * sizeof(uint16_t) + sizeof(uint32_t)) + keySlots * bands * (sizeof(double) + 1));
+			medianFilter16<true>(keys.data(), medianKeys.data(), width, height, channels, radius, withinKey.data(), keyCount.data(), sole.data());
+
+			// Pixel positions per (channel, key) from a counting sort, ordered by column tile, then row, then column.
+			// Tiles are at least as wide as the window, so a key's samples inside a window lie in at most two
+			// tiles, each one binary search away. Bands of tiles count and then scatter in parallel; a band's
+			// share of every key follows the shares of the bands to its left.
+			const int tileShift = std::max(6, static_cast<int>(std::bit_width(static_cast<unsigned>(2 * radius))));
+			const int tile = 1 << tileShift;
+			const int tiles = (width + tile - 1) / tile;
+			const int tileBands = std::min<int>(tiles, pool.size());
+			auto bandTiles = [&](int band) { return std::make_pair(tiles * band / tileBands, tiles * (band + 1) / tileBands); };
+			auto position = [&](int tileX, int y) { return static_cast<uint32_t>((static_cast<size_t>(tileX) * height + y) << tileShift); };
+			auto tileKeys = [&](int band, auto fn) {
+				const auto [tx0, tx1] = bandTiles(band);
+				for (int tx = tx0; tx < tx1; ++tx) {
+					const int xEnd = std::min(width, (tx + 1) * tile);
+					for (int y = 0; y < height; ++y) {
+						for (int x = tx * tile; x < xEnd; ++x) {
+							const size_t i = (static_cast<size_t>(y) * width + x) * channels;
+							for (int c = 0; c < channels; ++c) fn(static_cast<size_t>(c) * 65536 + keys[i + c], position(tx, y) + (x & (tile - 1)));
+						}
+					}
+				}
+			};
+			std::vector<std::vector<uint32_t>> next(tileBands, std::vector<uint32_t>(keySlots, 0));
+			std::vector<uint32_t> start(keySlots + 1, 0), members(count);
+			PPMPP_PROFILE_SCRATCH(count * sizeof(uint32_t) + tileBands * keySlots * sizeof(uint32_t));
+			pool.parallelFor(0, tileBands, 1, [&](int lo, int hi) {
+				for (int band = lo; band < hi; ++band) tileKeys(band, [&](size_t k, uint32_t) { ++next[band][k]; });
+			});
+			for (size_t k = 0; k < keySlots; ++k) {
+				uint32_t at = start[k];
+				for (int band = 0; band < tileBands; ++band) at += std::exchange(next[band][k], at);
+				start[k + 1] = at;
+			}
+			pool.parallelFor(0, tileBands, 1, [&](int lo, int hi) {
+				for (int band = lo; band < hi; ++band) tileKeys(band, [&](size_t k, uint32_t p) { members[next[band][k]++] = p; });
+			});
+			next.clear();
+
+			// Window positions around center that clamp to sample position s.
+			auto span = [radius](int s, int center, int size) {
+				const int first = s == 0 ? INT_MIN : s;
+				const int last = s == size - 1 ? INT_MAX : s;
+				return std::max(0, std::min(last, center + radius) - std::max(first, center - radius) + 1);
+			};
+			pool.parallelFor(0, height, 8, [&](int lo, int hi) {
+				std::vector<double> candidates;
+				for (int y = lo; y < hi; ++y) {
+					const int y0 = std::max(y - radius, 0), y1 = std::min(y + radius, height - 1);
+					for (int x = 0; x < width; ++x) {
+						const int tx0 = std::max(x - radius, 0) >> tileShift, tx1 = std::min(x + radius, width - 1) >> tileShift;
+						for (int c = 0; c < channels; ++c) {
+							const size_t i = static_cast<size_t>(y) * rowSamples + static_cast<size_t>(x) * channels + c;
+							const size_t k = static_cast<size_t>(c) * 65536 + medianKeys[i];
+							if (keyState[k] == single) {
+								out[i] = keyValue[k];
+								continue;
+							}
+							if (keyCount[i] == 1) {
+								out[i] = in[static_cast<size_t>(sole[i]) * channels + c];
+								continue;
+							}
+							candidates.clear();
+							const auto end = members.begin() + start[k + 1];
+							for (int tx = tx0; tx <= tx1 && candidates.size() < keyCount[i]; ++tx) {
+								const uint32_t last = position(tx, y1 + 1);
+								for (auto p = std::lower_bound(members.begin() + start[k], end, position(tx, y0)); p != end && *p < last && candidates.size() < keyCount[i]; ++p) {
+									const int sx = (tx << tileShift) + static_cast<int>(*p & (tile - 1));
+									const int sy = static_cast<int>((*p >> tileShift) - static_cast<size_t>(tx) * height);
+									const int m = span(sx, x, width) * span(sy, y, height);
+									candidates.insert(candidates.end(), m, in[(static_cast<size_t>(sy) * width + sx) * channels + c]);
+								}
+							}
+							std::nth_element(candidates.begin(), candidates.begin() + withinKey[i], candidates.end());
+							out[i] = candidates[withinKey[i]];
+						}
+					}
+				}
+			});
+		}
+
+		// Per-channel median of width x height pixels of type Px, in place. 8-bit and 16-bit channels are the keys of
+		// medianFilter8 and medianFilter16 as they are; other types go through the double median.
+		template <typename Px>
+		void medianFilterPixels(Px* pixels, int width, int height, int radius) {
+			using T = ChannelOf<Px>;
+			using V = std::conditional_t<std::is_same_v<T, uint8_t> || std::is_same_v<T, uint16_t>, T, double>;
+			std::vector<V> samples(static_cast<size_t>(width) * height * 3), result(samples.size());
+			PPMPP_PROFILE_SCRATCH(2 * samples.size() * sizeof(V));
+			ThreadPool::instance().parallelFor(0, height, 64, [&](int lo, int hi) {
+				for (size_t i = static_cast<size_t>(lo) * width; i < static_cast<size_t>(hi) * width; ++i) {
+					samples[3 * i] = channel<0>(pixels[i]);
+					samples[3 * i + 1] = channel<1>(pixels[i]);
+					samples[3 * i + 2] = channel<2>(pixels[i]);
+				}
+			});
+			if constexpr (std::is_same_v<T, uint8_t>) medianFilter8(samples.data(), result.data(), width, height, 3, radius);
+			else if constexpr (std::is_same_v<T, uint16_t>) medianFilter16(samples.data(), result.data(), width, height, 3, radius);
+			else medianFilter(samples.data(), result.data(), width, height, 3, radius);
+			ThreadPool::instance().parallelFor(0, height, 64, [&](int lo, int hi) {
+				for (size_t i = static_cast<size_t>(lo) * width; i < static_cast<size_t>(hi) * width; ++i) {
+					pixels[i] = Px(static_cast<T>(result[3 * i]), static_cast<T>(result[3 * i + 1]), static_cast<T>(result[3 * i + 2]));
+				}
+			});
+		}
+
+		// Edge-preserving smoothing of a Channels-valued image: each output is the average of its neighbors weighted
+		// by a spatial Gaussian and a Gaussian of the guide difference (guide in [0,1], one per pixel). Pixels are
+		// read with load(i, double* values) and written with store(i, const double* values), after all loads of
+		// the pixel's neighborhood, but the caller must not write into what it loads from.
+		// From spatialSigma 3 on this runs on a bilateral grid (Chen, Paris & Durand): pixels are accumulated into
+		// cells of spatialSigma x spatialSigma x rangeSigma, the grid is blurred, and every pixel reads it back
+		// trilinearly, so the cost does not grow with the radius. Smaller sigmas are evaluated directly with a
+		// range lookup table.
+		template <int Channels, typename Load, typename Store>
+		void bilateralFilter(int width, int height, const float* guide, double spatialSigma, double rangeSigma, Load load, Store store) {
+			if (!(spatialSigma > 0.0) || !(rangeSigma > 0.0)) throw std::invalid_argument("bilateral sigmas must be positive");
+			ThreadPool& pool = ThreadPool::instance();
+
+			if (spatialSigma < 3.0) {
+				const int radius = static_cast<int>(std::ceil(2 * spatialSigma));
+				const int side = 2 * radius + 1;
+				std::vector<double> spatial(static_cast<size_t>(side) * side);
+				for (int dy = -radius; dy <= radius; ++dy) {
+					for (int dx = -radius; dx <= radius; ++dx) {
+						spatial[static_cast<size_t>(dy + radius) * side + dx + radius] = std::exp(-(dx * dx + dy * dy) / (2 * spatialSigma * spatialSigma));
+					}
+				}
+				constexpr int lutSize = 1024;
+				std::array<double, lutSize + 1> range;
+				for (int i = 0; i <= lutSize; ++i) {
+					const double d = static_cast<double>(i) / lutSize;
+					range[i] = std::exp(-d * d / (2 * rangeSigma * rangeSigma));
+				}
+				pool.parallelFor(0, height, 8, [&](int lo, int hi) {
+					for (int y = lo; y < hi; ++y) {
+						for (int x = 0; x < width; ++x) {
+							const size_t center = static_cast<size_t>(y) * width + x;
+							const double g = guide[center];
+							double acc[Channels] = {}, v[Channels];
+							double total = 0.0;
+							for (int dy = -radius; dy <= radius; ++dy) {
+								const size_t row = static_cast<size_t>(std::clamp(y + dy, 0, height - 1)) * width;
+								const double* ws = &spatial[static_cast<size_t>(dy + radius) * side + radius];
+								for (int dx = -radius; dx <= radius; ++dx) {
+									const size_t i = row + std::clamp(x + dx, 0, width - 1);
+									const double w = ws[dx] * range[static_cast<int>(std::min(std::abs(guide[i] - g), 1.0) * lutSize + 0.5)];
+									load(i, v);
+									for (int c = 0; c < Channels; ++c) acc[c] += w * v[c];
+									total += w;
+								}
+							}
+							for (int c = 0; c < Channels; ++c) acc[c] /= total;
+							store(center, acc);
+						}
+					}
+				});
+				return;
+			}
+
+			// Cells hold the weighted channel sums plus the weight, x major then z within a grid row. Two empty
+			// cells pad every side for the blur.
+			constexpr int cell = Channels + 1;
+			const int pad = 2;
+			const double invS = 1.0 / spatialSigma, invR = 1.0 / rangeSigma;
+			const int gridW = static_cast<int>((width - 1) * invS + 0.5) + 1 + 2 * pad;
+			const int gridH = static_cast<int>((height - 1) * invS + 0.5) + 1 + 2 * pad;
+			const int gridD = static_cast<int>(invR) + 2 + 2 * pad;
+			const size_t slab = static_cast<size_t>(gridW) * gridD * cell;
+			std::vector<float> grid(slab * gridH, 0.0f), blurred(grid.size());
+			PPMPP_PROFILE_SCRATCH(2 * grid.size() * sizeof(float));
+
+			// Splat: nearest cell in x and y, linear in z. Each task owns whole grid rows, the image rows that
+			// round to them, so no two tasks write the same cell.
+			pool.parallelFor(0, gridH, 1, [&](int lo, int hi) {
+				for (int gy = lo; gy < hi; ++gy) {
+					float* dstSlab = &grid[slab * gy];
+					const int y0 = std::max(0, static_cast<int>(std::ceil((gy - pad - 0.5) * spatialSigma)));
+					const int y1 = std::min(height, static_cast<int>(std::ceil((gy - pad + 0.5) * spatialSigma)));
+					for (int y = y0; y < y1; ++y) {
+						const size_t rowStart = static_cast<size_t>(y) * width;
+						for (int x = 0; x < width; ++x) {
+							const size_t i = rowStart + x;
+							const double fz = std::clamp(static_cast<double>(guide[i]), 0.0, 1.0) * invR + pad;
+							const int iz = static_cast<int>(fz);
+							const float tz = static_cast<float>(fz - iz);
+							float* p = dstSlab + (static_cast<size_t>(static_cast<int>(x * invS + 0.5) + pad) * gridD + iz) * cell;
+							double v[Channels];
+							load(i, v);
+							for (int c = 0; c < Channels; ++c) {
+								p[c] += (1 - tz) * static_cast<float>(v[c]);
+								p[cell + c] += tz * static_cast<float>(v[c]);
+							}
+							p[Channels] += 1 - tz;
+							p[cell + Channels] += tz;
+						}
+					}
+				}
+			});
+
+			// Blur with 1 4 6 4 1 along z, x and y. The padding keeps every nonzero cell two cells from the border,
+			// so the taps are only skipped where they would read zeros anyway.
+			auto blurPass = [&](const std::vector<float>& src, std::vector<float>& dst, size_t stride, int axis) {
+				pool.parallelFor(0, gridH, 1, [&](int lo, int hi) {
+					for (int gy = lo; gy < hi; ++gy) {
+						for (int gx = 0; gx < gridW; ++gx) {
+							for (int gz = 0; gz < gridD; ++gz) {
+								const size_t i = slab * gy + (static_cast<size_t>(gx) * gridD + gz) * cell;
+								const int pos = axis == 0 ? gz : axis == 1 ? gx : gy;
+								const int size = axis == 0 ? gridD : axis == 1 ? gridW : gridH;
+								if (pos < 2 || pos >= size - 2) {
+									for (int c = 0; c < cell; ++c) dst[i + c] = 0.0f;
+									continue;
+								}
+								const float* s0 = &src[i - 2 * stride];
+								const float* s1 = &src[i - stride];
+								const float* s3 = &src[i + stride];
+								const float* s4 = &src[i + 2 * stride];
+								for (int c = 0; c < cell; ++c) {
+									dst[i + c] = (s0[c] + s4[c] + 4 * (s1[c] + s3[c]) + 6 * src[i + c]) * (1 / 16.0f);
+								}
+							}
+						}
+					}
+				});
+			};
+			blurPass(grid, blurred, cell, 0);
+			blurPass(blurred, grid, static_cast<size_t>(gridD) * cell, 1);
+			blurPass(grid, blurred, slab, 2);
+
+			// Slice: trilinear read at every pixel's grid position.
+			std::vector<int> columnCell(width);
+			std::vector<double> columnFrac(width);
+			for (int x = 0; x < width; ++x) {
+				const double fx = x * invS + pad;
+				columnCell[x] = static_cast<int>(fx);
+				columnFrac[x] = fx - columnCell[x];
+			}
+			pool.parallelFor(0, height, 16, [&](int lo, int hi) {
+				for (int y = lo; y < hi; ++y) {
+					const double fy = y * invS + pad;
+					const int iy = static_cast<int>(fy);
+					const double ty = fy - iy;
+					const float* slab0 = &blurred[slab * iy];
+					const float* slab1 = slab0 + slab;
+					for (int x = 0; x < width; ++x) {
+						const size_t i = static_cast<size_t>(y) * width + x;
+						const double fz = std::clamp(static_cast<double>(guide[i]), 0.0, 1.0) * invR + pad;
+						const int iz = static_cast<int>(fz);
+						const double tz = fz - iz, tx = columnFrac[x];
+						const size_t c00 = (static_cast<size_t>(columnCell[x]) * gridD + iz) * cell, c10 = c00 + static_cast<size_t>(gridD) * cell;
+						const double w00 = (1 - ty) * (1 - tx), w01 = (1 - ty) * tx, w10 = ty * (1 - tx), w11 = ty * tx;
+						double acc[cell];
+						for (int c = 0; c < cell; ++c) {
+							const double z0 = w00 * slab0[c00 + c] + w01 * slab0[c10 + c] + w10 * slab1[c00 + c] + w11 * slab1[c10 + c];
+							const double z1 = w00 * slab0[c00 + cell + c] + w01 * slab0[c10 + cell + c] + w10 * slab1[c00 + cell + c] + w11 * slab1[c10 + cell + c];
+							acc[c] = z0 + (z1 - z0) * tz;
+						}
+						// A pixel always lands in its own neighborhood, so the weight is positive.
+						for (int c = 0; c < Channels; ++c) acc[c] /= acc[Channels];
+						store(i, acc);
+					}
+				}
+			});
+		}
+	} // namespace detail
+
+	// Compact single-channel image (PGM P2/P5 or grayscale PAM), 8 or 16 bits per sample.
+	class GrayImage
+	{
+	public:
+		GrayImage() {}
+
+		GrayImage(int width, int height, int maxval = 255) {
+			resize(width, height);
+			setMaxval(maxval);
+		}
+
+		explicit GrayImage(std::string const& filename) {
+			read(filename);
+		}
+
+		void resize(int width, int height) {
+			m_data.assign(static_cast<size_t>(width) * height, 0);
+			m_width = width;
+			m_height = height;
+		}
+
+		int getWidth() const { return m_width; }
+		int getHeight() const { return m_height; }
+		int getMaxval() const { return m_maxval; }
+
+		void setMaxval(int maxval) {
+			if (maxval < 1 || maxval > 65535) throw Error("Invalid maxval");
+			m_maxval = maxval;
+		}
+
+		uint16_t getValue(int xCoord, int yCoord) const { return m_data[xCoord + m_width * yCoord]; }
+
+		void setValue(int xCoord, int yCoord, uint16_t value) {
+			if (xCoord >= 0 && xCoord < m_width && yCoord >= 0 && yCoord < m_height) {
+				m_data[xCoord + m_width * yCoord] = std::min<uint16_t>(value, static_cast<uint16_t>(m_maxval));
+			}
+		}
+
+		std::vector<uint16_t>& getData() { return m_data; }
+		const std::vector<uint16_t>& getData() const { return m_data; }
+
+		// Median over a (2r+1)^2 window in constant time per pixel, on 8-bit histograms up to maxval 255 and
+		// four-level 16-bit ones above that. The result is always one of the input values.
+		void applyMedianFilter(int radius) {
+			PPMPP_PROFILE_SCOPE("GrayImage::applyMedianFilter");
+			if (m_maxval <= 255) {
+				std::vector<uint8_t> codes(m_data.begin(), m_data.end()), result(m_data.size());
+				detail::medianFilter8(codes.data(), result.data(), m_width, m_height, 1, radius);
+				std::copy(result.begin(), result.end(), m_data.begin());
+			} else {
+				std::vector<uint16_t> result(m_data.size());
+				detail::medianFilter16(m_data.data(), result.data(), m_width, m_height, 1, radius);
+				m_data.swap(result);
+			}
+			PPMPP_PROFILE_PIXELS(m_data.size());
+		}
+
+		// Edge-preserving smoothing; rangeSigma is a fraction of maxval.
+		void applyBilateralFilter(double spatialSigma, double rangeSigma) {
+			PPMPP_PROFILE_SCOPE("GrayImage::applyBilateralFilter");
+			std::vector<float> guide(m_data.size());
+			std::vector<uint16_t> result(m_data.size());
+			const double scale = 1.0 / m_maxval;
+			for (size_t i = 0; i < m_data.size(); ++i) guide[i] = static_cast<float>(m_data[i] * scale);
+			detail::bilateralFilter<1>(m_width, m_height, guide.data(), spatialSigma, rangeSigma,
+				[&](size_t i, double* v) { v[0] = m_data[i] * scale; },
+				[&](size_t i, const double* v) { result[i] = static_cast<uint16_t>(std::lround(std::clamp(v[0], 0.0, 1.0) * m_maxval)); });
+			m_data.swap(result);
+			PPMPP_PROFILE_PIXELS(m_data.size());
+		}
+
+		// See MorphologyOp; the structuring element is a width x height rectangle centered on the pixel.
+		void applyMorphology(MorphologyOp op, int width, int height) {
+			PPMPP_PROFILE_SCOPE("GrayImage::applyMorphology");
+			std::vector<uint16_t> result = m_data;
+			detail::morphology(op, result.data(), m_width, m_height, 1, width, height, uint16_t(0), uint16_t(65535),
+				[](uint16_t a, uint16_t b) { return std::min(a, b); }, [](uint16_t a, uint16_t b) { return std::max(a, b); });
+			if (op == MorphologyOp::TopHat) {
+				for (size_t i = 0; i < m_data.size(); ++i) result[i] = static_cast<uint16_t>(m_data[i] - result[i]);
+			} else if (op == MorphologyOp::BlackHat) {
+				for (size_t i = 0; i < m_data.size(); ++i) result[i] = static_cast<uint16_t>(result[i] - m_data[i]);
+			}
+			m_data.swap(result);
+			PPMPP_PROFILE_PIXELS(m_data.size());
+		}
+
+		friend bool operator==(const GrayImage& lhs, const GrayImage& rhs) {
+			return lhs.m_width == rhs.m_width && lhs.m_height == rhs.m_height && lhs.m_maxval == rhs.m_maxval && lhs.m_data == rhs.m_data;
+		}
+
+		friend bool operator!=(const GrayImage& lhs, const GrayImage& rhs) {
+			return !(lhs == rhs);
+		}
+
+		void read(const std::string& filename) {
+			PPMPP_PROFILE_SCOPE("GrayImage::read");
+			std::vector<uint8_t> data = detail::readFileBytes(filename);
+			detail::NetpbmHeader header = detail::parseNetpbmHeader(data);
+			if (header.depth > 2) {
+				throw Error(filename + " is not a grayscale file.");
+			}
+			resize(header.width, header.height);
+			m_maxval = header.maxval;
+			uint16_t* dst = m_data.data();
+			detail::decodeNetpbmPixels(data, header, [dst](size_t i, const unsigned* s) { dst[i] = static_cast<uint16_t>(s[0]); });
+			PPMPP_PROFILE_PIXELS(m_data.size());
+		}
+
+		void write(const std::string& filename) {
+			std::string suffix = std::filesystem::path(filename).extension().string();
+			write(filename, detail::formatFromSuffix(suffix, FileFormat::P5) == FileFormat::P7 ? FileFormat::P7 : FileFormat::P5);
+		}
+
+		void write(const std::string& filename, FileFormat format) {
+			PPMPP_PROFILE_SCOPE("GrayImage::write");
+			if (format != FileFormat::P2 && format != FileFormat::P5 && format != FileFormat::P7) {
+				throw Error("GrayImage can only be written as P2, P5 or P7");
+			}
+			std::vector<uint8_t> out = detail::netpbmHeader(format, m_width, m_height, 1, m_maxval);
+			out.reserve(out.size() + m_data.size() * (format == FileFormat::P2 ? 6 : (m_maxval > 255 ? 2 : 1)));
+			int lineLength = 0;
+			for (uint16_t v : m_data) {
+				unsigned sample = v;
+				detail::appendNetpbmSamples(out, format, m_maxval, &sample, 1, lineLength);
+			}
+			if (format == FileFormat::P2) out.push_back('\n');
+			detail::writeFileBytes(filename, out);
+			PPMPP_PROFILE_PIXELS(m_data.size());
+		}
+
+	private:
+		std::vector<uint16_t> m_data;
+		int m_width = 0;
+		int m_height = 0;
+		int m_maxval = 255;
+	};
+
+	namespace detail
+	{
+		struct QoiRgba {
+			uint8_t r = 0, g = 0, b = 0, a = 0;
+			bool operator==(const QoiRgba& o) const { return r == o.r && g == o.g && b == o.b && a == o.a; }
+			bool operator!=(const QoiRgba& o) const { return !(*this == o); }
+		};
+
+		inline int qoiHash(const QoiRgba& px) {
+			return (px.r * 3 + px.g * 5 + px.b * 7 + px.a * 11) % 64;
+		}
+
+		inline uint32_t readBigEndian32(const uint8_t* p) {
+			return (static_cast<uint32_t>(p[0]) << 24) | (static_cast<uint32_t>(p[1]) << 16) | (static_cast<uint32_t>(p[2]) << 8) | p[3];
+		}
+
+		inline bool isQoi(const std::vector<uint8_t>& data) {
+			return data.size() >= 4 && data[0] == 'q' && data[1] == 'o' && data[2] == 'i' && data[3] == 'f';
+		}
+
+		// Width and height from the start of a Netpbm or QOI file, without reading the raster. Returns false
+		// if the file can't be opened or its header is not recognised within the first few KiB.
+		inline bool probeImageSize(const std::string& filename, int& width, int& height) {
+			std::ifstream in(filename, std::ios_base::in | std::ios_base::binary);
+			if (!in.is_open()) return false;
+			std::vector<uint8_t> prefix(4096);
+			in.read(reinterpret_cast<char*>(prefix.data()), static_cast<std::streamsize>(prefix.size()));
+			prefix.resize(static_cast<size_t>(in.gcount()));
+			if (isQoi(prefix)) {
+				if (prefix.size() < 14) return false;
+				uint32_t w = readBigEndian32(&prefix[4]);
+				uint32_t h = readBigEndian32(&prefix[8]);
+				if (w == 0 || h == 0 || w > 0x7fffffffu / h) return false;
+				width = static_cast<int>(w);
+				height = static_cast<int>(h);
+				return true;
+			}
+			try {
+				NetpbmHeader header = parseNetpbmHeader(prefix, false);
+				width = header.width;
+				height = header.height;
+				return true;
+			} catch (const Error&) {
+				return false;
+			}
+		}
+
+		// Calls fn(pixelIndex, rgba) for every pixel of a QOI stream (https://qoiformat.org/qoi-specification.pdf).
+		template <typename F>
+		void decodeQoiPixels(const std::vector<uint8_t>& data, int& width, int& height, int& channels, F fn) {
+			if (data.size() < 14 + 8 || !isQoi(data)) {
+				throw Error("Not a QOI file");
+			}
+			uint32_t w = readBigEndian32(&data[4]);
+			uint32_t h = readBigEndian32(&data[8]);
+			channels = data[12];
+			if (w == 0 || h == 0 || w > 0x7fffffffu / h || (channels != 3 && channels != 4)) {
+				throw Error("Invalid QOI header");
+			}
+			width = static_cast<int>(w);
+			height = static_cast<int>(h);
+
+			std::array<QoiRgba, 64> index{};
+			QoiRgba px{0, 0, 0, 255};
+			const size_t count = static_cast<size_t>(w) * h;
+			const size_t end = data.size() - 8;
+			size_t pos = 14;
+			int run = 0;
+			for (size_t i = 0; i < count; ++i) {
+				if (run > 0) {
+					--run;
+				} else {
+					if (pos >= end) throw Error("Truncated QOI data");
+					uint8_t b1 = data[pos++];
+					if (b1 == 0xfe) {
+						if (pos + 3 > end) throw Error("Truncated QOI data");
+						px.r = data[pos]; px.g = data[pos + 1]; px.b = data[pos + 2];
+						pos += 3;
+					} else if (b1 == 0xff) {
+						if (pos + 4 > end) throw Error("Truncated QOI data");
+						px.r = data[pos]; px.g = data[pos + 1]; px.b = data[pos + 2]; px.a = data[pos + 3];
+						pos += 4;
+					} else if ((b1 & 0xc0) == 0x00) {
+						px = index[b1];
+					} else if ((b1 & 0xc0) == 0x40) {
+						px.r = static_cast<uint8_t>(px.r + ((b1 >> 4) & 0x03) - 2);
+						px.g = static_cast<uint8_t>(px.g + ((b1 >> 2) & 0x03) - 2);
+						px.b = static_cast<uint8_t>(px.b + (b1 & 0x03) - 2);
+					} else if ((b1 & 0xc0) == 0x80) {
+						if (pos >= end) throw Error("Truncated QOI data");
+						uint8_t b2 = data[pos++];
+						int vg = (b1 & 0x3f) - 32;
+						px.r = static_cast<uint8_t>(px.r + vg - 8 + ((b2 >> 4) & 0x0f));
+						px.g = static_cast<uint8_t>(px.g + vg);
+						px.b = static_cast<uint8_t>(px.b + vg - 8 + (b2 & 0x0f));
+					} else {
+						run = b1 & 0x3f;
+					}
+					index[qoiHash(px)] = px;
+				}
+				fn(i, px);
+			}
+		}
+	} // namespace detail
+
+	// Streaming QOI encoder. Rows can be pushed as they are produced, e.g. from a render loop
+	// on one thread while the encoder runs on another; output is buffered and flushed in chunks.
+	class QoiEncoder
+	{
+	public:
+		QoiEncoder(std::ostream& out, int width, int height, int channels = 3) : m_out(out), m_width(width), m_channels(channels), m_remaining(static_cast<uint64_t>(width) * height) {
+			if (width <= 0 || height <= 0 || (channels != 3 && channels != 4)) {
+				throw Error("Invalid QOI image parameters");
+			}
+			m_buffer.reserve(kFlushSize + 64);
+			const uint8_t header[14] = {'q', 'o', 'i', 'f',
+				static_cast<uint8_t>(width >> 24), static_cast<uint8_t>(width >> 16), static_cast<uint8_t>(width >> 8), static_cast<uint8_t>(width),
+				static_cast<uint8_t>(height >> 24), static_cast<uint8_t>(height >> 16), static_cast<uint8_t>(height >> 8), static_cast<uint8_t>(height),
+				static_cast<uint8_t>(channels), 0};
+			m_buffer.insert(m_buffer.end(), header, header + 14);
+		}
+
+		QoiEncoder(const QoiEncoder&) = delete;
+		QoiEncoder& operator=(const QoiEncoder&) = delete;
+
+		// Encodes one row of width * channels bytes (RGB or RGBA).
+		void pushRow(const uint8_t* row) {
+			for (int x = 0; x < m_width; ++x, row += m_channels) {
+				detail::QoiRgba px{row[0], row[1], row[2], m_channels == 4 ? row[3] : m_prev.a};
+				pushPixel(px);
+			}
+			if (m_buffer.size() >= kFlushSize) flush();
+		}
+
+		// Writes the pending run and the end marker. All rows must have been pushed.
+		void finish() {
+			if (m_remaining != 0) {
+				throw Error("QOI stream finished before all rows were pushed");
+			}
+			if (m_run > 0) {
+				m_buffer.push_back(static_cast<uint8_t>(0xc0 | (m_run - 1)));
+				m_run = 0;
+			}
+			static const uint8_t padding[8] = {0, 0, 0, 0, 0, 0, 0, 1};
+			m_buffer.insert(m_buffer.end(), padding, padding + 8);
+			flush();
+			if (!m_out) {
+				throw Error("Could not write QOI stream");
+			}
+		}
+
+	private:
+		static constexpr size_t kFlushSize = 1 << 16;
+
+		void pushPixel(const detail::QoiRgba& px) {
+			if (m_remaining == 0) {
+				throw Error("Too many rows pushed to QOI stream");
+			}
+			--m_remaining;
+			if (px == m_prev) {
+				if (++m_run == 62) {
+					m_buffer.push_back(static_cast<uint8_t>(0xc0 | (m_run - 1)));
+					m_run = 0;
+				}
+				return;
+			}
+			if (m_run > 0) {
+				m_buffer.push_back(static_cast<uint8_t>(0xc0 | (m_run - 1)));
+				m_run = 0;
+			}
+			int hash = detail::qoiHash(px);
+			if (m_index[hash] == px) {
+				m_buffer.push_back(static_cast<uint8_t>(hash));
+			} else {
+				m_index[hash] = px;
+				if (px.a == m_prev.a) {
+					int vr = static_cast<int8_t>(px.r - m_prev.r);
+					int vg = static_cast<int8_t>(px.g - m_prev.g);
+					int vb = static_cast<int8_t>(px.b - m_prev.b);
+					int vgr = vr - vg;
+					int vgb = vb - vg;
+					if (vr > -3 && vr < 2 && vg > -3 && vg < 2 && vb > -3 && vb < 2) {
+						m_buffer.push_back(static_cast<uint8_t>(0x40 | (vr + 2) << 4 | (vg + 2) << 2 | (vb + 2)));
+					} else if (vgr > -9 && vgr < 8 && vg > -33 && vg < 32 && vgb > -9 && vgb < 8) {
+						m_buffer.push_back(static_cast<uint8_t>(0x80 | (vg + 32)));
+						m_buffer.push_back(static_cast<uint8_t>((vgr + 8) << 4 | (vgb + 8)));
+					} else {
+						const uint8_t op[4] = {0xfe, px.r, px.g, px.b};
+						m_buffer.insert(m_buffer.end(), op, op + 4);
+					}
+				} else {
+					const uint8_t op[5] = {0xff, px.r, px.g, px.b, px.a};
+					m_buffer.insert(m_buffer.end(), op, op + 5);
+				}
+			}
+			m_prev = px;
+		}
+
+		void flush() {
+			m_out.write(reinterpret_cast<const char*>(m_buffer.data()), static_cast<std::streamsize>(m_buffer.size()));
+			m_buffer.clear();
+		}
+
+		std::ostream& m_out;
+		int m_width;
+		int m_channels;
+		uint64_t m_remaining;
+		std::vector<uint8_t> m_buffer;
+		std::array<detail::QoiRgba, 64> m_index{};
+		detail::QoiRgba m_prev{0, 0, 0, 255};
+		int m_run = 0;
+	};
+
+	namespace detail
+	{
+		inline const std::array<uint32_t, 256>& crc32Table() {
+			static const std::array<uint32_t, 256> table = [] {
+				std::array<uint32_t, 256> t{};
+				for (uint32_t n = 0; n < 256; ++n) {
+					uint32_t c = n;
+					for (int k = 0; k < 8; ++k) c = (c & 1) ? 0xedb88320u ^ (c >> 1) : c >> 1;
+					t[n] = c;
+				}
+				return t;
+			}();
+			return table;
+		}
+
+		inline uint32_t crc32(uint32_t crc, const uint8_t* data, size_t size) {
+			const auto& table = crc32Table();
+			crc = ~crc;
+			for (size_t i = 0; i < size; ++i) crc = table[(crc ^ data[i]) & 0xff] ^ (crc >> 8);
+			return ~crc;
+		}
+
+		inline uint32_t adler32(uint32_t adler, const uint8_t* data, size_t size) {
+			uint32_t a = adler & 0xffff;
+			uint32_t b = adler >> 16;
+			while (size) {
+				// 5552 is the largest block for which b cannot overflow 32 bits before the modulo.
+				size_t n = std::min<size_t>(size, 5552);
+				size -= n;
+				for (size_t i = 0; i < n; ++i) {
+					a += *data++;
+					b += a;
+				}
+				a %= 65521;
+				b %= 65521;
+			}
+			return (b << 16) | a;
+		}
+
+		// Adler-32 of A+B from adler32(A), adler32(B) and the length of B.
+		inline uint32_t adler32Combine(uint32_t adler1, uint32_t adler2, size_t length2) {
+			const uint64_t base = 65521;
+			uint64_t rem = length2 % base;
+			uint64_t sum1 = adler1 & 0xffff;
+			uint64_t sum2 = (rem * sum1) % base;
+			sum1 += (adler2 & 0xffff) + base - 1;
+			sum2 += ((adler1 >> 16) & 0xffff) + ((adler2 >> 16) & 0xffff) + base - rem;
+			sum1 %= base;
+			sum2 %= base;
+			return static_cast<uint32_t>((sum2 << 16) | sum1);
+		}
+
+		class BitWriter
+		{
+		public:
+			explicit BitWriter(std::vector<uint8_t>& out) : m_out(out) {}
+
+			// Appends count bits of bits, least significant bit first (deflate bit order).
+			void write(uint32_t bits, int count) {
+				m_bitBuffer |= static_cast<uint64_t>(bits) << m_bitCount;
+				m_bitCount += count;
+				while (m_bitCount >= 8) {
+					m_out.push_back(static_cast<uint8_t>(m_bitBuffer));
+					m_bitBuffer >>= 8;
+					m_bitCount -= 8;
+				}
+			}
+
+			void alignToByte() {
+				if (m_bitCount > 0) write(0, 8 - m_bitCount);
+			}
+
+		private:
+			std::vector<uint8_t>& m_out;
+			uint64_t m_bitBuffer = 0;
+			int m_bitCount = 0;
+		};
+
+		struct DeflateToken {
+			uint16_t litlen; // literal byte, or match length when dist != 0
+			uint16_t dist;
+		};
+
+		constexpr uint16_t kDeflateLengthBase[29] = {3, 4, 5, 6, 7, 8, 9, 10, 11, 13, 15, 17, 19, 23, 27, 31, 35, 43, 51, 59, 67, 83, 99, 115, 131, 163, 195, 227, 258};
+		constexpr uint8_t kDeflateLengthExtra[29] = {0, 0, 0, 0, 0, 0, 0, 0, 1, 1, 1, 1, 2, 2, 2, 2, 3, 3, 3, 3, 4, 4, 4, 4, 5, 5, 5, 5, 0};
+		constexpr uint16_t kDeflateDistBase[30] = {1, 2, 3, 4, 5, 7, 9, 13, 17, 25, 33, 49, 65, 97, 129, 193, 257, 385, 513, 769, 1025, 1537, 2049, 3073, 4097, 6145, 8193, 12289, 16385, 24577};
+		constexpr uint8_t kDeflateDistExtra[30] = {0, 0, 0, 0, 1, 1, 2, 2, 3, 3, 4, 4, 5, 5, 6, 6, 7, 7, 8, 8, 9, 9, 10, 10, 11, 11, 12, 12, 13, 13};
+		constexpr uint8_t kCodeLengthOrder[19] = {16, 17, 18, 0, 8, 7, 9, 6, 10, 5, 11, 4, 12, 3, 13, 2, 14, 1, 15};
+
+		inline int deflateLengthCode(int length) {
+			if (length <= 10) return length - 3;
+			if (length == 258) return 28;
+			int l = length - 3;
+			int bits = static_cast<int>(std::bit_width(static_cast<unsigned>(l))) - 1;
+			return 4 * (bits - 1) + ((l >> (bits - 2)) & 3);
+		}
+
+		inline int deflateDistCode(int dist) {
+			if (dist <= 4) return dist - 1;
+			int d = dist - 1;
+			int bits = static_cast<int>(std::bit_width(static_cast<unsigned>(d))) - 1;
+			return 2 * bits + ((d >> (bits - 1)) & 1);
+		}
+
+		// Huffman code lengths for freqs, limited to maxLength bits by flattening the frequencies until the tree fits.
+		inline void buildHuffmanLengths(const std::vector<uint32_t>& freqs, int maxLength, std::vector<uint8_t>& lengths) {
+			lengths.assign(freqs.size(), 0);
+			std::vector<uint32_t> weights(freqs);
+			std::vector<int> symbols;
+			for (size_t i = 0; i < weights.size(); ++i) {
+				if (weights[i]) symbols.push_back(static_cast<int>(i));
+			}
+			if (symbols.empty()) return;
+			if (symbols.size() == 1) {
+				lengths[symbols[0]] = 1;
+				return;
+			}
+			using Node = std::pair<uint64_t, int>;
+			for (;;) {
+				std::priority_queue<Node, std::vector<Node>, std::greater<Node>> heap;
+				std::vector<int> parent(2 * symbols.size(), -1);
+				for (size_t k = 0; k < symbols.size(); ++k) heap.push({weights[symbols[k]], static_cast<int>(k)});
+				int next = static_cast<int>(symbols.size());
+				while (heap.size() > 1) {
+					Node a = heap.top(); heap.pop();
+					Node b = heap.top(); heap.pop();
+					parent[a.second] = next;
+					parent[b.second] = next;
+					heap.push({a.first + b.first, next++});
+				}
+				// Parents always have a higher index than their children, so depths resolve from the root down.
+				std::vector<int> depth(next, 0);
+				for (int i = next - 2; i >= 0; --i) depth[i] = depth[parent[i]] + 1;
+				int maxDepth = 0;
+				for (size_t k = 0; k < symbols.size(); ++k) maxDepth = std::max(maxDepth, depth[k]);
+				if (maxDepth <= maxLength) {
+					for (size_t k = 0; k < symbols.size(); ++k) lengths[symbols[k]] = static_cast<uint8_t>(depth[k]);
+					return;
+				}
+				for (int sym : symbols) weights[sym] = (weights[sym] >> 1) | 1;
+			}
+		}
+
+		// Canonical codes, bit-reversed for the LSB-first BitWriter.
+		inline void buildHuffmanCodes(const std::vector<uint8_t>& lengths, std::vector<uint16_t>& codes) {
+			int count[16] = {0};
+			for (uint8_t len : lengths) if (len) ++count[len];
+			int nextCode[16] = {0};
+			int code = 0;
+			for (int bits = 1; bits < 16; ++bits) {
+				code = (code + count[bits - 1]) << 1;
+				nextCode[bits] = code;
+			}
+			codes.assign(lengths.size(), 0);
+			for (size_t i = 0; i < lengths.size(); ++i) {
+				int len = lengths[i];
+				if (!len) continue;
+				int c = nextCode[len]++;
+				int reversed = 0;
+				for (int b = 0; b < len; ++b) reversed |= ((c >> b) & 1) << (len - 1 - b);
+				codes[i] = static_cast<uint16_t>(reversed);
+			}
+		}
+
+		struct DeflateLevel {
+			int maxChain;
+			int niceLength;
+			bool insertAll; // hash every position inside a match, not just its start
+		};
+
+		inline DeflateLevel deflateLevel(int level) {
+			static const DeflateLevel levels[10] = {
+				{0, 0, false}, {1, 16, false}, {4, 16, true}, {8, 32, true}, {16, 64, true},
+				{32, 128, true}, {64, 128, true}, {128, 258, true}, {256, 258, true}, {1024, 258, true}};
+			return levels[std::clamp(level, 0, 9)];
+		}
+
+		inline void findDeflateMatches(const uint8_t* data, size_t size, const DeflateLevel& params, std::vector<DeflateToken>& tokens) {
+			constexpr int kHashBits = 15;
+			constexpr size_t kWindow = 32768;
+			std::vector<int32_t> head(size_t(1) << kHashBits, -1);
+			std::vector<int32_t> prev(size);
+			auto hash = [data](size_t i) {
+				uint32_t v = static_cast<uint32_t>(data[i]) | static_cast<uint32_t>(data[i + 1]) << 8 | static_cast<uint32_t>(data[i + 2]) << 16;
+				return (v * 2654435761u) >> (32 - kHashBits);
+			};
+			auto insert = [&](size_t i) {
+				uint32_t h = hash(i);
+				prev[i] = head[h];
+				head[h] = static_cast<int32_t>(i);
+			};
+
+			tokens.clear();
+			tokens.reserve(size / 2);
+			size_t i = 0;
+			while (i < size) {
+				int bestLength = 0;
+				int bestDist = 0;
+				if (i + 3 <= size) {
+					int32_t candidate = head[hash(i)];
+					insert(i);
+					const int maxLength = static_cast<int>(std::min<size_t>(258, size - i));
+					const uint8_t* cur = data + i;
+					for (int chain = params.maxChain; candidate >= 0 && chain > 0; --chain) {
+						size_t dist = i - static_cast<size_t>(candidate);
+						if (dist > kWindow) break;
+						const uint8_t* ref = data + candidate;
+						if (ref[bestLength] == cur[bestLength] && ref[0] == cur[0]) {
+							int length = 0;
+							while (length < maxLength && ref[length] == cur[length]) ++length;
+							if (length > bestLength) {
+								bestLength = length;
+								bestDist = static_cast<int>(dist);
+								if (length >= params.niceLength || length >= maxLength) break;
+							}
+						}
+						candidate = prev[candidate];
+					}
+				}
+				if (bestLength >= 3) {
+					tokens.push_back({static_cast<uint16_t>(bestLength), static_cast<uint16_t>(bestDist)});
+					if (params.insertAll) {
+						for (int k = 1; k < bestLength && i + k + 3 <= size; ++k) insert(i + k);
+					}
+					i += bestLength;
+				} else {
+					tokens.push_back({data[i], 0});
+					++i;
+				}
+			}
+		}
+
+		inline void writeStoredBlocks(BitWriter& bits, std::vector<uint8_t>& out, const uint8_t* data, size_t size, bool final) {
+			size_t pos = 0;
+			do {
+				size_t n = std::min<size_t>(size - pos, 65535);
+				bits.write(final && pos + n == size ? 1 : 0, 1);
+				bits.write(0, 2);
+				bits.alignToByte();
+				const uint8_t header[4] = {static_cast<uint8_t>(n), static_cast<uint8_t>(n >> 8), static_cast<uint8_t>(~n), static_cast<uint8_t>(~n >> 8)};
+				out.insert(out.end(), header, header + 4);
+				out.insert(out.end(), data + pos, data + pos + n);
+				pos += n;
+			} while (pos < size);
+		}
+
+		// Writes tokens (covering raw[0, rawSize)) as one dynamic Huffman block, or as stored blocks
+		// when that would be smaller, e.g. for noise.
+		inline void writeDynamicBlock(BitWriter& bits, std::vector<uint8_t>& out, const DeflateToken* tokens, size_t count, const uint8_t* raw, size_t rawSize, bool final) {
+			std::vector<uint32_t> litFreq(286, 0), distFreq(30, 0);
+			for (size_t i = 0; i < count; ++i) {
+				if (tokens[i].dist) {
+					++litFreq[257 + deflateLengthCode(tokens[i].litlen)];
+					++distFreq[deflateDistCode(tokens[i].dist)];
+				} else {
+					++litFreq[tokens[i].litlen];
+				}
+			}
+			litFreq[256] = 1;
+			if (std::all_of(distFreq.begin(), distFreq.end(), [](uint32_t f) { return f == 0; })) distFreq[0] = 1;
+
+			std::vector<uint8_t> litLengths, distLengths;
+			buildHuffmanLengths(litFreq, 15, litLengths);
+			buildHuffmanLengths(distFreq, 15, distLengths);
+			std::vector<uint16_t> litCodes, distCodes;
+			buildHuffmanCodes(litLengths, litCodes);
+			buildHuffmanCodes(distLengths, distCodes);
+
+			int hlit = 286;
+			while (hlit > 257 && litLengths[hlit - 1] == 0) --hlit;
+			int hdist = 30;
+			while (hdist > 1 && distLengths[hdist - 1] == 0) --hdist;
+
+			// Run-length encode the concatenated code lengths with symbols 16 (repeat), 17 and 18 (zeros).
+			std::vector<uint8_t> all(litLengths.begin(), litLengths.begin() + hlit);
+			all.insert(all.end(), distLengths.begin(), distLengths.begin() + hdist);
+			std::vector<std::pair<uint8_t, uint8_t>> clSymbols; // symbol, extra bits value
+			for (size_t i = 0; i < all.size();) {
+				uint8_t len = all[i];
+				size_t run = 1;
+				while (i + run < all.size() && all[i + run] == len) ++run;
+				size_t left = run;
+				if (len == 0) {
+					while (left >= 11) { size_t n = std::min<size_t>(left, 138); clSymbols.push_back({18, static_cast<uint8_t>(n - 11)}); left -= n; }
+					if (left >= 3) { clSymbols.push_back({17, static_cast<uint8_t>(left - 3)}); left = 0; }
+				} else {
+					clSymbols.push_back({len, 0});
+					--left;
+					while (left >= 3) { size_t n = std::min<size_t>(left, 6); clSymbols.push_back({16, static_cast<uint8_t>(n - 3)}); left -= n; }
+				}
+				for (; left > 0; --left) clSymbols.push_back({len, 0});
+				i += run;
+			}
+
+			std::vector<uint32_t> clFreq(19, 0);
+			for (const auto& [sym, extra] : clSymbols) ++clFreq[sym];
+			std::vector<uint8_t> clLengths;
+			buildHuffmanLengths(clFreq, 7, clLengths);
+			std::vector<uint16_t> clCodes;
+			buildHuffmanCodes(clLengths, clCodes);
+			int hclen = 19;
+			while (hclen > 4 && clLengths[kCodeLengthOrder[hclen - 1]] == 0) --hclen;
+
+			uint64_t cost = 3 + 5 + 5 + 4 + 3 * hclen;
+			for (const auto& [sym, extra] : clSymbols) cost += clLengths[sym] + (sym == 16 ? 2 : sym == 17 ? 3 : sym == 18 ? 7 : 0);
+			for (int i = 0; i < 286; ++i) cost += static_cast<uint64_t>(litFreq[i]) * (litLengths[i] + (i >= 257 ? kDeflateLengthExtra[i - 257] : 0));
+			for (int i = 0; i < 30; ++i) cost += static_cast<uint64_t>(distFreq[i]) * (distLengths[i] + kDeflateDistExtra[i]);
+			if (cost > (rawSize + 5 * (rawSize / 65535 + 1)) * 8) {
+				writeStoredBlocks(bits, out, raw, rawSize, final);
+				return;
+			}
+
+			bits.write(final ? 1 : 0, 1);
+			bits.write(2, 2);
+			bits.write(hlit - 257, 5);
+			bits.write(hdist - 1, 5);
+			bits.write(hclen - 4, 4);
+			for (int i = 0; i < hclen; ++i) bits.write(clLengths[kCodeLengthOrder[i]], 3);
+			for (const auto& [sym, extra] : clSymbols) {
+				bits.write(clCodes[sym], clLengths[sym]);
+				if (sym == 16) bits.write(extra, 2);
+				else if (sym == 17) bits.write(extra, 3);
+				else if (sym == 18) bits.write(extra, 7);
+			}
+
+			for (size_t i = 0; i < count; ++i) {
+				const DeflateToken& t = tokens[i];
+				if (t.dist) {
+					int lc = deflateLengthCode(t.litlen);
+					bits.write(litCodes[257 + lc], litLengths[257 + lc]);
+					if (kDeflateLengthExtra[lc]) bits.write(t.litlen - kDeflateLengthBase[lc], kDeflateLengthExtra[lc]);
+					int dc = deflateDistCode(t.dist);
+					bits.write(distCodes[dc], distLengths[dc]);
+					if (kDeflateDistExtra[dc]) bits.write(t.dist - kDeflateDistBase[dc], kDeflateDistExtra[dc]);
+				} else {
+					bits.write(litCodes[t.litlen], litLengths[t.litlen]);
+				}
+			}
+			bits.write(litCodes[256], litLengths[256]);
+		}
+
+		// Raw deflate of one independent piece. Pieces that are not last end with a sync flush
+		// (an empty stored block), so their outputs can simply be concatenated into one stream.
+		inline void deflatePiece(const uint8_t* data, size_t size, int level, bool last, std::vector<uint8_t>& out) {
+			BitWriter bits(out);
+			if (level <= 0) {
+				writeStoredBlocks(bits, out, data, size, last);
+				if (last) return;
+			} else {
+				std::vector<DeflateToken> tokens;
+				findDeflateMatches(data, size, deflateLevel(level), tokens);
+				constexpr size_t kTokensPerBlock = 1 << 16;
+				size_t rawPos = 0;
+				for (size_t start = 0; start < tokens.size(); start += kTokensPerBlock) {
+					size_t n = std::min(kTokensPerBlock, tokens.size() - start);
+					size_t rawSize = 0;
+					for (size_t i = start; i < start + n; ++i) rawSize += tokens[i].dist ? tokens[i].litlen : 1;
+					writeDynamicBlock(bits, out, tokens.data() + start, n, data + rawPos, rawSize, last && start + n == tokens.size());
+					rawPos += rawSize;
+				}
+				if (last) {
+					bits.alignToByte();
+					return;
+				}
+			}
+			bits.write(0, 3);
+			bits.alignToByte();
+			const uint8_t syncFlush[4] = {0x00, 0x00, 0xff, 0xff};
+			out.insert(out.end(), syncFlush, syncFlush + 4);
+		}
+
+		inline uint8_t paethPredictor(int a, int b, int c) {
+			int p = a + b - c;
+			int pa = std::abs(p - a);
+			int pb = std::abs(p - b);
+			int pc = std::abs(p - c);
+			if (pa <= pb && pa <= pc) return static_cast<uint8_t>(a);
+			if (pb <= pc) return static_cast<uint8_t>(b);
+			return static_cast<uint8_t>(c);
+		}
+
+		// Writes the filter type byte and filtered row to out. Level 0 stores rows unfiltered; otherwise
+		// the filter with the smallest sum of absolute signed residuals is chosen for this row.
+		inline void filterPngRow(const uint8_t* row, const uint8_t* prior, size_t stride, int bpp, int level, uint8_t* out, std::vector<uint8_t>& scratch) {
+			if (level <= 0) {
+				out[0] = 0;
+				std::copy(row, row + stride, out + 1);
+				return;
+			}
+			static const std::vector<uint8_t> zeros(1 << 16, 0);
+			std::vector<uint8_t> zeroRow;
+			if (!prior) {
+				if (stride <= zeros.size()) {
+					prior = zeros.data();
+				} else {
+					zeroRow.assign(stride, 0);
+					prior = zeroRow.data();
+				}
+			}
+			scratch.resize(5 * stride);
+			uint8_t* f[5];
+			for (int i = 0; i < 5; ++i) f[i] = scratch.data() + i * stride;
+			const size_t b = static_cast<size_t>(bpp);
+
+			// One pass per filter keeps each loop branch-free so the compiler can vectorize it.
+			std::copy(row, row + stride, f[0]);
+			for (size_t i = 0; i < b; ++i) {
+				f[1][i] = row[i];
+				f[2][i] = static_cast<uint8_t>(row[i] - prior[i]);
+				f[3][i] = static_cast<uint8_t>(row[i] - (prior[i] >> 1));
+				f[4][i] = static_cast<uint8_t>(row[i] - prior[i]);
+			}
+			for (size_t i = b; i < stride; ++i) f[1][i] = static_cast<uint8_t>(row[i] - row[i - b]);
+			for (size_t i = b; i < stride; ++i) f[2][i] = static_cast<uint8_t>(row[i] - prior[i]);
+			for (size_t i = b; i < stride; ++i) f[3][i] = static_cast<uint8_t>(row[i] - ((row[i - b] + prior[i]) >> 1));
+			for (size_t i = b; i < stride; ++i) {
+				int a = row[i - b], up = prior[i], c = prior[i - b];
+				int pa = std::abs(up - c);
+				int pb = std::abs(a - c);
+				int pc = std::abs(a + up - 2 * c);
+				int predicted = (pa <= pb && pa <= pc) ? a : (pb <= pc ? up : c);
+				f[4][i] = static_cast<uint8_t>(row[i] - predicted);
+			}
+
+			uint32_t bestCost = UINT32_MAX;
+			int bestFilter = 0;
+			for (int filter = 0; filter < 5; ++filter) {
+				uint32_t cost = 0;
+				const int8_t* residual = reinterpret_cast<const int8_t*>(f[filter]);
+				for (size_t i = 0; i < stride; ++i) cost += static_cast<uint32_t>(std::abs(static_cast<int>(residual[i])));
+				if (cost < bestCost) {
+					bestCost = cost;
+					bestFilter = filter;
+				}
+			}
+			out[0] = static_cast<uint8_t>(bestFilter);
+			std::copy(f[bestFilter], f[bestFilter] + stride, out + 1);
+		}
+
+		inline void writePngChunk(std::ostream& out, const char* type, const uint8_t* data, size_t size, const uint8_t* suffix = nullptr, size_t suffixSize = 0) {
+			const uint32_t length = static_cast<uint32_t>(size + suffixSize);
+			const uint8_t header[8] = {static_cast<uint8_t>(length >> 24), static_cast<uint8_t>(length >> 16), static_cast<uint8_t>(length >> 8), static_cast<uint8_t>(length),
+				static_cast<uint8_t>(type[0]), static_cast<uint8_t>(type[1]), static_cast<uint8_t>(type[2]), static_cast<uint8_t>(type[3])};
+			uint32_t crc = crc32(0, header + 4, 4);
+			crc = crc32(crc, data, size);
+			crc = crc32(crc, suffix, suffixSize);
+			const uint8_t trailer[4] = {static_cast<uint8_t>(crc >> 24), static_cast<uint8_t>(crc >> 16), static_cast<uint8_t>(crc >> 8), static_cast<uint8_t>(crc)};
+			out.write(reinterpret_cast<const char*>(header), 8);
+			out.write(reinterpret_cast<const char*>(data), static_cast<std::streamsize>(size));
+			out.write(reinterpret_cast<const char*>(suffix), static_cast<std::streamsize>(suffixSize));
+			out.write(reinterpret_cast<const char*>(trailer), 4);
+		}
+
+		// Encodes interleaved 8-bit RGB/RGBA as PNG, or 8-bit palette indices when channels is 1 and a palette of
+		// paletteSize RGB triples is given. Row groups are filtered and deflated independently on the pool and
+		// emitted as one IDAT chunk each; level 0 (stored) to 9 (smallest) trades speed for size.
+		inline void writePng(std::ostream& out, const uint8_t* pixels, int width, int height, int channels, int level, ThreadPool& pool,
+			const uint8_t* palette = nullptr, int paletteSize = 0) {
+			level = std::clamp(level, 0, 9);
+			const size_t stride = static_cast<size_t>(width) * channels;
+			const size_t rowBytes = stride + 1;
+			const int minRows = static_cast<int>((size_t(1) << 17) / rowBytes) + 1;
+			const int rowsPerGroup = std::max(minRows, (height + static_cast<int>(pool.size()) * 4 - 1) / (static_cast<int>(pool.size()) * 4));
+			const int groups = (height + rowsPerGroup - 1) / rowsPerGroup;
+
+			std::vector<std::vector<uint8_t>> compressed(groups);
+			std::vector<uint32_t> adlers(groups);
+			std::vector<size_t> lengths(groups);
+			pool.parallelFor(0, groups, 1, [&](int lo, int hi) {
+				std::vector<uint8_t> filtered, scratch;
+				for (int g = lo; g < hi; ++g) {
+					int y0 = g * rowsPerGroup;
+					int y1 = std::min(height, y0 + rowsPerGroup);
+					filtered.resize((y1 - y0) * rowBytes);
+					for (int y = y0; y < y1; ++y) {
+						const uint8_t* row = pixels + y * stride;
+						filterPngRow(row, y > 0 ? row - stride : nullptr, stride, channels, level, filtered.data() + (y - y0) * rowBytes, scratch);
+					}
+					adlers[g] = adler32(1, filtered.data(), filtered.size());
+					lengths[g] = filtered.size();
+					compressed[g].reserve(filtered.size() / 2);
+					deflatePiece(filtered.data(), filtered.size(), level, g == groups - 1, compressed[g]);
+				}
+			});
+
+			uint32_t adler = adlers[0];
+			for (int g = 1; g < groups; ++g) adler = adler32Combine(adler, adlers[g], lengths[g]);
+
+			static const uint8_t signature[8] = {0x89, 'P', 'N', 'G', '\r', '\n', 0x1a, '\n'};
+			out.write(reinterpret_cast<const char*>(signature), 8);
+			const uint8_t ihdr[13] = {static_cast<uint8_t>(width >> 24), static_cast<uint8_t>(width >> 16), static_cast<uint8_t>(width >> 8), static_cast<uint8_t>(width),
+				static_cast<uint8_t>(height >> 24), static_cast<uint8_t>(height >> 16), static_cast<uint8_t>(height >> 8), static_cast<uint8_t>(height),
+				8, static_cast<uint8_t>(palette ? 3 : channels == 4 ? 6 : 2), 0, 0, 0};
+			writePngChunk(out, "IHDR", ihdr, 13);
+			if (palette) writePngChunk(out, "PLTE", palette, static_cast<size_t>(paletteSize) * 3);
+
+			const uint8_t zlibHeader[2] = {0x78, static_cast<uint8_t>(level <= 1 ? 0x01 : level <= 5 ? 0x5e : level == 6 ? 0x9c : 0xda)};
+			const uint8_t adlerBytes[4] = {static_cast<uint8_t>(adler >> 24), static_cast<uint8_t>(adler >> 16), static_cast<uint8_t>(adler >> 8), static_cast<uint8_t>(adler)};
+			for (int g = 0; g < groups; ++g) {
+				std::vector<uint8_t>& data = compressed[g];
+				if (g == 0) data.insert(data.begin(), zlibHeader, zlibHeader + 2);
+				bool last = g == groups - 1;
+				writePngChunk(out, "IDAT", data.data(), data.size(), last ? adlerBytes : nullptr, last ? 4 : 0);
+			}
+			writePngChunk(out, "IEND", nullptr, 0);
+		}
+	} // namespace detail
+
+	// Up to 256 colors with a cached inverse lookup. The RGB cube is split into 32x32x32 cells and every cell
+	// keeps the entries that can be nearest to some color inside it: those no farther from the cell than the
+	// smallest distance within which some entry covers the whole cell. Mapping a pixel searches only that
+	// list, usually one or a few entries, and gives the same answer as a full search (ties go to the lower
+	// index). The table is built once and shared by copies.
+	class Palette
+	{
+	public:
+		Palette() {}
+
+		explicit Palette(std::vector<Rgb8> colors) : m_colors(std::move(colors)) {
+			if (m_colors.empty() || m_colors.size() > 256) throw std::invalid_argument("Palette: 1 to 256 colors");
+			constexpr int cells = 1 << 15;
+			std::vector<std::vector<uint8_t>> lists(cells);
+			ThreadPool::instance().parallelFor(0, 32, 1, [&](int lo, int hi) {
+				std::vector<int> nearDistance(m_colors.size());
+				for (int r = lo; r < hi; ++r) {
+					for (int g = 0; g < 32; ++g) {
+						for (int b = 0; b < 32; ++b) {
+							// Per axis, the distance from the cell [8c, 8c + 7] to a value: nearest and farthest.
+							auto near = [](int v, int c) { return v < 8 * c ? 8 * c - v : v > 8 * c + 7 ? v - 8 * c - 7 : 0; };
+							auto far = [](int v, int c) { return std::max(std::abs(v - 8 * c), std::abs(v - 8 * c - 7)); };
+							int cover = std::numeric_limits<int>::max();
+							for (size_t i = 0; i < m_colors.size(); ++i) {
+								const Rgb8& p = m_colors[i];
+								const int nr = near(p.r, r), ng = near(p.g, g), nb = near(p.b, b);
+								const int fr = far(p.r, r), fg = far(p.g, g), fb = far(p.b, b);
+								nearDistance[i] = nr * nr + ng * ng + nb * nb;
+								cover = std::min(cover, fr * fr + fg * fg + fb * fb);
+							}
+							std::vector<uint8_t>& list = lists[(r << 10) | (g << 5) | b];
+							for (size_t i = 0; i < m_colors.size(); ++i) {
+								if (nearDistance[i] <= cover) list.push_back(static_cast<uint8_t>(i));
+							}
+						}
+					}
+				}
+			});
+			auto lookup = std::make_shared<Lookup>();
+			lookup->start.resize(cells + 1, 0);
+			for (int k = 0; k < cells; ++k) lookup->start[k + 1] = lookup->start[k] + static_cast<uint32_t>(lists[k].size());
+			lookup->candidates.reserve(lookup->start[cells]);
+			for (const auto& list : lists) lookup->candidates.insert(lookup->candidates.end(), list.begin(), list.end());
+			m_lookup = std::move(lookup);
+		}
+
+		int size() const { return static_cast<int>(m_colors.size()); }
+		const Rgb8& operator[](int i) const { return m_colors[i]; }
+		const std::vector<Rgb8>& getColors() const { return m_colors; }
+
+		uint8_t nearest(int r, int g, int b) const {
+			const int cell = ((r >> 3) << 10) | ((g >> 3) << 5) | (b >> 3);
+			const uint8_t* candidate = m_lookup->candidates.data() + m_lookup->start[cell];
+			const uint8_t* end = m_lookup->candidates.data() + m_lookup->start[cell + 1];
+			uint8_t best = *candidate;
+			if (end - candidate == 1) return best;
+			int bestDistance = std::numeric_limits<int>::max();
+			for (; candidate != end; ++candidate) {
+				const Rgb8& p = m_colors[*candidate];
+				const int dr = p.r - r, dg = p.g - g, db = p.b - b;
+				const int distance = dr * dr + dg * dg + db * db;
+				if (distance < bestDistance) {
+					bestDistance = distance;
+					best = *candidate;
+				}
+			}
+			return best;
+		}
+
+	private:
+		struct Lookup {
+			std::vector<uint32_t> start;
+			std::vector<uint8_t> candidates;
+		};
+
+		std::vector<Rgb8> m_colors;
+		std::shared_ptr<const Lookup> m_lookup;
+	};
+
+	enum class Dither { None, FloydSteinberg, Ordered };
+
+	// 8-bit palette indices plus their palette.
+	class IndexedImage
+	{
+	public:
+		IndexedImage() {}
+
+		IndexedImage(int width, int height, Palette palette)
+			: m_indices(static_cast<size_t>(width) * height, 0), m_width(width), m_height(height), m_palette(std::move(palette)) {}
+
+		int getWidth() const { return m_width; }
+		int getHeight() const { return m_height; }
+		const Palette& getPalette() const { return m_palette; }
+
+		uint8_t getValue(int xCoord, int yCoord) const { return m_indices[xCoord + static_cast<size_t>(m_width) * yCoord]; }
+		void setValue(int xCoord, int yCoord, uint8_t value) { m_indices[xCoord + static_cast<size_t>(m_width) * yCoord] = value; }
+
+		std::vector<uint8_t>& getData() { return m_indices; }
+		const std::vector<uint8_t>& getData() const { return m_indices; }
+
+		// .png is written as an indexed PNG. Anything else is a P5 of the indices with the palette beside it as an
+		// N x 1 P6, at filename + ".pal.ppm".
+		void write(const std::string& filename, int level = 6) const {
+			PPMPP_PROFILE_SCOPE("IndexedImage::write");
+			std::vector<uint8_t> palette;
+			for (const Rgb8& c : m_palette.getColors()) palette.insert(palette.end(), {c.r, c.g, c.b});
+			if (detail::formatFromSuffix(std::filesystem::path(filename).extension().string(), FileFormat::P5) == FileFormat::PNG) {
+				std::ofstream out(filename, std::ios_base::out | std::ios_base::binary);
+				if (!out.is_open()) {
+					throw Error("Could not open " + filename + " for writing.");
+				}
+				detail::writePng(out, m_indices.data(), m_width, m_height, 1, level, ThreadPool::instance(), palette.data(), m_palette.size());
+				if (!out) {
+					throw Error("Could not write " + filename);
+				}
+			} else {
+				std::vector<uint8_t> out = detail::netpbmHeader(FileFormat::P5, m_width, m_height, 1, 255);
+				out.insert(out.end(), m_indices.begin(), m_indices.end());
+				detail::writeFileBytes(filename, out);
+				std::vector<uint8_t> sidecar = detail::netpbmHeader(FileFormat::P6, m_palette.size(), 1, 3, 255);
+				sidecar.insert(sidecar.end(), palette.begin(), palette.end());
+				detail::writeFileBytes(filename + ".pal.ppm", sidecar);
+			}
+			PPMPP_PROFILE_PIXELS(m_indices.size());
+		}
+
+	private:
+		std::vector<uint8_t> m_indices;
+		int m_width = 0;
+		int m_height = 0;
+		Palette m_palette;
+	};
+
+	namespace detail
+	{
+		// Branch-free color space kernels over planar blocks; c0,c1,c2 hold r,g,b on one side and h,s,v/l on the other.
+		// Hue is in [0,1) like getHSV.
+		inline void rgbToHueChroma(double r, double g, double b, double& h, double& maxc, double& minc) {
+			bool swap1 = g < b;
+			double g1 = swap1 ? b : g, b1 = swap1 ? g : b;
+			double k = swap1 ? -1.0 : 0.0;
+			bool swap2 = r < g1;
+			double r2 = swap2 ? g1 : r, g2 = swap2 ? r : g1;
+			k = swap2 ? -1.0 / 3.0 - k : k;
+			minc = std::min(g2, b1);
+			maxc = r2;
+			h = std::abs(k + (g2 - b1) / (6 * (maxc - minc) + 1e-20));
+		}
+
+		inline void rgbToHsvBlock(double* c0, double* c1, double* c2, int n) {
+			for (int i = 0; i < n; ++i) {
+				double h, maxc, minc;
+				rgbToHueChroma(c0[i], c1[i], c2[i], h, maxc, minc);
+				c0[i] = h;
+				c1[i] = (maxc - minc) / (maxc + 1e-20);
+				c2[i] = maxc;
+			}
+		}
+
+		// One channel of the closed-form HSV/HSL to RGB mapping; k is the hue in sixths/twelfths plus the channel offset.
+		// Hue must be in [0,1], so one conditional subtract wraps k (std::floor would block vectorization).
+		inline double hsvChannel(double k, double v, double vs) {
+			k = k >= 6 ? k - 6 : k;
+			return v - vs * std::max(0.0, std::min(std::min(k, 4 - k), 1.0));
+		}
+
+		inline double hslChannel(double k, double l, double a) {
+			k = k >= 12 ? k - 12 : k;
+			return l - a * std::max(-1.0, std::min(std::min(k - 3, 9 - k), 1.0));
+		}
+
+		inline void hsvToRgbBlock(double* c0, double* c1, double* c2, int n) {
+			for (int i = 0; i < n; ++i) {
+				double h6 = c0[i] * 6, vs = c1[i] * c2[i], v = c2[i];
+				c0[i] = hsvChannel(h6 + 5, v, vs);
+				c1[i] = hsvChannel(h6 + 3, v, vs);
+				c2[i] = hsvChannel(h6 + 1, v, vs);
+			}
+		}
+
+		inline void rgbToHslBlock(double* c0, double* c1, double* c2, int n) {
+			for (int i = 0; i < n; ++i) {
+				double h, maxc, minc;
+				rgbToHueChroma(c0[i], c1[i], c2[i], h, maxc, minc);
+				double l = (maxc + minc) / 2;
+				c0[i] = h;
+				c1[i] = (maxc - minc) / (1 - std::abs(2 * l - 1) + 1e-20);
+				c2[i] = l;
+			}
+		}
+
+		inline void hslToRgbBlock(double* c0, double* c1, double* c2, int n) {
+			for (int i = 0; i < n; ++i) {
+				double h12 = c0[i] * 12, l = c2[i];
+				double a = c1[i] * std::min(l, 1 - l);
+				c0[i] = hslChannel(h12, l, a);
+				c1[i] = hslChannel(h12 + 8, l, a);
+				c2[i] = hslChannel(h12 + 4, l, a);
+			}
+		}
+	} // namespace detail
+
+	// Point operations applied together in one pass: each block of pixels is converted to HSV/HSL only when an
+	// operation needs it and stays there for consecutive operations in the same space. Hue arguments are in degrees.
+	class ColorPipeline
+	{
+	public:
+		ColorPipeline& shiftHue(double degrees) { return add(Op::HueShift, {wrapHue(degrees)}); }
+		ColorPipeline& scaleSaturation(double factor) { return add(Op::Saturation, {factor}); }
+		ColorPipeline& scaleValue(double factor) { return add(Op::Value, {factor}); }
+		ColorPipeline& scaleHslSaturation(double factor) { return add(Op::HslSaturation, {factor}); }
+		ColorPipeline& scaleLightness(double factor) { return add(Op::Lightness, {factor}); }
+		// Sets hue and HSL saturation, keeping lightness.
+		ColorPipeline& colorize(double hueDegrees, double saturation) { return add(Op::Colorize, {wrapHue(hueDegrees), std::clamp(saturation, 0.0, 1.0)}); }
+		// White where hue, saturation and value are all inside the ranges, black elsewhere. hueLo > hueHi wraps through 0.
+		ColorPipeline& thresholdHsv(double hueLo, double hueHi, double satLo, double satHi, double valLo, double valHi) {
+			bool allHues = hueHi - hueLo >= 360;
+			return add(Op::ThresholdHsv, {allHues ? 0.0 : wrapHue(hueLo), allHues ? 1.0 : wrapHue(hueHi), satLo, satHi, valLo, valHi});
+		}
+		ColorPipeline& brightness(double offset) { return add(Op::Brightness, {offset}); }
+		ColorPipeline& contrast(double factor) { return add(Op::Contrast, {factor}); }
+		ColorPipeline& grayscale() { return add(Op::Grayscale, {}); }
+		ColorPipeline& invert() { return add(Op::Invert, {}); }
+
+		bool empty() const { return m_steps.empty(); }
+
+		void apply(Pixel* pixels, size_t count) const {
+			constexpr int block = 64;
+			double c0[block], c1[block], c2[block];
+			for (size_t start = 0; start < count; start += block) {
+				const int n = static_cast<int>(std::min<size_t>(block, count - start));
+				Pixel* px = pixels + start;
+				for (int i = 0; i < n; ++i) std::tie(c0[i], c1[i], c2[i]) = px[i];
+
+				Space space = Space::Rgb;
+				for (const Step& step : m_steps) {
+					convert(space, spaceOf(step.op), c0, c1, c2, n);
+					space = spaceOf(step.op);
+					run(step, c0, c1, c2, n);
+				}
+				convert(space, Space::Rgb, c0, c1, c2, n);
+
+				for (int i = 0; i < n; ++i) px[i] = Pixel(c0[i], c1[i], c2[i]);
+			}
+		}
+
+	private:
+		enum class Op { HueShift, Saturation, Value, HslSaturation, Lightness, Colorize, ThresholdHsv, Brightness, Contrast, Grayscale, Invert };
+		enum class Space { Rgb, Hsv, Hsl };
+
+		struct Step {
+			Op op;
+			std::array<double, 6> args;
+		};
+
+		ColorPipeline& add(Op op, std::initializer_list<double> args) {
+			Step step{op, {}};
+			std::copy(args.begin(), args.end(), step.args.begin());
+			m_steps.push_back(step);
+			return *this;
+		}
+
+		// Degrees to [0,1); kernels keep hue in that range so wrapping is a single conditional subtract.
+		static double wrapHue(double degrees) {
+			double h = degrees / 360.0;
+			return h - std::floor(h);
+		}
+
+		static Space spaceOf(Op op) {
+			switch (op) {
+			case Op::HueShift: case Op::Saturation: case Op::Value: case Op::ThresholdHsv: return Space::Hsv;
+			case Op::HslSaturation: case Op::Lightness: case Op::Colorize: return Space::Hsl;
+			default: return Space::Rgb;
+			}
+		}
+
+		static void convert(Space from, Space to, double* c0, double* c1, double* c2, int n) {
+			if (from == to) return;
+			if (from == Space::Hsv) detail::hsvToRgbBlock(c0, c1, c2, n);
+			if (from == Space::Hsl) detail::hslToRgbBlock(c0, c1, c2, n);
+			if (to == Space::Hsv) detail::rgbToHsvBlock(c0, c1, c2, n);
+			if (to == Space::Hsl) detail::rgbToHslBlock(c0, c1, c2, n);
+		}
+
+		static void run(const Step& step, double* c0, double* c1, double* c2, int n) {
+			const auto& a = step.args;
+			switch (step.op) {
+			case Op::HueShift:
+				for (int i = 0; i < n; ++i) { double h = c0[i] + a[0]; c0[i] = h >= 1 ? h - 1 : h; }
+				break;
+			case Op::Saturation: case Op::HslSaturation:
+				for (int i = 0; i < n; ++i) c1[i] = std::clamp(c1[i] * a[0], 0.0, 1.0);
+				break;
+			case Op::Value:
+				for (int i = 0; i < n; ++i) c2[i] *= a[0];
+				break;
+			case Op::Lightness:
+				for (int i = 0; i < n; ++i) c2[i] = std::clamp(c2[i] * a[0], 0.0, 1.0);
+				break;
+			case Op::Colorize:
+				for (int i = 0; i < n; ++i) { c0[i] = a[0]; c1[i] = a[1]; }
+				break;
+			case Op::ThresholdHsv:
+				for (int i = 0; i < n; ++i) {
+					bool above = c0[i] >= a[0], below = c0[i] <= a[1];
+					bool hueIn = a[0] <= a[1] ? (above & below) : (above | below);
+					bool in = hueIn & (c1[i] >= a[2]) & (c1[i] <= a[3]) & (c2[i] >= a[4]) & (c2[i] <= a[5]);
+					c1[i] = 0;
+					c2[i] = in ? 1.0 : 0.0;
+				}
+				break;
+			case Op::Brightness:
+				for (int i = 0; i < n; ++i) { c0[i] += a[0]; c1[i] += a[0]; c2[i] += a[0]; }
+				break;
+			case Op::Contrast:
+				for (int i = 0; i < n; ++i) { c0[i] = (c0[i] - 0.5) * a[0] + 0.5; c1[i] = (c1[i] - 0.5) * a[0] + 0.5; c2[i] = (c2[i] - 0.5) * a[0] + 0.5; }
+				break;
+			case Op::Grayscale:
+				for (int i = 0; i < n; ++i) { double y = 0.299 * c0[i] + 0.587 * c1[i] + 0.114 * c2[i]; c0[i] = c1[i] = c2[i] = y; }
+				break;
+			case Op::Invert:
+				for (int i = 0; i < n; ++i) { c0[i] = 1 - c0[i]; c1[i] = 1 - c1[i]; c2[i] = 1 - c2[i]; }
+				break;
+			}
+		}
+
+		std::vector<Step> m_steps;
+	};
+
+	// How convolution reads pixels outside the image. Mirror reflects about the edge pixel (dcb|abcd).
+	enum class BorderMode { Clamp, Wrap, Mirror, Constant };
+
+	namespace detail
+	{
+		// Source index for i in a line of n pixels, or -1 for Constant.
+		inline int borderIndex(int i, int n, BorderMode mode) {
+			if (i >= 0 && i < n) return i;
+			switch (mode) {
+			case BorderMode::Clamp: return std::clamp(i, 0, n - 1);
+			case BorderMode::Wrap: return ((i % n) + n) % n;
+			case BorderMode::Mirror: {
+				if (n == 1) return 0;
+				int period = 2 * n - 2;
+				i = ((i % period) + period) % period;
+				return i < n ? i : period - i;
+			}
+			default: return -1;
+			}
+		}
+
+		// out[i] (+)= sum_k w[k] * src[i + k * step] for i in [0, count), in double, float or 32-bit fixed point.
+		// Blocks of outputs stay in registers across the taps; the inner loop is branch-free and contiguous, so it
+		// vectorizes.
+		template <typename A>
+		void convolveLine(const A* src, A* out, size_t count, const A* w, int taps, size_t step, bool accumulate = false) {
+			constexpr size_t block = 64;
+			A acc[block];
+			for (size_t start = 0; start < count; start += block) {
+				const size_t n = std::min(block, count - start);
+				const A* s = src + start;
+				if (accumulate) {
+					for (size_t i = 0; i < n; ++i) acc[i] = out[start + i] + w[0] * s[i];
+				} else {
+					for (size_t i = 0; i < n; ++i) acc[i] = w[0] * s[i];
+				}
+				for (int k = 1; k < taps; ++k) {
+					const A wk = w[k];
+					const A* sk = s + k * step;
+					for (size_t i = 0; i < n; ++i) acc[i] += wk * sk[i];
+				}
+				std::copy(acc, acc + n, out + start);
+			}
+		}
+	} // namespace detail
+
+	// Convolution weights, row-major, with the anchor pixel at (anchorX, anchorY) (the center by default).
+	class Kernel
+	{
+	public:
+		Kernel(int width, int height, std::vector<double> weights, int anchorX = -1, int anchorY = -1)
+			: m_width(width), m_height(height), m_weights(std::move(weights)),
+			  m_anchorX(anchorX < 0 ? width / 2 : anchorX), m_anchorY(anchorY < 0 ? height / 2 : anchorY) {
+			if (width <= 0 || height <= 0 || m_weights.size() != static_cast<size_t>(width) * height) {
+				throw std::invalid_argument("Kernel weights must be width * height");
+			}
+		}
+
+		static Kernel gaussian(double sigma) {
+			if (!(sigma > 0.0) || !std::isfinite(sigma)) throw std::invalid_argument("Kernel::gaussian: sigma must be positive");
+			int radius = std::max(1, static_cast<int>(std::ceil(sigma * 3)));
+			std::vector<double> line(2 * radius + 1);
+			double sum = 0;
+			for (int i = -radius; i <= radius; ++i) sum += line[i + radius] = std::exp(-(i * i) / (2 * sigma * sigma));
+			for (double& v : line) v /= sum;
+			return outer(line, line);
+		}
+
+		static Kernel box(int radius) {
+			std::vector<double> line(2 * radius + 1, 1.0 / (2 * radius + 1));
+			return outer(line, line);
+		}
+
+		static Kernel sharpen(double amount = 1.0) {
+			return Kernel(3, 3, {0, -amount, 0, -amount, 1 + 4 * amount, -amount, 0, -amount, 0});
+		}
+
+		static Kernel emboss() {
+			return Kernel(3, 3, {-2, -1, 0, -1, 1, 1, 0, 1, 2});
+		}
+
+		static Kernel sobelX() {
+			return Kernel(3, 3, {-1, 0, 1, -2, 0, 2, -1, 0, 1});
+		}
+
+		static Kernel sobelY() {
+			return Kernel(3, 3, {-1, -2, -1, 0, 0, 0, 1, 2, 1});
+		}
+
+		static Kernel laplacian() {
+			return Kernel(3, 3, {0, 1, 0, 1, -4, 1, 0, 1, 0});
+		}
+
+		int getWidth() const { return m_width; }
+		int getHeight() const { return m_height; }
+		int getAnchorX() const { return m_anchorX; }
+		int getAnchorY() const { return m_anchorY; }
+		double at(int x, int y) const { return m_weights[static_cast<size_t>(y) * m_width + x]; }
+
+		// True for rank-1 kernels, which are then column * row.
+		bool isSeparable(std::vector<double>& column, std::vector<double>& row) const {
+			size_t pivot = 0;
+			for (size_t i = 1; i < m_weights.size(); ++i) {
+				if (std::abs(m_weights[i]) > std::abs(m_weights[pivot])) pivot = i;
+			}
+			const double scale = std::abs(m_weights[pivot]);
+			if (scale == 0) return false;
+			const int py = static_cast<int>(pivot) / m_width, px = static_cast<int>(pivot) % m_width;
+			column.resize(m_height);
+			row.resize(m_width);
+			for (int y = 0; y < m_height; ++y) column[y] = at(px, y);
+			for (int x = 0; x < m_width; ++x) row[x] = at(x, py) / at(px, py);
+			for (int y = 0; y < m_height; ++y) {
+				for (int x = 0; x < m_width; ++x) {
+					if (std::abs(column[y] * row[x] - at(x, y)) > 1e-12 * scale) return false;
+				}
+			}
+			return true;
+		}
+
+	private:
+		static Kernel outer(const std::vector<double>& column, const std::vector<double>& row) {
+			std::vector<double> weights;
+			for (double c : column) {
+				for (double r : row) weights.push_back(c * r);
+			}
+			return Kernel(static_cast<int>(row.size()), static_cast<int>(column.size()), std::move(weights));
+		}
+
+		int m_width;
+		int m_height;
+		std::vector<double> m_weights;
+		int m_anchorX;
+		int m_anchorY;
+	};
+
+	namespace detail
+	{
+		// Convolves width x height pixels of type Px from in into result (which must not overlap). 8-bit channels
+		// are summed in 32-bit fixed point, with as many fraction bits as 255 * sum|w| leaves room for (split
+		// between the passes of a separable kernel, whose factors are first given equal peaks); the rounded
+		// weights keep the kernel's sum, so flat areas come out exact. Other channels are summed in WorkOf<Px>.
+		// Each worker keeps the source rows it needs in a ring of kernel-height slots (padded rows, or rows after
+		// the horizontal pass for separable kernels), so every source row is prepared about once and stays in cache.
+		// Border handling is confined to building those rows; the accumulation loops never clamp.
+		template <typename Px>
+		void convolvePixels(const Px* in, Px* result, int width, int height, const Kernel& kernel, BorderMode border, const Px& constant) {
+			using T = ChannelOf<Px>;
+			constexpr bool fixed = std::is_same_v<T, uint8_t>;
+			using A = std::conditional_t<fixed, int32_t, WorkOf<Px>>;
+			const int kw = kernel.getWidth(), kh = kernel.getHeight();
+			const int left = kernel.getAnchorX(), right = kw - 1 - left;
+			const int top = kernel.getAnchorY();
+			const size_t rowValues = static_cast<size_t>(width) * 3;
+			const size_t paddedValues = static_cast<size_t>(width + kw - 1) * 3;
+
+			std::vector<double> column, row;
+			const bool separable = kernel.isSeparable(column, row);
+			std::vector<double> full(static_cast<size_t>(kw) * kh);
+			for (int y = 0; y < kh; ++y) {
+				for (int x = 0; x < kw; ++x) full[static_cast<size_t>(y) * kw + x] = kernel.at(x, y);
+			}
+			// The row pass (or the whole kernel) first, then the column pass; in fixed point the sums carry
+			// 2^shift.
+			std::vector<A> rowWeights, columnWeights;
+			int shift = 0;
+			if constexpr (fixed) {
+				if (separable) {
+					auto peak = [](const std::vector<double>& w) {
+						double m = 0;
+						for (double v : w) m = std::max(m, std::abs(v));
+						return m;
+					};
+					const double rowPeak = peak(row), columnPeak = peak(column), balanced = std::sqrt(rowPeak * columnPeak);
+					for (double& v : row) v *= balanced / rowPeak;
+					for (double& v : column) v *= balanced / columnPeak;
+				}
+				// Rounded to bits fraction bits, with the rounding error of the sum moved onto the largest weight.
+				auto scaled = [](const std::vector<double>& w, int bits, double& sum) {
+					std::vector<double> q(w.size());
+					double exact = 0, rounded = 0;
+					size_t largest = 0;
+					for (size_t i = 0; i < w.size(); ++i) {
+						exact += std::ldexp(w[i], bits);
+						rounded += q[i] = std::round(std::ldexp(w[i], bits));
+						if (std::abs(w[i]) > std::abs(w[largest])) largest = i;
+					}
+					q[largest] += std::round(exact) - rounded;
+					sum = 0;
+					for (double v : q) sum += std::abs(v);
+					return q;
+				};
+				for (shift = 24;; --shift) {
+					double rowSum = 0, columnSum = 1;
+					const std::vector<double> q = scaled(separable ? row : full, separable ? shift / 2 : shift, rowSum);
+					const std::vector<double> qc = separable ? scaled(column, shift - shift / 2, columnSum) : std::vector<double>();
+					if (255.0 * rowSum * columnSum + std::ldexp(1.0, shift) < 2147483647.0) {
+						rowWeights.assign(q.begin(), q.end());
+						columnWeights.assign(qc.begin(), qc.end());
+						break;
+					}
+					if (shift == 0) throw std::invalid_argument("convolve: kernel weights too large for 8-bit fixed point");
+				}
+			} else {
+				rowWeights.assign(separable ? row.begin() : full.begin(), separable ? row.end() : full.end());
+				columnWeights.assign(column.begin(), column.end());
+			}
+			auto store = [shift](A v) {
+				if constexpr (fixed) return static_cast<T>(std::clamp((v + (shift ? 1 << (shift - 1) : 0)) >> shift, 0, 255));
+				else return storeChannel<T>(v);
+			};
+
+			auto put = [](A* dst, const Px& px) {
+				dst[0] = static_cast<A>(channel<0>(px));
+				dst[1] = static_cast<A>(channel<1>(px));
+				dst[2] = static_cast<A>(channel<2>(px));
+			};
+			// Interleaved channel values of row y, padded by left/right pixels according to the border mode.
+			auto padRow = [&](int y, A* out) {
+				const Px* src = in + static_cast<size_t>(y) * width;
+				for (int x = 0; x < width; ++x) put(out + 3 * (x + left), src[x]);
+				for (int x = -left; x < 0; ++x) {
+					int sx = borderIndex(x, width, border);
+					put(out + 3 * (x + left), sx < 0 ? constant : src[sx]);
+				}
+				for (int x = width; x < width + right; ++x) {
+					int sx = borderIndex(x, width, border);
+					put(out + 3 * (x + left), sx < 0 ? constant : src[sx]);
+				}
+			};
+			std::vector<A> constantRow(paddedValues);
+			for (size_t i = 0; i < constantRow.size(); i += 3) put(&constantRow[i], constant);
+			std::vector<A> constantHorizontal(rowValues);
+			if (separable) convolveLine(constantRow.data(), constantHorizontal.data(), rowValues, rowWeights.data(), kw, 3);
+
+			ThreadPool::instance().parallelFor(0, height, 32, [&](int lo, int hi) {
+				const size_t slotValues = separable ? rowValues : paddedValues;
+				std::vector<A> slots(slotValues * kh), padded(separable ? paddedValues : 0), out(rowValues);
+				std::vector<int> slotRow(kh, -1);
+				// Taps are consumed as soon as they are fetched, so a slot reused within one output row is harmless.
+				auto fetch = [&](int sy) -> const A* {
+					A* slot = &slots[slotValues * (sy % kh)];
+					if (slotRow[sy % kh] != sy) {
+						if (separable) {
+							padRow(sy, padded.data());
+							convolveLine(padded.data(), slot, rowValues, rowWeights.data(), kw, 3);
+						} else {
+							padRow(sy, slot);
+						}
+						slotRow[sy % kh] = sy;
+					}
+					return slot;
+				};
+				for (int y = lo; y < hi; ++y) {
+					for (int k = 0; k < kh; ++k) {
+						const int sy = borderIndex(y + k - top, height, border);
+						if (separable) {
+							const A* src = sy < 0 ? constantHorizontal.data() : fetch(sy);
+							convolveLine(src, out.data(), rowValues, &columnWeights[k], 1, 0, k > 0);
+						} else {
+							const A* src = sy < 0 ? constantRow.data() : fetch(sy);
+							convolveLine(src, out.data(), rowValues, &rowWeights[static_cast<size_t>(k) * kw], kw, 3, k > 0);
+						}
+					}
+					Px* dst = result + static_cast<size_t>(y) * width;
+					for (int x = 0; x < width; ++x) dst[x] = Px(store(out[3 * x]), store(out[3 * x + 1]), store(out[3 * x + 2]));
+				}
+			});
+		}
+	} // namespace detail
+
+	// Source offsets for a window of destination pixels: the pixel at (x,y) in the window is taken from
+	// (x + dx, y + dy) of the original image, bilinearly filtered. Pixels outside the mask are left alone.
+	class DisplacementMap
+	{
+	public:
+		DisplacementMap(int width, int height, int originX, int originY)
+			: m_width(width), m_height(height), m_originX(originX), m_originY(originY),
+			  m_dx(static_cast<size_t>(width) * height), m_dy(m_dx.size()), m_inside(m_dx.size(), 0) {}
+
+		void set(int x, int y, float dx, float dy) {
+			size_t i = static_cast<size_t>(y) * m_width + x;
+			m_dx[i] = dx;
+			m_dy[i] = dy;
+			m_inside[i] = 1;
+			m_maxOffset = std::max({m_maxOffset, std::abs(dx), std::abs(dy)});
+		}
+
+		bool isInside(int x, int y) const { return m_inside[static_cast<size_t>(y) * m_width + x] != 0; }
+		float getDx(int x, int y) const { return m_dx[static_cast<size_t>(y) * m_width + x]; }
+		float getDy(int x, int y) const { return m_dy[static_cast<size_t>(y) * m_width + x]; }
+		int getWidth() const { return m_width; }
+		int getHeight() const { return m_height; }
+		// The window pixel placed at the position passed to Image::applyDisplacement.
+		int getOriginX() const { return m_originX; }
+		int getOriginY() const { return m_originY; }
+		// Largest |dx| or |dy| set, so how far beyond the window the map can read.
+		float getMaxOffset() const { return m_maxOffset; }
+
+		// Spherical lens of the given radius, centered on the origin. The last few (radius, index) pairs are cached and
+		// shared; older maps live only as long as their callers hold them, so varying image sizes don't pile up.
+		static std::shared_ptr<const DisplacementMap> lens(int radius, double refractionIndex = 1.5) {
+			constexpr size_t cacheSize = 4;
+			static std::mutex mutex;
+			static std::vector<std::pair<std::pair<int, double>, std::shared_ptr<const DisplacementMap>>> cache; // newest first
+			radius = std::max(radius, 0);
+			const std::pair<int, double> key(radius, refractionIndex);
+			std::lock_guard<std::mutex> lock(mutex);
+			auto hit = std::find_if(cache.begin(), cache.end(), [&](const auto& entry) { return entry.first == key; });
+			if (hit != cache.end()) {
+				std::rotate(cache.begin(), hit, hit + 1);
+				return cache.front().second;
+			}
 
-	// Helper functions for colors
-	Pixel blendColors(Pixel &colorbackground, Pixel &colorforeground, float alpha) {float r=0.0f; float g=0.0f; float b=0.0f;r = (std::get<0>(colorforeground) * alpha) + (std::get<0>(colorbackground) * (1.0 - alpha));g = (std::get<1>(colorforeground) * alpha) + (std::get<1>(colorbackground) * (1.0 - alpha));b = (std::get<2>(colorforeground) * alpha) + (std::get<2>(colorbackground) * (1.0 - alpha));return createfPixelWithColor(r,g,b);}
-	void getHSV(double& h, double& s, double& v, const Pixel& px) {double r, g, b;std::tie(r, g, b) = px;double min_val = std::min({r, g, b});double max_val = std::max({r, g, b});double delta = max_val - min_val;v = max_val;if (max_val != 0.0) {s = delta / max_val;} else {s = 0.0;h = -1.0;return;}if (r == max_val) {h = (g - b) / delta;} else if (g == max_val) {h = 2.0 + (b - r) / delta;} else {h = 4.0 + (r - g) / delta;}h *= 60.0;if (h < 0) {h += 360.0;}h /= 360.0;}
-	void setHSV(double h,double s,double v,Pixel& px) {if (s == 0) {px = {v, v, v};return;}h *= 360.0;h = std::fmod(h, 360.0);h /= 60.0;int i = std::floor(h);double f = h - i;double p = v * (1.0 - s);double q = v * (1.0 - s * f);double t = v * (1.0 - s * (1.0 - f));switch (i) {case 0:px = {v, t, p};break;case 1:px = {q, v, p};break;case 2:px = {p, v, t};break;case 3:px = {p, q, v};break;case 4:px = {t, p, v};break;default:px = {v, p, q};break;}}
+			auto map = std::make_shared<DisplacementMap>(2 * radius + 1, 2 * radius + 1, radius, radius);
+			const double refraction = 1.0 - std::sqrt(1.0 - std::pow(refractionIndex - 1.0, 2)) / refractionIndex;
+			for (int y = -radius; y <= radius; ++y) {
+				for (int x = -radius; x <= radius; ++x) {
+					if (x * x + y * y > radius * radius) continue;
+					// The source lies on the same ray from the center, at dist * (dist / radius) * refraction.
+					double scale = radius > 0 ? std::sqrt(x * x + y * y) / radius * refraction : 0.0;
+					map->set(x + radius, y + radius, static_cast<float>(x * scale - x), static_cast<float>(y * scale - y));
+				}
+			}
+			cache.insert(cache.begin(), {key, map});
+			if (cache.size() > cacheSize) cache.pop_back();
+			return map;
+		}
+
+	private:
+		int m_width;
+		int m_height;
+		int m_originX;
+		int m_originY;
+		std::vector<float> m_dx;
+		std::vector<float> m_dy;
+		std::vector<uint8_t> m_inside;
+		float m_maxOffset = 0;
+	};
+
+	namespace detail
+	{
+		// 5x7 font for ASCII 32..126: five columns per glyph, bit 0 is the top row.
+		inline constexpr uint8_t font5x7[95 * 5] = {
+			0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x5F, 0x00, 0x00, 0x00, 0x07, 0x00, 0x07, 0x00, 0x14, 0x7F, 0x14, 0x7F, 0x14, //   ! " #
+			0x24, 0x2A, 0x7F, 0x2A, 0x12, 0x23, 0x13, 0x08, 0x64, 0x62, 0x36, 0x49, 0x55, 0x22, 0x50, 0x00, 0x05, 0x03, 0x00, 0x00, // $ % & '
+			0x00, 0x1C, 0x22, 0x41, 0x00, 0x00, 0x41, 0x22, 0x1C, 0x00, 0x14, 0x08, 0x3E, 0x08, 0x14, 0x08, 0x08, 0x3E, 0x08, 0x08, // ( ) * +
+			0x00, 0x50, 0x30, 0x00, 0x00, 0x08, 0x08, 0x08, 0x08, 0x08, 0x00, 0x60, 0x60, 0x00, 0x00, 0x20, 0x10, 0x08, 0x04, 0x02, // , - . /
+			0x3E, 0x51, 0x49, 0x45, 0x3E, 0x00, 0x42, 0x7F, 0x40, 0x00, 0x42, 0x61, 0x51, 0x49, 0x46, 0x21, 0x41, 0x45, 0x4B, 0x31, // 0 1 2 3
+			0x18, 0x14, 0x12, 0x7F, 0x10, 0x27, 0x45, 0x45, 0x45, 0x39, 0x3C, 0x4A, 0x49, 0x49, 0x30, 0x01, 0x71, 0x09, 0x05, 0x03, // 4 5 6 7
+			0x36, 0x49, 0x49, 0x49, 0x36, 0x06, 0x49, 0x49, 0x29, 0x1E, 0x00, 0x36, 0x36, 0x00, 0x00, 0x00, 0x56, 0x36, 0x00, 0x00, // 8 9 : ;
+			0x08, 0x14, 0x22, 0x41, 0x00, 0x14, 0x14, 0x14, 0x14, 0x14, 0x00, 0x41, 0x22, 0x14, 0x08, 0x02, 0x01, 0x51, 0x09, 0x06, // < = > ?
+			0x32, 0x49, 0x79, 0x41, 0x3E, 0x7E, 0x11, 0x11, 0x11, 0x7E, 0x7F, 0x49, 0x49, 0x49, 0x36, 0x3E, 0x41, 0x41, 0x41, 0x22, // @ A B C
+			0x7F, 0x41, 0x41, 0x22, 0x1C, 0x7F, 0x49, 0x49, 0x49, 0x41, 0x7F, 0x09, 0x09, 0x09, 0x01, 0x3E, 0x41, 0x49, 0x49, 0x7A, // D E F G
+			0x7F, 0x08, 0x08, 0x08, 0x7F, 0x00, 0x41, 0x7F, 0x41, 0x00, 0x20, 0x40, 0x41, 0x3F, 0x01, 0x7F, 0x08, 0x14, 0x22, 0x41, // H I J K
+			0x7F, 0x40, 0x40, 0x40, 0x40, 0x7F, 0x02, 0x0C, 0x02, 0x7F, 0x7F, 0x04, 0x08, 0x10, 0x7F, 0x3E, 0x41, 0x41, 0x41, 0x3E, // L M N O
+			0x7F, 0x09, 0x09, 0x09, 0x06, 0x3E, 0x41, 0x51, 0x21, 0x5E, 0x7F, 0x09, 0x19, 0x29, 0x46, 0x46, 0x49, 0x49, 0x49, 0x31, // P Q R S
+			0x01, 0x01, 0x7F, 0x01, 0x01, 0x3F, 0x40, 0x40, 0x40, 0x3F, 0x1F, 0x20, 0x40, 0x20, 0x1F, 0x3F, 0x40, 0x38, 0x40, 0x3F, // T U V W
+			0x63, 0x14, 0x08, 0x14, 0x63, 0x07, 0x08, 0x70, 0x08, 0x07, 0x61, 0x51, 0x49, 0x45, 0x43, 0x00, 0x7F, 0x41, 0x41, 0x00, // X Y Z [
+			0x02, 0x04, 0x08, 0x10, 0x20, 0x00, 0x41, 0x41, 0x7F, 0x00, 0x04, 0x02, 0x01, 0x02, 0x04, 0x40, 0x40, 0x40, 0x40, 0x40, // \ ] ^ _
+			0x00, 0x01, 0x02, 0x04, 0x00, 0x20, 0x54, 0x54, 0x54, 0x78, 0x7F, 0x48, 0x44, 0x44, 0x38, 0x38, 0x44, 0x44, 0x44, 0x20, // ` a b c
+			0x38, 0x44, 0x44, 0x48, 0x7F, 0x38, 0x54, 0x54, 0x54, 0x18, 0x08, 0x7E, 0x09, 0x01, 0x02, 0x0C, 0x52, 0x52, 0x52, 0x3E, // d e f g
+			0x7F, 0x08, 0x04, 0x04, 0x78, 0x00, 0x44, 0x7D, 0x40, 0x00, 0x20, 0x40, 0x44, 0x3D, 0x00, 0x7F, 0x10, 0x28, 0x44, 0x00, // h i j k
+			0x00, 0x41, 0x7F, 0x40, 0x00, 0x7C, 0x04, 0x18, 0x04, 0x78, 0x7C, 0x08, 0x04, 0x04, 0x78, 0x38, 0x44, 0x44, 0x44, 0x38, // l m n o
+			0x7C, 0x14, 0x14, 0x14, 0x08, 0x08, 0x14, 0x14, 0x18, 0x7C, 0x7C, 0x08, 0x04, 0x04, 0x08, 0x48, 0x54, 0x54, 0x54, 0x20, // p q r s
+			0x04, 0x3F, 0x44, 0x40, 0x20, 0x3C, 0x40, 0x40, 0x20, 0x7C, 0x1C, 0x20, 0x40, 0x20, 0x1C, 0x3C, 0x40, 0x30, 0x40, 0x3C, // t u v w
+			0x44, 0x28, 0x10, 0x28, 0x44, 0x0C, 0x50, 0x50, 0x50, 0x3C, 0x44, 0x64, 0x54, 0x4C, 0x44, 0x00, 0x08, 0x36, 0x41, 0x00, // x y z {
+			0x00, 0x00, 0x7F, 0x00, 0x00, 0x00, 0x41, 0x36, 0x08, 0x00, 0x08, 0x04, 0x08, 0x10, 0x08, // | } ~
+		};
+	} // namespace detail
+
+	enum class TextLayout { Proportional, Monospace };
+
+	// Coverage masks of the built-in 5x7 font at one pixel size, box-filtered from the bitmap and packed side by
+	// side into one 8-bit atlas. Built once per size and shared, so drawing a string is only masked blends.
+	class GlyphAtlas
+	{
+	public:
+		struct Glyph {
+			int offset;  // first atlas column
+			int left;    // first inked mask column; proportional layout starts drawing here
+			int advance; // proportional pen advance
+		};
+
+		// size is the height of the 7 font rows in pixels.
+		static std::shared_ptr<const GlyphAtlas> get(int size) {
+			static std::mutex mutex;
+			static std::map<int, std::shared_ptr<const GlyphAtlas>> cache;
+			size = std::clamp(size, 1, 512);
+			std::lock_guard<std::mutex> lock(mutex);
+			auto& entry = cache[size];
+			if (!entry) entry = std::shared_ptr<const GlyphAtlas>(new GlyphAtlas(size));
+			return entry;
+		}
+
+		int getSize() const { return m_size; }
+		int getGlyphWidth() const { return m_glyphWidth; }
+		int getGlyphHeight() const { return m_glyphHeight; }
+		int getLineHeight() const { return m_lineHeight; }
+		int getMonospaceAdvance() const { return m_monoAdvance; }
+
+		// Characters outside the font map to '?'.
+		const Glyph& glyph(char c) const {
+			const int i = static_cast<unsigned char>(c) - 32;
+			return m_glyphs[i >= 0 && i < 95 ? i : '?' - 32];
+		}
+
+		const uint8_t* row(int y) const { return &m_coverage[static_cast<size_t>(y) * m_atlasWidth]; }
+
+		int advance(char c, TextLayout layout) const { return layout == TextLayout::Monospace ? m_monoAdvance : glyph(c).advance; }
+
+		// Width of the widest line of text.
+		int measure(const std::string& text, TextLayout layout) const {
+			int width = 0, line = 0;
+			for (char c : text) {
+				if (c == '\n') {
+					line = 0;
+					continue;
+				}
+				line += advance(c, layout);
+				width = std::max(width, line);
+			}
+			return width;
+		}
+
+	private:
+		explicit GlyphAtlas(int size) : m_size(size) {
+			const double scale = size / 7.0;
+			m_glyphWidth = static_cast<int>(std::ceil(5 * scale));
+			m_glyphHeight = size;
+			m_lineHeight = static_cast<int>(std::lround(9 * scale));
+			m_monoAdvance = std::max(1, static_cast<int>(std::lround(6 * scale)));
+			m_atlasWidth = m_glyphWidth * 95;
+			m_coverage.assign(static_cast<size_t>(m_atlasWidth) * m_glyphHeight, 0);
+
+			// Fraction of [a, b) covered by font cell c, i.e. by [c, c + 1).
+			auto overlap = [](double a, double b, int c) { return std::max(0.0, std::min(b, c + 1.0) - std::max(a, static_cast<double>(c))); };
+			for (int g = 0; g < 95; ++g) {
+				const uint8_t* columns = &detail::font5x7[g * 5];
+				int first = 5, last = -1;
+				for (int c = 0; c < 5; ++c) {
+					if (columns[c]) {
+						first = std::min(first, c);
+						last = c;
+					}
+				}
+				Glyph& glyph = m_glyphs[g];
+				glyph.offset = g * m_glyphWidth;
+				glyph.left = last < 0 ? 0 : static_cast<int>(first * scale);
+				glyph.advance = last < 0 ? std::max(1, static_cast<int>(std::lround(3 * scale)))
+				                         : std::max(1, static_cast<int>(std::lround((last + 2) * scale)) - glyph.left);
+
+				for (int y = 0; y < m_glyphHeight; ++y) {
+					const double fy0 = y / scale, fy1 = (y + 1) / scale;
+					for (int x = 0; x < m_glyphWidth; ++x) {
+						const double fx0 = x / scale, fx1 = (x + 1) / scale;
+						double covered = 0;
+						for (int cy = static_cast<int>(fy0); cy < std::min(7.0, fy1); ++cy) {
+							const double wy = overlap(fy0, fy1, cy);
+							for (int cx = static_cast<int>(fx0); cx < std::min(5.0, fx1); ++cx) {
+								if (columns[cx] >> cy & 1) covered += wy * overlap(fx0, fx1, cx);
+							}
+						}
+						m_coverage[static_cast<size_t>(y) * m_atlasWidth + glyph.offset + x] =
+							static_cast<uint8_t>(std::lround(std::min(1.0, covered * scale * scale) * 255));
+					}
+				}
+			}
+		}
+
+		int m_size;
+		int m_glyphWidth;
+		int m_glyphHeight;
+		int m_lineHeight;
+		int m_monoAdvance;
+		int m_atlasWidth;
+		std::array<Glyph, 95> m_glyphs;
+		std::vector<uint8_t> m_coverage;
+	};
+
+	enum class GradientType { Linear, Radial, Conic };
+
+	// Color stops over t in [0,1] and the geometry that maps a pixel to t. Outside [0,1] the end colors are kept.
+	class Gradient
+	{
+	public:
+		// t runs from 0 at (x0,y0) to 1 at (x1,y1), constant across the perpendicular.
+		static Gradient linear(double x0, double y0, double x1, double y1) {
+			Gradient g(GradientType::Linear, x0, y0);
+			double dx = x1 - x0, dy = y1 - y0;
+			double len2 = dx * dx + dy * dy;
+			g.m_dx = len2 > 0 ? dx / len2 : 0;
+			g.m_dy = len2 > 0 ? dy / len2 : 0;
+			return g;
+		}
+
+		// t is the distance from the center divided by radius.
+		static Gradient radial(double cx, double cy, double radius) {
+			Gradient g(GradientType::Radial, cx, cy);
+			g.m_dx = radius > 0 ? 1.0 / radius : 0;
+			return g;
+		}
+
+		// t sweeps clockwise (y down) once around the center, starting at angleDegrees.
+		static Gradient conic(double cx, double cy, double angleDegrees = 0) {
+			Gradient g(GradientType::Conic, cx, cy);
+			g.m_dx = angleDegrees * M_PI / 180.0;
+			return g;
+		}
+
+		// Stops at equal positions are kept in insertion order, which gives a hard edge.
+		Gradient& addStop(double position, const Pixel& color) {
+			position = std::clamp(position, 0.0, 1.0);
+			auto it = std::upper_bound(m_positions.begin(), m_positions.end(), position);
+			m_colors.insert(m_colors.begin() + (it - m_positions.begin()), color);
+			m_positions.insert(it, position);
+			m_lut.clear();
+			m_lut8.clear();
+			return *this;
+		}
+
+		// Precomputes the ramp into size entries; colorAt then indexes the table instead of searching the stops. An
+		// 8-bit copy of the table serves fillSpan into Rgb8 pixels.
+		Gradient& buildLut(int size = 256) {
+			m_lut.clear();
+			size = std::max(size, 2);
+			std::vector<Pixel> lut(size);
+			for (int i = 0; i < size; ++i) lut[i] = colorAt(static_cast<double>(i) / (size - 1));
+			m_lut.swap(lut);
+			m_lut8.assign(m_lut.begin(), m_lut.end());
+			return *this;
+		}
+
+		GradientType getType() const { return m_type; }
+		size_t getStopCount() const { return m_positions.size(); }
+
+		Pixel colorAt(double t) const {
+			size_t segment = 1;
+			return colorAtImpl(t, segment);
+		}
+
+		double positionAt(double x, double y) const {
+			double dx = x - m_x, dy = y - m_y;
+			switch (m_type) {
+			case GradientType::Linear: return dx * m_dx + dy * m_dy;
+			case GradientType::Radial: return std::sqrt(dx * dx + dy * dy) * m_dx;
+			default: return conicPosition(dx, dy);
+			}
+		}
+
+		Pixel sample(int x, int y) const {
+			return colorAt(positionAt(x, y));
+		}
+
+		// Colors of pixels x0..x1-1 on row y, as Pixel or Rgb<T> (converted with convertChannel). Linear steps t with
+		// one add per pixel, radial steps the squared distance.
+		template <typename Px>
+		void fillSpan(int x0, int x1, int y, Px* out) const {
+			double dx = x0 - m_x, dy = y - m_y;
+			// Neighbouring pixels almost always fall in the same stop segment, so the search starts from the last one.
+			size_t segment = 1;
+			auto color = [&](double t) -> Px {
+				if constexpr (std::is_same_v<Px, Rgb8>) {
+					if (!m_lut8.empty()) return m_lut8[lutIndex(t)];
+				}
+				return Px(colorAtImpl(t, segment));
+			};
+			switch (m_type) {
+			case GradientType::Linear: {
+				double t = dx * m_dx + dy * m_dy;
+				for (int x = x0; x < x1; ++x, t += m_dx) *out++ = color(t);
+				break;
+			}
+			case GradientType::Radial: {
+				double d2 = dx * dx + dy * dy;
+				for (int x = x0; x < x1; ++x, d2 += 2 * dx + 1, dx += 1) *out++ = color(std::sqrt(d2) * m_dx);
+				break;
+			}
+			default:
+				for (int x = x0; x < x1; ++x, dx += 1) *out++ = color(conicPosition(dx, dy));
+				break;
+			}
+		}
+
+	private:
+		Gradient(GradientType type, double x, double y) : m_type(type), m_x(x), m_y(y) {}
+
+		// segment is the index of the stop ending the segment t was last found in.
+		Pixel colorAtImpl(double t, size_t& segment) const {
+			if (!m_lut.empty()) return m_lut[lutIndex(t)];
+			if (m_positions.empty()) return Pixel(0, 0, 0);
+			if (t <= m_positions.front()) return m_colors.front();
+			if (t >= m_positions.back()) return m_colors.back();
+			while (t >= m_positions[segment]) ++segment;
+			while (t < m_positions[segment - 1]) --segment;
+			double span = m_positions[segment] - m_positions[segment - 1];
+			double f = span > 0 ? (t - m_positions[segment - 1]) / span : 1.0;
+			const auto& [r1, g1, b1] = m_colors[segment - 1];
+			const auto& [r2, g2, b2] = m_colors[segment];
+			return Pixel(r1 + f * (r2 - r1), g1 + f * (g2 - g1), b1 + f * (b2 - b1));
+		}
+
+		size_t lutIndex(double t) const {
+			return static_cast<size_t>(std::clamp(t, 0.0, 1.0) * (m_lut.size() - 1) + 0.5);
+		}
+
+		double conicPosition(double dx, double dy) const {
+			double t = (std::atan2(dy, dx) - m_dx) / (2 * M_PI);
+			return t - std::floor(t);
+		}
+
+		GradientType m_type;
+		double m_x;
+		double m_y;
+		double m_dx = 0; // linear: direction / length^2, radial: 1 / radius, conic: start angle
+		double m_dy = 0;
+		std::vector<double> m_positions;
+		std::vector<Pixel> m_colors;
+		std::vector<Pixel> m_lut;
+		std::vector<Rgb8> m_lut8;
+	};
+
+	// Statistics of one channel. The histogram splits [0, 1] into equal bins; samples outside land in the end bins.
+	struct ChannelStatistics {
+		double min = 0;
+		double max = 0;
+		double mean = 0;
+		double variance = 0; // population variance
+		std::vector<uint64_t> histogram;
+
+		// Value below which the fraction p of the samples lies, interpolated inside the histogram bin.
+		double percentile(double p) const {
+			uint64_t total = 0;
+			for (uint64_t n : histogram) total += n;
+			if (total == 0) return mean;
+			const double target = std::clamp(p, 0.0, 1.0) * total;
+			uint64_t below = 0;
+			for (size_t b = 0; b < histogram.size(); ++b) {
+				if (histogram[b] > 0 && below + histogram[b] >= target) {
+					double v = (b + (target - below) / histogram[b]) / histogram.size();
+					return std::clamp(v, min, max);
+				}
+				below += histogram[b];
+			}
+			return max;
+		}
+	};
+
+	struct ImageStatistics {
+		uint64_t count = 0;
+		ChannelStatistics red;
+		ChannelStatistics green;
+		ChannelStatistics blue;
+		ChannelStatistics luminance; // Rec. 709 weights
+	};
+
+	struct ImageDifference {
+		double maxDelta = 0;          // largest absolute difference of any channel
+		uint64_t differingPixels = 0; // pixels with a channel difference above the tolerance
+		double mse = 0;               // mean squared error over all channels
+		double psnr = 0;              // in dB for a peak of 1.0; infinite for identical images
+	};
+
+	// 3x3 derivative filters: Sobel smooths across the derivative with 1 2 1, Scharr with 3 10 3, which keeps the
+	// direction accurate for diagonal edges.
+	enum class GradientOperator { Sobel, Scharr };
+
+	// Luminance gradient per pixel. Magnitudes are normalized so a step from 0 to 1 gives 1; direction is
+	// atan2(gy, gx) in radians, with y pointing down.
+	struct GradientField {
+		int width = 0;
+		int height = 0;
+		std::vector<float> magnitude;
+		std::vector<float> direction;
+	};
+
+	enum class Connectivity { Four, Eight };
+
+	// How floodFill compares a pixel with the seed: largest channel difference, or luminance difference.
+	enum class ColorMatch { Rgb, Luminance };
+
+	// Pixels x0..x1-1 of row y.
+	struct Span {
+		int y;
+		int x0;
+		int x1;
+	};
+
+	class Image;
+
+	// Replace copies the source; the other modes mix op(dst, src) into dst by opacity times the alpha mask.
+	enum class BlendMode { Replace, Alpha, Add, Multiply, Screen };
+
+	// drawImage samples Bicubic as Bilinear; transform and rotate support all three.
+	enum class ScaleFilter { Nearest, Bilinear, Bicubic };
+
+	// One drawImages entry: srcRect of *source, scaled to dstRect when the sizes differ. The part of srcRect outside
+	// the source is dropped along with the matching share of dstRect. A source in the other ColorSpace is converted
+	// while drawing. alpha, if set, is a mask the size of the source.
+	struct ImageBlit {
+		const Image* source = nullptr;
+		Rect srcRect;
+		Rect dstRect;
+		BlendMode mode = BlendMode::Replace;
+		ScaleFilter filter = ScaleFilter::Bilinear;
+		double opacity = 1.0;
+		const GrayImage* alpha = nullptr;
+	};
+
+	namespace detail
+	{
+		// A blit with clipping and the source column mapping worked out once per call.
+		template <typename Px>
+		struct PreparedBlit {
+			const Px* pixels;
+			int stride;
+			const GrayImage* alpha;
+			Rect src;  // clipped to the source
+			Rect dst;  // the part of the destination rectangle src maps to
+			Rect clip; // dst clipped to the target
+			BlendMode mode;
+			ScaleFilter filter;
+			double opacity;
+			bool direct; // same size: rows map 1:1
+			double scaleX, scaleY;   // source pixels per destination pixel
+			double originX, originY; // source position of dst's top-left corner, relative to src
+			std::vector<int> x0, x1; // source columns per clip column
+			std::vector<double> fx;  // weight of x1
+		};
+
+		// Fills in everything but pixels and alpha for srcRect of a sourceWidth x sourceHeight source drawn to dstRect
+		// of a width x height target. False if nothing is drawn.
+		template <typename Px>
+		bool planBlit(const Rect& srcRect, const Rect& dstRect, int sourceWidth, int sourceHeight, int width, int height,
+		              BlendMode mode, ScaleFilter filter, double opacity, PreparedBlit<Px>& p) {
+			p.src = srcRect.intersect(Rect(0, 0, sourceWidth, sourceHeight));
+			if (p.src.empty() || dstRect.empty()) return false;
+			p.direct = srcRect.w == dstRect.w && srcRect.h == dstRect.h;
+			p.scaleX = static_cast<double>(srcRect.w) / dstRect.w;
+			p.scaleY = static_cast<double>(srcRect.h) / dstRect.h;
+			// Clipping the source shrinks the destination by the same share: keep the destination pixels whose
+			// centers map inside src, so the scale stays srcRect : dstRect.
+			auto visible = [](int dst, int dstLen, double scale, int cut, int len) {
+				const int lo = static_cast<int>(std::ceil(cut / scale - 0.5));
+				const int hi = static_cast<int>(std::ceil((cut + len) / scale - 0.5));
+				return std::make_pair(dst + std::max(lo, 0), dst + std::min(hi, dstLen));
+			};
+			const auto [dx0, dx1] = visible(dstRect.x, dstRect.w, p.scaleX, p.src.x - srcRect.x, p.src.w);
+			const auto [dy0, dy1] = visible(dstRect.y, dstRect.h, p.scaleY, p.src.y - srcRect.y, p.src.h);
+			p.dst = Rect(dx0, dy0, dx1 - dx0, dy1 - dy0);
+			p.originX = srcRect.x - p.src.x + (dx0 - dstRect.x) * p.scaleX;
+			p.originY = srcRect.y - p.src.y + (dy0 - dstRect.y) * p.scaleY;
+			p.clip = p.dst.intersect(Rect(0, 0, width, height));
+			if (p.dst.empty() || p.clip.empty()) return false;
+
+			p.stride = sourceWidth;
+			p.mode = mode;
+			p.filter = filter;
+			p.opacity = std::clamp(opacity, 0.0, 1.0);
+			if (!p.direct) {
+				p.x0.resize(p.clip.w);
+				p.x1.resize(p.clip.w);
+				p.fx.assign(p.clip.w, 0.0);
+				for (int i = 0; i < p.clip.w; ++i) {
+					const double sx = p.originX + (p.clip.x + i - p.dst.x + 0.5) * p.scaleX;
+					if (p.filter == ScaleFilter::Nearest) {
+						p.x0[i] = p.x1[i] = p.src.x + std::clamp(static_cast<int>(sx), 0, p.src.w - 1);
+					} else {
+						const double c = std::clamp(sx - 0.5, 0.0, p.src.w - 1.0);
+						const int x = static_cast<int>(c);
+						p.x0[i] = p.src.x + x;
+						p.x1[i] = p.src.x + std::min(x + 1, p.src.w - 1);
+						p.fx[i] = c - x;
+					}
+				}
+			}
+			return true;
+		}
+
+		// dst = lerp(dst, op(dst, src), coverage * opacity), or a plain copy for Replace. 8-bit channels blend in
+		// integers, with the weight in 1/256 steps; other channels in WorkOf<Px>, on the scale 0..channelMax.
+		// Integer channels are clamped after the mix, so Add saturates where a Pixel would leave [0,1].
+		template <typename Px>
+		void blendSpan(Px* dst, const Px* src, const double* coverage, double opacity, int n, BlendMode mode) {
+			using T = ChannelOf<Px>;
+			if (mode == BlendMode::Replace) {
+				std::copy_n(src, n, dst);
+				return;
+			}
+			if constexpr (std::is_same_v<T, uint8_t>) {
+				auto run = [&](auto op) {
+					for (int i = 0; i < n; ++i) {
+						const int a = static_cast<int>((coverage ? coverage[i] * opacity : opacity) * 256 + 0.5);
+						auto mix = [a, op](uint8_t& d, int s) { d = static_cast<uint8_t>(std::min(d + (((op(d, s) - d) * a + 128) >> 8), 255)); };
+						mix(dst[i].r, src[i].r);
+						mix(dst[i].g, src[i].g);
+						mix(dst[i].b, src[i].b);
+					}
+				};
+				switch (mode) {
+				case BlendMode::Alpha: run([](int, int s) { return s; }); break;
+				case BlendMode::Add: run([](int d, int s) { return d + s; }); break;
+				case BlendMode::Multiply: run([](int d, int s) { return (d * s + 127) / 255; }); break;
+				case BlendMode::Screen: run([](int d, int s) { return d + s - (d * s + 127) / 255; }); break;
+				default: break;
+				}
+			} else {
+				using W = WorkOf<Px>;
+				constexpr W full = static_cast<W>(channelMax<T>());
+				auto run = [&](auto op) {
+					for (int i = 0; i < n; ++i) {
+						const W a = static_cast<W>(coverage ? coverage[i] * opacity : opacity);
+						auto mix = [a, op](T& d, W s) { d = storeChannel<T>(d + (op(static_cast<W>(d), s) - d) * a); };
+						mix(channel<0>(dst[i]), channel<0>(src[i]));
+						mix(channel<1>(dst[i]), channel<1>(src[i]));
+						mix(channel<2>(dst[i]), channel<2>(src[i]));
+					}
+				};
+				switch (mode) {
+				case BlendMode::Alpha: run([](W, W s) { return s; }); break;
+				case BlendMode::Add: run([](W d, W s) { return d + s; }); break;
+				case BlendMode::Multiply: run([](W d, W s) { return d * s / full; }); break;
+				case BlendMode::Screen: run([](W d, W s) { return full - (full - d) * (full - s) / full; }); break;
+				default: break;
+				}
+			}
+		}
+
+		// Draws row y of the blit into dst, the target's pixels from p.clip.x on. line and coverage hold p.clip.w
+		// entries of scratch.
+		template <typename Px>
+		void blitRow(const PreparedBlit<Px>& p, int y, Px* dst, std::vector<Px>& line, std::vector<double>& coverage) {
+			using T = ChannelOf<Px>;
+			const int n = p.clip.w;
+			const bool masked = p.alpha && p.mode != BlendMode::Replace;
+			const double maxval = p.alpha ? p.alpha->getMaxval() : 1.0;
+			if (p.direct) {
+				const int sy = p.src.y + y - p.dst.y, sx = p.src.x + p.clip.x - p.dst.x;
+				const size_t offset = static_cast<size_t>(sy) * p.stride + sx;
+				if (masked) {
+					const uint16_t* a = &p.alpha->getData()[offset];
+					for (int i = 0; i < n; ++i) coverage[i] = a[i] / maxval;
+				}
+				blendSpan(dst, p.pixels + offset, masked ? coverage.data() : nullptr, p.opacity, n, p.mode);
+				return;
+			}
+
+			const double sy = p.originY + (y - p.dst.y + 0.5) * p.scaleY;
+			int y0, y1;
+			double fy = 0;
+			if (p.filter == ScaleFilter::Nearest) {
+				y0 = y1 = p.src.y + std::clamp(static_cast<int>(sy), 0, p.src.h - 1);
+			} else {
+				const double c = std::clamp(sy - 0.5, 0.0, p.src.h - 1.0);
+				const int r = static_cast<int>(c);
+				y0 = p.src.y + r;
+				y1 = p.src.y + std::min(r + 1, p.src.h - 1);
+				fy = c - r;
+			}
+			const Px* row0 = p.pixels + static_cast<size_t>(y0) * p.stride;
+			const Px* row1 = p.pixels + static_cast<size_t>(y1) * p.stride;
+			const uint16_t* mask0 = p.alpha ? &p.alpha->getData()[static_cast<size_t>(y0) * p.stride] : nullptr;
+			const uint16_t* mask1 = p.alpha ? &p.alpha->getData()[static_cast<size_t>(y1) * p.stride] : nullptr;
+			if (p.filter == ScaleFilter::Nearest) {
+				for (int i = 0; i < n; ++i) line[i] = row0[p.x0[i]];
+				if (masked) {
+					for (int i = 0; i < n; ++i) coverage[i] = mask0[p.x0[i]] / maxval;
+				}
+			} else {
+				if constexpr (std::is_same_v<T, uint8_t>) {
+					// Weights in 1/256 steps; the four taps are summed in integers.
+					const int wy = static_cast<int>(fy * 256 + 0.5);
+					for (int i = 0; i < n; ++i) {
+						const int wx = static_cast<int>(p.fx[i] * 256 + 0.5);
+						const Px& a = row0[p.x0[i]];
+						const Px& b = row0[p.x1[i]];
+						const Px& c = row1[p.x0[i]];
+						const Px& d = row1[p.x1[i]];
+						auto mix = [wx, wy](int va, int vb, int vc, int vd) {
+							return static_cast<uint8_t>(((va * (256 - wx) + vb * wx) * (256 - wy) + (vc * (256 - wx) + vd * wx) * wy + 32768) >> 16);
+						};
+						line[i] = Px(mix(a.r, b.r, c.r, d.r), mix(a.g, b.g, c.g, d.g), mix(a.b, b.b, c.b, d.b));
+					}
+				} else {
+					using W = WorkOf<Px>;
+					const W wy = static_cast<W>(fy);
+					for (int i = 0; i < n; ++i) {
+						const W fx = static_cast<W>(p.fx[i]);
+						const Px& a = row0[p.x0[i]];
+						const Px& b = row0[p.x1[i]];
+						const Px& c = row1[p.x0[i]];
+						const Px& d = row1[p.x1[i]];
+						auto mix = [fx, wy](W va, W vb, W vc, W vd) {
+							const W t = va + (vb - va) * fx, u = vc + (vd - vc) * fx;
+							return storeChannel<T>(t + (u - t) * wy);
+						};
+						line[i] = Px(mix(channel<0>(a), channel<0>(b), channel<0>(c), channel<0>(d)),
+						             mix(channel<1>(a), channel<1>(b), channel<1>(c), channel<1>(d)),
+						             mix(channel<2>(a), channel<2>(b), channel<2>(c), channel<2>(d)));
+					}
+				}
+				if (masked) {
+					for (int i = 0; i < n; ++i) {
+						const double fx = p.fx[i];
+						const double top = mask0[p.x0[i]] + (mask0[p.x1[i]] - mask0[p.x0[i]]) * fx;
+						const double bottom = mask1[p.x0[i]] + (mask1[p.x1[i]] - mask1[p.x0[i]]) * fx;
+						coverage[i] = (top + (bottom - top) * fy) / maxval;
+					}
+				}
+			}
+			blendSpan(dst, line.data(), masked ? coverage.data() : nullptr, p.opacity, n, p.mode);
+		}
+	} // namespace detail
+
+	// Box averages the source area under each output pixel; Triangle is a tent twice as wide (1 3 3 1 at even
+	// sizes), which aliases less on fine detail.
+	enum class PyramidFilter { Box, Triangle };
+
+	// Mip chain of an image: level 0 is the image itself, each further level is floor(w/2) x floor(h/2) of the one
+	// above (at least 1x1). Odd sizes filter over the exact source area, so no row or column is dropped. All levels
+	// share one allocation.
+	class ImagePyramid
+	{
+	public:
+		ImagePyramid() {}
+
+		// levels <= 0 builds the whole chain down to 1x1.
+		ImagePyramid(const Pixel* pixels, int width, int height, int levels = 0, PyramidFilter filter = PyramidFilter::Triangle, ColorSpace colorSpace = ColorSpace::Srgb)
+			: m_colorSpace(colorSpace) {
+			if (width <= 0 || height <= 0) throw std::invalid_argument("ImagePyramid: empty image");
+			size_t total = 0;
+			for (int w = width, h = height;; w = std::max(w / 2, 1), h = std::max(h / 2, 1)) {
+				m_levels.push_back({total, w, h});
+				total += static_cast<size_t>(w) * h;
+				if ((w == 1 && h == 1) || static_cast<int>(m_levels.size()) == levels) break;
+			}
+			m_pixels.resize(total);
+			std::copy_n(pixels, static_cast<size_t>(width) * height, m_pixels.begin());
+
+			std::vector<Pixel> scratch(static_cast<size_t>(std::max(width / 2, 1)) * height);
+			for (size_t i = 1; i < m_levels.size(); ++i) {
+				reduceLevel(m_levels[i - 1], m_levels[i], filter, scratch);
+			}
+		}
+
+		int getLevels() const { return static_cast<int>(m_levels.size()); }
+		int getWidth(int level) const { return m_levels.at(level).width; }
+		int getHeight(int level) const { return m_levels.at(level).height; }
+		ColorSpace getColorSpace() const { return m_colorSpace; }
+
+		// Row-major pixels of one level.
+		const Pixel* data(int level) const { return m_pixels.data() + m_levels.at(level).offset; }
+
+		const Pixel& getPixel(int level, int x, int y) const { return data(level)[static_cast<size_t>(y) * getWidth(level) + x]; }
+
+		// Smallest level that still has at least scale times the base resolution, e.g. 0.3 -> level 1.
+		int levelForScale(double scale) const {
+			if (!(scale < 1.0)) return 0;
+			int level = scale > 0.0 ? static_cast<int>(std::floor(std::log2(1.0 / scale))) : getLevels() - 1;
+			return std::min(level, getLevels() - 1);
+		}
+
+	private:
+		struct Level {
+			size_t offset;
+			int width;
+			int height;
+		};
+
+		// Per-output taps along one axis, a fixed number each (zero-weight padded), edge indices clamped.
+		struct Taps {
+			int count = 0;
+			std::vector<int> index;
+			std::vector<double> weight;
+		};
+
+		static Taps buildTaps(int srcSize, int dstSize, PyramidFilter filter) {
+			const double scale = static_cast<double>(srcSize) / dstSize;
+			const double radius = filter == PyramidFilter::Box ? scale / 2 : scale;
+			Taps taps;
+			taps.count = static_cast<int>(std::ceil(2 * radius)) + 1;
+			taps.index.assign(static_cast<size_t>(dstSize) * taps.count, 0);
+			taps.weight.assign(taps.index.size(), 0.0);
+			for (int i = 0; i < dstSize; ++i) {
+				const double center = (i + 0.5) * scale;
+				const int first = static_cast<int>(std::floor(center - radius));
+				double sum = 0.0;
+				for (int k = 0; k < taps.count; ++k) {
+					const int j = first + k;
+					double w;
+					if (filter == PyramidFilter::Box) {
+						// Overlap of source pixel [j, j+1) with the output footprint.
+						w = std::max(0.0, std::min(j + 1.0, center + radius) - std::max<double>(j, center - radius));
+					} else {
+						w = std::max(0.0, 1.0 - std::abs(j + 0.5 - center) / radius);
+					}
+					taps.index[static_cast<size_t>(i) * taps.count + k] = std::clamp(j, 0, srcSize - 1);
+					taps.weight[static_cast<size_t>(i) * taps.count + k] = w;
+					sum += w;
+				}
+				for (int k = 0; k < taps.count; ++k) taps.weight[static_cast<size_t>(i) * taps.count + k] /= sum;
+			}
+			return taps;
+		}
+
+		// Separable reduction: rows are filtered horizontally into scratch (src height x dst width), then columns
+		// vertically into the next level. Both passes run in parallel over rows.
+		void reduceLevel(const Level& src, const Level& dst, PyramidFilter filter, std::vector<Pixel>& scratch) {
+			const Taps horizontal = buildTaps(src.width, dst.width, filter);
+			const Taps vertical = buildTaps(src.height, dst.height, filter);
+			const Pixel* in = m_pixels.data() + src.offset;
+			Pixel* out = m_pixels.data() + dst.offset;
+
+			ThreadPool::instance().parallelFor(0, src.height, 16, [&](int lo, int hi) {
+				for (int y = lo; y < hi; ++y) {
+					const Pixel* row = in + static_cast<size_t>(y) * src.width;
+					Pixel* tmp = scratch.data() + static_cast<size_t>(y) * dst.width;
+					for (int x = 0; x < dst.width; ++x) {
+						const int* index = &horizontal.index[static_cast<size_t>(x) * horizontal.count];
+						const double* weight = &horizontal.weight[static_cast<size_t>(x) * horizontal.count];
+						double r = 0, g = 0, b = 0;
+						for (int k = 0; k < horizontal.count; ++k) {
+							const auto& [sr, sg, sb] = row[index[k]];
+							r += weight[k] * sr;
+							g += weight[k] * sg;
+							b += weight[k] * sb;
+						}
+						tmp[x] = Pixel(r, g, b);
+					}
+				}
+			});
+
+			ThreadPool::instance().parallelFor(0, dst.height, 8, [&](int lo, int hi) {
+				std::vector<double> acc(static_cast<size_t>(dst.width) * 3);
+				for (int y = lo; y < hi; ++y) {
+					std::fill(acc.begin(), acc.end(), 0.0);
+					for (int k = 0; k < vertical.count; ++k) {
+						const double w = vertical.weight[static_cast<size_t>(y) * vertical.count + k];
+						if (w == 0.0) continue;
+						const Pixel* tmp = scratch.data() + static_cast<size_t>(vertical.index[static_cast<size_t>(y) * vertical.count + k]) * dst.width;
+						for (int x = 0; x < dst.width; ++x) {
+							const auto& [sr, sg, sb] = tmp[x];
+							acc[3 * x] += w * sr;
+							acc[3 * x + 1] += w * sg;
+							acc[3 * x + 2] += w * sb;
+						}
+					}
+					Pixel* row = out + static_cast<size_t>(y) * dst.width;
+					for (int x = 0; x < dst.width; ++x) row[x] = Pixel(acc[3 * x], acc[3 * x + 1], acc[3 * x + 2]);
+				}
+			});
+			PPMPP_PROFILE_PIXELS(static_cast<size_t>(src.width) * src.height);
+		}
+
+		std::vector<Pixel> m_pixels;
+		std::vector<Level> m_levels;
+		ColorSpace m_colorSpace = ColorSpace::Srgb;
+	};
 
 	class Image
 	{
@@ -85,17 +3958,35 @@ namespace ppm
 		explicit Image(std::string const& filename) {
 			read(filename);
 		}
-        Image(const Image& other) : m_img(other.m_img), m_width(other.m_width), m_height(other.m_height) {}
+
+		// Palette colors expanded to pixels.
+		explicit Image(const IndexedImage& indexed) {
+			resize(indexed.getWidth(), indexed.getHeight());
+			const Palette& palette = indexed.getPalette();
+			for (size_t i = 0; i < m_img.size(); ++i) {
+				const Rgb8& c = palette[indexed.getData()[i]];
+				m_img[i] = Pixel(c.r / 255.0, c.g / 255.0, c.b / 255.0);
+			}
+		}
+
+		// Copy of one pyramid level.
+		Image(const ImagePyramid& pyramid, int level) : m_colorSpace(pyramid.getColorSpace()) {
+			resize(pyramid.getWidth(level), pyramid.getHeight(level));
+			std::copy_n(pyramid.data(level), m_img.size(), m_img.begin());
+		}
+        Image(const Image& other) : m_img(other.m_img), m_width(other.m_width), m_height(other.m_height), m_dirty(other.m_dirty), m_colorSpace(other.m_colorSpace) {}
         
-        Image& operator=(const Image& other) {if (this == &other) return *this;m_img = other.m_img;m_width = other.m_width;m_height = other.m_height;return *this;}
+        Image& operator=(const Image& other) {if (this == &other) return *this;m_img = other.m_img;m_width = other.m_width;m_height = other.m_height;m_dirty = other.m_dirty;m_colorSpace = other.m_colorSpace;return *this;}
         
-        Image(Image&& other) noexcept : m_img(std::move(other.m_img)), m_width(other.m_width), m_height(other.m_height) {other.m_width = 0;other.m_height = 0;}
+        Image(Image&& other) noexcept : m_img(std::move(other.m_img)), m_width(other.m_width), m_height(other.m_height), m_dirty(std::move(other.m_dirty)), m_colorSpace(other.m_colorSpace) {other.m_width = 0;other.m_height = 0;}
         
         Image& operator=(Image&& other) noexcept {
         	if (this == &other) return *this;
         	m_img = std::move(other.m_img);
         	m_width = other.m_width;
         	m_height = other.m_height;
+        	m_dirty = std::move(other.m_dirty);
+        	m_colorSpace = other.m_colorSpace;
         	other.m_width = 0;
         	other.m_height = 0;
         	return *this;
@@ -116,10 +4007,12 @@ namespace ppm
         }
 
         void resize(int width, int height) {
+        	PPMPP_PROFILE_SCOPE("resize");
         	m_img.clear();
         	m_img.resize(width*height);
         	setWidth(width);
         	setHeight(height);
+        	resetDirtyImpl();
         }
 		
 		void setWidth(int width) { 
@@ -130,17 +4023,19 @@ namespace ppm
 			m_height = height; 
 		}
 		
-		int getWidth() { 
+		int getWidth() const { 
 			return m_width; 
 		}
         
-        int getHeight() { 
+        int getHeight() const { 
         	return m_height; 
         }
 		
 		void setPixel(int xCoord, int yCoord, const Pixel& newPixel) { 
 			if (xCoord >= 0 && xCoord < m_width && yCoord >= 0 && yCoord < m_height) { 
-				m_img[getIndex(xCoord, yCoord)] = newPixel; 
+				m_img[getIndex(xCoord, yCoord)] = m_paint ? m_paint->sample(xCoord, yCoord) : newPixel; 
+				markDirtyPixelImpl(xCoord, yCoord);
+				PPMPP_PROFILE_PIXELS(1);
 			}
 		}
 		
@@ -149,6 +4044,7 @@ namespace ppm
 		}
 		
 		void setAllPixels(const Pixel& newPixel) {
+			PPMPP_PROFILE_SCOPE("setAllPixels");
 			for(int y = 0; y < m_height; ++y) {
 				for(int x = 0; x < m_width; ++x) {
 					setPixel(x,y,newPixel);
@@ -161,13 +4057,103 @@ namespace ppm
 		    m_img = image;
 		    m_width=width;
 		    m_height=height;
+		    resetDirtyImpl();
 		}
 
 		std::vector<Pixel> getImage() {
 		    return m_img;
 		}
+
+		const std::vector<Pixel>& getPixels() const {
+		    return m_img;
+		}
+
+		// Copies rect into out (rect.w * rect.h colors, row-major) as T, chosen at compile time: floating point
+		// gets the stored values, integers the full range, through the sRGB encoder for linear images.
+		// Throws std::out_of_range if rect is not inside the image.
+		template <typename T>
+		void exportPixels(Rgb<T>* out, const Rect& rect) const {
+			PPMPP_PROFILE_SCOPE("exportPixels");
+			exportPixelsImpl(out, rect);
+		}
+
+		template <typename T>
+		std::vector<Rgb<T>> exportPixels() const {
+			PPMPP_PROFILE_SCOPE("exportPixels");
+			std::vector<Rgb<T>> out(m_img.size());
+			exportPixelsImpl(out.data(), Rect(0, 0, m_width, m_height));
+			return out;
+		}
+
+		// The reverse of exportPixels: decodes rect.w * rect.h colors from in into rect.
+		template <typename T>
+		void importPixels(const Rgb<T>* in, const Rect& rect) {
+			PPMPP_PROFILE_SCOPE("importPixels");
+			importPixelsImpl(in, rect);
+		}
+
+		// Converts the stored pixels so the image looks the same in the new space. Later reads decode into it.
+		void setColorSpace(ColorSpace space) {
+			PPMPP_PROFILE_SCOPE("setColorSpace");
+			setColorSpaceImpl(space);
+		}
+
+		ColorSpace getColorSpace() const {
+			return m_colorSpace;
+		}
+
+		// Starts recording which tiles (tileSize rounded up to a power of two) are written; all tiles start dirty.
+		void enableDirtyTracking(int tileSize = 32) {
+			int shift = 0;
+			while ((1 << shift) < std::max(tileSize, 1)) ++shift;
+			m_dirty.tileShift = shift;
+			m_dirty.tiles.assign(1, 0);
+			resetDirtyImpl();
+		}
+
+		void disableDirtyTracking() {
+			m_dirty.tiles.clear();
+			m_dirty.tilesX = m_dirty.tilesY = 0;
+		}
+
+		bool isDirtyTrackingEnabled() const {
+			return !m_dirty.tiles.empty();
+		}
+
+		int getTileSize() const {
+			return 1 << m_dirty.tileShift;
+		}
+
+		// For writes that bypass setPixel and the draw calls.
+		void markDirty(int x, int y, int w, int h) {
+			markDirtyImpl(x, y, x + w, y + h);
+		}
+
+		void clearDirty() {
+			std::fill(m_dirty.tiles.begin(), m_dirty.tiles.end(), 0);
+		}
+
+		bool hasDirty() const {
+			return std::any_of(m_dirty.tiles.begin(), m_dirty.tiles.end(), [](uint8_t t) { return t != 0; });
+		}
+
+		bool isTileDirty(int tileX, int tileY) const {
+			if (m_dirty.tiles.empty()) return true;
+			if (tileX < 0 || tileX >= m_dirty.tilesX || tileY < 0 || tileY >= m_dirty.tilesY) return false;
+			return m_dirty.tiles[tileY * m_dirty.tilesX + tileX] != 0;
+		}
+
+		// Non-overlapping rectangles (inclusive corners) covering the dirty tiles grown by halo pixels, rounded to whole tiles.
+		std::vector<Coord> getDirtyRects(int halo = 0) const {
+			std::vector<Coord> rects;
+			for (const auto& r : regionRectsImpl(Region::Dirty, halo)) {
+				rects.push_back(createCoord(r[0], r[1], r[2] - 1, r[3] - 1));
+			}
+			return rects;
+		}
 		
 		void drawLine(Coord& startCoords, const Pixel& lineColor) {
+			PPMPP_PROFILE_SCOPE("drawLine");
 			Coord clippedCoords;
 			if (clipLineImpl(startCoords, clippedCoords)) {drawLineImpl(clippedCoords, lineColor);}
 		}
@@ -182,125 +4168,484 @@ namespace ppm
 		}
 		
 		void drawBezierQuadratic(const Point& pt0, const Point& pt1, const Point& pt2, int split, const Pixel& bezierColor) {
+			PPMPP_PROFILE_SCOPE("drawBezierQuadratic");
 			std::vector<std::tuple<int, int>> xyCoordinates;
 			quadraticBezierCurvesImpl(pt0, pt1, pt2, split, xyCoordinates);
 			drawXyLineImpl(xyCoordinates, bezierColor, pt2);
 		}
 		
 		void drawBezierCubic(const Point& pt0, const Point& pt1, const Point& pt2, const Point& pt3, int split, const Pixel& bezierColor) {
+			PPMPP_PROFILE_SCOPE("drawBezierCubic");
 			std::vector<std::tuple<int, int>> xyCoordinates;
 			cubicBezierCurvesImpl(pt0, pt1, pt2, pt3, split, xyCoordinates);
 			drawXyLineImpl(xyCoordinates, bezierColor, pt3);
 		}
 
 		void drawRectangle(const Point& xy, const Point& wh, const Pixel& rectangleColor) {
+        	PPMPP_PROFILE_SCOPE("drawRectangle");
         	drawRectImpl(xy, wh, rectangleColor);
     	}
 
 		void drawFilledRectangle(const Point& xy, const Point& wh, const Pixel& rectangleColor) {
+	        PPMPP_PROFILE_SCOPE("drawFilledRectangle");
 	        drawFilledRectImpl(xy, wh, rectangleColor);
 	    }
 
+		void drawFilledRectangle(const Point& xy, const Point& wh, const Gradient& gradient) {
+	        PPMPP_PROFILE_SCOPE("drawFilledRectangle");
+	        paintWithImpl(gradient, [&] { drawFilledRectImpl(xy, wh, Pixel()); });
+	    }
+
 		void drawCircle(const Point& xy, int radius, const Pixel& circleColor) {
+	        PPMPP_PROFILE_SCOPE("drawCircle");
 	        drawCircleImpl(xy, radius, circleColor);
 	    }
 
 		void drawFilledCircle(const Point& xy, int radius, const Pixel& circleColor) {
+	        PPMPP_PROFILE_SCOPE("drawFilledCircle");
 	        drawFilledCircleImpl(xy, radius, circleColor);
 	    }
 
+		void drawFilledCircle(const Point& xy, int radius, const Gradient& gradient) {
+	        PPMPP_PROFILE_SCOPE("drawFilledCircle");
+	        paintWithImpl(gradient, [&] { drawFilledCircleImpl(xy, radius, Pixel()); });
+	    }
+
 		void drawWedge(const Point& center, int radius, int startAngle, int endAngle, const Pixel& wedgeColor) {
+	        PPMPP_PROFILE_SCOPE("drawWedge");
 	        drawWedgeImpl(center, radius, startAngle, endAngle, wedgeColor);
 	    }
 
 		void drawFilledWedge(const Point& center, int radius, int startAngle, int endAngle, const Pixel& wedgeColor) {
+	        PPMPP_PROFILE_SCOPE("drawFilledWedge");
 	        drawFilledWedgeImpl(center, radius, startAngle, endAngle, wedgeColor);
 	    }
 
+		void drawFilledWedge(const Point& center, int radius, int startAngle, int endAngle, const Gradient& gradient) {
+	        PPMPP_PROFILE_SCOPE("drawFilledWedge");
+	        paintWithImpl(gradient, [&] { drawFilledWedgeImpl(center, radius, startAngle, endAngle, Pixel()); });
+	    }
+
 		void drawTriangle(const Point& pt1, const Point& pt2, const Point& pt3, const Pixel& triangleColor) {
+	        PPMPP_PROFILE_SCOPE("drawTriangle");
 	        drawTriangleImpl(pt1, pt2, pt3, triangleColor);
 	    }
 
 		void drawFilledTriangle(const Point& pt1, const Point& pt2, const Point& pt3, const Pixel& fillColor) {
+	        PPMPP_PROFILE_SCOPE("drawFilledTriangle");
 	        drawFilledTriangleImpl(pt1, pt2, pt3, fillColor);
 	    }
 
+		void drawFilledTriangle(const Point& pt1, const Point& pt2, const Point& pt3, const Gradient& gradient) {
+	        PPMPP_PROFILE_SCOPE("drawFilledTriangle");
+	        paintWithImpl(gradient, [&] { drawFilledTriangleImpl(pt1, pt2, pt3, Pixel()); });
+	    }
+
 		void drawRotatedRectangle(int x, int y, int w, int h, double angle, const Pixel& px) {
+	        PPMPP_PROFILE_SCOPE("drawRotatedRectangle");
 	        drawRotatedRectangleImpl(x, y, w, h, angle, px);
 	    }
 
 		void drawFilledRotatedRectangle(int x, int y, int w, int h, double angle, const Pixel& px) {
+	        PPMPP_PROFILE_SCOPE("drawFilledRotatedRectangle");
 	        drawFilledRotatedRectangleImpl(x, y, w, h, angle, px);
 	    }
 
+		void drawFilledRotatedRectangle(int x, int y, int w, int h, double angle, const Gradient& gradient) {
+	        PPMPP_PROFILE_SCOPE("drawFilledRotatedRectangle");
+	        paintWithImpl(gradient, [&] { drawFilledRotatedRectangleImpl(x, y, w, h, angle, Pixel()); });
+	    }
+
 		void drawRotatedEllipse(int x, int y, int w, int h, double angle, const Pixel& px) {
+	        PPMPP_PROFILE_SCOPE("drawRotatedEllipse");
 	        drawRotatedEllipseImpl(x, y, w, h, angle, px);
 	    }
 
 		void drawFilledRotatedEllipse(int x, int y, int w, int h, double angle, const Pixel& px) {
+	        PPMPP_PROFILE_SCOPE("drawFilledRotatedEllipse");
 	        drawFilledRotatedEllipseImpl(x, y, w, h, angle, px);
 	    }
 
+		void drawFilledRotatedEllipse(int x, int y, int w, int h, double angle, const Gradient& gradient) {
+	        PPMPP_PROFILE_SCOPE("drawFilledRotatedEllipse");
+	        paintWithImpl(gradient, [&] { drawFilledRotatedEllipseImpl(x, y, w, h, angle, Pixel()); });
+	    }
+
 		void drawRotatedPolygon(const std::vector<Point>& vertices, double angle, const Pixel& px) {
+	        PPMPP_PROFILE_SCOPE("drawRotatedPolygon");
 	        drawRotatedPolygonImpl(vertices, angle, px);
 	    }
 
-		void drawFilledRotatedPolygon(const std::vector<Point>& vertices, double angle, const Pixel& px) {
-	        drawFilledRotatedPolygonImpl(vertices, angle, px);
-	    }
+		void drawFilledRotatedPolygon(const std::vector<Point>& vertices, double angle, const Pixel& px) {
+	        PPMPP_PROFILE_SCOPE("drawFilledRotatedPolygon");
+	        drawFilledRotatedPolygonImpl(vertices, angle, px);
+	    }
+
+		void drawFilledRotatedPolygon(const std::vector<Point>& vertices, double angle, const Gradient& gradient) {
+	        PPMPP_PROFILE_SCOPE("drawFilledRotatedPolygon");
+	        paintWithImpl(gradient, [&] { drawFilledRotatedPolygonImpl(vertices, angle, Pixel()); });
+	    }
+
+		// Draws text with its top-left corner at xy using the built-in font; size is the glyph height in pixels.
+		// '\n' starts a new line. Glyph edges are antialiased, and opacity scales the coverage.
+		void drawText(const Point& xy, const std::string& text, int size, const Pixel& color, TextLayout layout = TextLayout::Proportional, double opacity = 1.0) {
+	        PPMPP_PROFILE_SCOPE("drawText");
+	        drawTextImpl(std::get<0>(xy), std::get<1>(xy), text, *GlyphAtlas::get(size), color, layout, opacity);
+	    }
+
+		// Fills the region connected to seed whose colors are within tolerance of the seed color.
+		void floodFill(const Point& seed, const Pixel& color, double tolerance = 0.0, Connectivity connectivity = Connectivity::Four, ColorMatch match = ColorMatch::Rgb) {
+	        PPMPP_PROFILE_SCOPE("floodFill");
+	        fillSpansImpl(floodRegionImpl(std::get<0>(seed), std::get<1>(seed), tolerance, connectivity, match), color);
+	    }
+
+		void floodFill(const Point& seed, const Gradient& gradient, double tolerance = 0.0, Connectivity connectivity = Connectivity::Four, ColorMatch match = ColorMatch::Rgb) {
+	        PPMPP_PROFILE_SCOPE("floodFill");
+	        std::vector<Span> spans = floodRegionImpl(std::get<0>(seed), std::get<1>(seed), tolerance, connectivity, match);
+	        paintWithImpl(gradient, [&] { fillSpansImpl(spans, Pixel()); });
+	    }
+
+		// The region floodFill would fill, as one span per run of pixels, without changing the image.
+		std::vector<Span> floodRegion(const Point& seed, double tolerance = 0.0, Connectivity connectivity = Connectivity::Four, ColorMatch match = ColorMatch::Rgb) const {
+	        PPMPP_PROFILE_SCOPE("floodRegion");
+	        return floodRegionImpl(std::get<0>(seed), std::get<1>(seed), tolerance, connectivity, match);
+	    }
+
+		void fillSpans(const std::vector<Span>& spans, const Pixel& color) {
+	        PPMPP_PROFILE_SCOPE("fillSpans");
+	        fillSpansImpl(spans, color);
+	    }
+
+		void fillSpans(const std::vector<Span>& spans, const Gradient& gradient) {
+	        PPMPP_PROFILE_SCOPE("fillSpans");
+	        paintWithImpl(gradient, [&] { fillSpansImpl(spans, Pixel()); });
+	    }
+
+		// Draws srcRect of src with its top-left corner at dst, clipped against both images.
+		void drawImage(const Image& src, const Rect& srcRect, const Point& dst, BlendMode mode = BlendMode::Replace, double opacity = 1.0) {
+	        PPMPP_PROFILE_SCOPE("drawImage");
+	        ImageBlit blit{&src, srcRect, Rect(std::get<0>(dst), std::get<1>(dst), srcRect.w, srcRect.h), mode, ScaleFilter::Nearest, opacity};
+	        drawImagesImpl(&blit, 1);
+	    }
+
+		// Draws srcRect of src scaled into dstRect.
+		void drawImage(const Image& src, const Rect& srcRect, const Rect& dstRect, BlendMode mode = BlendMode::Replace, ScaleFilter filter = ScaleFilter::Bilinear, double opacity = 1.0) {
+	        PPMPP_PROFILE_SCOPE("drawImage");
+	        ImageBlit blit{&src, srcRect, dstRect, mode, filter, opacity};
+	        drawImagesImpl(&blit, 1);
+	    }
+
+		// Draws the blits in order, with the destination rows split across threads.
+		void drawImages(const std::vector<ImageBlit>& blits) {
+	        PPMPP_PROFILE_SCOPE("drawImages");
+	        drawImagesImpl(blits.data(), blits.size());
+	    }
+
+		Pixel getAverageRgbOfImage() {
+			PPMPP_PROFILE_SCOPE("getAverageRgbOfImage");
+			ImageStatistics stats = computeStatisticsImpl(0, 0, m_width, m_height, 0);
+			return createfPixelWithColor(stats.red.mean, stats.green.mean, stats.blue.mean);
+		}
+
+		// Histograms, min/max, mean and variance of all channels in one parallel pass. bins = 0 skips the histograms.
+		ImageStatistics computeStatistics(int bins = 256) const {
+			PPMPP_PROFILE_SCOPE("computeStatistics");
+			return computeStatisticsImpl(0, 0, m_width, m_height, bins);
+		}
+
+		// As above, for the rectangle at (x,y) clipped to the image.
+		ImageStatistics computeStatistics(int x, int y, int w, int h, int bins = 256) const {
+			PPMPP_PROFILE_SCOPE("computeStatistics");
+			return computeStatisticsImpl(x, y, x + w, y + h, bins);
+		}
+
+		// True if both images have the same size and no channel differs by more than tolerance.
+		// Stops at the first block that exceeds it.
+		bool approximatelyEquals(const Image& other, double tolerance) const {
+			PPMPP_PROFILE_SCOPE("approximatelyEquals");
+			return approximatelyEqualsImpl(other, tolerance);
+		}
+
+		// Max delta, differing pixel count, MSE and PSNR in one parallel pass. Throws std::invalid_argument on a size mismatch.
+		ImageDifference compare(const Image& other, double tolerance = 0.0) const {
+			PPMPP_PROFILE_SCOPE("compare");
+			return compareImpl(other, tolerance);
+		}
+
+		// Mean SSIM of the luminance over all window x window positions (box window).
+		double computeSsim(const Image& other, int window = 8) const {
+			PPMPP_PROFILE_SCOPE("computeSsim");
+			return computeSsimImpl(other, window);
+		}
+
+		// Heat map of the largest channel difference times gain: black, red, yellow, white.
+		Image diffImage(const Image& other, double gain = 1.0) const {
+			PPMPP_PROFILE_SCOPE("diffImage");
+			return diffImageImpl(other, gain);
+		}
+
+		// Median-cut palette of up to `colors` entries from a histogram of at most ~1M sampled pixels, in the
+		// 8-bit sRGB codes the image would be written with. An image with no more than `colors` distinct colors
+		// gets exactly those.
+		Palette buildPalette(int colors = 256) const {
+			PPMPP_PROFILE_SCOPE("buildPalette");
+			return buildPaletteImpl(colors);
+		}
+
+		// Maps every pixel to its nearest palette entry; Ordered dithering runs rows in parallel, FloydSteinberg
+		// diffuses the error serpentine on one thread.
+		IndexedImage quantize(const Palette& palette, Dither dither = Dither::None) const {
+			PPMPP_PROFILE_SCOPE("quantize");
+			return quantizeImpl(palette, dither);
+		}
+
+		IndexedImage quantize(int colors = 256, Dither dither = Dither::None) const {
+			PPMPP_PROFILE_SCOPE("quantize");
+			return quantizeImpl(buildPaletteImpl(colors), dither);
+		}
+
+		// The gradient methods read grayscale (convertToGrayscale weights) straight from the pixels, so there is no
+		// need to convert first. Borders repeat the edge pixels.
+		GradientField computeGradient(GradientOperator op = GradientOperator::Sobel) const {
+			PPMPP_PROFILE_SCOPE("computeGradient");
+			return computeGradientImpl(op);
+		}
 
-		Pixel getAverageRgbOfImage() {
-			double rSum = 0.0;
-			double gSum = 0.0;
-			double bSum = 0.0;
-			double totalPixels = m_img.size();
-			for (const auto& px : m_img) {
-				rSum += std::get<0>(px);
-				gSum += std::get<1>(px);
-				bSum += std::get<2>(px);
-			} 
-			return createfPixelWithColor(rSum / totalPixels, gSum / totalPixels, bSum / totalPixels);
+		// Gradient magnitude as a compact grayscale image, 1.0 (or more) mapped to maxval.
+		GrayImage gradientMagnitude(GradientOperator op = GradientOperator::Sobel, int maxval = 255) const {
+			PPMPP_PROFILE_SCOPE("gradientMagnitude");
+			return gradientMagnitudeImpl(op, maxval);
+		}
+
+		// Canny edges: gradient, non-maximum suppression across the edge, and hysteresis that keeps weak pixels
+		// (magnitude >= lowThreshold) only when they connect to strong ones (>= highThreshold). Edges are 255, the
+		// rest 0. There is no built-in smoothing; blur noisy images first.
+		GrayImage detectEdges(double lowThreshold, double highThreshold, GradientOperator op = GradientOperator::Sobel) const {
+			PPMPP_PROFILE_SCOPE("detectEdges");
+			return detectEdgesImpl(lowThreshold, highThreshold, op);
 		}
 
-		void convertToGrayscale() {
-	        convertToGrayscaleImpl();
+		// Region::Dirty limits the work to the dirty tiles plus the halo the filter reads, when tracking is enabled.
+		void convertToGrayscale(Region region = Region::All) {
+	        PPMPP_PROFILE_SCOPE("convertToGrayscale");
+	        for (const auto& r : regionRectsImpl(region, 0)) {
+	            convertToGrayscaleImpl(r[0], r[1], r[2], r[3]);
+	        }
 	    }
 
-		void applyGaussianBlur() {
-	        applyGaussianBlurImpl();
+		void applyGaussianBlur(Region region = Region::All) {
+	        PPMPP_PROFILE_SCOPE("applyGaussianBlur");
+	        for (const auto& r : regionRectsImpl(region, 1)) {
+	            applyGaussianBlurImpl(r[0], r[1], r[2], r[3]);
+	        }
 	    }
 
 	    void applyAntiAliasing() {
+            PPMPP_PROFILE_SCOPE("applyAntiAliasing");
             applyAntiAliasingImpl();
         }
 
         void downscale(int width, int height) {
+        	PPMPP_PROFILE_SCOPE("downscale");
         	downscaleImpl(width,height);
         }
 
         void upscale(int scale) {
+        	PPMPP_PROFILE_SCOPE("upscale");
         	upscaleImpl(scale);
         }
 
-        void applyBloom(double threshold, double sigma) {
-        	applyBloomImpl(threshold, sigma);
+        // Mip chain of this image, see ImagePyramid. Each level is reduced from the one above, not from the base.
+        ImagePyramid buildPyramid(int levels = 0, PyramidFilter filter = PyramidFilter::Triangle) const {
+        	PPMPP_PROFILE_SCOPE("buildPyramid");
+        	return ImagePyramid(m_img.data(), m_width, m_height, levels, filter, m_colorSpace);
+        }
+
+        // Warps the image by m (source to destination coordinates) onto a canvas of the same size.
+        // Destination pixels that map outside the source get background.
+        void transform(const Affine2D& m, ScaleFilter filter = ScaleFilter::Bilinear, const Pixel& background = Pixel(0, 0, 0)) {
+        	PPMPP_PROFILE_SCOPE("transform");
+        	transformImpl(m, m_width, m_height, filter, background);
+        }
+
+        // As above, onto a width x height canvas.
+        void transform(const Affine2D& m, int width, int height, ScaleFilter filter = ScaleFilter::Bilinear, const Pixel& background = Pixel(0, 0, 0)) {
+        	PPMPP_PROFILE_SCOPE("transform");
+        	transformImpl(m, width, height, filter, background);
+        }
+
+        // Rotates about the center (clockwise for positive degrees) and grows the canvas to fit.
+        // Multiples of 90 degrees are exact pixel moves.
+        void rotate(double degrees, ScaleFilter filter = ScaleFilter::Bilinear, const Pixel& background = Pixel(0, 0, 0)) {
+        	PPMPP_PROFILE_SCOPE("rotate");
+        	rotateImpl(degrees, filter, background);
+        }
+
+        void applyBloom(double threshold, double sigma, Region region = Region::All) {
+        	PPMPP_PROFILE_SCOPE("applyBloom");
+        	for (const auto& r : regionRectsImpl(region, bloomRadiusImpl(sigma))) {
+        	    applyBloomImpl(threshold, sigma, r[0], r[1], r[2], r[3]);
+        	}
         }
 
         void applyLens(int numb) {
-        	applyLensImpl(numb);
+        	PPMPP_PROFILE_SCOPE("applyLens");
+        	applyLensImpl(numb, std::random_device{}());
+        }
+
+        // Same seed, same image size: same lens centers.
+        void applyLens(int numb, uint32_t seed) {
+        	PPMPP_PROFILE_SCOPE("applyLens");
+        	applyLensImpl(numb, seed);
+        }
+
+        void applyLens(const std::vector<Point>& centers) {
+        	PPMPP_PROFILE_SCOPE("applyLens");
+        	applyLensImpl(centers);
+        }
+
+        // Rank-1 kernels run as a horizontal and a vertical pass; others as one 2D pass. Rows are split across the pool.
+        void convolve(const Kernel& kernel, BorderMode border = BorderMode::Clamp, const Pixel& constant = Pixel(0, 0, 0)) {
+        	PPMPP_PROFILE_SCOPE("convolve");
+        	convolveImpl(kernel, border, constant);
+        }
+
+        // See MorphologyOp. The structuring element is a width x height rectangle centered on the pixel; the cost per
+        // pixel does not depend on its size.
+        void applyMorphology(MorphologyOp op, int width, int height, MorphologyMode mode = MorphologyMode::PerChannel) {
+        	PPMPP_PROFILE_SCOPE("applyMorphology");
+        	applyMorphologyImpl(op, width, height, mode);
+        }
+
+        void erode(int width, int height, MorphologyMode mode = MorphologyMode::PerChannel) {
+        	PPMPP_PROFILE_SCOPE("erode");
+        	applyMorphologyImpl(MorphologyOp::Erode, width, height, mode);
+        }
+
+        void dilate(int width, int height, MorphologyMode mode = MorphologyMode::PerChannel) {
+        	PPMPP_PROFILE_SCOPE("dilate");
+        	applyMorphologyImpl(MorphologyOp::Dilate, width, height, mode);
+        }
+
+        void open(int width, int height, MorphologyMode mode = MorphologyMode::PerChannel) {
+        	PPMPP_PROFILE_SCOPE("open");
+        	applyMorphologyImpl(MorphologyOp::Open, width, height, mode);
+        }
+
+        void close(int width, int height, MorphologyMode mode = MorphologyMode::PerChannel) {
+        	PPMPP_PROFILE_SCOPE("close");
+        	applyMorphologyImpl(MorphologyOp::Close, width, height, mode);
+        }
+
+        void topHat(int width, int height, MorphologyMode mode = MorphologyMode::PerChannel) {
+        	PPMPP_PROFILE_SCOPE("topHat");
+        	applyMorphologyImpl(MorphologyOp::TopHat, width, height, mode);
+        }
+
+        // Per-channel median over a (2r+1)^2 window; radius is at most 127. The result is always one of the window's
+        // samples. Up to 65536 distinct values per channel the cost per pixel does not depend on the radius.
+        void applyMedianFilter(int radius) {
+        	PPMPP_PROFILE_SCOPE("applyMedianFilter");
+        	applyMedianFilterImpl(radius);
+        }
+
+        // Edge-preserving smoothing: neighbors are weighted by distance (spatialSigma, in pixels) and by luminance
+        // difference (rangeSigma). From spatialSigma 3 on it runs on a bilateral grid, so large radii cost the same.
+        void applyBilateralFilter(double spatialSigma, double rangeSigma) {
+        	PPMPP_PROFILE_SCOPE("applyBilateralFilter");
+        	applyBilateralFilterImpl(spatialSigma, rangeSigma);
+        }
+
+        // Places the map's origin at (x,y). Every pixel is sampled from the image as it was before the call.
+        void applyDisplacement(const DisplacementMap& map, int x, int y) {
+        	PPMPP_PROFILE_SCOPE("applyDisplacement");
+        	applyDisplacementImpl({{&map, x, y}});
         }
 
+		// Runs all steps of the pipeline in one multi-threaded pass.
+		void applyColorPipeline(const ColorPipeline& pipeline, Region region = Region::All) {
+			PPMPP_PROFILE_SCOPE("applyColorPipeline");
+			applyColorPipelineImpl(pipeline, region);
+		}
+
+		void shiftHue(double degrees, Region region = Region::All) {
+			PPMPP_PROFILE_SCOPE("shiftHue");
+			applyColorPipelineImpl(ColorPipeline().shiftHue(degrees), region);
+		}
+
+		void scaleSaturation(double factor, Region region = Region::All) {
+			PPMPP_PROFILE_SCOPE("scaleSaturation");
+			applyColorPipelineImpl(ColorPipeline().scaleSaturation(factor), region);
+		}
+
+		void scaleValue(double factor, Region region = Region::All) {
+			PPMPP_PROFILE_SCOPE("scaleValue");
+			applyColorPipelineImpl(ColorPipeline().scaleValue(factor), region);
+		}
+
+		void colorize(double hueDegrees, double saturation, Region region = Region::All) {
+			PPMPP_PROFILE_SCOPE("colorize");
+			applyColorPipelineImpl(ColorPipeline().colorize(hueDegrees, saturation), region);
+		}
+
+		void thresholdHsv(double hueLo, double hueHi, double satLo, double satHi, double valLo, double valHi, Region region = Region::All) {
+			PPMPP_PROFILE_SCOPE("thresholdHsv");
+			applyColorPipelineImpl(ColorPipeline().thresholdHsv(hueLo, hueHi, satLo, satHi, valLo, valHi), region);
+		}
+
+		// Fills the whole image, rows in parallel.
+		void fillGradient(const Gradient& gradient) {
+			PPMPP_PROFILE_SCOPE("fillGradient");
+			fillGradientImpl(gradient);
+		}
+
 		void drawGradients(const std::vector<Pixel>& colors, double angle_degree) {
+			PPMPP_PROFILE_SCOPE("drawGradients");
 			drawGradientsImpl(colors, angle_degree);
 		}
 		
 		void read(const std::string& filename) {
-			readImpl(filename);
+			PPMPP_PROFILE_SCOPE("read");
+			readImpl(filename, nullptr);
+		}
+
+		void read(const std::string& filename, GrayImage& alpha) {
+			PPMPP_PROFILE_SCOPE("read");
+			readImpl(filename, &alpha);
 		}
 
 		void write(const std::string& filename) {
+			PPMPP_PROFILE_SCOPE("write");
 			writeImpl(filename);
 		}
+
+		void write(const std::string& filename, FileFormat format, int maxval = 255) {
+			PPMPP_PROFILE_SCOPE("write");
+			writeFormatImpl(filename, format, maxval, nullptr);
+		}
+
+		void write(const std::string& filename, const GrayImage& alpha) {
+			PPMPP_PROFILE_SCOPE("write");
+			FileFormat format = detail::formatFromSuffix(getSuffix(filename), FileFormat::P7);
+			if (format != FileFormat::QOI && format != FileFormat::PNG) format = FileFormat::P7;
+			writeFormatImpl(filename, format, alpha.getMaxval(), &alpha);
+		}
+
+		// level 0 (stored, fastest) to 9 (smallest); 1 is fast enough for real-time frame dumps.
+		void writePng(const std::string& filename, int level = 6) {
+			PPMPP_PROFILE_SCOPE("writePng");
+			writePngImpl(filename, level, nullptr);
+		}
+
+		// Quantizes on the calling thread, then QOI-encodes and writes on a background thread.
+		std::future<void> writeQoiAsync(const std::string& filename) {
+			PPMPP_PROFILE_SCOPE("writeQoiAsync");
+			std::vector<uint8_t> pixels;
+			quantizeRgb8Impl(pixels, nullptr);
+			return std::async(std::launch::async, [filename, pixels = std::move(pixels), width = m_width, height = m_height]() {
+				writeQoiImpl(filename, pixels, width, height, 3);
+			});
+		}
 	private:
 		int getIndex(int x, int y) {
 	        return y * m_width + x;
@@ -312,6 +4657,14 @@ namespace ppm
 	        int x2 = std::get<2>(Coords);
 	        int y2 = std::get<3>(Coords);
 	        
+	        if (m_paint && y1 == y2) {
+	            int xs = std::min(x1, x2), xe = std::max(x1, x2) + 1;
+	            m_paint->fillSpan(xs, xe, y1, &m_img[getIndex(xs, y1)]);
+	            markDirtyImpl(xs, y1, xe, y1 + 1);
+	            PPMPP_PROFILE_PIXELS(xe - xs);
+	            return;
+	        }
+
 	        int dx = x2 - x1;
 	        int dy = y2 - y1;
 	        int dx1 = std::abs(dx);
@@ -517,6 +4870,8 @@ namespace ppm
 		    for (const auto& pt : xy) {
 		        auto [x, y] = pt;
 		        m_img[getIndex(x, y)] = color;
+		        markDirtyPixelImpl(x, y);
+		        PPMPP_PROFILE_PIXELS(1);
 		    }
 		}
 		
@@ -841,6 +5196,8 @@ namespace ppm
 
 		        if (image_x >= 0 && image_x < m_width && image_y >= 0 && image_y < m_height) {
 		            m_img[getIndex(image_x, image_y)] = px;
+		            markDirtyPixelImpl(image_x, image_y);
+		            PPMPP_PROFILE_PIXELS(1);
 		        }
 		    }
 		}
@@ -873,7 +5230,9 @@ namespace ppm
 		            if (4.0 * rotated_x * rotated_x / (w * w) + 4.0 * rotated_y * rotated_y / (h * h) <= 1.0) {
 		                Point pt = std::make_tuple(scan_x, scan_y);
 		                if (isinbounds(pt)) {
-		                    m_img[getIndex(scan_x, scan_y)] = px;
+		                    m_img[getIndex(scan_x, scan_y)] = m_paint ? m_paint->sample(scan_x, scan_y) : px;
+		                    markDirtyPixelImpl(scan_x, scan_y);
+		                    PPMPP_PROFILE_PIXELS(1);
 		                }
 		            }
 		        }
@@ -976,25 +5335,34 @@ namespace ppm
 		    return r == g && g == b;
 		}
 
-	    void convertToGrayscaleImpl() {
-	        for (auto& pixel : m_img) {
-	            auto& [r, g, b] = pixel;
-	            if (!isGrayscaleRGBImpl(r,g,b)) {
-	            	double gray = 0.299 * r + 0.587 * g + 0.114 * b;
-	            	pixel = {gray, gray, gray};
-	        	}
+	    void convertToGrayscaleImpl(int x0, int y0, int x1, int y1) {
+	        for (int y = y0; y < y1; ++y) {
+	            for (int x = x0; x < x1; ++x) {
+	                auto& [r, g, b] = m_img[getIndex(x, y)];
+	                if (!isGrayscaleRGBImpl(r,g,b)) {
+	                	double gray = 0.299 * r + 0.587 * g + 0.114 * b;
+	                	r = g = b = gray;
+	            	}
+	            }
 	        }
+	        markDirtyImpl(x0, y0, x1, y1);
+	        PPMPP_PROFILE_PIXELS(static_cast<size_t>(x1 - x0) * (y1 - y0));
 		}
 
 	    void applyGaussianBlurImpl() {
+	        applyGaussianBlurImpl(0, 0, m_width, m_height);
+	    }
+
+	    // The border row and column of the image are left as they are.
+	    void applyGaussianBlurImpl(int x0, int y0, int x1, int y1) {
 	        std::array<std::array<double, 3>, 3> kernel = {{
 	            {1.0 / 16, 2.0 / 16, 1.0 / 16},
 	            {2.0 / 16, 4.0 / 16, 2.0 / 16},
 	            {1.0 / 16, 2.0 / 16, 1.0 / 16}
 	        }};
 	        
-	        for (int y = 1; y < m_height - 1; ++y) {
-	            for (int x = 1; x < m_width - 1; ++x) {
+	        for (int y = std::max(y0, 1); y < std::min(y1, m_height - 1); ++y) {
+	            for (int x = std::max(x0, 1); x < std::min(x1, m_width - 1); ++x) {
 	                double sumR = 0.0, sumG = 0.0, sumB = 0.0;
 
 	                for (int k = -1; k <= 1; ++k) {
@@ -1008,8 +5376,10 @@ namespace ppm
 	                }
 
 	                m_img[getIndex(x, y)] = {sumR, sumG, sumB};
+	                PPMPP_PROFILE_PIXELS(1);
 	            }
 	        }
+	        markDirtyImpl(x0, y0, x1, y1);
 	    }
 
 	    double cubicWeightImpl(double distance) {
@@ -1054,11 +5424,186 @@ namespace ppm
 	        return result;
 	    }
 
+	    void applyMorphologyImpl(MorphologyOp op, int width, int height, MorphologyMode mode) {
+	        std::vector<Pixel>& result = m_backBuffer;
+	        if (result.size() != m_img.size()) result.resize(m_img.size());
+	        detail::morphologyPixels(m_img.data(), result.data(), m_width, m_height, op, width, height, mode);
+	        m_img.swap(result);
+	        markDirtyImpl(0, 0, m_width, m_height);
+	        PPMPP_PROFILE_PIXELS(m_img.size());
+	    }
+
+	    void applyMedianFilterImpl(int radius) {
+	        detail::medianFilterPixels(m_img.data(), m_width, m_height, radius);
+	        markDirtyImpl(0, 0, m_width, m_height);
+	        PPMPP_PROFILE_PIXELS(m_img.size());
+	    }
+
+	    void applyBilateralFilterImpl(double spatialSigma, double rangeSigma) {
+	        std::vector<float> guide(m_img.size());
+	        PPMPP_PROFILE_SCRATCH(guide.size() * sizeof(float));
+	        ThreadPool::instance().parallelFor(0, m_height, 64, [&](int lo, int hi) {
+	            for (size_t i = static_cast<size_t>(lo) * m_width; i < static_cast<size_t>(hi) * m_width; ++i) {
+	                const auto& [r, g, b] = m_img[i];
+	                guide[i] = static_cast<float>(0.2126 * r + 0.7152 * g + 0.0722 * b);
+	            }
+	        });
+	        std::vector<Pixel>& result = m_backBuffer;
+	        if (result.size() != m_img.size()) result.resize(m_img.size());
+	        detail::bilateralFilter<3>(m_width, m_height, guide.data(), spatialSigma, rangeSigma,
+	            [this](size_t i, double* v) { std::tie(v[0], v[1], v[2]) = m_img[i]; },
+	            [&result](size_t i, const double* v) { result[i] = Pixel(v[0], v[1], v[2]); });
+	        m_img.swap(result);
+	        markDirtyImpl(0, 0, m_width, m_height);
+	        PPMPP_PROFILE_PIXELS(m_img.size());
+	    }
+
+	    void rotateImpl(double degrees, ScaleFilter filter, const Pixel& background) {
+	        const double turns = degrees / 90.0;
+	        if (std::abs(turns - std::round(turns)) < 1e-9) {
+	            rotateQuarterTurnsImpl(((static_cast<int>(std::round(turns)) % 4) + 4) % 4);
+	            return;
+	        }
+	        const double rad = degrees * M_PI / 180.0;
+	        const double c = std::abs(std::cos(rad)), s = std::abs(std::sin(rad));
+	        const int width = static_cast<int>(std::ceil(m_width * c + m_height * s - 1e-6));
+	        const int height = static_cast<int>(std::ceil(m_width * s + m_height * c - 1e-6));
+	        const Affine2D m = Affine2D::translate(width / 2.0, height / 2.0) * Affine2D::rotate(degrees) * Affine2D::translate(-m_width / 2.0, -m_height / 2.0);
+	        transformImpl(m, width, height, filter, background);
+	    }
+
+	    // Clockwise quarter turns as blocked transposes: each 32x32 destination tile reads a 32x32 source tile.
+	    void rotateQuarterTurnsImpl(int quarters) {
+	        if (quarters == 0) return;
+	        const int srcWidth = m_width, srcHeight = m_height;
+	        const int width = quarters == 2 ? srcWidth : srcHeight, height = quarters == 2 ? srcHeight : srcWidth;
+	        std::vector<Pixel>& result = m_backBuffer;
+	        if (result.size() != m_img.size()) result.resize(m_img.size());
+	        const int tile = 32;
+	        ThreadPool::instance().parallelFor(0, (height + tile - 1) / tile, 1, [&](int lo, int hi) {
+	            for (int ty = lo * tile; ty < std::min(height, hi * tile); ty += tile) {
+	                for (int tx = 0; tx < width; tx += tile) {
+	                    for (int y = ty; y < std::min(height, ty + tile); ++y) {
+	                        Pixel* dst = &result[static_cast<size_t>(y) * width];
+	                        for (int x = tx; x < std::min(width, tx + tile); ++x) {
+	                            int sx, sy;
+	                            if (quarters == 1) { sx = y; sy = srcHeight - 1 - x; }
+	                            else if (quarters == 2) { sx = srcWidth - 1 - x; sy = srcHeight - 1 - y; }
+	                            else { sx = srcWidth - 1 - y; sy = x; }
+	                            dst[x] = m_img[static_cast<size_t>(sy) * srcWidth + sx];
+	                        }
+	                    }
+	                }
+	            }
+	        });
+	        m_img.swap(result);
+	        m_width = width;
+	        m_height = height;
+	        resetDirtyImpl();
+	        PPMPP_PROFILE_PIXELS(m_img.size());
+	    }
+
+	    // Inverse mapping: every destination pixel center is taken back to the source. Along a row the source position
+	    // advances by a constant step, kept in 16.16 fixed point and re-anchored at the start of each 64x64 tile so the
+	    // rounding error stays below 1/1000 pixel. Tiles keep the rotated source footprint in cache.
+	    void transformImpl(const Affine2D& m, int width, int height, ScaleFilter filter, const Pixel& background) {
+	        if (width <= 0 || height <= 0) throw std::invalid_argument("transform: empty output size");
+	        const Affine2D inverse = m.inverse();
+	        double ox, oy, ex, ey, fx, fy;
+	        inverse.apply(0, 0, ox, oy);
+	        inverse.apply(1, 0, ex, ey);
+	        inverse.apply(0, 1, fx, fy);
+	        const double stepXx = ex - ox, stepXy = ey - oy, stepYx = fx - ox, stepYy = fy - oy;
+
+	        constexpr int shift = 16;
+	        constexpr int64_t one = int64_t(1) << shift;
+	        constexpr double toReal = 1.0 / one;
+	        const int64_t limitX = static_cast<int64_t>(m_width - 1) * one + one / 2, limitY = static_cast<int64_t>(m_height - 1) * one + one / 2;
+	        const int64_t stepX = std::llround(stepXx * one), stepY = std::llround(stepXy * one);
+	        const int lastX = m_width - 1, lastY = m_height - 1;
+	        // Catmull-Rom weights for 4096 sub-pixel phases.
+	        std::vector<std::array<double, 4>> cubic;
+	        if (filter == ScaleFilter::Bicubic) {
+	            cubic.resize(4096);
+	            for (int i = 0; i < 4096; ++i) {
+	                for (int k = 0; k < 4; ++k) cubic[i][k] = cubicWeightImpl(i / 4096.0 - (k - 1));
+	            }
+	        }
+
+	        std::vector<Pixel>& result = m_backBuffer;
+	        if (result.size() != static_cast<size_t>(width) * height) result.resize(static_cast<size_t>(width) * height);
+	        const int tile = 64;
+	        ThreadPool::instance().parallelFor(0, (height + tile - 1) / tile, 1, [&](int lo, int hi) {
+	            for (int ty = lo * tile; ty < std::min(height, hi * tile); ty += tile) {
+	                for (int tx = 0; tx < width; tx += tile) {
+	                    const int x1 = std::min(width, tx + tile);
+	                    for (int y = ty; y < std::min(height, ty + tile); ++y) {
+	                        // Sample grid coordinates: pixel (i, j) of the source is centered on (i, j).
+	                        int64_t px = std::llround((ox + (tx + 0.5) * stepXx + (y + 0.5) * stepYx - 0.5) * one);
+	                        int64_t py = std::llround((oy + (tx + 0.5) * stepXy + (y + 0.5) * stepYy - 0.5) * one);
+	                        Pixel* dst = &result[static_cast<size_t>(y) * width];
+	                        for (int x = tx; x < x1; ++x, px += stepX, py += stepY) {
+	                            if (px < -one / 2 || py < -one / 2 || px > limitX || py > limitY) {
+	                                dst[x] = background;
+	                                continue;
+	                            }
+	                            const int ix = static_cast<int>(px >> shift), iy = static_cast<int>(py >> shift);
+	                            if (filter == ScaleFilter::Nearest) {
+	                                const int nx = std::min(static_cast<int>((px + one / 2) >> shift), lastX);
+	                                const int ny = std::min(static_cast<int>((py + one / 2) >> shift), lastY);
+	                                dst[x] = m_img[static_cast<size_t>(ny) * m_width + nx];
+	                            } else if (filter == ScaleFilter::Bilinear) {
+	                                const double wx = (px & (one - 1)) * toReal, wy = (py & (one - 1)) * toReal;
+	                                const int x0 = std::clamp(ix, 0, lastX), x1s = std::clamp(ix + 1, 0, lastX);
+	                                const Pixel* row0 = &m_img[static_cast<size_t>(std::clamp(iy, 0, lastY)) * m_width];
+	                                const Pixel* row1 = &m_img[static_cast<size_t>(std::clamp(iy + 1, 0, lastY)) * m_width];
+	                                const auto& [a0, a1, a2] = row0[x0];
+	                                const auto& [b0, b1, b2] = row0[x1s];
+	                                const auto& [c0, c1, c2] = row1[x0];
+	                                const auto& [d0, d1, d2] = row1[x1s];
+	                                const double t0 = a0 + (b0 - a0) * wx, t1 = a1 + (b1 - a1) * wx, t2 = a2 + (b2 - a2) * wx;
+	                                const double u0 = c0 + (d0 - c0) * wx, u1 = c1 + (d1 - c1) * wx, u2 = c2 + (d2 - c2) * wx;
+	                                dst[x] = Pixel(t0 + (u0 - t0) * wy, t1 + (u1 - t1) * wy, t2 + (u2 - t2) * wy);
+	                            } else {
+	                                const auto& wx = cubic[(px & (one - 1)) >> (shift - 12)];
+	                                const auto& wy = cubic[(py & (one - 1)) >> (shift - 12)];
+	                                double r = 0, g = 0, b = 0;
+	                                for (int k = 0; k < 4; ++k) {
+	                                    const Pixel* row = &m_img[static_cast<size_t>(std::clamp(iy + k - 1, 0, lastY)) * m_width];
+	                                    double rr = 0, rg = 0, rb = 0;
+	                                    for (int n = 0; n < 4; ++n) {
+	                                        const auto& [sr, sg, sb] = row[std::clamp(ix + n - 1, 0, lastX)];
+	                                        rr += wx[n] * sr;
+	                                        rg += wx[n] * sg;
+	                                        rb += wx[n] * sb;
+	                                    }
+	                                    r += wy[k] * rr;
+	                                    g += wy[k] * rg;
+	                                    b += wy[k] * rb;
+	                                }
+	                                dst[x] = Pixel(std::clamp(r, 0.0, 1.0), std::clamp(g, 0.0, 1.0), std::clamp(b, 0.0, 1.0));
+	                            }
+	                        }
+	                    }
+	                }
+	            }
+	        });
+
+	        const bool resized = width != m_width || height != m_height;
+	        m_img.swap(result);
+	        m_width = width;
+	        m_height = height;
+	        if (resized) resetDirtyImpl();
+	        else markDirtyImpl(0, 0, m_width, m_height);
+	        PPMPP_PROFILE_PIXELS(m_img.size());
+	    }
+
 	    void upscaleImpl(int scale) {
 	        // Calculate new dimensions
 		    int newWidth = m_width * scale;
 		    int newHeight = m_height * scale;
 		    std::vector<Pixel> newImg(newWidth * newHeight, Pixel(0,0,0)); // Initialize upscaled image with black pixels
+		    PPMPP_PROFILE_SCRATCH(newImg.size() * sizeof(Pixel));
 
 		    // Iterate over new image pixels and assign bicubic interpolated values from old image
 		    for (int y = 0; y < newHeight; ++y) {
@@ -1074,8 +5619,10 @@ namespace ppm
 
 		    // Replace current image with the upscaled image
 		    m_img = std::move(newImg);
+		    PPMPP_PROFILE_PIXELS(m_img.size());
 		    m_width = newWidth;
 		    m_height = newHeight;
+		    resetDirtyImpl();
 	    }
 
 	    void downscaleImpl(int width, int height) {
@@ -1084,6 +5631,7 @@ namespace ppm
 
 	        // New image data
 	        std::vector<Pixel> newImg(width * height);
+	        PPMPP_PROFILE_SCRATCH(newImg.size() * sizeof(Pixel));
 
 	        // Averaging blocks of pixels
 	        for (int y = 0; y < height; ++y) {
@@ -1112,8 +5660,10 @@ namespace ppm
 
 	        // Set the downscaled image as the current image
 	        m_img.swap(newImg);
+	        PPMPP_PROFILE_PIXELS(m_img.size());
 	        m_width = width;
 	        m_height = height;
+	        resetDirtyImpl();
 	    }
 
 	    void applyAntiAliasingImpl() {
@@ -1125,228 +5675,1368 @@ namespace ppm
             downscaleImpl(width,height);
         }
 
-        void applyBloomImpl(double threshold, double sigma) {
-            // Lambda function for Gaussian blur
-            auto gaussianBlur = [&](std::vector<Pixel>& img) {
-                int kernelSize = static_cast<int>(std::round(sigma * 6)) + 1;
-                std::vector<double> kernel(kernelSize);
-                double sigma2 = 2 * sigma * sigma;
-                double sum = 0.0;
-
-                // Generate Gaussian kernel
-                for (int i = 0; i < kernelSize; ++i) {
-                    int x = i - kernelSize / 2;
-                    kernel[i] = std::exp(-(x * x) / sigma2);
-                    sum += kernel[i];
+        // Reach of the bloom blur on each side; also the halo a dirty region is grown by before blooming it.
+        int bloomRadiusImpl(double sigma) const {
+            return (static_cast<int>(std::round(sigma * 6)) + 1) / 2;
+        }
+
+        // Bloom over [x0,x1)x[y0,y1); reads up to the kernel radius around it, clamped to the image like the full pass.
+        void applyBloomImpl(double threshold, double sigma, int x0, int y0, int x1, int y1) {
+            int kernelSize = static_cast<int>(std::round(sigma * 6)) + 1;
+            int radius = bloomRadiusImpl(sigma);
+            std::vector<double> kernel(kernelSize);
+            double sigma2 = 2 * sigma * sigma;
+            double sum = 0.0;
+
+            // Generate Gaussian kernel
+            for (int i = 0; i < kernelSize; ++i) {
+                int x = i - radius;
+                kernel[i] = std::exp(-(x * x) / sigma2);
+                sum += kernel[i];
+            }
+
+            // Normalize the kernel
+            for (double &value : kernel) {
+                value /= sum;
+            }
+
+            int ax0 = std::max(x0 - radius, 0), ax1 = std::min(x1 + radius, m_width);
+            int ay0 = std::max(y0 - radius, 0), ay1 = std::min(y1 + radius, m_height);
+            int areaWidth = ax1 - ax0, rectWidth = x1 - x0;
+
+            std::vector<Pixel> brightPass(static_cast<size_t>(areaWidth) * (ay1 - ay0));
+            PPMPP_PROFILE_SCRATCH(brightPass.size() * sizeof(Pixel));
+            for (int y = ay0; y < ay1; ++y) {
+                for (int x = ax0; x < ax1; ++x) {
+                    Pixel pixel = m_img[getIndex(x, y)];
+                    double brightness = 0.2126 * std::get<0>(pixel) + 0.7152 * std::get<1>(pixel) + 0.0722 * std::get<2>(pixel);
+                    brightPass[(x - ax0) + (y - ay0) * areaWidth] = brightness <= threshold ? Pixel(0, 0, 0) : pixel;
                 }
+            }
 
-                // Normalize the kernel
-                for (double &value : kernel) {
-                    value /= sum;
+            // Apply Gaussian blur horizontally, only for the columns the vertical pass reads
+            std::vector<Pixel> blurred(static_cast<size_t>(rectWidth) * (ay1 - ay0));
+            PPMPP_PROFILE_SCRATCH(blurred.size() * sizeof(Pixel));
+            for (int y = ay0; y < ay1; ++y) {
+                for (int x = x0; x < x1; ++x) {
+                    double red = 0.0, green = 0.0, blue = 0.0;
+                    for (int k = 0; k < kernelSize; ++k) {
+                        int pixelPosX = std::clamp(x + k - radius, ax0, ax1 - 1);
+
+                        const Pixel &p = brightPass[(pixelPosX - ax0) + (y - ay0) * areaWidth];
+                        red += std::get<0>(p) * kernel[k];
+                        green += std::get<1>(p) * kernel[k];
+                        blue += std::get<2>(p) * kernel[k];
+                    }
+                    blurred[(x - x0) + (y - ay0) * rectWidth] = Pixel(red, green, blue);
                 }
+            }
 
-                // Apply Gaussian blur horizontally
-                std::vector<Pixel> blurred(m_img.size());
-                for (int y = 0; y < m_height; ++y) {
-                    for (int x = 0; x < m_width; ++x) {
-                        double red = 0.0, green = 0.0, blue = 0.0;
-                        for (int k = 0; k < kernelSize; ++k) {
-                            int pixelPosX = x + k - kernelSize / 2;
-                            if (pixelPosX < 0) pixelPosX = 0;
-                            if (pixelPosX >= m_width) pixelPosX = m_width - 1;
-
-                            Pixel &p = img[pixelPosX + y * m_width];
-                            red += std::get<0>(p) * kernel[k];
-                            green += std::get<1>(p) * kernel[k];
-                            blue += std::get<2>(p) * kernel[k];
-                        }
-                        blurred[x + y * m_width] = Pixel(red, green, blue);
+            // Apply Gaussian blur vertically and add the glow
+            for (int y = y0; y < y1; ++y) {
+                for (int x = x0; x < x1; ++x) {
+                    double red = 0.0, green = 0.0, blue = 0.0;
+                    for (int k = 0; k < kernelSize; ++k) {
+                        int pixelPosY = std::clamp(y + k - radius, ay0, ay1 - 1);
+
+                        const Pixel &p = blurred[(x - x0) + (pixelPosY - ay0) * rectWidth];
+                        red += std::get<0>(p) * kernel[k];
+                        green += std::get<1>(p) * kernel[k];
+                        blue += std::get<2>(p) * kernel[k];
                     }
+
+                    auto& [r, g, b] = m_img[getIndex(x, y)];
+                    r = std::min(r + red, 1.0);
+                    g = std::min(g + green, 1.0);
+                    b = std::min(b + blue, 1.0);
                 }
+            }
+            markDirtyImpl(x0, y0, x1, y1);
+            PPMPP_PROFILE_PIXELS(static_cast<size_t>(rectWidth) * (y1 - y0));
+        }
 
-                // Apply Gaussian blur vertically
-                for (int y = 0; y < m_height; ++y) {
-                    for (int x = 0; x < m_width; ++x) {
-                        double red = 0.0, green = 0.0, blue = 0.0;
-                        for (int k = 0; k < kernelSize; ++k) {
-                            int pixelPosY = y + k - kernelSize / 2;
-                            if (pixelPosY < 0) pixelPosY = 0;
-                            if (pixelPosY >= m_height) pixelPosY = m_height - 1;
-
-                            Pixel &p = blurred[x + pixelPosY * m_width];
-                            red += std::get<0>(p) * kernel[k];
-                            green += std::get<1>(p) * kernel[k];
-                            blue += std::get<2>(p) * kernel[k];
-                        }
-                        img[x + y * m_width] = Pixel(red, green, blue);
+        void applyLensImpl(int numb, uint32_t seed) {
+            std::mt19937 gen(seed);
+
+            std::uniform_int_distribution<> disWidth(0, m_width - 1);
+            std::uniform_int_distribution<> disHeight(0, m_height - 1);
+
+            std::vector<Point> centers;
+            for (int i = 0; i < numb; ++i) {
+                int centerX = disWidth(gen);
+                int centerY = disHeight(gen);
+                centers.emplace_back(centerX, centerY);
+            }
+            applyLensImpl(centers);
+        }
+
+        void applyLensImpl(const std::vector<Point>& centers) {
+            int lensRadius = m_width / 10; // Example radius for each lens
+            double refractionIndex = 1.5; // Index of refraction for the lens material
+
+            std::shared_ptr<const DisplacementMap> lens = DisplacementMap::lens(lensRadius, refractionIndex);
+            std::vector<Placement> placements;
+            for (const auto& [x, y] : centers) placements.push_back({lens.get(), x, y});
+            applyDisplacementImpl(placements);
+        }
+
+        // Output goes to the back buffer kept from the previous call, so repeated filtering doesn't reallocate.
+        void convolveImpl(const Kernel& kernel, BorderMode border, const Pixel& constant) {
+            if (m_img.empty()) return;
+            std::vector<Pixel>& result = m_backBuffer;
+            if (result.size() != m_img.size()) {
+                result.resize(m_img.size());
+                PPMPP_PROFILE_SCRATCH(result.size() * sizeof(Pixel));
+            }
+            detail::convolvePixels(m_img.data(), result.data(), m_width, m_height, kernel, border, constant);
+            m_img.swap(result);
+            markDirtyImpl(0, 0, m_width, m_height);
+            PPMPP_PROFILE_PIXELS(m_img.size());
+        }
+
+        struct Placement {
+            const DisplacementMap* map;
+            int x;
+            int y;
+        };
+
+        // Applies the maps in order; all of them sample the image as it was on entry, so overlaps don't compound.
+        // Only what the maps can read (each window grown by its largest offset plus the bilinear neighbor) is
+        // copied to the back buffer first.
+        void applyDisplacementImpl(const std::vector<Placement>& placements) {
+            if (m_img.empty() || placements.empty()) return;
+            std::vector<std::array<int, 4>> reads;
+            int top = m_height, bottom = 0;
+            for (const Placement& p : placements) {
+                const DisplacementMap& map = *p.map;
+                const int left = p.x - map.getOriginX(), up = p.y - map.getOriginY();
+                if (left >= m_width || up >= m_height || left + map.getWidth() <= 0 || up + map.getHeight() <= 0) continue;
+                const int pad = static_cast<int>(std::min<double>(std::ceil(map.getMaxOffset()), std::max(m_width, m_height))) + 1;
+                const std::array<int, 4> r = {std::max(left - pad, 0), std::max(up - pad, 0),
+                                              std::min(left + map.getWidth() + pad, m_width), std::min(up + map.getHeight() + pad, m_height)};
+                top = std::min(top, r[1]);
+                bottom = std::max(bottom, r[3]);
+                reads.push_back(r);
+            }
+            if (reads.empty()) return;
+
+            std::vector<Pixel>& source = m_backBuffer;
+            if (source.size() != m_img.size()) {
+                source.resize(m_img.size());
+                PPMPP_PROFILE_SCRATCH(source.size() * sizeof(Pixel));
+            }
+            // Per row, the spans of the windows crossing it are merged so overlapping windows are copied once.
+            ThreadPool::instance().parallelFor(top, bottom, 16, [&](int lo, int hi) {
+                std::vector<std::pair<int, int>> spans;
+                for (int y = lo; y < hi; ++y) {
+                    spans.clear();
+                    for (const auto& r : reads) {
+                        if (y >= r[1] && y < r[3]) spans.emplace_back(r[0], r[2]);
+                    }
+                    std::sort(spans.begin(), spans.end());
+                    for (size_t i = 0; i < spans.size();) {
+                        int x0 = spans[i].first, x1 = spans[i].second;
+                        for (++i; i < spans.size() && spans[i].first <= x1; ++i) x1 = std::max(x1, spans[i].second);
+                        std::copy(m_img.begin() + getIndex(x0, y), m_img.begin() + getIndex(x1, y), source.begin() + getIndex(x0, y));
                     }
                 }
+            });
+
+            auto sample = [&](double sx, double sy) {
+                sx = std::clamp(sx, 0.0, m_width - 1.0);
+                sy = std::clamp(sy, 0.0, m_height - 1.0);
+                int x0 = static_cast<int>(sx), y0 = static_cast<int>(sy);
+                int x1 = std::min(x0 + 1, m_width - 1), y1 = std::min(y0 + 1, m_height - 1);
+                double fx = sx - x0, fy = sy - y0;
+                const auto& [r00, g00, b00] = source[y0 * m_width + x0];
+                const auto& [r10, g10, b10] = source[y0 * m_width + x1];
+                const auto& [r01, g01, b01] = source[y1 * m_width + x0];
+                const auto& [r11, g11, b11] = source[y1 * m_width + x1];
+                double w00 = (1 - fx) * (1 - fy), w10 = fx * (1 - fy), w01 = (1 - fx) * fy, w11 = fx * fy;
+                return Pixel(r00 * w00 + r10 * w10 + r01 * w01 + r11 * w11,
+                             g00 * w00 + g10 * w10 + g01 * w01 + g11 * w11,
+                             b00 * w00 + b10 * w10 + b01 * w01 + b11 * w11);
             };
 
-            std::vector<Pixel> brightPass(m_img.begin(), m_img.end());
-            for (Pixel& pixel : brightPass) {
-                double brightness = 0.2126 * std::get<0>(pixel) + 0.7152 * std::get<1>(pixel) + 0.0722 * std::get<2>(pixel);
-                if (brightness <= threshold) {
-                    pixel = Pixel(0, 0, 0);
-                }
+            for (const Placement& p : placements) {
+                const DisplacementMap& map = *p.map;
+                const int left = p.x - map.getOriginX(), top = p.y - map.getOriginY();
+                const int x0 = std::max(left, 0), x1 = std::min(left + map.getWidth(), m_width);
+                const int y0 = std::max(top, 0), y1 = std::min(top + map.getHeight(), m_height);
+                if (x0 >= x1 || y0 >= y1) continue;
+                ThreadPool::instance().parallelFor(y0, y1, 8, [&](int lo, int hi) {
+                    for (int y = lo; y < hi; ++y) {
+                        for (int x = x0; x < x1; ++x) {
+                            int mx = x - left, my = y - top;
+                            if (!map.isInside(mx, my)) continue;
+                            m_img[getIndex(x, y)] = sample(x + map.getDx(mx, my), y + map.getDy(mx, my));
+                        }
+                    }
+                });
+                markDirtyImpl(x0, y0, x1, y1);
+                PPMPP_PROFILE_PIXELS(static_cast<uint64_t>(x1 - x0) * (y1 - y0));
             }
+        }
+
+	    // Evenly spaced stops along the angle, spanning the projection of the far corner.
+	    void drawGradientsImpl(const std::vector<Pixel>& colors, double angle_degree) {
+	        double angle = angle_degree * M_PI / 180.0;
+
+	        if (colors.empty()) {
+	            std::cerr << "Invalid number of colors";
+	            return;
+	        }
+
+	        double length = m_width * std::cos(angle) + m_height * std::sin(angle);
+	        Gradient gradient = Gradient::linear(0, 0, length * std::cos(angle), length * std::sin(angle));
+	        for (size_t i = 0; i < colors.size(); ++i) {
+	            gradient.addStop(colors.size() > 1 ? static_cast<double>(i) / (colors.size() - 1) : 0.0, colors[i]);
+	        }
+	        fillGradientImpl(gradient);
+	    }
+
+	    void drawTextImpl(int x0, int y0, const std::string& text, const GlyphAtlas& atlas, const Pixel& color, TextLayout layout, double opacity) {
+	        const auto [cr, cg, cb] = color;
+	        const double scale = std::clamp(opacity, 0.0, 1.0) / 255.0;
+	        const int height = atlas.getGlyphHeight();
+	        int penX = x0, penY = y0, right = x0;
+	        size_t blended = 0;
+	        for (char c : text) {
+	            if (c == '\n') {
+	                penX = x0;
+	                penY += atlas.getLineHeight();
+	                continue;
+	            }
+	            const GlyphAtlas::Glyph& glyph = atlas.glyph(c);
+	            const int first = layout == TextLayout::Proportional ? glyph.left : 0;
+	            // Mask column m lands on x = left + m; clip the glyph box to the image once.
+	            const int left = penX - first;
+	            const int mx0 = std::max(first, -left), mx1 = std::min(atlas.getGlyphWidth(), m_width - left);
+	            const int my0 = std::max(0, -penY), my1 = std::min(height, m_height - penY);
+	            for (int my = my0; my < my1; ++my) {
+	                const uint8_t* coverage = atlas.row(my) + glyph.offset;
+	                Pixel* dst = &m_img[static_cast<size_t>(penY + my) * m_width + left];
+	                for (int mx = mx0; mx < mx1; ++mx) {
+	                    if (!coverage[mx]) continue;
+	                    const double a = coverage[mx] * scale;
+	                    auto& [r, g, b] = dst[mx];
+	                    r += (cr - r) * a;
+	                    g += (cg - g) * a;
+	                    b += (cb - b) * a;
+	                    ++blended;
+	                }
+	            }
+	            penX += atlas.advance(c, layout);
+	            right = std::max(right, penX);
+	        }
+	        markDirtyImpl(x0, y0, right + atlas.getGlyphWidth(), penY + height);
+	        PPMPP_PROFILE_PIXELS(blended);
+	    }
+
+	    // Scanline seed fill. Each stack entry is a parent span and the row to scan next to it; every run found is
+	    // extended left and right in one go, marked in a visited bitmap and pushed for both neighbouring rows.
+	    // The stack and bitmap are the only allocations, so there is no recursion and no per-pixel heap traffic.
+	    std::vector<Span> floodRegionImpl(int sx, int sy, double tolerance, Connectivity connectivity, ColorMatch match) const {
+	        std::vector<Span> spans;
+	        if (sx < 0 || sy < 0 || sx >= m_width || sy >= m_height) return spans;
+
+	        const auto [tr, tg, tb] = m_img[static_cast<size_t>(sy) * m_width + sx];
+	        const double targetLuma = 0.2126 * tr + 0.7152 * tg + 0.0722 * tb;
+	        auto matches = [&](const Pixel& px) {
+	            const auto& [r, g, b] = px;
+	            if (match == ColorMatch::Luminance) return std::abs(0.2126 * r + 0.7152 * g + 0.0722 * b - targetLuma) <= tolerance;
+	            return std::abs(r - tr) <= tolerance && std::abs(g - tg) <= tolerance && std::abs(b - tb) <= tolerance;
+	        };
+	        std::vector<uint64_t> visited((static_cast<size_t>(m_width) * m_height + 63) / 64, 0);
+	        auto isVisited = [&](size_t i) { return (visited[i >> 6] >> (i & 63)) & 1; };
+	        auto inside = [&](int x, int y) {
+	            const size_t i = static_cast<size_t>(y) * m_width + x;
+	            return !isVisited(i) && matches(m_img[i]);
+	        };
+
+	        struct Pending {
+	            int y;
+	            int x0;
+	            int x1; // inclusive
+	        };
+	        std::vector<Pending> stack;
+	        stack.reserve(4096);
+	        // Finds the maximal run through (x, y), records it and queues the rows above and below. Returns its end.
+	        auto takeRun = [&](int x, int y) {
+	            int left = x, right = x;
+	            while (left > 0 && inside(left - 1, y)) --left;
+	            while (right + 1 < m_width && inside(right + 1, y)) ++right;
+	            // Set bits [begin, end) a word at a time.
+	            for (size_t i = static_cast<size_t>(y) * m_width + left, end = i + (right - left + 1); i < end;) {
+	                const size_t bits = std::min<size_t>(64 - (i & 63), end - i);
+	                visited[i >> 6] |= (bits == 64 ? ~uint64_t(0) : ((uint64_t(1) << bits) - 1)) << (i & 63);
+	                i += bits;
+	            }
+	            spans.push_back(Span{y, left, right + 1});
+	            if (y > 0) stack.push_back(Pending{y - 1, left, right});
+	            if (y + 1 < m_height) stack.push_back(Pending{y + 1, left, right});
+	            return right;
+	        };
+
+	        takeRun(sx, sy);
+	        const int reach = connectivity == Connectivity::Eight ? 1 : 0;
+	        while (!stack.empty()) {
+	            const Pending p = stack.back();
+	            stack.pop_back();
+	            const int hi = std::min(m_width - 1, p.x1 + reach);
+	            const size_t rowStart = static_cast<size_t>(p.y) * m_width;
+	            for (int x = std::max(0, p.x0 - reach); x <= hi;) {
+	                // Rescanning the parent row mostly meets visited pixels; skip them a word at a time.
+	                const size_t i = rowStart + x;
+	                const uint64_t unvisited = ~visited[i >> 6] >> (i & 63);
+	                if (!unvisited) {
+	                    x += 64 - static_cast<int>(i & 63);
+	                    continue;
+	                }
+	                x += std::countr_zero(unvisited);
+	                if (x > hi) break;
+	                x = matches(m_img[rowStart + x]) ? takeRun(x, p.y) + 2 : x + 1;
+	            }
+	        }
+	        return spans;
+	    }
+
+	    void fillSpansImpl(const std::vector<Span>& spans, const Pixel& color) {
+	        size_t pixels = 0;
+	        for (const Span& span : spans) {
+	            const int x0 = std::max(span.x0, 0), x1 = std::min(span.x1, m_width);
+	            if (span.y < 0 || span.y >= m_height || x0 >= x1) continue;
+	            Pixel* row = &m_img[static_cast<size_t>(span.y) * m_width];
+	            if (m_paint) m_paint->fillSpan(x0, x1, span.y, row + x0);
+	            else std::fill(row + x0, row + x1, color);
+	            markDirtyImpl(x0, span.y, x1, span.y + 1);
+	            pixels += x1 - x0;
+	        }
+	        PPMPP_PROFILE_PIXELS(pixels);
+	    }
+
+	    bool prepareBlitImpl(const ImageBlit& blit, std::vector<Pixel>& snapshot, detail::PreparedBlit<Pixel>& p) const {
+	        if (!blit.source) throw std::invalid_argument("drawImage: null source");
+	        const Image& source = *blit.source;
+	        if (blit.alpha && (blit.alpha->getWidth() != source.m_width || blit.alpha->getHeight() != source.m_height)) {
+	            throw std::invalid_argument("drawImage: alpha must have the size of the source");
+	        }
+	        if (!detail::planBlit(blit.srcRect, blit.dstRect, source.m_width, source.m_height, m_width, m_height, blit.mode, blit.filter, blit.opacity, p)) return false;
+
+	        if (&source == this) {
+	            snapshot = m_img;
+	            p.pixels = snapshot.data();
+	        } else if (source.m_colorSpace != m_colorSpace) {
+	            // Bring the sampled part of the source into this image's space first.
+	            Pixel (*convert)(const Pixel&) = m_colorSpace == ColorSpace::Linear ? toLinear : toSrgb;
+	            snapshot.resize(source.m_img.size());
+	            ThreadPool::instance().parallelFor(p.src.y, p.src.y + p.src.h, 16, [&](int lo, int hi) {
+	                for (int y = lo; y < hi; ++y) {
+	                    const size_t row = static_cast<size_t>(y) * source.m_width + p.src.x;
+	                    std::transform(source.m_img.begin() + row, source.m_img.begin() + row + p.src.w, snapshot.begin() + row, convert);
+	                }
+	            });
+	            p.pixels = snapshot.data();
+	        } else {
+	            p.pixels = source.m_img.data();
+	        }
+	        p.alpha = blit.alpha;
+	        return true;
+	    }
+
+	    void drawImagesImpl(const ImageBlit* blits, size_t count) {
+	        std::vector<detail::PreparedBlit<Pixel>> prepared;
+	        std::vector<std::vector<Pixel>> snapshots(count);
+	        int top = m_height, bottom = 0, widest = 0;
+	        for (size_t i = 0; i < count; ++i) {
+	            detail::PreparedBlit<Pixel> p;
+	            if (!prepareBlitImpl(blits[i], snapshots[i], p)) continue;
+	            top = std::min(top, p.clip.y);
+	            bottom = std::max(bottom, p.clip.y + p.clip.h);
+	            widest = std::max(widest, p.clip.w);
+	            prepared.push_back(std::move(p));
+	        }
+	        if (prepared.empty()) return;
+
+	        // Each row chunk applies every blit in order, so overlapping blits stack as if drawn one by one.
+	        ThreadPool::instance().parallelFor(top, bottom, 16, [&](int lo, int hi) {
+	            std::vector<Pixel> line(widest);
+	            std::vector<double> coverage(widest);
+	            for (const auto& p : prepared) {
+	                const int y0 = std::max(lo, p.clip.y), y1 = std::min(hi, p.clip.y + p.clip.h);
+	                for (int y = y0; y < y1; ++y) detail::blitRow(p, y, &m_img[static_cast<size_t>(y) * m_width + p.clip.x], line, coverage);
+	            }
+	        });
+
+	        size_t pixels = 0;
+	        for (const auto& p : prepared) {
+	            markDirtyImpl(p.clip.x, p.clip.y, p.clip.x + p.clip.w, p.clip.y + p.clip.h);
+	            pixels += static_cast<size_t>(p.clip.w) * p.clip.h;
+	        }
+	        PPMPP_PROFILE_PIXELS(pixels);
+	    }
+
+	    void applyColorPipelineImpl(const ColorPipeline& pipeline, Region region) {
+	        if (pipeline.empty()) return;
+	        for (const auto& r : regionRectsImpl(region, 0)) {
+	            const int x0 = r[0], y0 = r[1], x1 = r[2], y1 = r[3];
+	            ThreadPool::instance().parallelFor(y0, y1, 8, [&](int lo, int hi) {
+	                if (x0 == 0 && x1 == m_width) {
+	                    pipeline.apply(&m_img[getIndex(0, lo)], static_cast<size_t>(m_width) * (hi - lo));
+	                    return;
+	                }
+	                for (int y = lo; y < hi; ++y) pipeline.apply(&m_img[getIndex(x0, y)], x1 - x0);
+	            });
+	            markDirtyImpl(x0, y0, x1, y1);
+	            PPMPP_PROFILE_PIXELS(static_cast<size_t>(x1 - x0) * (y1 - y0));
+	        }
+	    }
+
+	    // Each chunk of rows fills its own partial (per-row mean and M2, then Chan's pairwise update), and the
+	    // partials are merged in row order, so the result is stable and doesn't depend on the thread count.
+	    ImageStatistics computeStatisticsImpl(int x0, int y0, int x1, int y1, int bins) const {
+	        struct Partial {
+	            uint64_t count = 0;
+	            double mean[4] = {};
+	            double m2[4] = {};
+	            double min[4];
+	            double max[4];
+	            std::vector<uint64_t> histogram;
+	        };
+	        auto merge = [](Partial& a, uint64_t n, const double* mean, const double* m2, const double* lo, const double* hi) {
+	            const double total = static_cast<double>(a.count + n);
+	            for (int c = 0; c < 4; ++c) {
+	                const double delta = mean[c] - a.mean[c];
+	                a.mean[c] += delta * n / total;
+	                a.m2[c] += m2[c] + delta * delta * (static_cast<double>(a.count) * n / total);
+	                a.min[c] = std::min(a.min[c], lo[c]);
+	                a.max[c] = std::max(a.max[c], hi[c]);
+	            }
+	            a.count += n;
+	        };
+	        auto reset = [bins](Partial& p) {
+	            std::fill_n(p.min, 4, std::numeric_limits<double>::infinity());
+	            std::fill_n(p.max, 4, -std::numeric_limits<double>::infinity());
+	            p.histogram.assign(static_cast<size_t>(bins) * 4, 0);
+	        };
 
-            gaussianBlur(brightPass);
+	        bins = std::max(bins, 0);
+	        x0 = std::max(x0, 0); y0 = std::max(y0, 0);
+	        x1 = std::min(x1, m_width); y1 = std::min(y1, m_height);
+	        Partial total;
+	        reset(total);
+	        if (x0 < x1 && y0 < y1) {
+	            const int width = x1 - x0;
+	            const int grain = std::max(1, 65536 / width);
+	            std::vector<Partial> partials((y1 - y0 + grain - 1) / grain);
+	            for (Partial& part : partials) reset(part);
+	            PPMPP_PROFILE_SCRATCH(partials.size() * (sizeof(Partial) + bins * 4 * sizeof(uint64_t)) + width * 4 * sizeof(double));
+
+	            ThreadPool::instance().parallelFor(y0, y1, grain, [&](int lo, int hi) {
+	                // Planar rows r, g, b, luminance, and per-column running mean, M2, min and max for each plane.
+	                // The column updates are element-wise, so they vectorize without reassociating any sums.
+	                const size_t n = static_cast<size_t>(width) * 4;
+	                std::vector<double> planes(n), colMean(n), colM2(n), colMin(n), colMax(n);
+	                // A call can span several grains when the pool has no workers.
+	                for (int c0 = lo; c0 < hi; c0 += grain) {
+	                    const int c1 = std::min(hi, c0 + grain);
+	                    Partial& part = partials[(c0 - y0) / grain];
+	                    std::fill(colMean.begin(), colMean.end(), 0.0);
+	                    std::fill(colM2.begin(), colM2.end(), 0.0);
+	                    std::fill(colMin.begin(), colMin.end(), std::numeric_limits<double>::infinity());
+	                    std::fill(colMax.begin(), colMax.end(), -std::numeric_limits<double>::infinity());
+	                    for (int y = c0; y < c1; ++y) {
+	                        const Pixel* src = &m_img[static_cast<size_t>(y) * m_width + x0];
+	                        double* r = planes.data();
+	                        double* g = r + width;
+	                        double* b = g + width;
+	                        double* l = b + width;
+	                        for (int i = 0; i < width; ++i) {
+	                            r[i] = std::get<0>(src[i]);
+	                            g[i] = std::get<1>(src[i]);
+	                            b[i] = std::get<2>(src[i]);
+	                            l[i] = 0.2126 * r[i] + 0.7152 * g[i] + 0.0722 * b[i];
+	                        }
+	                        const double inv = 1.0 / (y - c0 + 1);
+	                        double* mean = colMean.data();
+	                        double* m2 = colM2.data();
+	                        double* mn = colMin.data();
+	                        double* mx = colMax.data();
+	                        const double* v = planes.data();
+	                        for (size_t i = 0; i < n; ++i) {
+	                            const double delta = v[i] - mean[i];
+	                            mean[i] += delta * inv;
+	                            m2[i] += delta * (v[i] - mean[i]);
+	                            mn[i] = v[i] < mn[i] ? v[i] : mn[i];
+	                            mx[i] = v[i] > mx[i] ? v[i] : mx[i];
+	                        }
+	                        if (bins > 0) {
+	                            for (int c = 0; c < 4; ++c) {
+	                                uint64_t* hist = part.histogram.data() + static_cast<size_t>(c) * bins;
+	                                const double* w = v + static_cast<size_t>(c) * width;
+	                                for (int i = 0; i < width; ++i) {
+	                                    int bin = static_cast<int>(std::clamp(w[i], 0.0, 1.0) * bins);
+	                                    ++hist[bin < bins ? bin : bins - 1];
+	                                }
+	                            }
+	                        }
+	                    }
+	                    for (int i = 0; i < width; ++i) {
+	                        double mean[4], m2[4], mn[4], mx[4];
+	                        for (int c = 0; c < 4; ++c) {
+	                            const size_t k = static_cast<size_t>(c) * width + i;
+	                            mean[c] = colMean[k];
+	                            m2[c] = colM2[k];
+	                            mn[c] = colMin[k];
+	                            mx[c] = colMax[k];
+	                        }
+	                        merge(part, c1 - c0, mean, m2, mn, mx);
+	                    }
+	                }
+	            });
+
+	            for (const Partial& part : partials) {
+	                merge(total, part.count, part.mean, part.m2, part.min, part.max);
+	                for (size_t i = 0; i < total.histogram.size(); ++i) total.histogram[i] += part.histogram[i];
+	            }
+	            PPMPP_PROFILE_PIXELS(total.count);
+	        }
+
+	        ImageStatistics stats;
+	        stats.count = total.count;
+	        ChannelStatistics* channels[4] = {&stats.red, &stats.green, &stats.blue, &stats.luminance};
+	        for (int c = 0; c < 4; ++c) {
+	            channels[c]->mean = total.mean[c];
+	            channels[c]->variance = total.count ? total.m2[c] / total.count : 0.0;
+	            channels[c]->min = total.count ? total.min[c] : 0.0;
+	            channels[c]->max = total.count ? total.max[c] : 0.0;
+	            channels[c]->histogram.assign(total.histogram.begin() + static_cast<size_t>(c) * bins, total.histogram.begin() + static_cast<size_t>(c + 1) * bins);
+	        }
+	        return stats;
+	    }
+
+	    void checkRectImpl(const Rect& rect) const {
+	        if (rect.x < 0 || rect.y < 0 || rect.w < 0 || rect.h < 0 || rect.x + rect.w > m_width || rect.y + rect.h > m_height) {
+	            throw std::out_of_range("rectangle outside the image");
+	        }
+	    }
+
+	    template <typename T>
+	    void exportPixelsImpl(Rgb<T>* out, const Rect& rect) const {
+	        checkRectImpl(rect);
+	        const bool linear = m_colorSpace == ColorSpace::Linear;
+	        const detail::SrgbTables& srgb = detail::srgbTables();
+	        auto encode = [&](double v) -> T {
+	            if constexpr (std::is_floating_point_v<T>) return static_cast<T>(v);
+	            else if constexpr (std::is_same_v<T, uint8_t>) return linear ? detail::encodeSrgb8(srgb, v) : convertChannel<uint8_t>(v);
+	            else return convertChannel<T>(linear ? linearToSrgb(std::clamp(v, 0.0, 1.0)) : v);
+	        };
+	        ThreadPool::instance().parallelFor(0, rect.h, 32, [&](int lo, int hi) {
+	            for (int y = lo; y < hi; ++y) {
+	                const Pixel* src = &m_img[static_cast<size_t>(rect.y + y) * m_width + rect.x];
+	                Rgb<T>* dst = out + static_cast<size_t>(y) * rect.w;
+	                for (int x = 0; x < rect.w; ++x) {
+	                    dst[x] = Rgb<T>(encode(std::get<0>(src[x])), encode(std::get<1>(src[x])), encode(std::get<2>(src[x])));
+	                }
+	            }
+	        });
+	        PPMPP_PROFILE_PIXELS(static_cast<size_t>(rect.w) * rect.h);
+	    }
+
+	    template <typename T>
+	    void importPixelsImpl(const Rgb<T>* in, const Rect& rect) {
+	        checkRectImpl(rect);
+	        const bool linear = m_colorSpace == ColorSpace::Linear;
+	        const detail::SrgbTables& srgb = detail::srgbTables();
+	        auto decode = [&](T v) -> double {
+	            if constexpr (std::is_floating_point_v<T>) return v;
+	            else if constexpr (std::is_same_v<T, uint8_t>) return linear ? srgb.toLinear[v] : convertChannel<double>(v);
+	            else return linear ? srgbToLinear(convertChannel<double>(v)) : convertChannel<double>(v);
+	        };
+	        ThreadPool::instance().parallelFor(0, rect.h, 32, [&](int lo, int hi) {
+	            for (int y = lo; y < hi; ++y) {
+	                const Rgb<T>* src = in + static_cast<size_t>(y) * rect.w;
+	                Pixel* dst = &m_img[static_cast<size_t>(rect.y + y) * m_width + rect.x];
+	                for (int x = 0; x < rect.w; ++x) dst[x] = Pixel(decode(src[x].r), decode(src[x].g), decode(src[x].b));
+	            }
+	        });
+	        markDirtyImpl(rect.x, rect.y, rect.x + rect.w, rect.y + rect.h);
+	        PPMPP_PROFILE_PIXELS(static_cast<size_t>(rect.w) * rect.h);
+	    }
+
+	    void checkSameSizeImpl(const Image& other) const {
+	        if (m_width != other.m_width || m_height != other.m_height) {
+	            throw std::invalid_argument("image sizes differ");
+	        }
+	    }
+
+	    bool approximatelyEqualsImpl(const Image& other, double tolerance) const {
+	        if (m_width != other.m_width || m_height != other.m_height) return false;
+	        const size_t total = m_img.size();
+	        const size_t block = 4096;
+	        std::atomic<bool> differs{false};
+	        ThreadPool::instance().parallelFor(0, static_cast<int>((total + block - 1) / block), 16, [&](int lo, int hi) {
+	            for (int k = lo; k < hi && !differs.load(std::memory_order_relaxed); ++k) {
+	                const Pixel* a = &m_img[k * block];
+	                const Pixel* b = &other.m_img[k * block];
+	                const size_t n = std::min(block, total - k * block);
+	                // Branch-free over the block so the compiler vectorizes it.
+	                int over = 0;
+	                for (size_t i = 0; i < n; ++i) {
+	                    over |= (std::abs(std::get<0>(a[i]) - std::get<0>(b[i])) > tolerance)
+	                        | (std::abs(std::get<1>(a[i]) - std::get<1>(b[i])) > tolerance)
+	                        | (std::abs(std::get<2>(a[i]) - std::get<2>(b[i])) > tolerance);
+	                }
+	                if (over) differs.store(true, std::memory_order_relaxed);
+	            }
+	        });
+	        return !differs.load();
+	    }
+
+	    ImageDifference compareImpl(const Image& other, double tolerance) const {
+	        checkSameSizeImpl(other);
+	        struct Partial {
+	            double maxDelta = 0;
+	            uint64_t differing = 0;
+	            double squares = 0;
+	        };
+	        const int grain = std::max(1, 65536 / std::max(m_width, 1));
+	        std::vector<Partial> partials((m_height + grain - 1) / grain);
+	        ThreadPool::instance().parallelFor(0, m_height, grain, [&](int lo, int hi) {
+	            for (int y = lo; y < hi; ++y) {
+	                Partial& part = partials[y / grain];
+	                const Pixel* a = &m_img[static_cast<size_t>(y) * m_width];
+	                const Pixel* b = &other.m_img[static_cast<size_t>(y) * m_width];
+	                double maxDelta = 0, squares = 0;
+	                uint64_t differing = 0;
+	                for (int i = 0; i < m_width; ++i) {
+	                    const double d0 = std::abs(std::get<0>(a[i]) - std::get<0>(b[i]));
+	                    const double d1 = std::abs(std::get<1>(a[i]) - std::get<1>(b[i]));
+	                    const double d2 = std::abs(std::get<2>(a[i]) - std::get<2>(b[i]));
+	                    const double d = std::max(d0, std::max(d1, d2));
+	                    maxDelta = std::max(maxDelta, d);
+	                    differing += d > tolerance;
+	                    squares += d0 * d0 + d1 * d1 + d2 * d2;
+	                }
+	                part.maxDelta = std::max(part.maxDelta, maxDelta);
+	                part.differing += differing;
+	                part.squares += squares;
+	            }
+	        });
+
+	        ImageDifference result;
+	        double squares = 0;
+	        for (const Partial& part : partials) {
+	            result.maxDelta = std::max(result.maxDelta, part.maxDelta);
+	            result.differingPixels += part.differing;
+	            squares += part.squares;
+	        }
+	        result.mse = m_img.empty() ? 0.0 : squares / (m_img.size() * 3.0);
+	        result.psnr = result.mse > 0 ? 10.0 * std::log10(1.0 / result.mse) : std::numeric_limits<double>::infinity();
+	        PPMPP_PROFILE_PIXELS(m_img.size());
+	        return result;
+	    }
+
+	    // Box-window SSIM (Wang et al. 2004) with the usual constants for a dynamic range of 1. Each chunk of
+	    // output rows slides running column sums of x, y, x^2, y^2 and xy down the image, so every window costs O(1).
+	    double computeSsimImpl(const Image& other, int window) const {
+	        checkSameSizeImpl(other);
+	        window = std::clamp(window, 1, std::max(1, std::min(m_width, m_height)));
+	        const int outWidth = m_width - window + 1, outHeight = m_height - window + 1;
+	        if (m_img.empty() || outWidth <= 0 || outHeight <= 0) return 1.0;
+	        const double k1 = 0.01 * 0.01, k2 = 0.03 * 0.03;
+	        const double invArea = 1.0 / (static_cast<double>(window) * window);
+	        const int grain = std::max(8, 65536 / m_width);
+	        std::vector<double> partials((outHeight + grain - 1) / grain, 0.0);
+
+	        ThreadPool::instance().parallelFor(0, outHeight, grain, [&](int lo, int hi) {
+	            std::vector<double> sums(static_cast<size_t>(m_width) * 5, 0.0);
+	            std::vector<double> lumaA(m_width), lumaB(m_width);
+	            auto addRow = [&](int y, double sign) {
+	                const Pixel* a = &m_img[static_cast<size_t>(y) * m_width];
+	                const Pixel* b = &other.m_img[static_cast<size_t>(y) * m_width];
+	                double* sx = sums.data();
+	                double* sy = sx + m_width;
+	                double* sxx = sy + m_width;
+	                double* syy = sxx + m_width;
+	                double* sxy = syy + m_width;
+	                for (int i = 0; i < m_width; ++i) {
+	                    lumaA[i] = 0.2126 * std::get<0>(a[i]) + 0.7152 * std::get<1>(a[i]) + 0.0722 * std::get<2>(a[i]);
+	                    lumaB[i] = 0.2126 * std::get<0>(b[i]) + 0.7152 * std::get<1>(b[i]) + 0.0722 * std::get<2>(b[i]);
+	                }
+	                for (int i = 0; i < m_width; ++i) {
+	                    const double x = lumaA[i], v = lumaB[i];
+	                    sx[i] += sign * x;
+	                    sy[i] += sign * v;
+	                    sxx[i] += sign * x * x;
+	                    syy[i] += sign * v * v;
+	                    sxy[i] += sign * x * v;
+	                }
+	            };
+	            // A call can span several grains when the pool has no workers.
+	            for (int c0 = lo; c0 < hi; c0 += grain) {
+	                const int c1 = std::min(hi, c0 + grain);
+	                std::fill(sums.begin(), sums.end(), 0.0);
+	                for (int y = c0; y < c0 + window - 1; ++y) addRow(y, 1.0);
+	                double total = 0;
+	                for (int y = c0; y < c1; ++y) {
+	                    addRow(y + window - 1, 1.0);
+	                    double w[5] = {};
+	                    for (int k = 0; k < 5; ++k) {
+	                        for (int i = 0; i < window; ++i) w[k] += sums[static_cast<size_t>(k) * m_width + i];
+	                    }
+	                    for (int x = 0; x < outWidth; ++x) {
+	                        if (x > 0) {
+	                            for (int k = 0; k < 5; ++k) {
+	                                const double* column = sums.data() + static_cast<size_t>(k) * m_width;
+	                                w[k] += column[x + window - 1] - column[x - 1];
+	                            }
+	                        }
+	                        const double mx = w[0] * invArea, my = w[1] * invArea;
+	                        const double vx = std::max(0.0, w[2] * invArea - mx * mx);
+	                        const double vy = std::max(0.0, w[3] * invArea - my * my);
+	                        const double cxy = w[4] * invArea - mx * my;
+	                        total += ((2 * mx * my + k1) * (2 * cxy + k2)) / ((mx * mx + my * my + k1) * (vx + vy + k2));
+	                    }
+	                    addRow(y, -1.0);
+	                }
+	                partials[c0 / grain] = total;
+	            }
+	        });
+
+	        double total = 0;
+	        for (double part : partials) total += part;
+	        PPMPP_PROFILE_PIXELS(m_img.size());
+	        return total / (static_cast<double>(outWidth) * outHeight);
+	    }
+
+	    // Row y as 8-bit RGB codes, rounded like write does.
+	    void rgb8RowImpl(int y, uint8_t* dst) const {
+	        const Pixel* src = &m_img[static_cast<size_t>(y) * m_width];
+	        const bool linear = m_colorSpace == ColorSpace::Linear;
+	        const detail::SrgbTables& srgb = detail::srgbTables();
+	        for (int x = 0; x < m_width; ++x, dst += 3) {
+	            const auto& [r, g, b] = src[x];
+	            if (linear) {
+	                dst[0] = detail::encodeSrgb8(srgb, r);
+	                dst[1] = detail::encodeSrgb8(srgb, g);
+	                dst[2] = detail::encodeSrgb8(srgb, b);
+	            } else {
+	                dst[0] = static_cast<uint8_t>(detail::quantizeSample(r, 255));
+	                dst[1] = static_cast<uint8_t>(detail::quantizeSample(g, 255));
+	                dst[2] = static_cast<uint8_t>(detail::quantizeSample(b, 255));
+	            }
+	        }
+	    }
+
+	    // Heckbert's median cut over 5-bit RGB bins. The box with the largest population times extent is split at
+	    // the population median of its longest axis; each entry is the mean of the sampled pixels in its box.
+	    Palette buildPaletteImpl(int colors) const {
+	        if (colors < 1 || colors > 256) throw std::invalid_argument("buildPalette: 1 to 256 colors");
+	        struct Bin {
+	            uint64_t count = 0, r = 0, g = 0, b = 0;
+	        };
+	        constexpr int bins = 1 << 15;
+	        const size_t step = std::max<size_t>(1, m_img.size() >> 20);
+	        ThreadPool& pool = ThreadPool::instance();
+
+	        // An image with at most `colors` distinct colors gets exactly those; every pixel is looked at, and the
+	        // scan stops as soon as there are more.
+	        std::vector<uint32_t> distinct;
+	        std::mutex distinctMutex;
+	        std::atomic<bool> tooMany{false};
+	        pool.parallelFor(0, m_height, 64, [&](int lo, int hi) {
+	            std::vector<uint8_t> row(static_cast<size_t>(m_width) * 3);
+	            std::vector<uint32_t> local;
+	            uint32_t last = std::numeric_limits<uint32_t>::max();
+	            for (int y = lo; y < hi && !tooMany.load(std::memory_order_relaxed); ++y) {
+	                rgb8RowImpl(y, row.data());
+	                for (int x = 0; x < m_width; ++x) {
+	                    const uint32_t key = (uint32_t(row[3 * x]) << 16) | (uint32_t(row[3 * x + 1]) << 8) | row[3 * x + 2];
+	                    if (key == last) continue;
+	                    last = key;
+	                    auto it = std::lower_bound(local.begin(), local.end(), key);
+	                    if (it != local.end() && *it == key) continue;
+	                    if (static_cast<int>(local.size()) == colors) {
+	                        tooMany = true;
+	                        return;
+	                    }
+	                    local.insert(it, key);
+	                }
+	            }
+	            std::lock_guard<std::mutex> lock(distinctMutex);
+	            std::vector<uint32_t> merged;
+	            std::set_union(distinct.begin(), distinct.end(), local.begin(), local.end(), std::back_inserter(merged));
+	            distinct.swap(merged);
+	            if (static_cast<int>(distinct.size()) > colors) tooMany = true;
+	        });
+	        if (!tooMany.load() && !distinct.empty()) {
+	            std::vector<Rgb8> palette;
+	            for (uint32_t key : distinct) palette.push_back({static_cast<uint8_t>(key >> 16), static_cast<uint8_t>(key >> 8), static_cast<uint8_t>(key)});
+	            return Palette(std::move(palette));
+	        }
 
-            for (size_t i = 0; i < m_img.size(); ++i) {
-                double br, bg, bb;
-                std::tie(br, bg, bb) = brightPass[i];
+	        const int grain = std::max(1, (m_height + 2 * static_cast<int>(pool.size()) - 1) / (2 * static_cast<int>(pool.size())));
+	        std::vector<std::vector<Bin>> partials((m_height + grain - 1) / grain, std::vector<Bin>(bins));
+	        PPMPP_PROFILE_SCRATCH(partials.size() * bins * sizeof(Bin));
+	        pool.parallelFor(0, m_height, grain, [&](int lo, int hi) {
+	            std::vector<uint8_t> row(static_cast<size_t>(m_width) * 3);
+	            for (int c0 = lo; c0 < hi; c0 += grain) {
+	                std::vector<Bin>& histogram = partials[c0 / grain];
+	                for (int y = c0; y < std::min(hi, c0 + grain); ++y) {
+	                    const size_t rowStart = static_cast<size_t>(y) * m_width;
+	                    size_t i = (rowStart + step - 1) / step * step;
+	                    if (i >= rowStart + m_width) continue;
+	                    rgb8RowImpl(y, row.data());
+	                    for (; i < rowStart + m_width; i += step) {
+	                        const uint8_t* c = &row[3 * (i - rowStart)];
+	                        Bin& bin = histogram[((c[0] >> 3) << 10) | ((c[1] >> 3) << 5) | (c[2] >> 3)];
+	                        ++bin.count;
+	                        bin.r += c[0];
+	                        bin.g += c[1];
+	                        bin.b += c[2];
+	                    }
+	                }
+	            }
+	        });
+	        std::vector<Bin> histogram(bins);
+	        std::vector<int> used;
+	        for (int k = 0; k < bins; ++k) {
+	            for (const auto& partial : partials) {
+	                histogram[k].count += partial[k].count;
+	                histogram[k].r += partial[k].r;
+	                histogram[k].g += partial[k].g;
+	                histogram[k].b += partial[k].b;
+	            }
+	            if (histogram[k].count) used.push_back(k);
+	        }
+	        if (used.empty()) return Palette({Rgb8{}});
 
-                double r, g, b;
-                std::tie(r, g, b) = m_img[i];
+	        struct Box {
+	            int begin, end;
+	            uint64_t count;
+	            int axis, extent;
+	        };
+	        auto coordinate = [](int bin, int axis) { return (bin >> (10 - 5 * axis)) & 31; };
+	        auto makeBox = [&](int begin, int end) {
+	            Box box{begin, end, 0, 0, 0};
+	            int lo[3] = {31, 31, 31}, hi[3] = {0, 0, 0};
+	            for (int i = begin; i < end; ++i) {
+	                box.count += histogram[used[i]].count;
+	                for (int a = 0; a < 3; ++a) {
+	                    lo[a] = std::min(lo[a], coordinate(used[i], a));
+	                    hi[a] = std::max(hi[a], coordinate(used[i], a));
+	                }
+	            }
+	            for (int a = 0; a < 3; ++a) {
+	                if (hi[a] - lo[a] > box.extent) {
+	                    box.extent = hi[a] - lo[a];
+	                    box.axis = a;
+	                }
+	            }
+	            return box;
+	        };
+	        std::vector<Box> boxes{makeBox(0, static_cast<int>(used.size()))};
+	        while (static_cast<int>(boxes.size()) < colors) {
+	            int pick = -1;
+	            uint64_t bestScore = 0;
+	            for (size_t k = 0; k < boxes.size(); ++k) {
+	                const uint64_t score = boxes[k].count * static_cast<uint64_t>(boxes[k].extent);
+	                if (score > bestScore) {
+	                    bestScore = score;
+	                    pick = static_cast<int>(k);
+	                }
+	            }
+	            if (pick < 0) break; // every box is a single bin
+	            const Box box = boxes[pick];
+	            std::sort(used.begin() + box.begin, used.begin() + box.end, [&](int a, int b) { return coordinate(a, box.axis) < coordinate(b, box.axis); });
+	            uint64_t below = 0;
+	            int split = box.begin + 1;
+	            for (int i = box.begin; i < box.end - 1; ++i) {
+	                below += histogram[used[i]].count;
+	                split = i + 1;
+	                if (2 * below >= box.count) break;
+	            }
+	            boxes[pick] = makeBox(box.begin, split);
+	            boxes.push_back(makeBox(split, box.end));
+	        }
 
-                m_img[i] = Pixel(
-                    std::min(r + br, 1.0),
-                    std::min(g + bg, 1.0),
-                    std::min(b + bb, 1.0)
-                );
-            }
-        }
+	        std::vector<Rgb8> palette;
+	        for (const Box& box : boxes) {
+	            uint64_t r = 0, g = 0, b = 0;
+	            for (int i = box.begin; i < box.end; ++i) {
+	                r += histogram[used[i]].r;
+	                g += histogram[used[i]].g;
+	                b += histogram[used[i]].b;
+	            }
+	            palette.push_back({static_cast<uint8_t>((r + box.count / 2) / box.count), static_cast<uint8_t>((g + box.count / 2) / box.count),
+	                static_cast<uint8_t>((b + box.count / 2) / box.count)});
+	        }
+	        return Palette(std::move(palette));
+	    }
 
-        void applyLensImpl(int numb) {
-            int lensRadius = m_width / 10; // Example radius for each lens
-            double refractionIndex = 1.5; // Index of refraction for the lens material
+	    IndexedImage quantizeImpl(const Palette& palette, Dither dither) const {
+	        IndexedImage result(m_width, m_height, palette);
+	        uint8_t* out = result.getData().data();
+	        const int width = m_width;
+	        if (dither == Dither::FloydSteinberg) {
+	            // Errors are kept in 1/16 units for the row below, padded by one pixel on both sides.
+	            std::vector<uint8_t> row(static_cast<size_t>(width) * 3);
+	            std::vector<int> current(static_cast<size_t>(width + 2) * 3, 0), next(current.size(), 0);
+	            for (int y = 0; y < m_height; ++y) {
+	                rgb8RowImpl(y, row.data());
+	                std::fill(next.begin(), next.end(), 0);
+	                const bool reverse = y & 1;
+	                const int dir = reverse ? -1 : 1;
+	                for (int n = 0; n < width; ++n) {
+	                    const int x = reverse ? width - 1 - n : n;
+	                    int value[3];
+	                    for (int c = 0; c < 3; ++c) {
+	                        const int error = current[3 * (x + 1) + c];
+	                        value[c] = std::clamp(row[3 * x + c] + (error >= 0 ? error + 8 : error - 8) / 16, 0, 255);
+	                    }
+	                    const uint8_t index = palette.nearest(value[0], value[1], value[2]);
+	                    out[static_cast<size_t>(y) * width + x] = index;
+	                    const Rgb8& chosen = palette[index];
+	                    const int error[3] = {value[0] - chosen.r, value[1] - chosen.g, value[2] - chosen.b};
+	                    for (int c = 0; c < 3; ++c) {
+	                        current[3 * (x + 1 + dir) + c] += 7 * error[c];
+	                        next[3 * (x + 1 - dir) + c] += 3 * error[c];
+	                        next[3 * (x + 1) + c] += 5 * error[c];
+	                        next[3 * (x + 1 + dir) + c] += error[c];
+	                    }
+	                }
+	                current.swap(next);
+	            }
+	            PPMPP_PROFILE_PIXELS(m_img.size());
+	            return result;
+	        }
 
-            std::random_device rd;
-            std::mt19937 gen(rd());
+	        static constexpr uint8_t bayer[8][8] = {
+	            {0, 32, 8, 40, 2, 34, 10, 42}, {48, 16, 56, 24, 50, 18, 58, 26}, {12, 44, 4, 36, 14, 46, 6, 38}, {60, 28, 52, 20, 62, 30, 54, 22},
+	            {3, 35, 11, 43, 1, 33, 9, 41}, {51, 19, 59, 27, 49, 17, 57, 25}, {15, 47, 7, 39, 13, 45, 5, 37}, {63, 31, 55, 23, 61, 29, 53, 21}};
+	        // Threshold offsets span one palette step: 255 over the levels per channel a palette of this size has.
+	        const double spread = 255.0 / std::max(std::cbrt(palette.size()) - 1.0, 1.0);
+	        int offsets[8][8] = {};
+	        for (int j = 0; j < 8; ++j) {
+	            for (int i = 0; i < 8; ++i) offsets[j][i] = dither == Dither::Ordered ? static_cast<int>(std::lround((bayer[j][i] + 0.5) / 64.0 * spread - spread / 2)) : 0;
+	        }
+	        ThreadPool::instance().parallelFor(0, m_height, 16, [&](int lo, int hi) {
+	            std::vector<uint8_t> row(static_cast<size_t>(width) * 3);
+	            for (int y = lo; y < hi; ++y) {
+	                rgb8RowImpl(y, row.data());
+	                const int* offset = offsets[y & 7];
+	                uint8_t* dst = out + static_cast<size_t>(y) * width;
+	                for (int x = 0; x < width; ++x) {
+	                    const int o = offset[x & 7];
+	                    dst[x] = palette.nearest(std::clamp(row[3 * x] + o, 0, 255), std::clamp(row[3 * x + 1] + o, 0, 255), std::clamp(row[3 * x + 2] + o, 0, 255));
+	                }
+	            }
+	        });
+	        PPMPP_PROFILE_PIXELS(m_img.size());
+	        return result;
+	    }
 
-            std::uniform_int_distribution<> disWidth(0, m_width - 1);
-            std::uniform_int_distribution<> disHeight(0, m_height - 1);
+	    // Calls fn(y, gx, gy) for every row with the normalized derivatives of that row. Each band of rows keeps the
+	    // luminance of three rows in a ring (padded by one pixel on both sides), converting every source row once;
+	    // the filter is split into a vertical pass (smooth and difference per column) and a horizontal pass, both
+	    // contiguous float loops without branches so they vectorize.
+	    template <typename RowFn>
+	    void gradientRowsImpl(GradientOperator op, RowFn fn) const {
+	        const float side = op == GradientOperator::Sobel ? 1.0f : 3.0f, center = op == GradientOperator::Sobel ? 2.0f : 10.0f;
+	        const float norm = 1.0f / (2 * side + center);
+	        const int width = m_width, height = m_height;
+	        ThreadPool::instance().parallelFor(0, height, 32, [&](int lo, int hi) {
+	            std::vector<float> rows(3 * static_cast<size_t>(width + 2)), smooth(width + 2), diff(width + 2), gx(width), gy(width);
+	            float* ring[3] = {rows.data(), rows.data() + (width + 2), rows.data() + 2 * (width + 2)};
+	            auto load = [&](int y, float* dst) {
+	                const Pixel* src = &m_img[static_cast<size_t>(std::clamp(y, 0, height - 1)) * width];
+	                for (int x = 0; x < width; ++x) {
+	                    const auto& [r, g, b] = src[x];
+	                    dst[x + 1] = static_cast<float>(0.299 * r + 0.587 * g + 0.114 * b);
+	                }
+	                dst[0] = dst[1];
+	                dst[width + 1] = dst[width];
+	            };
+	            load(lo - 1, ring[0]);
+	            load(lo, ring[1]);
+	            for (int y = lo; y < hi; ++y) {
+	                load(y + 1, ring[2]);
+	                const float* above = ring[0];
+	                const float* row = ring[1];
+	                const float* below = ring[2];
+	                for (int i = 0; i < width + 2; ++i) {
+	                    smooth[i] = side * (above[i] + below[i]) + center * row[i];
+	                    diff[i] = below[i] - above[i];
+	                }
+	                for (int x = 0; x < width; ++x) {
+	                    gx[x] = (smooth[x + 2] - smooth[x]) * norm;
+	                    gy[x] = (side * (diff[x] + diff[x + 2]) + center * diff[x + 1]) * norm;
+	                }
+	                fn(y, gx.data(), gy.data());
+	                std::rotate(ring, ring + 1, ring + 3);
+	            }
+	        });
+	        PPMPP_PROFILE_PIXELS(m_img.size());
+	    }
 
-            for (int i = 0; i < numb; ++i) {
-                int centerX = disWidth(gen);
-                int centerY = disHeight(gen);
+	    GradientField computeGradientImpl(GradientOperator op) const {
+	        GradientField field;
+	        field.width = m_width;
+	        field.height = m_height;
+	        field.magnitude.resize(m_img.size());
+	        field.direction.resize(m_img.size());
+	        gradientRowsImpl(op, [&](int y, const float* gx, const float* gy) {
+	            float* magnitude = &field.magnitude[static_cast<size_t>(y) * m_width];
+	            float* direction = &field.direction[static_cast<size_t>(y) * m_width];
+	            for (int x = 0; x < m_width; ++x) magnitude[x] = std::sqrt(gx[x] * gx[x] + gy[x] * gy[x]);
+	            for (int x = 0; x < m_width; ++x) direction[x] = std::atan2(gy[x], gx[x]);
+	        });
+	        return field;
+	    }
 
-                for (int y = -lensRadius; y <= lensRadius; ++y) {
-                    for (int x = -lensRadius; x <= lensRadius; ++x) {
-                        if (x * x + y * y <= lensRadius * lensRadius) {
-                            double dist = std::sqrt(x * x + y * y);
-                            double distRatio = dist / lensRadius;
-                            double theta = std::atan2(y, x);
-                            double refraction = 1.0 - std::sqrt(1.0 - std::pow(refractionIndex - 1.0, 2)) / refractionIndex;
-                            double newDist = distRatio * dist * refraction;
+	    GrayImage gradientMagnitudeImpl(GradientOperator op, int maxval) const {
+	        GrayImage result(m_width, m_height, maxval);
+	        uint16_t* out = result.getData().data();
+	        const float scale = static_cast<float>(maxval);
+	        gradientRowsImpl(op, [&](int y, const float* gx, const float* gy) {
+	            uint16_t* row = out + static_cast<size_t>(y) * m_width;
+	            for (int x = 0; x < m_width; ++x) {
+	                row[x] = static_cast<uint16_t>(std::min(std::sqrt(gx[x] * gx[x] + gy[x] * gy[x]), 1.0f) * scale + 0.5f);
+	            }
+	        });
+	        return result;
+	    }
 
-                            int srcX = static_cast<int>(centerX + newDist * std::cos(theta));
-                            int srcY = static_cast<int>(centerY + newDist * std::sin(theta));
+	    GrayImage detectEdgesImpl(double lowThreshold, double highThreshold, GradientOperator op) const {
+	        if (lowThreshold > highThreshold) throw std::invalid_argument("detectEdges: lowThreshold above highThreshold");
+	        const int width = m_width, height = m_height;
+	        const size_t count = m_img.size();
+	        // Magnitude plus the gradient direction folded to 4 sectors: 0 horizontal, 1 diagonal down-right,
+	        // 2 vertical, 3 diagonal down-left.
+	        std::vector<float> magnitude(count);
+	        std::vector<uint8_t> sector(count), state(count);
+	        PPMPP_PROFILE_SCRATCH(count * (sizeof(float) + 2));
+	        const float tan22 = 0.41421356f, tan67 = 2.41421356f;
+	        gradientRowsImpl(op, [&](int y, const float* gx, const float* gy) {
+	            float* m = &magnitude[static_cast<size_t>(y) * width];
+	            uint8_t* s = &sector[static_cast<size_t>(y) * width];
+	            for (int x = 0; x < width; ++x) {
+	                m[x] = std::sqrt(gx[x] * gx[x] + gy[x] * gy[x]);
+	                const float ax = std::abs(gx[x]), ay = std::abs(gy[x]);
+	                s[x] = ay <= tan22 * ax ? 0 : ay >= tan67 * ax ? 2 : (gx[x] * gy[x] > 0 ? 1 : 3);
+	            }
+	        });
+
+	        // Non-maximum suppression and double threshold: 0 none, 1 weak, 2 strong. Ties keep the first pixel of a
+	        // plateau only, so edges stay one pixel wide.
+	        const int dx[4] = {1, 1, 0, -1}, dy[4] = {0, 1, 1, 1};
+	        const float low = static_cast<float>(lowThreshold), high = static_cast<float>(highThreshold);
+	        ThreadPool::instance().parallelFor(0, height, 32, [&](int lo, int hi) {
+	            for (int y = lo; y < hi; ++y) {
+	                for (int x = 0; x < width; ++x) {
+	                    const size_t i = static_cast<size_t>(y) * width + x;
+	                    const float m = magnitude[i];
+	                    uint8_t result = 0;
+	                    if (m >= low && m > 0.0f) {
+	                        const int k = sector[i];
+	                        const int xa = std::clamp(x + dx[k], 0, width - 1), ya = std::clamp(y + dy[k], 0, height - 1);
+	                        const int xb = std::clamp(x - dx[k], 0, width - 1), yb = std::clamp(y - dy[k], 0, height - 1);
+	                        if (m >= magnitude[static_cast<size_t>(ya) * width + xa] && m > magnitude[static_cast<size_t>(yb) * width + xb]) {
+	                            result = m >= high ? 2 : 1;
+	                        }
+	                    }
+	                    state[i] = result;
+	                }
+	            }
+	        });
+
+	        // Hysteresis: grow from every strong pixel through 8-connected weak ones.
+	        GrayImage edges(width, height, 255);
+	        uint16_t* out = edges.getData().data();
+	        std::vector<size_t> stack;
+	        for (size_t seed = 0; seed < count; ++seed) {
+	            if (state[seed] != 2 || out[seed]) continue;
+	            out[seed] = 255;
+	            stack.push_back(seed);
+	            while (!stack.empty()) {
+	                const size_t i = stack.back();
+	                stack.pop_back();
+	                const int x = static_cast<int>(i % width), y = static_cast<int>(i / width);
+	                for (int ny = std::max(y - 1, 0); ny <= std::min(y + 1, height - 1); ++ny) {
+	                    for (int nx = std::max(x - 1, 0); nx <= std::min(x + 1, width - 1); ++nx) {
+	                        const size_t j = static_cast<size_t>(ny) * width + nx;
+	                        if (state[j] != 0 && !out[j]) {
+	                            out[j] = 255;
+	                            stack.push_back(j);
+	                        }
+	                    }
+	                }
+	            }
+	        }
+	        return edges;
+	    }
 
-                            srcX = std::clamp(srcX, 0, m_width - 1);
-                            srcY = std::clamp(srcY, 0, m_height - 1);
+	    Image diffImageImpl(const Image& other, double gain) const {
+	        checkSameSizeImpl(other);
+	        Gradient heat = Gradient::linear(0, 0, 1, 0);
+	        heat.addStop(0.0, Pixel(0, 0, 0)).addStop(1.0 / 3, Pixel(1, 0, 0)).addStop(2.0 / 3, Pixel(1, 1, 0)).addStop(1.0, Pixel(1, 1, 1)).buildLut(1024);
+	        Image result(m_width, m_height);
+	        ThreadPool::instance().parallelFor(0, m_height, 16, [&](int lo, int hi) {
+	            for (size_t i = static_cast<size_t>(lo) * m_width; i < static_cast<size_t>(hi) * m_width; ++i) {
+	                const double d = std::max({std::abs(std::get<0>(m_img[i]) - std::get<0>(other.m_img[i])),
+	                                           std::abs(std::get<1>(m_img[i]) - std::get<1>(other.m_img[i])),
+	                                           std::abs(std::get<2>(m_img[i]) - std::get<2>(other.m_img[i]))});
+	                result.m_img[i] = heat.colorAt(d * gain);
+	            }
+	        });
+	        PPMPP_PROFILE_PIXELS(m_img.size());
+	        return result;
+	    }
 
-                            Pixel& srcPixel = m_img[srcX + srcY * m_width];
+	    void setColorSpaceImpl(ColorSpace space) {
+	        if (space == m_colorSpace) return;
+	        Pixel (*convert)(const Pixel&) = space == ColorSpace::Linear ? toLinear : toSrgb;
+	        ThreadPool::instance().parallelFor(0, m_height, 16, [&](int lo, int hi) {
+	            for (size_t i = static_cast<size_t>(lo) * m_width; i < static_cast<size_t>(hi) * m_width; ++i) m_img[i] = convert(m_img[i]);
+	        });
+	        m_colorSpace = space;
+	        PPMPP_PROFILE_PIXELS(m_img.size());
+	    }
 
-                            setPixel(centerX + x, centerY + y, srcPixel);
-                        }
-                    }
-                }
-            }
-        }
+	    void fillGradientImpl(const Gradient& gradient) {
+	        ThreadPool::instance().parallelFor(0, m_height, 8, [&](int lo, int hi) {
+	            for (int y = lo; y < hi; ++y) {
+	                gradient.fillSpan(0, m_width, y, &m_img[getIndex(0, y)]);
+	            }
+	        });
+	        markDirtyImpl(0, 0, m_width, m_height);
+	        PPMPP_PROFILE_PIXELS(m_img.size());
+	    }
 
-	    void drawGradientsImpl(const std::vector<Pixel>& colors, double angle_degree) {
-	        double angle = angle_degree * M_PI / 180.0;
+	    // Runs a filled-primitive draw with every written pixel taken from the gradient instead of its color. The
+	    // previous paint is restored even if the draw throws, so m_paint never outlives the caller's gradient.
+	    template <typename Draw>
+	    void paintWithImpl(const Gradient& gradient, Draw draw) {
+	        struct Restore {
+	            const Gradient*& paint;
+	            const Gradient* saved;
+	            ~Restore() { paint = saved; }
+	        } restore{m_paint, std::exchange(m_paint, &gradient)};
+	        draw();
+	    }
 
-	        if (colors.size() < 2 || colors.size() > 5) {
-	            std::cerr << "Invalid number of colors";
+	    void readImpl(const std::string& filename, GrayImage* alpha) {
+	        std::vector<uint8_t> data = detail::readFileBytes(filename);
+	        if (detail::isQoi(data)) {
+	            readQoiImpl(data, alpha);
 	            return;
 	        }
+	        detail::NetpbmHeader header = detail::parseNetpbmHeader(data);
+	        const size_t count = static_cast<size_t>(header.width) * header.height;
+	        const bool gray = header.depth <= 2;
+	        const int alphaChannel = (header.depth == 2 || header.depth == 4) ? header.depth - 1 : -1;
+
+	        std::vector<Pixel> img(count);
+	        if (alpha) {
+	            alpha->resize(header.width, header.height);
+	            alpha->setMaxval(header.maxval);
+	            if (alphaChannel < 0) std::fill(alpha->getData().begin(), alpha->getData().end(), static_cast<uint16_t>(header.maxval));
+	        }
+	        uint16_t* alphaData = (alpha && alphaChannel >= 0) ? alpha->getData().data() : nullptr;
+
+	        // 8-bit samples go through a table; this is also bit-identical to dividing by 255.0.
+	        // Linear images decode every sample value through a table of maxval + 1 entries.
+	        const bool linear = m_colorSpace == ColorSpace::Linear;
+	        const double maxval = header.maxval;
+	        std::vector<double> lut(linear ? header.maxval + 1 : 256);
+	        if (linear && header.maxval == 255) {
+	            std::copy(detail::srgbTables().toLinear.begin(), detail::srgbTables().toLinear.end(), lut.begin());
+	        } else {
+	            for (size_t v = 0; v < lut.size(); ++v) lut[v] = linear ? srgbToLinear(v / maxval) : v / maxval;
+	        }
+	        auto toDouble = [&](unsigned v) { return (linear || header.maxval <= 255) ? lut[v] : v / maxval; };
 
-	        auto interpolate = [](const Pixel& a, const Pixel& b, double t) -> Pixel {
-	            auto [r1, g1, b1] = a;
-	            auto [r2, g2, b2] = b;
-	            return {r1 + t * (r2 - r1), g1 + t * (g2 - g1), b1 + t * (b2 - b1)};
-	        };
-
-	        double max_projection = m_width * std::cos(angle) + m_height * std::sin(angle);
-	        double min_projection = 0;
-	        double total_length = max_projection - min_projection;
-	        double segment_length = total_length / (colors.size() - 1);
-
-	        for (int y = 0; y < m_height; ++y) {
-	            for (int x = 0; x < m_width; ++x) {
-	                double projection = x * std::cos(angle) + y * std::sin(angle);
-	                int segment_index = std::min(static_cast<int>(projection / segment_length), static_cast<int>(colors.size()) - 2);
-	                double t_local = (projection - segment_index * segment_length) / segment_length;
-
-	                Pixel color = interpolate(colors[segment_index], colors[segment_index + 1], t_local);
-	                setPixel(x,y,color);
+	        Pixel* dst = img.data();
+	        detail::decodeNetpbmPixels(data, header, [&](size_t i, const unsigned* s) {
+	            if (gray) {
+	                double v = toDouble(s[0]);
+	                dst[i] = Pixel(v, v, v);
+	            } else {
+	                dst[i] = Pixel(toDouble(s[0]), toDouble(s[1]), toDouble(s[2]));
 	            }
-	        }
+	            if (alphaData) alphaData[i] = static_cast<uint16_t>(s[alphaChannel]);
+	        });
+
+	        m_img.swap(img);
+	        m_width = header.width;
+	        m_height = header.height;
+	        resetDirtyImpl();
+	        PPMPP_PROFILE_PIXELS(m_img.size());
 	    }
 
-	    void readImpl(const std::string& filename) {
-	        std::string magic;
-	        int max;
-	        uint8_t buffer[3];
-	        Pixel color;
+	    void readQoiImpl(const std::vector<uint8_t>& data, GrayImage* alpha) {
+	        int width = 0, height = 0, channels = 0;
+	        std::vector<Pixel> img;
+	        uint16_t* alphaData = nullptr;
+	        std::array<double, 256> lut;
+	        for (int v = 0; v < 256; ++v) lut[v] = m_colorSpace == ColorSpace::Linear ? detail::srgbTables().toLinear[v] : v / 255.0;
+	        detail::decodeQoiPixels(data, width, height, channels, [&](size_t i, const detail::QoiRgba& px) {
+	            if (i == 0) {
+	                img.resize(static_cast<size_t>(width) * height);
+	                if (alpha) {
+	                    alpha->resize(width, height);
+	                    alpha->setMaxval(255);
+	                    alphaData = alpha->getData().data();
+	                }
+	            }
+	            img[i] = Pixel(lut[px.r], lut[px.g], lut[px.b]);
+	            if (alphaData) alphaData[i] = px.a;
+	        });
+	        m_img.swap(img);
+	        m_width = width;
+	        m_height = height;
+	        resetDirtyImpl();
+	        PPMPP_PROFILE_PIXELS(m_img.size());
+	    }
 
-	        std::ifstream in(filename, std::ifstream::binary);
-	        if (!in.is_open()) {
-	            std::cout << "Can't open " << filename << std::endl;
-	            exit(1);
-	        }
+	    void writeImpl(const std::string& filename) {
+	        std::string suffix = getSuffix(filename);
+	        FileFormat format = detail::formatFromSuffix(suffix, FileFormat::P6);
+	        std::string fname = format == FileFormat::P6 ? setSuffix(filename, ".ppm") : filename;
+	        writeFormatImpl(fname, format, 255, nullptr);
+	    }
 
-	        in >> magic;
-	        in.seekg(1, std::ios::cur);
-	        char c;
-	        in.get(c);
-	        if (c == '#') {
-	            while (c != '\n') {
-	                in.get(c);
-	            }
+	    void writeFormatImpl(const std::string& filename, FileFormat format, int maxval, const GrayImage* alpha) {
+	        if (format == FileFormat::QOI) {
+	            std::vector<uint8_t> pixels;
+	            quantizeRgb8Impl(pixels, alpha);
+	            writeQoiImpl(filename, pixels, m_width, m_height, alpha ? 4 : 3);
+	        } else if (format == FileFormat::PNG) {
+	            writePngImpl(filename, 6, alpha);
 	        } else {
-	            in.seekg(-1, std::ios::cur);
+	            writeNetpbmImpl(filename, format, maxval, alpha);
 	        }
+	    }
 
-	        in >> m_width >> m_height >> max;
-	        if (max != 255) {
-	            std::cout << "Not 8 bit per RGB color." << std::endl;
-	            exit(1);
+	    // Converts m_img to interleaved 8-bit RGB (or RGBA when alpha is given), with the same quantization as P6.
+	    void quantizeRgb8Impl(std::vector<uint8_t>& out, const GrayImage* alpha) {
+	        if (alpha && (alpha->getWidth() != m_width || alpha->getHeight() != m_height)) {
+	            throw Error("Alpha must have the same size as the image");
 	        }
-
-	        if (magic == "P6") {
-	            in.seekg(1, std::ios::cur);
-	            m_img.clear();
-	            for (int i = 0; i < m_width * m_height; ++i) {
-	                in.read(reinterpret_cast<char*>(buffer), 3);
-	                color = std::make_tuple(
-	                    static_cast<double>(buffer[0]) / 255.0,
-	                    static_cast<double>(buffer[1]) / 255.0,
-	                    static_cast<double>(buffer[2]) / 255.0
-	                );
-	                m_img.push_back(color);
+	        const int channels = alpha ? 4 : 3;
+	        const size_t count = static_cast<size_t>(m_width) * m_height;
+	        out.resize(count * channels);
+	        PPMPP_PROFILE_SCRATCH(out.size());
+	        uint8_t* dst = out.data();
+	        const bool linear = m_colorSpace == ColorSpace::Linear;
+	        const detail::SrgbTables& srgb = detail::srgbTables();
+	        for (size_t i = 0; i < count; ++i, dst += channels) {
+	            auto [r, g, b] = m_img[i];
+	            if (linear) {
+	                dst[0] = detail::encodeSrgb8(srgb, r);
+	                dst[1] = detail::encodeSrgb8(srgb, g);
+	                dst[2] = detail::encodeSrgb8(srgb, b);
+	            } else {
+	                dst[0] = static_cast<uint8_t>(detail::quantizeSample(r, 255));
+	                dst[1] = static_cast<uint8_t>(detail::quantizeSample(g, 255));
+	                dst[2] = static_cast<uint8_t>(detail::quantizeSample(b, 255));
 	            }
-	        } else {
-	            std::cout << filename << " is not a P6 file." << std::endl;
-	            exit(1);
+	            if (alpha) dst[3] = static_cast<uint8_t>(static_cast<uint32_t>(alpha->getData()[i]) * 255 / alpha->getMaxval());
 	        }
-	        
-	        in.close();
 	    }
 
-	    void writeImpl(const std::string& filename) {
-	        Pixel color;
-	        std::string fname = setSuffix(filename, ".ppm");
+	    void writePngImpl(const std::string& filename, int level, const GrayImage* alpha) {
+	        std::vector<uint8_t> pixels;
+	        quantizeRgb8Impl(pixels, alpha);
+	        std::ofstream out(filename, std::ios_base::out | std::ios_base::binary);
+	        if (!out.is_open()) {
+	            throw Error("Could not open " + filename + " for writing.");
+	        }
+	        detail::writePng(out, pixels.data(), m_width, m_height, alpha ? 4 : 3, level, ThreadPool::instance());
+	        if (!out) {
+	            throw Error("Could not write " + filename);
+	        }
+	        PPMPP_PROFILE_PIXELS(static_cast<uint64_t>(m_width) * m_height);
+	    }
 
-	        std::ofstream out(fname, std::ios_base::out | std::ios_base::binary);
+	    static void writeQoiImpl(const std::string& filename, const std::vector<uint8_t>& pixels, int width, int height, int channels) {
+	        std::ofstream out(filename, std::ios_base::out | std::ios_base::binary);
 	        if (!out.is_open()) {
-	            std::cerr << "Could not open " << fname << " for writing." << std::endl;
-	            exit(1);
+	            throw Error("Could not open " + filename + " for writing.");
+	        }
+	        QoiEncoder encoder(out, width, height, channels);
+	        const size_t stride = static_cast<size_t>(width) * channels;
+	        for (int y = 0; y < height; ++y) {
+	            encoder.pushRow(pixels.data() + y * stride);
+	        }
+	        encoder.finish();
+	        PPMPP_PROFILE_PIXELS(static_cast<uint64_t>(width) * height);
+	    }
+
+	    void writeNetpbmImpl(const std::string& filename, FileFormat format, int maxval, const GrayImage* alpha) {
+	        if (maxval < 1 || maxval > 65535) {
+	            throw Error("Invalid maxval");
+	        }
+	        if (alpha && (format != FileFormat::P7 || alpha->getWidth() != m_width || alpha->getHeight() != m_height)) {
+	            throw Error("Alpha requires P7 and a GrayImage of the same size");
 	        }
+	        const bool gray = format == FileFormat::P2 || format == FileFormat::P5;
+	        const int depth = (gray ? 1 : 3) + (alpha ? 1 : 0);
+	        const size_t count = static_cast<size_t>(m_width) * m_height;
+
+	        std::vector<uint8_t> out = detail::netpbmHeader(format, m_width, m_height, depth, maxval);
+	        const bool ascii = format == FileFormat::P2 || format == FileFormat::P3;
+	        const int bytesPerSample = maxval > 255 ? 2 : 1;
+
+	        // Linear images are encoded to sRGB with rounding; the 8-bit case uses the table encoder.
+	        const detail::SrgbTables& srgb = detail::srgbTables();
+	        auto encode = [&](double v) -> unsigned {
+	            if (m_colorSpace == ColorSpace::Srgb) return detail::quantizeSample(v, maxval);
+	            if (maxval == 255) return detail::encodeSrgb8(srgb, v);
+	            return static_cast<unsigned>(linearToSrgb(std::clamp(v, 0.0, 1.0)) * maxval + 0.5);
+	        };
 
-	        out << "P6\n" << m_width << ' ' << m_height << "\n255\n";
+	        unsigned samples[4];
+	        auto quantize = [&](size_t i) {
+	            auto [r, g, b] = m_img[i];
+	            if (gray) {
+	                samples[0] = encode(0.299 * r + 0.587 * g + 0.114 * b);
+	            } else {
+	                samples[0] = encode(r);
+	                samples[1] = encode(g);
+	                samples[2] = encode(b);
+	            }
+	            if (alpha) {
+	                samples[depth - 1] = static_cast<unsigned>(std::min<uint64_t>(static_cast<uint64_t>(alpha->getData()[i]) * maxval / alpha->getMaxval(), maxval));
+	            }
+	        };
 
-	        for (int i = 0; i < m_width * m_height; ++i) {
-	            color = m_img[i];
-	            out << static_cast<char>(std::get<0>(color) * 255.0)
-	                << static_cast<char>(std::get<1>(color) * 255.0)
-	                << static_cast<char>(std::get<2>(color) * 255.0);
+	        if (ascii) {
+	            out.reserve(out.size() + count * depth * 4);
+	            int lineLength = 0;
+	            for (size_t i = 0; i < count; ++i) {
+	                quantize(i);
+	                detail::appendNetpbmSamples(out, format, maxval, samples, depth, lineLength);
+	            }
+	            out.push_back('\n');
+	        } else {
+	            // Binary rasters are sized once and filled in place.
+	            size_t offset = out.size();
+	            out.resize(offset + count * depth * bytesPerSample);
+	            uint8_t* dst = out.data() + offset;
+	            for (size_t i = 0; i < count; ++i) {
+	                quantize(i);
+	                for (int c = 0; c < depth; ++c) {
+	                    if (bytesPerSample == 2) *dst++ = static_cast<uint8_t>(samples[c] >> 8);
+	                    *dst++ = static_cast<uint8_t>(samples[c]);
+	                }
+	            }
 	        }
+	        PPMPP_PROFILE_SCRATCH(out.capacity());
 
-	        out.close();
+	        detail::writeFileBytes(filename, out);
+	        PPMPP_PROFILE_PIXELS(count);
 	    }
 
 		void getAllYs(std::vector<int> &ys, std::vector<Point> &Coords) {
@@ -1452,8 +7142,834 @@ namespace ppm
 		    return "";
 		}
 
+		// Re-derives the tile grid after a size change; everything counts as dirty afterwards.
+		void resetDirtyImpl() {
+			if (m_dirty.tiles.empty()) return;
+			int tile = 1 << m_dirty.tileShift;
+			m_dirty.tilesX = std::max((m_width + tile - 1) >> m_dirty.tileShift, 1);
+			m_dirty.tilesY = std::max((m_height + tile - 1) >> m_dirty.tileShift, 1);
+			m_dirty.tiles.assign(static_cast<size_t>(m_dirty.tilesX) * m_dirty.tilesY, 1);
+		}
+
+		void markDirtyPixelImpl(int x, int y) {
+			if (!m_dirty.tiles.empty()) {
+				m_dirty.tiles[(y >> m_dirty.tileShift) * m_dirty.tilesX + (x >> m_dirty.tileShift)] = 1;
+			}
+		}
+
+		// Marks the tiles touching [x0,x1)x[y0,y1), clipped to the image.
+		void markDirtyImpl(int x0, int y0, int x1, int y1) {
+			if (m_dirty.tiles.empty()) return;
+			x0 = std::max(x0, 0); y0 = std::max(y0, 0);
+			x1 = std::min(x1, m_width); y1 = std::min(y1, m_height);
+			if (x0 >= x1 || y0 >= y1) return;
+			int shift = m_dirty.tileShift;
+			for (int ty = y0 >> shift; ty <= (y1 - 1) >> shift; ++ty) {
+				std::fill_n(m_dirty.tiles.begin() + ty * m_dirty.tilesX + (x0 >> shift), ((x1 - 1) >> shift) - (x0 >> shift) + 1, 1);
+			}
+		}
+
+		// Half-open [x0,y0,x1,y1) rectangles a Region covers. Dirty tiles are dilated by the halo (in whole tiles),
+		// split into horizontal runs per tile row, and runs with the same span in consecutive rows are merged.
+		std::vector<std::array<int, 4>> regionRectsImpl(Region region, int halo) const {
+			std::vector<std::array<int, 4>> rects;
+			if (m_width <= 0 || m_height <= 0) return rects;
+			if (region == Region::All || m_dirty.tiles.empty()) {
+				rects.push_back({0, 0, m_width, m_height});
+				return rects;
+			}
+
+			int tilesX = m_dirty.tilesX, tilesY = m_dirty.tilesY, shift = m_dirty.tileShift;
+			int grow = (std::max(halo, 0) + (1 << shift) - 1) >> shift;
+			std::vector<uint8_t> mask = m_dirty.tiles;
+			if (grow > 0) {
+				std::vector<uint8_t> rows(mask.size(), 0);
+				for (int ty = 0; ty < tilesY; ++ty) {
+					for (int tx = 0; tx < tilesX; ++tx) {
+						if (!m_dirty.tiles[ty * tilesX + tx]) continue;
+						std::fill(rows.begin() + ty * tilesX + std::max(tx - grow, 0), rows.begin() + ty * tilesX + std::min(tx + grow, tilesX - 1) + 1, 1);
+					}
+				}
+				std::fill(mask.begin(), mask.end(), 0);
+				for (int ty = 0; ty < tilesY; ++ty) {
+					for (int tx = 0; tx < tilesX; ++tx) {
+						if (!rows[ty * tilesX + tx]) continue;
+						for (int y = std::max(ty - grow, 0); y <= std::min(ty + grow, tilesY - 1); ++y) mask[y * tilesX + tx] = 1;
+					}
+				}
+			}
+
+			// Tile-space rects; open ones end on the previous tile row and can still grow downward.
+			std::vector<std::array<int, 4>> tileRects;
+			std::vector<size_t> open, nextOpen;
+			for (int ty = 0; ty < tilesY; ++ty) {
+				nextOpen.clear();
+				for (int tx = 0; tx < tilesX;) {
+					if (!mask[ty * tilesX + tx]) { ++tx; continue; }
+					int end = tx;
+					while (end < tilesX && mask[ty * tilesX + end]) ++end;
+					auto match = std::find_if(open.begin(), open.end(), [&](size_t i) { return tileRects[i][0] == tx && tileRects[i][2] == end; });
+					if (match != open.end()) {
+						tileRects[*match][3] = ty + 1;
+						nextOpen.push_back(*match);
+					} else {
+						tileRects.push_back({tx, ty, end, ty + 1});
+						nextOpen.push_back(tileRects.size() - 1);
+					}
+					tx = end;
+				}
+				open.swap(nextOpen);
+			}
+
+			for (const auto& t : tileRects) {
+				rects.push_back({t[0] << shift, t[1] << shift, std::min(t[2] << shift, m_width), std::min(t[3] << shift, m_height)});
+			}
+			return rects;
+		}
+
+		// Tile-granular record of what changed since clearDirty(); tiles is empty while tracking is off.
+		struct DirtyMask {
+			int tileShift = 5;
+			int tilesX = 0;
+			int tilesY = 0;
+			std::vector<uint8_t> tiles;
+		};
+
 		std::vector<Pixel> m_img;
         int m_width = 0;
         int m_height = 0;
+        DirtyMask m_dirty;
+        const Gradient* m_paint = nullptr;
+        ColorSpace m_colorSpace = ColorSpace::Srgb;
+        std::vector<Pixel> m_backBuffer; // previous pixels after a double-buffered filter; never copied
+	};
+
+	// The hot Image filters on packed Rgb<T> buffers of width * height pixels, row by row (e.g. from exportPixels).
+	// They run the same kernels as the Image methods of the same names, instantiated for the channel type: 8-bit
+	// channels take integer paths, other types compute in float (double for Rgb<double>), and integer channels
+	// are rounded and clamped to their range. Channel values are used as stored, with no color space conversion.
+
+	// out must not overlap in.
+	template <typename T>
+	void convolve(const Rgb<T>* in, Rgb<T>* out, int width, int height, const Kernel& kernel, BorderMode border = BorderMode::Clamp,
+	              const Rgb<T>& constant = Rgb<T>()) {
+		PPMPP_PROFILE_SCOPE("convolve(Rgb)");
+		if (in == out) throw std::invalid_argument("convolve: out must not overlap in");
+		detail::convolvePixels(in, out, width, height, kernel, border, constant);
+		PPMPP_PROFILE_PIXELS(static_cast<size_t>(width) * height);
+	}
+
+	template <typename T>
+	void applyMorphology(Rgb<T>* pixels, int width, int height, MorphologyOp op, int seWidth, int seHeight, MorphologyMode mode = MorphologyMode::PerChannel) {
+		PPMPP_PROFILE_SCOPE("applyMorphology(Rgb)");
+		std::vector<Rgb<T>> result(static_cast<size_t>(width) * height);
+		PPMPP_PROFILE_SCRATCH(result.size() * sizeof(Rgb<T>));
+		detail::morphologyPixels(pixels, result.data(), width, height, op, seWidth, seHeight, mode);
+		std::copy(result.begin(), result.end(), pixels);
+		PPMPP_PROFILE_PIXELS(result.size());
+	}
+
+	// 8-bit and 16-bit channels are filtered in constant time per pixel as they are.
+	template <typename T>
+	void applyMedianFilter(Rgb<T>* pixels, int width, int height, int radius) {
+		PPMPP_PROFILE_SCOPE("applyMedianFilter(Rgb)");
+		detail::medianFilterPixels(pixels, width, height, radius);
+		PPMPP_PROFILE_PIXELS(static_cast<size_t>(width) * height);
+	}
+
+	// srcRect of the srcWidth x srcHeight buffer src drawn to dstRect of dst, clipped and scaled like
+	// Image::drawImage (Bicubic samples as Bilinear). alpha, if set, is a mask the size of src. src must not
+	// overlap dst.
+	template <typename T>
+	void drawImage(Rgb<T>* dst, int width, int height, const Rgb<T>* src, int srcWidth, int srcHeight, const Rect& srcRect, const Rect& dstRect,
+	               BlendMode mode = BlendMode::Replace, ScaleFilter filter = ScaleFilter::Bilinear, double opacity = 1.0, const GrayImage* alpha = nullptr) {
+		PPMPP_PROFILE_SCOPE("drawImage(Rgb)");
+		if (alpha && (alpha->getWidth() != srcWidth || alpha->getHeight() != srcHeight)) {
+			throw std::invalid_argument("drawImage: alpha must have the size of the source");
+		}
+		detail::PreparedBlit<Rgb<T>> p;
+		if (!detail::planBlit(srcRect, dstRect, srcWidth, srcHeight, width, height, mode, filter, opacity, p)) return;
+		p.pixels = src;
+		p.alpha = alpha;
+		ThreadPool::instance().parallelFor(p.clip.y, p.clip.y + p.clip.h, 16, [&](int lo, int hi) {
+			std::vector<Rgb<T>> line(p.clip.w);
+			std::vector<double> coverage(p.clip.w);
+			for (int y = lo; y < hi; ++y) detail::blitRow(p, y, dst + static_cast<size_t>(y) * width + p.clip.x, line, coverage);
+		});
+		PPMPP_PROFILE_PIXELS(static_cast<size_t>(p.clip.w) * p.clip.h);
+	}
+
+	// Stop colors are converted with convertChannel; Rgb8 pixels are read from an 8-bit table after buildLut.
+	template <typename T>
+	void fillGradient(Rgb<T>* pixels, int width, int height, const Gradient& gradient) {
+		PPMPP_PROFILE_SCOPE("fillGradient(Rgb)");
+		ThreadPool::instance().parallelFor(0, height, 8, [&](int lo, int hi) {
+			for (int y = lo; y < hi; ++y) gradient.fillSpan(0, width, y, pixels + static_cast<size_t>(y) * width);
+		});
+		PPMPP_PROFILE_PIXELS(static_cast<size_t>(width) * height);
+	}
+
+	// Blocking FIFO with a fixed capacity; push waits while full, pop waits while empty.
+	template <typename T>
+	class BoundedQueue
+	{
+	public:
+		explicit BoundedQueue(size_t capacity) : m_capacity(std::max<size_t>(capacity, 1)) {}
+
+		// Returns false if the queue was closed.
+		bool push(T item) {
+			std::unique_lock<std::mutex> lock(m_mutex);
+			m_notFull.wait(lock, [this] { return m_closed || m_items.size() < m_capacity; });
+			if (m_closed) return false;
+			m_items.push_back(std::move(item));
+			m_notEmpty.notify_one();
+			return true;
+		}
+
+		// Returns false once the queue is closed and drained.
+		bool pop(T& item) {
+			std::unique_lock<std::mutex> lock(m_mutex);
+			m_notEmpty.wait(lock, [this] { return m_closed || !m_items.empty(); });
+			if (m_items.empty()) return false;
+			item = std::move(m_items.front());
+			m_items.pop_front();
+			m_notFull.notify_one();
+			return true;
+		}
+
+		void close() {
+			std::lock_guard<std::mutex> lock(m_mutex);
+			m_closed = true;
+			m_notEmpty.notify_all();
+			m_notFull.notify_all();
+		}
+
+	private:
+		size_t m_capacity;
+		std::deque<T> m_items;
+		std::mutex m_mutex;
+		std::condition_variable m_notEmpty;
+		std::condition_variable m_notFull;
+		bool m_closed = false;
+	};
+
+	// Caps the bytes held by in-flight work. A single item larger than the cap is still let through.
+	class MemoryBudget
+	{
+	public:
+		explicit MemoryBudget(size_t capacity) : m_capacity(capacity) {}
+
+		void acquire(size_t bytes) {
+			std::unique_lock<std::mutex> lock(m_mutex);
+			m_cv.wait(lock, [&] { return m_used == 0 || m_used + bytes <= m_capacity; });
+			m_used += bytes;
+		}
+
+		void release(size_t bytes) {
+			{
+				std::lock_guard<std::mutex> lock(m_mutex);
+				m_used -= std::min(bytes, m_used);
+			}
+			m_cv.notify_all();
+		}
+
+		// Re-accounts an item whose size changed while it was held. Never blocks, so a holder can't
+		// deadlock waiting on itself; the budget may briefly run over until items are released.
+		void resize(size_t from, size_t to) {
+			{
+				std::lock_guard<std::mutex> lock(m_mutex);
+				m_used = m_used - std::min(from, m_used) + to;
+			}
+			if (to < from) m_cv.notify_all();
+		}
+
+		size_t used() {
+			std::lock_guard<std::mutex> lock(m_mutex);
+			return m_used;
+		}
+
+	private:
+		size_t m_capacity;
+		size_t m_used = 0;
+		std::mutex m_mutex;
+		std::condition_variable m_cv;
+	};
+
+	using ImageFilter = std::function<void(Image&)>;
+
+	struct BatchOptions {
+		unsigned readers = 2;
+		unsigned workers = std::max(1u, std::thread::hardware_concurrency());
+		unsigned writers = 2;
+		size_t maxInFlightBytes = size_t(1) << 30;
+		std::string outputDirectory = ".";
+		std::string outputSuffix = ".ppm"; // picks the output format, see Image::write
+	};
+
+	struct BatchStageStats {
+		std::string name;
+		uint64_t items = 0;
+		uint64_t pixels = 0;
+		double busySeconds = 0.0; // summed over the stage's threads
+	};
+
+	struct BatchReport {
+		BatchStageStats read{"read"};
+		BatchStageStats process{"process"};
+		BatchStageStats write{"write"};
+		uint64_t succeeded = 0;
+		std::vector<std::pair<std::string, std::string>> failures; // input, error message
+		double wallSeconds = 0.0;
+		size_t peakInFlightBytes = 0;
+	};
+
+	// Regular files in directory, sorted by name.
+	inline std::vector<std::string> listFiles(const std::string& directory) {
+		std::vector<std::string> files;
+		for (const auto& entry : std::filesystem::directory_iterator(directory)) {
+			if (entry.is_regular_file()) files.push_back(entry.path().string());
+		}
+		std::sort(files.begin(), files.end());
+		return files;
+	}
+
+	// Reads, filters and writes every input through a bounded three-stage pipeline: reader threads,
+	// worker threads and writer threads connected by bounded queues, with in-flight images limited
+	// to maxInFlightBytes. A failing file is recorded in the report and does not stop the batch.
+	inline BatchReport processBatch(const std::vector<std::string>& inputs, const std::vector<ImageFilter>& chain, const BatchOptions& options = BatchOptions()) {
+		struct Item {
+			size_t index = 0;
+			Image image;
+			size_t bytes = 0;
+		};
+
+		BatchReport report;
+		std::mutex reportMutex;
+		MemoryBudget budget(options.maxInFlightBytes);
+		const unsigned readers = std::max(1u, options.readers);
+		const unsigned workers = std::max(1u, options.workers);
+		const unsigned writers = std::max(1u, options.writers);
+		BoundedQueue<Item> toProcess(workers * 2);
+		BoundedQueue<Item> toWrite(writers * 2);
+		std::atomic<size_t> nextInput{0};
+		std::atomic<size_t> peak{0};
+
+		using Clock = std::chrono::steady_clock;
+		auto seconds = [](Clock::time_point start) { return std::chrono::duration<double>(Clock::now() - start).count(); };
+		auto fail = [&](size_t index, const std::string& message) {
+			std::lock_guard<std::mutex> lock(reportMutex);
+			report.failures.emplace_back(inputs[index], message);
+		};
+		auto account = [&](BatchStageStats& stage, const Item& item, double busy) {
+			std::lock_guard<std::mutex> lock(reportMutex);
+			++stage.items;
+			stage.pixels += item.bytes / sizeof(Pixel);
+			stage.busySeconds += busy;
+		};
+		auto outputPath = [&](size_t index) {
+			std::filesystem::path path(options.outputDirectory);
+			path /= std::filesystem::path(inputs[index]).stem();
+			path += options.outputSuffix;
+			return path.string();
+		};
+		auto notePeak = [&] {
+			size_t used = budget.used();
+			for (size_t seen = peak.load(); used > seen && !peak.compare_exchange_weak(seen, used);) {}
+		};
+
+		// Inputs with the same stem in different directories would overwrite each other's output;
+		// the first one wins and the others are reported as failures.
+		std::vector<uint8_t> skip(inputs.size(), 0);
+		{
+			std::map<std::string, size_t> owners;
+			for (size_t index = 0; index < inputs.size(); ++index) {
+				auto [it, inserted] = owners.emplace(outputPath(index), index);
+				if (!inserted) {
+					skip[index] = 1;
+					fail(index, "output " + it->first + " collides with " + inputs[it->second]);
+				}
+			}
+		}
+
+		const Clock::time_point wallStart = Clock::now();
+		std::vector<std::thread> readerThreads, workerThreads, writerThreads;
+		for (unsigned t = 0; t < readers; ++t) {
+			readerThreads.emplace_back([&] {
+				for (size_t index; (index = nextInput.fetch_add(1)) < inputs.size();) {
+					if (skip[index]) continue;
+					// Reserve the decoded size (plus the file buffer while decoding) from the header, so
+					// decoding itself stays within the budget.
+					int width = 0, height = 0;
+					std::error_code ec;
+					const uintmax_t fileSize = std::filesystem::file_size(inputs[index], ec);
+					const size_t fileBytes = ec ? 0 : static_cast<size_t>(fileSize);
+					const size_t reserved = detail::probeImageSize(inputs[index], width, height)
+						? static_cast<size_t>(width) * height * sizeof(Pixel) + fileBytes : fileBytes;
+					budget.acquire(reserved);
+					notePeak();
+
+					Clock::time_point start = Clock::now();
+					Item item;
+					item.index = index;
+					try {
+						item.image.read(inputs[index]);
+					} catch (const std::exception& e) {
+						budget.release(reserved);
+						fail(index, e.what());
+						continue;
+					}
+					item.bytes = static_cast<size_t>(item.image.getWidth()) * item.image.getHeight() * sizeof(Pixel);
+					budget.resize(reserved, item.bytes);
+					notePeak();
+					account(report.read, item, seconds(start));
+					toProcess.push(std::move(item));
+				}
+			});
+		}
+		for (unsigned t = 0; t < workers; ++t) {
+			workerThreads.emplace_back([&] {
+				Item item;
+				while (toProcess.pop(item)) {
+					Clock::time_point start = Clock::now();
+					try {
+						for (const auto& filter : chain) filter(item.image);
+					} catch (const std::exception& e) {
+						fail(item.index, e.what());
+						budget.release(item.bytes);
+						continue;
+					}
+					account(report.process, item, seconds(start));
+					// Resampling filters change the size the budget and the write stats must see.
+					const size_t bytes = static_cast<size_t>(item.image.getWidth()) * item.image.getHeight() * sizeof(Pixel);
+					budget.resize(item.bytes, bytes);
+					item.bytes = bytes;
+					notePeak();
+					toWrite.push(std::move(item));
+				}
+			});
+		}
+		for (unsigned t = 0; t < writers; ++t) {
+			writerThreads.emplace_back([&] {
+				Item item;
+				while (toWrite.pop(item)) {
+					Clock::time_point start = Clock::now();
+					try {
+						item.image.write(outputPath(item.index));
+						account(report.write, item, seconds(start));
+						std::lock_guard<std::mutex> lock(reportMutex);
+						++report.succeeded;
+					} catch (const std::exception& e) {
+						fail(item.index, e.what());
+					}
+					budget.release(item.bytes);
+					item.image = Image();
+				}
+			});
+		}
+
+		for (auto& t : readerThreads) t.join();
+		toProcess.close();
+		for (auto& t : workerThreads) t.join();
+		toWrite.close();
+		for (auto& t : writerThreads) t.join();
+
+		report.wallSeconds = seconds(wallStart);
+		report.peakInFlightBytes = peak.load();
+		return report;
+	}
+
+	// One line per stage: items, megapixels per second of wall time and busy time.
+	inline void printBatchReport(std::ostream& out, const BatchReport& report) {
+		out << "Processed " << report.succeeded << " file(s), " << report.failures.size() << " failed, in " << report.wallSeconds << " s\n";
+		for (const BatchStageStats* stage : {&report.read, &report.process, &report.write}) {
+			double wall = report.wallSeconds > 0.0 ? report.wallSeconds : 1.0;
+			out << "  " << stage->name << ": " << stage->items << " images, " << stage->items / wall << " images/s, "
+			    << stage->pixels / wall / 1e6 << " MPixel/s, busy " << stage->busySeconds << " s\n";
+		}
+		out << "  peak in-flight: " << report.peakInFlightBytes / (1024.0 * 1024.0) << " MiB\n";
+		for (const auto& [input, message] : report.failures) {
+			out << "  failed: " << input << ": " << message << '\n';
+		}
+	}
+
+	// Writes images on background threads so the submitting thread only pays for a move. Queued
+	// images are limited to maxQueuedBytes of pixel data: submit blocks while the queue is full. A
+	// failed write never stops the writer; its exception is stored in the returned future and, if an
+	// error callback was given, passed to it on the writer thread.
+	class ImageWriter
+	{
+	public:
+		using ErrorCallback = std::function<void(const std::string& path, std::exception_ptr error)>;
+
+		explicit ImageWriter(unsigned threads = 2, size_t maxQueuedBytes = size_t(256) << 20, ErrorCallback onError = nullptr)
+			: m_queue(std::numeric_limits<size_t>::max()), m_budget(maxQueuedBytes), m_onError(std::move(onError)) {
+			for (unsigned t = 0; t < std::max(1u, threads); ++t) {
+				m_threads.emplace_back([this] { writerLoop(); });
+			}
+		}
+
+		// Writes everything still queued before returning.
+		~ImageWriter() {
+			m_queue.close();
+			for (auto& t : m_threads) t.join();
+		}
+
+		ImageWriter(const ImageWriter&) = delete;
+		ImageWriter& operator=(const ImageWriter&) = delete;
+
+		// Takes over the image's pixels; the format follows the suffix as in Image::write.
+		std::future<void> submit(Image&& image, std::string path) {
+			PPMPP_PROFILE_SCOPE("ImageWriter::submit");
+			return submitImpl(std::move(image), std::move(path), false, FileFormat::P6, 255);
+		}
+
+		std::future<void> submit(Image&& image, std::string path, FileFormat format, int maxval = 255) {
+			PPMPP_PROFILE_SCOPE("ImageWriter::submit");
+			return submitImpl(std::move(image), std::move(path), true, format, maxval);
+		}
+
+		// Returns once every image submitted before the call has been written or has failed.
+		void flush() {
+			PPMPP_PROFILE_SCOPE("ImageWriter::flush");
+			std::unique_lock<std::mutex> lock(m_mutex);
+			const uint64_t target = m_submitted;
+			m_idle.wait(lock, [&] { return m_completed >= target; });
+		}
+
+		size_t queuedBytes() {
+			return m_budget.used();
+		}
+
+		size_t pending() {
+			std::lock_guard<std::mutex> lock(m_mutex);
+			return static_cast<size_t>(m_submitted - m_completed);
+		}
+
+	private:
+		struct Job {
+			Image image;
+			std::string path;
+			bool explicitFormat = false;
+			FileFormat format = FileFormat::P6;
+			int maxval = 255;
+			size_t bytes = 0;
+			std::promise<void> done;
+		};
+
+		std::future<void> submitImpl(Image&& image, std::string path, bool explicitFormat, FileFormat format, int maxval) {
+			Job job;
+			job.bytes = image.getPixels().size() * sizeof(Pixel);
+			job.image = std::move(image);
+			job.path = std::move(path);
+			job.explicitFormat = explicitFormat;
+			job.format = format;
+			job.maxval = maxval;
+			std::future<void> result = job.done.get_future();
+
+			m_budget.acquire(job.bytes);
+			{
+				std::lock_guard<std::mutex> lock(m_mutex);
+				++m_submitted;
+			}
+			m_queue.push(std::move(job));
+			return result;
+		}
+
+		void writerLoop() {
+			Job job;
+			while (m_queue.pop(job)) {
+				try {
+					if (job.explicitFormat) {
+						job.image.write(job.path, job.format, job.maxval);
+					} else {
+						job.image.write(job.path);
+					}
+					job.done.set_value();
+				} catch (...) {
+					std::exception_ptr error = std::current_exception();
+					job.done.set_exception(error);
+					if (m_onError) {
+						try {
+							m_onError(job.path, error);
+						} catch (...) {
+						}
+					}
+				}
+				job.image = Image();
+				m_budget.release(job.bytes);
+				{
+					std::lock_guard<std::mutex> lock(m_mutex);
+					++m_completed;
+				}
+				m_idle.notify_all();
+			}
+		}
+
+		BoundedQueue<Job> m_queue;
+		MemoryBudget m_budget;
+		ErrorCallback m_onError;
+		std::mutex m_mutex;
+		std::condition_variable m_idle;
+		uint64_t m_submitted = 0;
+		uint64_t m_completed = 0;
+		std::vector<std::thread> m_threads;
+	};
+
+	enum class FrameFormat { Y4M, P6Stream };
+
+	namespace detail
+	{
+		inline void quantizeRowRgb8(const Pixel* src, int width, uint8_t* dst, bool linear = false) {
+			const SrgbTables& srgb = srgbTables();
+			for (int x = 0; x < width; ++x, dst += 3) {
+				auto [r, g, b] = src[x];
+				if (linear) {
+					dst[0] = encodeSrgb8(srgb, r);
+					dst[1] = encodeSrgb8(srgb, g);
+					dst[2] = encodeSrgb8(srgb, b);
+					continue;
+				}
+				dst[0] = static_cast<uint8_t>(quantizeSample(r, 255));
+				dst[1] = static_cast<uint8_t>(quantizeSample(g, 255));
+				dst[2] = static_cast<uint8_t>(quantizeSample(b, 255));
+			}
+		}
+
+		// BT.601 studio-range RGB -> YUV 4:2:0 for one pair of rows (row1 may equal row0 at the bottom edge).
+		// Chroma is the average of each 2x2 block. Rows are first split into planar float arrays so the
+		// arithmetic loops are straight-line and vectorizable.
+		inline void convertRowPairYuv420(const Pixel* row0, const Pixel* row1, int width, uint8_t* y0, uint8_t* y1, uint8_t* u, uint8_t* v, std::vector<float>& scratch, bool linear = false) {
+			scratch.resize(static_cast<size_t>(width) * 6);
+			float* r[2] = {scratch.data(), scratch.data() + 3 * width};
+			float* g[2] = {r[0] + width, r[1] + width};
+			float* b[2] = {g[0] + width, g[1] + width};
+			const Pixel* rows[2] = {row0, row1};
+			const SrgbTables& srgb = srgbTables();
+			for (int k = 0; k < 2; ++k) {
+				for (int x = 0; x < width; ++x) {
+					auto [pr, pg, pb] = rows[k][x];
+					if (linear) {
+						r[k][x] = encodeSrgb8(srgb, pr) * (1.0f / 255);
+						g[k][x] = encodeSrgb8(srgb, pg) * (1.0f / 255);
+						b[k][x] = encodeSrgb8(srgb, pb) * (1.0f / 255);
+						continue;
+					}
+					r[k][x] = static_cast<float>(std::clamp(pr, 0.0, 1.0));
+					g[k][x] = static_cast<float>(std::clamp(pg, 0.0, 1.0));
+					b[k][x] = static_cast<float>(std::clamp(pb, 0.0, 1.0));
+				}
+			}
+			uint8_t* ys[2] = {y0, y1};
+			for (int k = 0; k < 2; ++k) {
+				if (!ys[k]) continue;
+				const float* rr = r[k];
+				const float* gg = g[k];
+				const float* bb = b[k];
+				uint8_t* out = ys[k];
+				for (int x = 0; x < width; ++x) {
+					out[x] = static_cast<uint8_t>(16.5f + 65.481f * rr[x] + 128.553f * gg[x] + 24.966f * bb[x]);
+				}
+			}
+			const int chromaWidth = (width + 1) / 2;
+			for (int cx = 0; cx < chromaWidth; ++cx) {
+				int x0 = 2 * cx;
+				int x1 = std::min(x0 + 1, width - 1);
+				float ar = 0.25f * (r[0][x0] + r[0][x1] + r[1][x0] + r[1][x1]);
+				float ag = 0.25f * (g[0][x0] + g[0][x1] + g[1][x0] + g[1][x1]);
+				float ab = 0.25f * (b[0][x0] + b[0][x1] + b[1][x0] + b[1][x1]);
+				u[cx] = static_cast<uint8_t>(128.5f - 37.797f * ar - 74.203f * ag + 112.0f * ab);
+				v[cx] = static_cast<uint8_t>(128.5f + 112.0f * ar - 93.786f * ag - 18.214f * ab);
+			}
+		}
+	} // namespace detail
+
+	// Writes a sequence of frames to one output: a YUV4MPEG2 file or a stream of concatenated P6
+	// frames (path "-" is stdout; a FIFO path works too). Frames are converted on the calling
+	// thread (in parallel over rows) into one of a small ring of buffers and written by a background
+	// thread. Rows that did not change since the previous frame are not converted again.
+	class FrameSink
+	{
+	public:
+		FrameSink(const std::string& path, FrameFormat format, int width, int height, int fps = 30, size_t ringSize = 3)
+			: m_format(format), m_width(width), m_height(height), m_free(ringSize), m_full(ringSize) {
+			if (width <= 0 || height <= 0 || fps <= 0 || ringSize == 0) {
+				throw Error("Invalid FrameSink parameters");
+			}
+			if (path == "-") {
+				m_out = &std::cout;
+			} else {
+				m_file.open(path, std::ios_base::out | std::ios_base::binary);
+				if (!m_file.is_open()) {
+					throw Error("Could not open " + path + " for writing.");
+				}
+				m_out = &m_file;
+			}
+
+			std::string header;
+			if (format == FrameFormat::Y4M) {
+				header = "YUV4MPEG2 W" + std::to_string(width) + " H" + std::to_string(height) + " F" + std::to_string(fps) + ":1 Ip A1:1 C420jpeg\n";
+				m_frameHeader = "FRAME\n";
+				const size_t chroma = static_cast<size_t>((width + 1) / 2) * ((height + 1) / 2);
+				m_frameBytes = static_cast<size_t>(width) * height + 2 * chroma;
+			} else {
+				m_frameHeader = "P6\n" + std::to_string(width) + ' ' + std::to_string(height) + "\n255\n";
+				m_frameBytes = static_cast<size_t>(width) * height * 3;
+			}
+			m_out->write(header.data(), static_cast<std::streamsize>(header.size()));
+
+			m_converted.assign(m_frameBytes, 0);
+			m_ring.assign(ringSize, std::vector<uint8_t>(m_frameBytes));
+			for (size_t i = 0; i < ringSize; ++i) m_free.push(i);
+			m_writer = std::thread([this] { writerLoop(); });
+		}
+
+		~FrameSink() {
+			try {
+				close();
+			} catch (...) {
+			}
+		}
+
+		FrameSink(const FrameSink&) = delete;
+		FrameSink& operator=(const FrameSink&) = delete;
+
+		// Blocks only when every ring buffer is still waiting to be written. Rethrows a writer error.
+		// With dirty tracking enabled on the frame, only rows in dirty tiles are converted; call clearDirty() after submit.
+		void submit(const Image& frame) {
+			PPMPP_PROFILE_SCOPE("FrameSink::submit");
+			if (m_closed) throw Error("FrameSink is closed");
+			if (frame.getWidth() != m_width || frame.getHeight() != m_height) {
+				throw Error("Frame size does not match the FrameSink");
+			}
+			rethrowWriterError();
+
+			const std::vector<Pixel>& pixels = frame.getPixels();
+			const bool linear = frame.getColorSpace() == ColorSpace::Linear;
+			const bool tracked = frame.isDirtyTrackingEnabled() && m_framesSubmitted > 0;
+			const bool havePrevious = !tracked && !m_previous.empty() && linear == m_previousLinear;
+			const bool keepPrevious = !frame.isDirtyTrackingEnabled();
+			if (keepPrevious) {
+				m_previous.resize(pixels.size());
+			} else {
+				m_previous.clear();
+			}
+			const int tileSize = frame.getTileSize();
+			std::vector<uint8_t> tileRowDirty;
+			if (tracked) {
+				const int tilesX = (m_width + tileSize - 1) / tileSize;
+				tileRowDirty.resize((m_height + tileSize - 1) / tileSize);
+				for (int ty = 0; ty < static_cast<int>(tileRowDirty.size()); ++ty) {
+					for (int tx = 0; tx < tilesX && !tileRowDirty[ty]; ++tx) tileRowDirty[ty] = frame.isTileDirty(tx, ty);
+				}
+			}
+			const size_t w = static_cast<size_t>(m_width);
+			const int rowStep = m_format == FrameFormat::Y4M ? 2 : 1;
+			const int groups = (m_height + rowStep - 1) / rowStep;
+			std::atomic<uint64_t> reused{0};
+
+			ThreadPool::instance().parallelFor(0, groups, 16, [&](int lo, int hi) {
+				std::vector<float> scratch;
+				uint64_t skipped = 0;
+				for (int group = lo; group < hi; ++group) {
+					const int y = group * rowStep;
+					const int yLast = std::min(y + rowStep, m_height) - 1;
+					if (tracked && !tileRowDirty[y / tileSize] && !tileRowDirty[yLast / tileSize]) {
+						++skipped;
+						continue;
+					}
+					if (havePrevious && std::equal(pixels.begin() + y * w, pixels.begin() + (yLast + 1) * w, m_previous.begin() + y * w)) {
+						++skipped;
+						continue;
+					}
+					if (m_format == FrameFormat::Y4M) {
+						const size_t chromaWidth = (w + 1) / 2;
+						uint8_t* yPlane = m_converted.data();
+						uint8_t* uPlane = yPlane + w * m_height;
+						uint8_t* vPlane = uPlane + chromaWidth * ((m_height + 1) / 2);
+						detail::convertRowPairYuv420(&pixels[y * w], &pixels[yLast * w], m_width, yPlane + y * w, yLast != y ? yPlane + yLast * w : nullptr,
+							uPlane + group * chromaWidth, vPlane + group * chromaWidth, scratch, linear);
+					} else {
+						detail::quantizeRowRgb8(&pixels[y * w], m_width, m_converted.data() + y * w * 3, linear);
+					}
+					// Skipped rows already match, so only the rows converted here are copied.
+					if (keepPrevious) {
+						std::copy(pixels.begin() + y * w, pixels.begin() + (yLast + 1) * w, m_previous.begin() + y * w);
+					}
+				}
+				reused += skipped;
+			});
+			m_rowsReused += reused.load() * rowStep;
+			PPMPP_PROFILE_PIXELS(static_cast<uint64_t>(m_width) * m_height);
+
+			m_previousLinear = linear;
+			size_t slot;
+			if (!m_free.pop(slot)) throw Error("FrameSink is closed");
+			std::copy(m_converted.begin(), m_converted.end(), m_ring[slot].begin());
+			m_full.push(slot);
+			++m_framesSubmitted;
+		}
+
+		// Writes all pending frames and closes the output. Rethrows a writer error.
+		void close() {
+			if (!m_closed) {
+				m_closed = true;
+				m_full.close();
+				m_writer.join();
+				m_free.close();
+				m_out->flush();
+				if (m_file.is_open()) m_file.close();
+			}
+			rethrowWriterError();
+		}
+
+		uint64_t getFramesSubmitted() const { return m_framesSubmitted; }
+		uint64_t getRowsReused() const { return m_rowsReused; }
+
+	private:
+		void writerLoop() {
+			size_t slot;
+			while (m_full.pop(slot)) {
+				if (!m_failed.load()) {
+					m_out->write(m_frameHeader.data(), static_cast<std::streamsize>(m_frameHeader.size()));
+					m_out->write(reinterpret_cast<const char*>(m_ring[slot].data()), static_cast<std::streamsize>(m_frameBytes));
+					if (!*m_out) {
+						std::lock_guard<std::mutex> lock(m_errorMutex);
+						m_error = std::make_exception_ptr(Error("Could not write frame"));
+						m_failed = true;
+					}
+				}
+				m_free.push(slot);
+			}
+		}
+
+		void rethrowWriterError() {
+			std::lock_guard<std::mutex> lock(m_errorMutex);
+			if (m_error) {
+				std::exception_ptr error = m_error;
+				m_error = nullptr;
+				std::rethrow_exception(error);
+			}
+		}
+
+		FrameFormat m_format;
+		int m_width;
+		int m_height;
+		std::ofstream m_file;
+		std::ostream* m_out = nullptr;
+		std::string m_frameHeader;
+		size_t m_frameBytes = 0;
+		std::vector<uint8_t> m_converted;
+		std::vector<Pixel> m_previous;
+		bool m_previousLinear = false;
+		std::vector<std::vector<uint8_t>> m_ring;
+		BoundedQueue<size_t> m_free;
+		BoundedQueue<size_t> m_full;
+		std::thread m_writer;
+		std::mutex m_errorMutex;
+		std::exception_ptr m_error;
+		std::atomic<bool> m_failed{false};
+		bool m_closed = false;
+		uint64_t m_framesSubmitted = 0;
+		uint64_t m_rowsReused = 0;
 	};
 } // namespace ppm
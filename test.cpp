@@ -146,5 +146,137 @@ int main()
 	image.downscale(image.getWidth()/2,image.getHeight()/2);
 	image.write("blur2_0downscale.ppm");
 
+	// Netpbm formats
+	image.read("blur2_0.ppm");
+	{image.write("test2_p3.ppm",ppm::FileFormat::P3);ppm::Image img3("test2_p3.ppm");if (img3 != image) {std::cout<<"Error: P3 round trip\n";}}
+	{image.write("test2_p6_16.ppm",ppm::FileFormat::P6,65535);ppm::Image img3("test2_p6_16.ppm");img3.write("test2_p6_8.ppm");img3.read("test2_p6_8.ppm");if (img3.getWidth() != image.getWidth()) {std::cout<<"Error: 16-bit P6 round trip\n";}}
+	{image.write("test2_gray.pgm");ppm::GrayImage gray("test2_gray.pgm");if (gray.getWidth() != image.getWidth() || gray.getMaxval() != 255) {std::cout<<"Error: P5 read\n";}gray.write("test2_gray2.pgm");ppm::GrayImage gray2("test2_gray2.pgm");if (gray != gray2) {std::cout<<"Error: P5 round trip\n";}}
+	{ppm::GrayImage gray(4,2,65535);gray.setValue(1,1,40000);gray.write("test2_gray16.pgm");ppm::GrayImage gray2("test2_gray16.pgm");if (gray2.getValue(1,1) != 40000 || gray2.getMaxval() != 65535) {std::cout<<"Error: 16-bit P5 round trip\n";}gray.write("test2_gray16.pam");gray2.read("test2_gray16.pam");if (gray != gray2) {std::cout<<"Error: grayscale PAM round trip\n";}}
+	{ppm::GrayImage alpha(image.getWidth(),image.getHeight());alpha.setValue(3,3,128);image.write("test2_alpha.pam",alpha);ppm::GrayImage alpha2;ppm::Image img3;img3.read("test2_alpha.pam",alpha2);if (img3 != image || alpha2 != alpha) {std::cout<<"Error: PAM RGB_ALPHA round trip\n";}}
+	{image.write("test2_qoi.qoi");ppm::Image img3("test2_qoi.qoi");if (img3 != image) {std::cout<<"Error: QOI round trip\n";}}
+	{ppm::GrayImage alpha(image.getWidth(),image.getHeight());alpha.setValue(5,5,7);image.write("test2_alpha.qoi",alpha);ppm::GrayImage alpha2;ppm::Image img3;img3.read("test2_alpha.qoi",alpha2);if (img3 != image || alpha2 != alpha) {std::cout<<"Error: QOI RGBA round trip\n";}}
+	{std::future<void> done=image.writeQoiAsync("test2_qoi_async.qoi");done.get();ppm::Image img3("test2_qoi_async.qoi");if (img3 != image) {std::cout<<"Error: writeQoiAsync round trip\n";}}
+	{const uint8_t check[]={'1','2','3','4','5','6','7','8','9'};if (ppm::detail::crc32(0,check,9) != 0xCBF43926u) {std::cout<<"Error: crc32 check value\n";}if (ppm::detail::adler32Combine(ppm::detail::adler32(1,check,4),ppm::detail::adler32(1,check+4,5),5) != ppm::detail::adler32(1,check,9)) {std::cout<<"Error: adler32Combine\n";}}
+	{image.writePng("test2_png.png",1);image.write("test2_png9.png");std::vector<uint8_t> data=ppm::detail::readFileBytes("test2_png.png");if (data.size() < 8 || data[1] != 'P' || data[2] != 'N' || data[3] != 'G') {std::cout<<"Error: PNG signature\n";}}
+	{{std::ofstream("test2_huge.ppm")<<"P3 40000 40000 255\n0 0 0\n";std::ofstream("test2_tiny.pgm")<<"P2 2 1 255\n1 2";}bool thrown=false;try {ppm::Image img3("test2_huge.ppm");} catch (const ppm::Error&) {thrown=true;}ppm::Image tiny("test2_tiny.pgm");if (!thrown || tiny.getWidth() != 2 || std::lround(std::get<0>(tiny.getPixel(1,0))*255) != 2) {std::cout<<"Error: ASCII raster size check\n";}}
+	{bool thrown=false;try {ppm::Image img3("does_not_exist.ppm");} catch (const ppm::Error&) {thrown=true;}if (!thrown) {std::cout<<"Error: reading a missing file should throw ppm::Error\n";}}
+
+	// Frame sinks
+	{image.read("blur2_0.ppm");ppm::FrameSink sink("test2_frames.y4m",ppm::FrameFormat::Y4M,image.getWidth(),image.getHeight(),25);sink.submit(image);image.drawFilledRectangle(ppm::createPoint(0,0),ppm::createPoint(10,10),color5);sink.submit(image);sink.close();if (sink.getRowsReused() != static_cast<uint64_t>(image.getHeight()-10)) {std::cout<<"Error: FrameSink rows reused\n";}if (std::filesystem::file_size("test2_frames.y4m") != 43+2*(6+320*200*3/2)) {std::cout<<"Error: FrameSink Y4M size\n";}}
+	{image.read("blur2_0.ppm");{ppm::FrameSink sink("test2_frames.ppm",ppm::FrameFormat::P6Stream,image.getWidth(),image.getHeight());sink.submit(image);}image2.read("test2_frames.ppm");if (image != image2) {std::cout<<"Error: FrameSink P6 stream\n";}}
+	{image.read("blur2_0.ppm");ppm::FrameSink sink("test2_frames3.ppm",ppm::FrameFormat::P6Stream,image.getWidth(),image.getHeight());sink.submit(image);image.setPixel(5,5,color5);sink.submit(image);sink.submit(image);sink.close();bool threw=false;try {sink.submit(image);} catch (const ppm::Error&) {threw=true;}if (!threw || sink.getRowsReused() != static_cast<uint64_t>(2*image.getHeight()-1)) {std::cout<<"Error: FrameSink previous rows\n";}}
+	{image.read("blur2_0.ppm");ppm::Image copy=image;ppm::Image other=image;other.convertToGrayscale();other.write("test2_writer_c.qoi");ppm::ImageWriter writer(2,1);std::future<void> a=writer.submit(std::move(copy),"test2_writer_a.ppm");std::future<void> b=writer.submit(std::move(other),"test2_writer_b.qoi",ppm::FileFormat::QOI);writer.flush();a.get();b.get();if (copy.getWidth() != 0 || writer.pending() != 0 || writer.queuedBytes() != 0 || ppm::Image("test2_writer_a.ppm") != image || ppm::detail::readFileBytes("test2_writer_b.qoi") != ppm::detail::readFileBytes("test2_writer_c.qoi")) {std::cout<<"Error: ImageWriter round trip\n";}}
+	{std::string failed;ppm::ImageWriter writer(1,size_t(1)<<20,[&](const std::string& path,std::exception_ptr){failed=path;});ppm::Image img(4,4);std::future<void> f=writer.submit(std::move(img),"no_such_dir/test2_writer.ppm");writer.flush();bool threw=false;try {f.get();} catch (const ppm::Error&) {threw=true;}if (!threw || failed != "no_such_dir/test2_writer.ppm") {std::cout<<"Error: ImageWriter error reporting\n";}}
+
+	// Gradients
+	{ppm::Gradient g=ppm::Gradient::linear(0,0,99,0);for (int i=0;i<6;++i) {g.addStop(i/5.0,ppm::createfPixelWithColor(i/5.0,0,1-i/5.0));}ppm::Image img(100,10);img.fillGradient(g);auto [r,gr,b]=img.getPixel(50,5);if (std::abs(r-50/99.0) > 1e-6 || gr != 0.0) {std::cout<<"Error: fillGradient linear\n";}g.buildLut(1024);img.fillGradient(g);if (std::abs(std::get<0>(img.getPixel(50,5))-50/99.0) > 1e-3) {std::cout<<"Error: Gradient::buildLut\n";}}
+	{ppm::Gradient g=ppm::Gradient::radial(50,50,40);g.addStop(0,color5).addStop(1,ppm::createfPixelWithColor(0,0,0));ppm::Image img(100,100);img.drawFilledCircle(ppm::createPoint(50,50),20,g);if (img.getPixel(50,50) != color5 || img.getPixel(5,5) != ppm::createfPixelWithColor(0,0,0) || img.getPixel(80,50) != ppm::createfPixelWithColor(0,0,0) || img.getPixel(60,50) == img.getPixel(50,50)) {std::cout<<"Error: drawFilledCircle(Gradient)\n";}}
+	{ppm::Gradient g=ppm::Gradient::conic(50,50);g.addStop(0,ppm::createfPixelWithColor(0,0,0)).addStop(1,ppm::createfPixelWithColor(1,1,1));if (std::abs(g.positionAt(50,60)-0.25) > 1e-9 || std::abs(g.positionAt(40,50)-0.5) > 1e-9) {std::cout<<"Error: Gradient::conic\n";}}
+
+	// Color adjustments
+	{ppm::Image img(4,1);img.setPixel(0,0,ppm::createfPixelWithColor(1,0,0));img.setPixel(1,0,ppm::createfPixelWithColor(0,1,0));img.setPixel(2,0,ppm::createfPixelWithColor(0.5,0.5,0.5));img.shiftHue(120);auto [r,g,b]=img.getPixel(0,0);if (std::abs(g-1) > 1e-9 || r > 1e-9 || b > 1e-9 || img.getPixel(2,0) != ppm::createfPixelWithColor(0.5,0.5,0.5)) {std::cout<<"Error: shiftHue\n";}img.thresholdHsv(200,280,0.5,1,0,1);if (img.getPixel(1,0) != ppm::createfPixelWithColor(1,1,1) || img.getPixel(0,0) != ppm::createfPixelWithColor(0,0,0)) {std::cout<<"Error: thresholdHsv\n";}}
+	{image.read("blur2_0.ppm");image2=image;image.applyColorPipeline(ppm::ColorPipeline().scaleSaturation(0.5).scaleValue(0.8).grayscale());std::vector<ppm::Pixel> pixels=image2.getImage();for (auto& px : pixels) {double h,s,v;ppm::getHSV(h,s,v,px);if (s > 0) {ppm::setHSV(h,s*0.5,v*0.8,px);} else {px={v*0.8,v*0.8,v*0.8};}}int w=image2.getWidth(),h=image2.getHeight();image2.setImage(pixels,w,h);image2.convertToGrayscale();for (int i=0;i<image.getWidth();++i) {if (std::abs(std::get<0>(image.getPixel(i,7))-std::get<0>(image2.getPixel(i,7))) > 1e-9) {std::cout<<"Error: applyColorPipeline\n";break;}}}
+
+	// Linear light
+	{image.setColorSpace(ppm::ColorSpace::Linear);image.read("blur2_0.ppm");image.write("test2_linear.ppm");image.setColorSpace(ppm::ColorSpace::Srgb);image2.read("test2_linear.ppm");ppm::Image ref("blur2_0.ppm");if (image2 != ref) {std::cout<<"Error: linear read/write round trip\n";}}
+	{ppm::Image img(2,2);img.setColorSpace(ppm::ColorSpace::Linear);img.setPixel(1,0,ppm::createfPixelWithColor(1,1,1));img.setPixel(0,1,ppm::createfPixelWithColor(1,1,1));img.downscale(1,1);img.write("test2_linear.pgm");img.setColorSpace(ppm::ColorSpace::Srgb);img.read("test2_linear.pgm");if (std::abs(std::get<0>(img.getPixel(0,0))-188/255.0) > 1e-9) {std::cout<<"Error: linear-light averaging\n";}}
+	{int bad=0;for (int k=0;k<256;++k) {if (ppm::encodeSrgb8(ppm::srgbToLinear(k/255.0)) != k) {++bad;}}if (bad || ppm::encodeSrgb8(-1.0) != 0 || ppm::encodeSrgb8(2.0) != 255) {std::cout<<"Error: ppm::encodeSrgb8\n";}}
+
+	// Displacement maps
+	{image.read("blur2_0.ppm");image2=image;image.applyLens(3,42u);image2.applyLens(3,42u);if (image != image2) {std::cout<<"Error: applyLens(numb, seed)\n";}}
+	{image.read("blur2_0.ppm");image2=image;image.applyLens({ppm::createPoint(100,80),ppm::createPoint(100,80)});image2.applyDisplacement(*ppm::DisplacementMap::lens(image2.getWidth()/10),100,80);if (image != image2 || ppm::DisplacementMap::lens(32) != ppm::DisplacementMap::lens(32)) {std::cout<<"Error: applyLens(centers)\n";}}
+	{auto lens=ppm::DisplacementMap::lens(-3);bool same=lens == ppm::DisplacementMap::lens(0);std::weak_ptr<const ppm::DisplacementMap> old=ppm::DisplacementMap::lens(1000);for (int r=1;r<=4;++r) {ppm::DisplacementMap::lens(r);}if (!same || lens->getWidth() != 1 || !old.expired()) {std::cout<<"Error: DisplacementMap::lens cache\n";}}
+	{image.read("blur2_0.ppm");image.convolve(ppm::Kernel::box(1));image2=image;ppm::DisplacementMap shift(4,4,0,0);for (int y=0;y<4;++y) {for (int x=0;x<4;++x) {shift.set(x,y,20.0f,-10.0f);}}image.applyDisplacement(shift,50,50);image.applyDisplacement(shift,52,51);for (int y=50;y<54;++y) {for (int x=50;x<52;++x) {if (image.getPixel(x,y) != image2.getPixel(x+20,y-10)) {std::cout<<"Error: applyDisplacement() reads outside the window\n";x=y=1000;}}}}
+
+	// Statistics
+	{ppm::Image img(3,2);img.setAllPixels(ppm::createfPixelWithColor(0.25,0.5,1.0));img.setPixel(0,0,ppm::createfPixelWithColor(0.75,0.5,0.0));ppm::ImageStatistics st=img.computeStatistics(4);if (st.count != 6 || std::abs(st.red.mean-1.0/3) > 1e-12 || std::abs(st.red.variance-0.25*5/36) > 1e-12 || st.blue.min != 0.0 || st.blue.max != 1.0 || st.green.histogram[2] != 6 || st.red.histogram[1] != 5 || st.green.variance != 0.0) {std::cout<<"Error: computeStatistics()\n";}}
+	{image.read("blur2_0.ppm");ppm::ImageStatistics st=image.computeStatistics(10,20,30,40,16);ppm::Pixel avg=image.getAverageRgbOfImage();double sum=0;for (int y=20;y<60;++y) {for (int x=10;x<40;++x) {sum+=std::get<1>(image.getPixel(x,y));}}if (st.count != 1200 || std::abs(st.green.mean-sum/1200) > 1e-12 || st.luminance.percentile(0) < st.luminance.min || st.luminance.percentile(1) != st.luminance.max || std::abs(std::get<0>(avg)-image.computeStatistics(0).red.mean) > 1e-6) {std::cout<<"Error: computeStatistics(x,y,w,h)\n";}}
+
+	// Comparison
+	{image.read("blur2_0.ppm");image2=image;image2.setPixel(7,3,ppm::Pixel(std::get<0>(image.getPixel(7,3))+0.002,std::get<1>(image.getPixel(7,3)),std::get<2>(image.getPixel(7,3))));ppm::ImageDifference d=image.compare(image2,0.001);if (!image.approximatelyEquals(image2,0.003) || image.approximatelyEquals(image2,0.001) || d.differingPixels != 1 || std::abs(d.maxDelta-0.002) > 1e-12 || std::abs(d.mse-0.002*0.002/(image.getWidth()*image.getHeight()*3.0)) > 1e-18 || std::abs(image.computeSsim(image)-1.0) > 1e-9 || image.computeSsim(image2) >= 1.0 || image.compare(image).psnr != std::numeric_limits<double>::infinity()) {std::cout<<"Error: compare()\n";}}
+	{ppm::Image a(16,16),b(16,16);a.setAllPixels(ppm::Pixel(0.5,0.5,0.5));b.setAllPixels(ppm::Pixel(0.5,0.5,0.5));b.setPixel(3,3,ppm::Pixel(1,1,1));ppm::Image heat=a.diffImage(b,2.0);if (heat.getPixel(3,3) != ppm::Pixel(1,1,1) || heat.getPixel(0,0) != ppm::Pixel(0,0,0)) {std::cout<<"Error: diffImage()\n";}}
+
+	// Pixel types
+	{constexpr ppm::Rgb8 c(ppm::Pixel(1.0,0.5,0.0));static_assert(c == ppm::Rgb8(255,128,0) && ppm::rgbCast<uint16_t>(c).r == 65535);ppm::Rect r(ppm::createCoord(2,3,11,7));ppm::Coord co=ppm::Rect(4,5,2,2);ppm::Image img(8,8);img.drawFilledRectangle(ppm::Vec2i(1,1),ppm::Vec2i(3,3),ppm::Rgb8(255,0,0));if (r != ppm::Rect(2,3,10,5) || co != ppm::createCoord(4,5,5,6) || img.getPixel(2,2) != ppm::Pixel(1,0,0) || r.intersect(ppm::Rect(0,0,4,4)) != ppm::Rect(2,3,2,1)) {std::cout<<"Error: Rgb/Vec2i/Rect conversions\n";}}
+	{image.read("blur2_0.ppm");std::vector<ppm::Rgb8> px=image.exportPixels<uint8_t>();ppm::Image img(image.getWidth(),image.getHeight());img.importPixels(px.data(),ppm::Rect(0,0,img.getWidth(),img.getHeight()));std::vector<ppm::Rgbf> part(4*3);image.exportPixels(part.data(),ppm::Rect(5,6,4,3));if (img != image || part[5] != ppm::Rgbf(image.getPixel(6,7))) {std::cout<<"Error: exportPixels/importPixels\n";}}
+	{ppm::Image img(40,30);for (int y=0;y<30;++y) {for (int x=0;x<40;++x) {img.setPixel(x,y,ppm::createPixelWithColor((x*37+y*11)%256,x*6,y*8));}}std::vector<ppm::Rgb8> px=img.exportPixels<uint8_t>(),blurred(px.size());std::vector<ppm::Rgbf> pf=img.exportPixels<float>();ppm::Image ref=img;ref.convolve(ppm::Kernel::gaussian(1.5));ppm::convolve(px.data(),blurred.data(),40,30,ppm::Kernel::gaussian(1.5));std::vector<ppm::Rgb8> expect=ref.exportPixels<uint8_t>();int worst=0;for (size_t i=0;i<px.size();++i) {worst=std::max({worst,std::abs(blurred[i].r-expect[i].r),std::abs(blurred[i].g-expect[i].g),std::abs(blurred[i].b-expect[i].b)});}ref=img;ref.applyMedianFilter(2);ppm::applyMedianFilter(px.data(),40,30,2);ppm::Image opened=img;opened.applyMorphology(ppm::MorphologyOp::Open,5,3);ppm::applyMorphology(pf.data(),40,30,ppm::MorphologyOp::Open,5,3);if (worst > 1 || px != ref.exportPixels<uint8_t>() || pf != opened.exportPixels<float>()) {std::cout<<"Error: Rgb<T> convolve/applyMedianFilter/applyMorphology\n";}}
+	{ppm::Image dst(32,24),src(20,16);dst.setAllPixels(ppm::Pixel(0.2,0.4,0.6));for (int y=0;y<16;++y) {for (int x=0;x<20;++x) {src.setPixel(x,y,ppm::createPixelWithColor(x*12,y*15,128));}}std::vector<ppm::Rgb8> d=dst.exportPixels<uint8_t>(),s=src.exportPixels<uint8_t>();dst.drawImage(src,ppm::Rect(0,0,20,16),ppm::Rect(3,2,30,24),ppm::BlendMode::Screen,ppm::ScaleFilter::Bilinear,0.6);ppm::drawImage(d.data(),32,24,s.data(),20,16,ppm::Rect(0,0,20,16),ppm::Rect(3,2,30,24),ppm::BlendMode::Screen,ppm::ScaleFilter::Bilinear,0.6);std::vector<ppm::Rgb8> e=dst.exportPixels<uint8_t>();int worst=0;for (size_t i=0;i<d.size();++i) {worst=std::max({worst,std::abs(d[i].r-e[i].r),std::abs(d[i].g-e[i].g),std::abs(d[i].b-e[i].b)});}ppm::Gradient g=ppm::Gradient::radial(16,12,10);g.addStop(0,ppm::Pixel(1,0,0)).addStop(1,ppm::Pixel(0,0,1)).buildLut();dst.fillGradient(g);ppm::fillGradient(d.data(),32,24,g);if (worst > 1 || d != dst.exportPixels<uint8_t>()) {std::cout<<"Error: Rgb<T> drawImage/fillGradient\n";}}
+
+	// Text
+	{ppm::Image img(64,32);img.setAllPixels(ppm::Pixel(1,1,1));img.drawText(ppm::createPoint(1,1),"|",7,ppm::Pixel(0,0,0));auto atlas=ppm::GlyphAtlas::get(7);if (img.getPixel(1,1) != ppm::Pixel(0,0,0) || img.getPixel(2,1) != ppm::Pixel(1,1,1) || img.getPixel(1,8) != ppm::Pixel(1,1,1) || atlas != ppm::GlyphAtlas::get(7) || atlas->measure("abc",ppm::TextLayout::Monospace) != 18 || atlas->measure("ab\nc",ppm::TextLayout::Monospace) != 12 || atlas->measure("ii",ppm::TextLayout::Proportional) >= 12) {std::cout<<"Error: drawText()\n";}}
+	{ppm::Image img(16,16);img.drawText(ppm::createPoint(-20,10),"clipped text\nand more",14,ppm::Pixel(1,1,1),ppm::TextLayout::Monospace,0.5);if (img.computeStatistics(0).red.max > 0.5 || img.computeStatistics(0).red.max == 0.0) {std::cout<<"Error: drawText(opacity)\n";}}
+
+	// Blitting
+	{image.read("blur2_0.ppm");ppm::Image img(50,40);img.drawImage(image,ppm::Rect(10,20,30,30),ppm::createPoint(-5,25));ppm::Image half(image.getWidth()/2,image.getHeight()/2);half.drawImage(image,ppm::Rect(0,0,image.getWidth(),image.getHeight()),ppm::Rect(0,0,half.getWidth(),half.getHeight()),ppm::BlendMode::Replace,ppm::ScaleFilter::Nearest);if (img.getPixel(0,25) != image.getPixel(15,20) || img.getPixel(24,39) != image.getPixel(39,34) || img.getPixel(0,24) != ppm::Pixel(0,0,0) || half.getPixel(7,3) != image.getPixel(15,7)) {std::cout<<"Error: drawImage()\n";}}
+	{ppm::Image a(8,8),b(8,8);a.setAllPixels(ppm::Pixel(0.5,0.5,0.5));b.setAllPixels(ppm::Pixel(1,0,0.5));ppm::GrayImage mask(8,8,255);mask.setValue(1,1,255);ppm::Image c=a;std::vector<ppm::ImageBlit> blits={{&b,ppm::Rect(0,0,8,8),ppm::Rect(0,0,8,8),ppm::BlendMode::Alpha,ppm::ScaleFilter::Nearest,0.5,&mask},{&b,ppm::Rect(0,0,8,8),ppm::Rect(4,4,8,8),ppm::BlendMode::Multiply}};c.drawImages(blits);if (c.getPixel(1,1) != ppm::Pixel(0.75,0.25,0.5) || c.getPixel(0,0) != a.getPixel(0,0) || c.getPixel(5,5) != ppm::Pixel(0.5,0,0.25)) {std::cout<<"Error: drawImages()\n";}}
+	{ppm::Image src(8,8);for (int y=0;y<8;++y) {for (int x=0;x<8;++x) {src.setPixel(x,y,ppm::Pixel((x+1)/8.0,(y+1)/8.0,0.5));}}ppm::Image dst(32,16);dst.drawImage(src,ppm::Rect(-8,0,16,8),ppm::Rect(0,0,32,16),ppm::BlendMode::Replace,ppm::ScaleFilter::Nearest);ppm::Image lin=src;lin.setColorSpace(ppm::ColorSpace::Linear);ppm::Image back(8,8);back.drawImage(lin,ppm::Rect(0,0,8,8),ppm::createPoint(0,0));double err=0;for (int i=0;i<8;++i) {err=std::max(err,std::abs(std::get<0>(back.getPixel(i,i))-std::get<0>(src.getPixel(i,i))));}if (dst.getPixel(15,0) != ppm::Pixel(0,0,0) || dst.getPixel(16,0) != src.getPixel(0,0) || dst.getPixel(31,15) != src.getPixel(7,7) || err > 1e-9) {std::cout<<"Error: drawImage() clipped scaling and color spaces\n";}}
+
+	// Flood fill
+	{ppm::Image img(20,20);img.setAllPixels(ppm::Pixel(1,1,1));ppm::Coord c=ppm::createCoord(0,0,19,19);img.drawLine(c,ppm::Pixel(0,0,0));c=ppm::createCoord(0,10,19,10);img.drawLine(c,ppm::Pixel(0.02,0.02,0.02));ppm::Image img2=img;img.floodFill(ppm::createPoint(15,3),ppm::Pixel(1,0,0));size_t n=0;for (const ppm::Span& s : img2.floodRegion(ppm::createPoint(15,3))) {n+=s.x1-s.x0;}if (img.getPixel(18,9) != ppm::Pixel(1,0,0) || img.getPixel(3,5) != ppm::Pixel(1,1,1) || img.getPixel(15,12) != ppm::Pixel(1,1,1) || n != 145) {std::cout<<"Error: floodFill()\n";}}
+	{ppm::Image img(20,20);img.setAllPixels(ppm::Pixel(1,1,1));ppm::Coord c=ppm::createCoord(0,0,19,19);img.drawLine(c,ppm::Pixel(0,0,0));size_t four=0,eight=0,dark=0;for (const ppm::Span& s : img.floodRegion(ppm::createPoint(0,0))) {four+=s.x1-s.x0;}for (const ppm::Span& s : img.floodRegion(ppm::createPoint(0,0),0.0,ppm::Connectivity::Eight)) {eight+=s.x1-s.x0;}for (const ppm::Span& s : img.floodRegion(ppm::createPoint(0,0),0.5,ppm::Connectivity::Four,ppm::ColorMatch::Luminance)) {dark+=s.x1-s.x0;}if (four != 1 || eight != 20 || dark != 1) {std::cout<<"Error: floodRegion(connectivity)\n";}}
+
+	// Denoising
+	{ppm::Image img(24,16);for (int y=0;y<16;++y) {for (int x=0;x<24;++x) {img.setPixel(x,y,x<12?ppm::Pixel(40/255.0,80/255.0,120/255.0):ppm::Pixel(200/255.0,1,0));}}ppm::Image clean=img;img.setPixel(3,3,ppm::Pixel(1,1,1));img.setPixel(20,9,ppm::Pixel(0,0,0));img.setPixel(11,5,ppm::Pixel(1,0,1));img.applyMedianFilter(1);ppm::GrayImage gray(9,9);gray.setValue(4,4,255);gray.setValue(0,0,7);gray.applyMedianFilter(2);if (!(img == clean) || gray.getValue(4,4) != 0 || gray.getValue(0,0) != 0) {std::cout<<"Error: applyMedianFilter()\n";}}
+	{ppm::GrayImage deep(20,10,65535);ppm::Image flat(20,10);for (int y=0;y<10;++y) {for (int x=0;x<20;++x) {deep.setValue(x,y,1000);flat.setPixel(x,y,ppm::Pixel(0.3001,0.3001,0.3001));}}deep.applyMedianFilter(3);flat.applyMedianFilter(3);if (deep.getValue(7,4) != 1000 || std::get<0>(flat.getPixel(7,4)) != 0.3001) {std::cout<<"Error: applyMedianFilter() constant input\n";}}
+	{std::mt19937 rng(5);std::uniform_real_distribution<double> dist(0.0,1.0);ppm::Image img(40,30);ppm::GrayImage deep(40,30,65535);for (int y=0;y<30;++y) {for (int x=0;x<40;++x) {img.setPixel(x,y,ppm::Pixel(0.5+0.001*dist(rng),dist(rng),0.2));deep.setValue(x,y,static_cast<uint16_t>(30000+dist(rng)*500));}}ppm::Image src=img;ppm::GrayImage deepSrc=deep;img.applyMedianFilter(2);deep.applyMedianFilter(2);bool ok=true;for (int y=0;y<30;y+=7) {for (int x=0;x<40;x+=9) {std::vector<double> r,g;std::vector<int> d;for (int j=-2;j<=2;++j) {for (int i=-2;i<=2;++i) {int sx=std::clamp(x+i,0,39),sy=std::clamp(y+j,0,29);r.push_back(std::get<0>(src.getPixel(sx,sy)));g.push_back(std::get<1>(src.getPixel(sx,sy)));d.push_back(deepSrc.getValue(sx,sy));}}std::nth_element(r.begin(),r.begin()+12,r.end());std::nth_element(g.begin(),g.begin()+12,g.end());std::nth_element(d.begin(),d.begin()+12,d.end());ok=ok&&std::get<0>(img.getPixel(x,y))==r[12]&&std::get<1>(img.getPixel(x,y))==g[12]&&std::get<2>(img.getPixel(x,y))==0.2&&deep.getValue(x,y)==d[12];}}if (!ok) {std::cout<<"Error: applyMedianFilter() exact samples\n";}}
+	{std::mt19937 rng(9);std::uniform_real_distribution<double> dist(0.0,1.0);ppm::Image img(300,240);for (int y=0;y<240;++y) {for (int x=0;x<300;++x) {double v=dist(rng);img.setPixel(x,y,ppm::Pixel(v,0.4+0.01*v*y/240.0,0.7));}}ppm::Image src=img;img.applyMedianFilter(3);bool ok=true;for (int y=0;y<240;y+=37) {for (int x=0;x<300;x+=41) {std::vector<double> r,g;for (int j=-3;j<=3;++j) {for (int i=-3;i<=3;++i) {int sx=std::clamp(x+i,0,299),sy=std::clamp(y+j,0,239);r.push_back(std::get<0>(src.getPixel(sx,sy)));g.push_back(std::get<1>(src.getPixel(sx,sy)));}}std::nth_element(r.begin(),r.begin()+24,r.end());std::nth_element(g.begin(),g.begin()+24,g.end());ok=ok&&std::get<0>(img.getPixel(x,y))==r[24]&&std::get<1>(img.getPixel(x,y))==g[24];}}if (!ok) {std::cout<<"Error: applyMedianFilter() exact samples beyond 65536 levels\n";}}
+	{ppm::Image img(64,48);for (int y=0;y<48;++y) {for (int x=0;x<64;++x) {img.setPixel(x,y,x<32?ppm::Pixel(0.1+0.02*((x*7+y*3)%5),0.1,0.1):ppm::Pixel(0.9,0.9,0.9));}}ppm::Image img2=img;img.applyBilateralFilter(4,0.05);img2.applyBilateralFilter(1.5,0.05);bool ok=true;for (ppm::Image* p : {&img,&img2}) {for (int y=0;y<48;++y) {ok=ok&&std::abs(std::get<0>(p->getPixel(30,y))-0.14)<0.03&&std::abs(std::get<1>(p->getPixel(33,y))-0.9)<1e-4;}}if (!ok) {std::cout<<"Error: applyBilateralFilter()\n";}}
+
+	// Palette
+	{ppm::Image img(64,32);for (int y=0;y<32;++y) {for (int x=0;x<64;++x) {img.setPixel(x,y,x<32?(y<16?ppm::Pixel(1,0,0):ppm::Pixel(0,1,0)):(y<16?ppm::Pixel(0,0,1):ppm::Pixel(1,1,1)));}}ppm::IndexedImage q=img.quantize(16);q.write("test_indexed.pgm");ppm::GrayImage indices("test_indexed.pgm");ppm::Image sidecar("test_indexed.pgm.pal.ppm");ppm::Image back(q);if (q.getPalette().size() != 4 || !(back == img) || indices.getData()[0] != q.getData()[0] || sidecar.getWidth() != 4 || sidecar.getPixel(q.getValue(40,20),0) != ppm::Pixel(1,1,1)) {std::cout<<"Error: quantize()\n";}}
+	{ppm::Image img(64,64);img.setAllPixels(ppm::Pixel(0.5,0.5,0.5));ppm::Palette bw({ppm::Rgb8{0,0,0},ppm::Rgb8{255,255,255}});int counts[3]={0,0,0};int d=0;for (ppm::Dither dither : {ppm::Dither::None,ppm::Dither::Ordered,ppm::Dither::FloydSteinberg}) {ppm::IndexedImage q=img.quantize(bw,dither);for (uint8_t v : q.getData()) {counts[d]+=v;}++d;}if (bw.nearest(200,180,190) != 1 || counts[0] != 0 || counts[1] != 2048 || std::abs(counts[2]-2048) > 16) {std::cout<<"Error: quantize(dither)\n";}}
+	{ppm::Image ramp(256,4);std::vector<ppm::Rgb8> grays;for (int v=0;v<256;++v) {grays.push_back({static_cast<uint8_t>(v),static_cast<uint8_t>(v),static_cast<uint8_t>(v)});for (int y=0;y<4;++y) {ramp.setPixel(v,y,ppm::Pixel(v/255.0,v/255.0,v/255.0));}}ppm::Palette exact(grays);ppm::IndexedImage q=ramp.quantize(exact,ppm::Dither::None);ppm::Palette built=ramp.buildPalette(256);ppm::Palette two({ppm::Rgb8{0,0,0},ppm::Rgb8{6,6,6}});bool ok=built.size()==256&&two.nearest(0,0,0)==0&&two.nearest(4,3,3)==1;for (int v=0;v<256;++v) {ok=ok&&q.getValue(v,2)==v&&built[v].r==v&&built.nearest(v,v,v)==v;}std::mt19937 rng(4);for (int k=0;k<2000&&ok;++k) {int r=rng()%256,g=rng()%256,b=rng()%256,best=0;long bestD=1L<<40;for (int i=0;i<256;++i) {long d=(r-i)*(r-i)+(g-i)*(g-i)+(b-i)*(b-i);if (d<bestD) {bestD=d;best=i;}}ok=exact.nearest(r,g,b)==best;}if (!ok) {std::cout<<"Error: Palette exact lookup and buildPalette exact colors\n";}}
+
+	// Edges
+	{ppm::Image img(16,12);img.setAllPixels(ppm::Pixel(0,0,0));for (int y=0;y<12;++y) {for (int x=8;x<16;++x) {img.setPixel(x,y,ppm::Pixel(1,1,1));}}ppm::GrayImage mag=img.gradientMagnitude();ppm::GrayImage scharr=img.gradientMagnitude(ppm::GradientOperator::Scharr,1000);ppm::GradientField f=img.computeGradient();ppm::Image img2=img;img2.rotate(90);ppm::GradientField f2=img2.computeGradient();if (mag.getValue(7,5) != 255 || mag.getValue(8,0) != 255 || mag.getValue(6,5) != 0 || mag.getValue(9,11) != 0 || scharr.getValue(8,6) != 1000 || std::abs(f.direction[5*16+7]) > 1e-6 || std::abs(f2.direction[8*12+3]-M_PI/2) > 1e-6 || std::abs(f.magnitude[5*16+8]-1) > 1e-6) {std::cout<<"Error: gradientMagnitude()\n";}}
+	{ppm::Image img(40,30);img.setAllPixels(ppm::Pixel(0.1,0.1,0.1));ppm::Rect r{10,8,20,14};for (int y=r.y;y<r.y+r.h;++y) {for (int x=r.x;x<r.x+r.w;++x) {img.setPixel(x,y,ppm::Pixel(0.8,0.8,0.8));}}img.setPixel(3,3,ppm::Pixel(0.3,0.3,0.3));ppm::GrayImage edges=img.detectEdges(0.1,0.5);int n=0;for (uint16_t v : edges.getData()) {n+=v!=0;}if (edges.getValue(9,15) != 255 || edges.getValue(10,15) != 0 || edges.getValue(3,3) != 0 || edges.getValue(20,20) != 0 || n != 2*20+2*14-4) {std::cout<<"Error: detectEdges()\n";}}
+
+	// Morphology
+	{ppm::Image img(30,20);img.setAllPixels(ppm::Pixel(0,0,0));for (int y=5;y<15;++y) {for (int x=5;x<25;++x) {img.setPixel(x,y,ppm::Pixel(1,1,1));}}img.setPixel(2,2,ppm::Pixel(1,1,1));img.setPixel(10,10,ppm::Pixel(0,0,0));ppm::Image opened=img;opened.open(3,3);ppm::Image closed=img;closed.close(3,3);ppm::Image eroded=img;eroded.erode(5,3);ppm::Image hat=img;hat.topHat(3,3);if (opened.getPixel(2,2) != ppm::Pixel(0,0,0) || opened.getPixel(5,5) != ppm::Pixel(1,1,1) || closed.getPixel(10,10) != ppm::Pixel(1,1,1) || eroded.getPixel(6,10) != ppm::Pixel(0,0,0) || eroded.getPixel(7,10) != ppm::Pixel(1,1,1) || eroded.getPixel(7,5) != ppm::Pixel(0,0,0) || hat.getPixel(2,2) != ppm::Pixel(1,1,1) || hat.getPixel(12,12) != ppm::Pixel(0,0,0)) {std::cout<<"Error: applyMorphology()\n";}}
+	{ppm::Image img(9,9);img.setAllPixels(ppm::Pixel(0.5,0.5,0.5));img.setPixel(4,4,ppm::Pixel(1,0,0));img.setPixel(6,4,ppm::Pixel(0,0.9,0));ppm::Image lum=img;lum.dilate(3,1,ppm::MorphologyMode::Luminance);ppm::Image chan=img;chan.dilate(3,1);ppm::GrayImage mask(12,8);mask.setValue(3,3,200);mask.setValue(8,3,90);mask.applyMorphology(ppm::MorphologyOp::Dilate,7,1);if (lum.getPixel(5,4) != ppm::Pixel(0,0.9,0) || lum.getPixel(3,4) != ppm::Pixel(0.5,0.5,0.5) || chan.getPixel(5,4) != ppm::Pixel(1,0.9,0.5) || mask.getValue(5,3) != 200 || mask.getValue(6,3) != 200 || mask.getValue(7,3) != 90 || mask.getValue(11,3) != 90 || mask.getValue(0,3) != 200 || mask.getValue(3,4) != 0) {std::cout<<"Error: applyMorphology(luminance)\n";}}
+
+	// Pyramid
+	{ppm::Image img(8,6);for (int y=0;y<6;++y) {for (int x=0;x<8;++x) {img.setPixel(x,y,ppm::Pixel(x/8.0,y/6.0,(x*y)%3/2.0));}}ppm::ImagePyramid p=img.buildPyramid(0,ppm::PyramidFilter::Box);ppm::Image img2=img;img2.downscale(4,3);ppm::Image img3(p,1);ppm::Image img4(p,0);if (p.getLevels() != 4 || p.getWidth(3) != 1 || p.getHeight(2) != 1 || !img2.approximatelyEquals(img3,1e-12) || !(img4 == img) || p.levelForScale(0.3) != 1 || p.levelForScale(0.01) != 3) {std::cout<<"Error: buildPyramid()\n";}}
+	{ppm::Image img(5,3);for (int y=0;y<3;++y) {for (int x=0;x<5;++x) {img.setPixel(x,y,ppm::Pixel(x/5.0,y/3.0,(x+y)%2));}}ppm::ImagePyramid p=img.buildPyramid(0,ppm::PyramidFilter::Box);ppm::Image flat(7,5);flat.setAllPixels(ppm::Pixel(0.25,0.5,0.75));ppm::ImagePyramid q=flat.buildPyramid(2);const ppm::Pixel avg=img.getAverageRgbOfImage();const ppm::Pixel& top=p.getPixel(2,0,0);if (p.getLevels() != 3 || p.getWidth(1) != 2 || p.getHeight(1) != 1 || std::abs(std::get<0>(top)-std::get<0>(avg)) > 1e-6 || std::abs(std::get<2>(top)-std::get<2>(avg)) > 1e-6 || q.getLevels() != 2 || std::abs(std::get<1>(q.getPixel(1,2,1))-0.5) > 1e-12) {std::cout<<"Error: buildPyramid(odd)\n";}}
+
+	// Transform
+	{ppm::Image img(7,4);for (int y=0;y<4;++y) {for (int x=0;x<7;++x) {img.setPixel(x,y,ppm::Pixel(x/7.0,y/4.0,0.5));}}ppm::Image img2=img;img2.rotate(90);ppm::Image img3=img;img3.transform(ppm::Affine2D::translate(4,0)*ppm::Affine2D::rotate(90),4,7,ppm::ScaleFilter::Nearest);ppm::Image img4=img;img4.rotate(90);img4.rotate(-90);img4.rotate(180);img4.rotate(540);if (img2.getWidth() != 4 || img2.getHeight() != 7 || img2.getPixel(3,0) != img.getPixel(0,0) || !(img2 == img3) || !(img4 == img)) {std::cout<<"Error: rotate(90)\n";}}
+	{ppm::Image img(16,16);for (int y=0;y<16;++y) {for (int x=0;x<16;++x) {img.setPixel(x,y,ppm::Pixel((x^y)&1,x/16.0,y/16.0));}}ppm::Image img2=img;img2.transform(ppm::Affine2D());ppm::Affine2D m=ppm::Affine2D::rotate(30,8,8)*ppm::Affine2D::scale(1.5,0.5)*ppm::Affine2D::shear(0.2,0);double x,y;(m.inverse()*m).apply(3,5,x,y);ppm::Image img3=img;img3.rotate(45,ppm::ScaleFilter::Bicubic);if (!(img2 == img) || std::abs(x-3) > 1e-9 || std::abs(y-5) > 1e-9 || img3.getWidth() != 23 || img3.getPixel(0,0) != ppm::Pixel(0,0,0)) {std::cout<<"Error: transform()\n";}}
+
+	// Convolution
+	{image.read("blur2_0.ppm");image2=image;image.convolve(ppm::Kernel(3,3,{0,0,0,0,1,0,0,0,0}),ppm::BorderMode::Mirror);if (image != image2) {std::cout<<"Error: convolve(identity)\n";}}
+	{ppm::Image img(4,3);img.setPixel(3,1,ppm::Pixel(0.9,0.9,0.9));img.convolve(ppm::Kernel::box(1),ppm::BorderMode::Wrap);std::vector<double> column,row;if (std::abs(std::get<0>(img.getPixel(0,0))-0.1) > 1e-12 || std::abs(std::get<0>(img.getPixel(1,1))) > 1e-12 || !ppm::Kernel::gaussian(1.5).isSeparable(column,row) || ppm::Kernel::laplacian().isSeparable(column,row)) {std::cout<<"Error: convolve(box, Wrap)\n";}}
+	{bool threw=false;try {ppm::Kernel::gaussian(0.0);} catch (const std::invalid_argument&) {threw=true;}if (!threw) {std::cout<<"Error: Kernel::gaussian(0) accepted\n";}}
+
+	// Dirty regions
+	{image.read("blur2_0.ppm");image.enableDirtyTracking(32);image.clearDirty();if (image.hasDirty()) {std::cout<<"Error: clearDirty()\n";}image.setPixel(40,40,color5);std::vector<ppm::Coord> rects=image.getDirtyRects();if (rects.size() != 1 || rects[0] != ppm::createCoord(32,32,63,63)) {std::cout<<"Error: getDirtyRects()\n";}if (image.getDirtyRects(1)[0] != ppm::createCoord(0,0,95,95)) {std::cout<<"Error: getDirtyRects(halo)\n";}}
+	{image.read("blur2_0.ppm");image2=image;image.enableDirtyTracking();image.clearDirty();image.drawFilledCircle(ppm::createPoint(150,100),10,color5);image2.drawFilledCircle(ppm::createPoint(150,100),10,color5);image.applyBloom(0.8,2.0,ppm::Region::Dirty);image2.applyBloom(0.8,2.0);for (int y=96;y<128;++y) {for (int x=128;x<160;++x) {if (image.getPixel(x,y) != image2.getPixel(x,y)) {std::cout<<"Error: applyBloom(Region::Dirty)\n";x=y=1000;}}}}
+	{ppm::Image a(64,64);a.enableDirtyTracking();a.clearDirty();for (int y=24;y<32;++y) {for (int x=24;x<32;++x) {a.setPixel(x,y,ppm::createPixelWithColor(255,255,255));}}ppm::Image b=a;a.applyBloom(0.8,0.2,ppm::Region::Dirty);b.applyBloom(0.8,0.2);for (int y=0;y<64;++y) {for (int x=0;x<64;++x) {if (a.getPixel(x,y) != b.getPixel(x,y)) {std::cout<<"Error: applyBloom(Region::Dirty) halo\n";x=y=1000;}}}}
+	{image.read("blur2_0.ppm");image.enableDirtyTracking();ppm::FrameSink sink("test2_dirty.ppm",ppm::FrameFormat::P6Stream,image.getWidth(),image.getHeight());sink.submit(image);image.clearDirty();image.setPixel(5,5,color5);sink.submit(image);sink.close();if (sink.getRowsReused() != static_cast<uint64_t>(image.getHeight()-32)) {std::cout<<"Error: FrameSink dirty rows\n";}}
+
+	// Batch processing
+	{ppm::BatchOptions options;options.outputSuffix=".qoi";options.maxInFlightBytes=1;std::vector<ppm::ImageFilter> chain={[](ppm::Image& img){img.convertToGrayscale();}};ppm::BatchReport report=ppm::processBatch({"blur2_0.ppm","test2_2.ppm","does_not_exist.ppm"},chain,options);if (report.succeeded != 2 || report.failures.size() != 1 || report.process.items != 2) {std::cout<<"Error: ppm::processBatch\n";}image.read("blur2_0.qoi");image2.read("test2_6.ppm");if (image != image2) {std::cout<<"Error: ppm::processBatch output\n";}}
+	{ppm::BatchOptions options;options.outputSuffix="_half.qoi";options.workers=1;std::vector<ppm::ImageFilter> chain={[](ppm::Image& img){img.downscale(img.getWidth()/2,img.getHeight()/2);}};ppm::BatchReport report=ppm::processBatch({"blur2_0.ppm","./blur2_0.ppm"},chain,options);if (report.succeeded != 1 || report.failures.size() != 1 || report.failures[0].first != "./blur2_0.ppm" || report.read.pixels != 320*200 || report.write.pixels != 160*100) {std::cout<<"Error: ppm::processBatch collisions and resized items\n";}}
+
+	// Profiling (compile with -DPPMPP_PROFILE)
+	if (ppm::profile::enabled) {
+		ppm::profile::reset();
+		ppm::Image img3(200,200);
+		img3.drawFilledCircle(ppm::createPoint(100,100),50,color5);
+		img3.drawFilledCircle(ppm::createPoint(100,100),20,color5);
+		img3.applyBloom(0.8,2.0);
+		bool found=false;
+		for (const auto& st : ppm::profile::snapshot()) {
+			if (st.name == "drawFilledCircle") {found=true;if (st.calls != 2 || st.pixelsWritten == 0 || st.maxNs > st.totalNs) {std::cout<<"Error: drawFilledCircle profile counters\n";}}
+			if (st.name == "drawLine") {std::cout<<"Error: nested drawLine should fold into drawFilledCircle\n";}
+			if (st.name == "applyBloom" && st.scratchBytes == 0) {std::cout<<"Error: applyBloom scratch bytes\n";}
+		}
+		if (!found) {std::cout<<"Error: drawFilledCircle missing from profile snapshot\n";}
+		{ppm::ThreadPool pool(4);{ppm::profile::ScopedOp op("poolChunks");pool.parallelFor(0,64,1,[](int lo,int hi){ppm::profile::addPixels(hi-lo);});}for (const auto& st : ppm::profile::snapshot()) if (st.name == "poolChunks" && st.pixelsWritten != 64) {std::cout<<"Error: parallelFor chunks should count against the calling operation\n";}}
+		ppm::profile::writeChromeTrace("test2_trace.json");
+		ppm::profile::reset();
+		if (!ppm::profile::snapshot().empty()) {std::cout<<"Error: ppm::profile::reset()\n";}
+	}
+
 	return 0;
 }